@@ -0,0 +1,192 @@
+// カーネルのstring.c（ワード単位のmemset/memcmp/memmove/memcpy）を
+// ホストで動かしてlibcの結果と比較する. 先頭/末尾の端数とワード
+// ループのすべての組み合わせを通るように、オフセット0..15と長さ
+// 0..MAXLENを総当たりし、memmoveは重なりの両方向も確かめる.
+// 最後にページ単位のコピーの速度をlibcと比べて表示する.
+//
+// make hosttest で実行する.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// -Dmemcpy=kmemcpy 等で名前を変えてコンパイルしたkernel/string.c
+void *kmemset(void *dst, int c, uint32_t n);
+int   kmemcmp(const void *v1, const void *v2, uint32_t n);
+void *kmemmove(void *dst, const void *src, uint32_t n);
+void *kmemcpy(void *dst, const void *src, uint32_t n);
+
+#define NOFF    16
+#define MAXLEN  80
+#define BUFSIZE (NOFF + MAXLEN + NOFF + 64)
+#define PAGE    4096
+
+static int ok = 0, ng = 0;
+
+static void
+check(int cond, const char *what, int doff, int soff, int len)
+{
+  if (cond) {
+    ok++;
+  } else {
+    if (ng < 20)
+      printf("  %s: doff %d, soff %d, len %d: failed\n", what, doff, soff, len);
+    ng++;
+  }
+}
+
+static void
+fill(uint8_t *buf, int n, int seed)
+{
+  for (int i = 0; i < n; i++)
+    buf[i] = (uint8_t)(i * 7 + seed * 13 + 1);
+}
+
+static int
+sign(int x)
+{
+  return (x > 0) - (x < 0);
+}
+
+static void
+test_memset(void)
+{
+  uint8_t a[BUFSIZE], b[BUFSIZE];
+
+  for (int doff = 0; doff < NOFF; doff++) {
+    for (int len = 0; len <= MAXLEN; len++) {
+      fill(a, BUFSIZE, len);
+      fill(b, BUFSIZE, len);
+      void *r = kmemset(a + doff, 0x1a5, len);
+      memset(b + doff, 0x1a5, len);
+      check(r == a + doff && memcmp(a, b, BUFSIZE) == 0, "memset", doff, 0, len);
+    }
+  }
+}
+
+static void
+test_memcpy(void)
+{
+  uint8_t src[BUFSIZE], a[BUFSIZE], b[BUFSIZE];
+
+  for (int doff = 0; doff < NOFF; doff++) {
+    for (int soff = 0; soff < NOFF; soff++) {
+      for (int len = 0; len <= MAXLEN; len++) {
+        fill(src, BUFSIZE, 1);
+        fill(a, BUFSIZE, 2);
+        fill(b, BUFSIZE, 2);
+        void *r = kmemcpy(a + doff, src + soff, len);
+        memcpy(b + doff, src + soff, len);
+        check(r == a + doff && memcmp(a, b, BUFSIZE) == 0, "memcpy", doff, soff, len);
+        fill(a, BUFSIZE, 2);
+        r = kmemmove(a + doff, src + soff, len);
+        check(r == a + doff && memcmp(a, b, BUFSIZE) == 0, "memmove", doff, soff, len);
+      }
+    }
+  }
+}
+
+// 同じバッファ内で重なるmemmove. doff > soffは後ろから、
+// doff < soffは前からコピーしなければ壊れる
+static void
+test_overlap(void)
+{
+  uint8_t a[BUFSIZE], b[BUFSIZE];
+
+  for (int doff = 0; doff < 2 * NOFF; doff++) {
+    for (int soff = 0; soff < 2 * NOFF; soff++) {
+      for (int len = 0; len <= MAXLEN; len++) {
+        fill(a, BUFSIZE, 3);
+        fill(b, BUFSIZE, 3);
+        void *r = kmemmove(a + doff, a + soff, len);
+        memmove(b + doff, b + soff, len);
+        check(r == a + doff && memcmp(a, b, BUFSIZE) == 0, "memmove overlap", doff, soff, len);
+      }
+    }
+  }
+}
+
+static void
+test_memcmp(void)
+{
+  uint8_t a[BUFSIZE], b[BUFSIZE];
+
+  for (int aoff = 0; aoff < NOFF; aoff++) {
+    for (int boff = 0; boff < NOFF; boff++) {
+      for (int len = 0; len <= MAXLEN; len++) {
+        fill(a, BUFSIZE, 4);
+        memcpy(b + boff, a + aoff, len);
+        check(kmemcmp(a + aoff, b + boff, len) == 0, "memcmp equal", aoff, boff, len);
+        // 各位置で大小両方向の違いを作る
+        for (int pos = 0; pos < len; pos++) {
+          uint8_t save = b[boff + pos];
+          b[boff + pos] = a[aoff + pos] + 0x80;
+          check(sign(kmemcmp(a + aoff, b + boff, len)) == sign(memcmp(a + aoff, b + boff, len)),
+                "memcmp differ", aoff, boff, len);
+          b[boff + pos] = save;
+        }
+      }
+    }
+  }
+}
+
+static double
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 4KBページのコピーをnページ分繰り返した時の速度（MB/s）
+static double
+bench(void *(*copy)(void *, const void *, uint32_t), uint8_t *dst, uint8_t *src, int off, int n)
+{
+  double t = now();
+
+  for (int i = 0; i < n; i++) {
+    copy(dst + off, src, PAGE);
+    __asm__ volatile("" ::: "memory");
+  }
+  t = now() - t;
+  return (double)PAGE * n / t / (1024 * 1024);
+}
+
+static void *
+libc_memcpy(void *dst, const void *src, uint32_t n)
+{
+  return memcpy(dst, src, n);
+}
+
+int
+main(int argc, char *argv[])
+{
+  uint8_t *src, *dst;
+  int n = 200000;
+
+  printf("strtest: memset\n");
+  test_memset();
+  printf("strtest: memcpy/memmove\n");
+  test_memcpy();
+  printf("strtest: memmove overlap\n");
+  test_overlap();
+  printf("strtest: memcmp\n");
+  test_memcmp();
+  printf("strtest: ok: %d, ng: %d\n", ok, ng);
+
+  src = aligned_alloc(PAGE, 2 * PAGE);
+  dst = aligned_alloc(PAGE, 2 * PAGE);
+  fill(src, 2 * PAGE, 5);
+  printf("strtest: page copy (MB/s)  kernel   libc\n");
+  printf("  aligned                  %6.0f %6.0f\n",
+         bench(kmemcpy, dst, src, 0, n), bench(libc_memcpy, dst, src, 0, n));
+  printf("  unaligned dst            %6.0f %6.0f\n",
+         bench(kmemcpy, dst, src, 3, n), bench(libc_memcpy, dst, src, 3, n));
+  free(src);
+  free(dst);
+
+  exit(ng == 0 ? 0 : 1);
+}
@@ -4,6 +4,7 @@
 #include <common/types.h>
 #include <common/fs.h>
 #include <list.h>
+#include <waitqueue.h>
 
 #define DSIZE   BSIZE
 #define B_BUSY  0x1     /* Buffer is lockd by some process */
@@ -17,6 +18,7 @@ struct buf {
     uint32_t refcnt;
     struct list_head clink;     /* LRU cache list. */
     struct list_head dlink;     /* Disk buffer list. */
+    struct wait_queue wait;     /* B_BUSYが外れるのを待つプロセス */
     uint8_t *data;
 };
 
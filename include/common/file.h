@@ -44,6 +44,7 @@ struct inode {
     struct timespec mtime;      // 最新更新日時
     struct timespec ctime;      // 作成日時
     uint32_t addrs[NDIRECT+2];  // データブロックのアドレス
+    int nexec;                  // このファイルを実行中のイメージ数（書き込みはETXTBSY）
 };
 
 // map major device number to device functions.
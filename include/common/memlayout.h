@@ -35,10 +35,6 @@
  *  (0x40_0000_0000)
  *                         トランポリン             R-X
  *  0x3F_FFFF_F000 -> ---------------------------
- *                         ガードページ             ---
- *                       カーネルスタック0          RW-
- *                         ガードページ             ---
- *                       カーネルスタック1          RW-
  *                              ....
  *  PHYSTOP       -> ----------------------------
  *  (Duo    : 0x83E0_0000)
@@ -131,10 +127,9 @@
  */
 #define TRAMPOLINE (MAXVA - PGSIZE)
 
-/* trampolineの下にカーネルスタックをマッピングする
- * それぞれガードページを挟む.
+/* カーネルスタックはallocproc()がkalloc()したページを
+ * ストレートマッピングのまま使う.
  */
-#define KSTACK(p) (TRAMPOLINE - ((p)+1)* 2*PGSIZE)
 
 /* カーネルがリンクされるアドレス = KERNELBASE */
 #define KERNLINK    (KERNBASE)
@@ -143,10 +138,12 @@
  *  0x40_0000_0000 -> --------------------------- MAXVA (256GB)
  *                         トランポリン             R-X
  *  0x3F_FFFF_F000 -> --------------------------- TRAMPOLINE
- *                         トラップフレーム
- *  0x3F_FFFF_E000 -> --------------------------- TRAPFRAME
+ *                    トラップフレーム（スレッドごと）
+ *  0x3F_FFFF_E000 -> --------------------------- TRAPFRAME (スロット0)
+ *                           ...
+ *  0x3F_FFFB_F000 -> --------------------------- TRAPFRAME_SLOT(NTFSLOT-1)
  *                          ガードページ
- *  0x3F_FFFF_D000 -> --------------------------- USERTOP (STACKTOP/MMAPTOP)
+ *  0x3F_FFFB_E000 -> --------------------------- USERTOP (STACKTOP/MMAPTOP)
  *                        スタック (16 * 4KB)
  *                                                <- sp
  *                    --------------------------- STACKBASE
@@ -166,7 +163,12 @@
 
 #define TRAPFRAME   (TRAMPOLINE - PGSIZE)
 
-#define USERTOP     (TRAPFRAME - PGSIZE) /* ユーザ空間の最上位アドレス (ガードページをはさむ) */
+/* アドレス空間を共有するスレッドはそれぞれのトラップフレームを
+ * TRAPFRAMEから下に並ぶスロットにマッピングする */
+#define NTFSLOT     64
+#define TRAPFRAME_SLOT(n)   (TRAPFRAME - (n) * PGSIZE)
+
+#define USERTOP     TRAPFRAME_SLOT(NTFSLOT) /* ユーザ空間の最上位アドレス (ガードページをはさむ) */
 #define STACKPAGE   16
 #define STACKTOP    USERTOP             /* スタックはUSERTOPから */
 #define STACKBASE   (STACKTOP - STACKPAGE * PGSIZE) /* スタックは16ページ */
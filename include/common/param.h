@@ -2,9 +2,8 @@
 #define INC_PARAM_H
 
 #include "config.h"
-#define NPROC        64  // maximum number of processes
-#define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
+#define NOFILE     1024  // RLIMIT_NOFILEの既定値（open files per process）
+#define NR_OPEN   65536  // RLIMIT_NOFILEに設定できる最大値
 #define NINODE     1024  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
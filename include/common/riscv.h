@@ -207,6 +207,11 @@ w_pmpaddr0(uint64_t x)
 
 #define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64_t)pagetable) >> 12))
 
+// satpのASIDフィールド (Bit[59:44]). 実装されているビット数はCPUによる
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK  (0xFFFFUL << SATP_ASID_SHIFT)
+#define MAKE_SATP_ASID(pagetable, asid) (MAKE_SATP(pagetable) | ((uint64_t)(asid) << SATP_ASID_SHIFT))
+
 // SATP (supervisor address translation and protection)レジスタ
 // ページテーブルのアドレスを保持する
 static inline void
@@ -318,7 +323,8 @@ r_sp()
 }
 
 // スレッドポインタtpを読み書きする。xv6ではtpをこのコアのhartid
-// (コア番号で、cpus[]のインデックスでもある）の保管に使用している => これは使用しない
+// (コア番号で、cpus[]のインデックスでもある）の保管に使用している.
+// ユーザのtpはtrapframeに退避し、カーネル内では常にhartidである
 static inline uint64_t
 r_tp()
 {
@@ -349,6 +355,27 @@ sfence_vma()
     asm volatile("sfence.vma zero, zero");
 }
 
+// flush the TLB entries for one virtual address.
+static inline void
+sfence_vma_addr(uint64_t va)
+{
+    asm volatile("sfence.vma %0, zero" : : "r" (va) : "memory");
+}
+
+// 指定したASIDのTLBエントリをすべてフラッシュする（グローバルエントリを除く）
+static inline void
+sfence_vma_asid(uint64_t asid)
+{
+    asm volatile("sfence.vma zero, %0" : : "r" (asid) : "memory");
+}
+
+// 指定したASIDの1つの仮想アドレスのTLBエントリをフラッシュする
+static inline void
+sfence_vma_addr_asid(uint64_t va, uint64_t asid)
+{
+    asm volatile("sfence.vma %0, %1" : : "r" (va), "r" (asid) : "memory");
+}
+
 static inline void
 fence_i()
 {
@@ -422,6 +449,11 @@ typedef uint64_t *pagetable_t; // 512 PTEs
 #define PGROUNDUP(sz)  (((sz)+PGSIZE-1) & ~(PGSIZE-1))
 #define PGROUNDDOWN(a) (((a)) & ~(PGSIZE-1))
 
+// 2MBページ（レベル1のリーフPTEでマップするメガページ）
+#define MEGAPGSIZE  (PGSIZE * 512)
+#define MEGAPGROUNDUP(sz)  (((sz)+MEGAPGSIZE-1) & ~(MEGAPGSIZE-1))
+#define MEGAPGROUNDDOWN(a) (((a)) & ~(MEGAPGSIZE-1))
+
 #define PTE_V       (1L << 0) // valid
 #define PTE_R       (1L << 1)
 #define PTE_W       (1L << 2)
@@ -432,6 +464,7 @@ typedef uint64_t *pagetable_t; // 512 PTEs
 #define PTE_D       (1L << 7)
 
 #define PTE_COW     (1L << 8)   // このページはCOWか?
+#define PTE_WP      (1L << 9)   // 書き込み検出のため書き込み禁止にしている共有ページか?
 
 #define PTE_SEC     (1UL << 59) /* Security */
 #define PTE_S       (1UL << 60) /* Shareable */
@@ -17,7 +17,8 @@
 #define NO_1_8_V    1
 
 /* maximum number of CPUs */
-#define NCPU        1
+/*  - Duoで使えるのはhart 0だけ. QEMUでは-smp $(CPUS)まで起動する */
+#define NCPU        4
 
 #define UART0 0x04140000UL
 #define UART0_PHY UART0
@@ -23,6 +23,11 @@ struct k_sigaction;
 struct pollfd;
 struct tm;
 struct mmap_region;
+struct exec_image;
+struct wait_queue;
+struct mm;
+struct files;
+struct pgrp_pos;
 
 #define _cleanup_(x) __attribute__((cleanup(x)))
 
@@ -37,6 +42,9 @@ void            bunpin(struct buf*);
 // buddy.c
 void            buddy_init(void);
 struct page *   buddy_alloc(size_t size);
+struct page *   buddy_try_alloc(size_t size);
+void            buddy_split(struct page *page);
+int             buddy_alloc_batch(struct page **head, int count);
 void            buddy_free(struct page *page);
 
 // clock.c
@@ -54,6 +62,23 @@ void            consputc(int);
 
 // exec.c
 int             execve(char *path, char *const argv[], char *const envp[], int argc, int envc);
+struct exec_image *exec_image_dup(struct exec_image *im);
+void            exec_image_put(struct exec_image *im);
+int             exec_fault(struct proc *p, uint64_t va);
+
+// fdtable.c
+void            fdtableinit(void);
+struct files *  files_alloc(void);
+struct files *  files_dup(struct files *old);
+void            files_release(struct proc *p);
+void            files_close_on_exec(struct files *files);
+struct file *   fdget(int fd);
+void            fdput(struct proc *p);
+int             fdalloc(struct file *f, int from, int cloexec);
+int             fddup3(int oldfd, int newfd, int cloexec);
+struct file *   fdremove(int fd);
+int             fdgetflags(int fd);
+int             fdsetflags(int fd, int flags);
 
 // file.c
 struct file*    filealloc(void);
@@ -64,7 +89,6 @@ int             fileread(struct file *f, uint64_t addr, int n, int user);
 int             filestat(struct file*, uint64_t addr);
 int             filewrite(struct file *f, uint64_t addr, int n, int user);
 long            sendfile(struct file *out_f, struct file *in_f, off_t offsetp, size_t count);
-int             writeback(struct file *f, off_t off, uint64_t addr);
 int             fileioctl(struct file*, unsigned long, void *argp);
 long            filelseek(struct file *f, off_t offset, int whence);
 long            filelink(char *oldpath, int olddirfd, char *newpath, int newdirfd);
@@ -79,6 +103,11 @@ struct file *   fileget(char *path);
 long            faccess(char *path, int dirfd, int mode, int flags);
 long            filerename(char *oldpath, int olddirfd, char *newpath, int newdirfd, uint32_t flags);
 
+// futex.c
+void            futexinit(void);
+long            futex(uint64_t uaddr, int op, uint32_t val, uint64_t utime, uint64_t uaddr2, uint32_t val3);
+long            futex_wake_one(uint64_t uaddr);
+
 // fs.c
 void            fsinit(int);
 int             dirlink(struct inode *dp, char *name, uint32_t inum, uint16_t type);
@@ -111,6 +140,11 @@ void            ramdiskrw(struct buf*, int write);
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *pa);
+void            kfree_cold(void *pa);
+int             kalloc_drain(void);
+void*           kalloc_zeroed(void);
+int             kalloc_zero_idle(void);
+void            kalloc_init(void);
 void            kinit(void);
 
 // kmalloc.c
@@ -129,10 +163,13 @@ long            munmap(void *addr, size_t len);
 void           *mremap(void *old_addr, size_t old_length, size_t new_length, int flags, void *new_addr);
 long            mprotect(void *addr, size_t length, int prot);
 long            msync(void *addr, size_t length, int flags);
+long            madvise(void *addr, size_t length, int advice);
+void            mmap_dirty(struct proc *p, uint64_t va, uint64_t pa);
 uint64_t        get_perm(int prot, int flags);
 long            mmap_load_pages(void *addr, size_t length, int prot, int flags, struct file *f, off_t offset);
+long            mmap_readahead(struct mm *mm, uint64_t start, uint64_t end);
 void            print_mmap_list(struct proc *p, const char *title);
-void            free_mmap_list(struct proc *p);
+void            free_mmap_list(struct mm *mm);
 long            copy_mmap_regions(struct proc *parent, struct proc *child);
 struct mmap_region  *find_mmap_region(struct proc *p, void *start);
 bool            is_mmap_region(struct proc *p, void *addr, uint64_t length);
@@ -160,36 +197,57 @@ void            panic(char*) __attribute__((noreturn));
 void            printfinit(void);
 void            debug_bytes(char *title, char *buf, int size);
 
+// pid.c
+void            pidinit(void);
+void            attach_pid(struct proc *p);
+void            detach_pid(struct proc *p);
+void            attach_pgrp(struct proc *p);
+void            change_pgrp(struct proc *p, pid_t pgid);
+struct proc *   find_proc(pid_t pid);
+int             collect_pgrp(pid_t pgid, struct proc **procs, int n, struct pgrp_pos *pos);
+void            foreach_proc(void (*fn)(struct proc *, void *), void *arg);
+int             pgrp_in_session(pid_t pgid, pid_t sid);
+
 // proc.c
 struct cpu *    mycpu(void);
 struct proc *   myproc(void);
 int             cpuid(void);
+void            procinithart(void);
 void            delayms(unsigned long n);
 void            delayus(unsigned long n);
 int             either_copyout(int user_dst, uint64_t dst, void *src, uint64_t len);
 int             either_copyin(void *dst, int user_src, uint64_t src, uint64_t len);
 void            exit(int);
+void            exit_group(int);
+int             de_thread(struct proc *p);
 int             fork(void);
+int             clone(uint64_t flags, uint64_t stack, uint64_t ptid, uint64_t tls, uint64_t ctid);
+void            vfork_release(struct proc *p);
 struct cpu*     getmycpu(void);
 uint64_t        get_timer(uint64_t start);
 int             growproc(int);
 void            kdelay(unsigned long n);
 int             kill(pid_t pid, int sig);
+int             tkill(pid_t tgid, pid_t tid, int sig);
 int             killed(struct proc*);
 struct cpu*     mycpu(void);
 struct proc*    myproc();
 void            procdump(void);
 void            procinit(void);
-void            proc_mapstacks(pagetable_t);
-pagetable_t     proc_pagetable(struct proc *);
+pagetable_t     proc_pagetable(void);
 void            proc_freepagetable(pagetable_t, uint64_t);
+struct mm *     mm_alloc(void);
+int             mm_map_trapframe(struct mm *mm, struct proc *p);
+void            mm_unmap_trapframe(struct mm *mm, int slot);
+struct mm *     mm_detach(struct proc *p);
+void            mm_put(struct mm *mm);
+void            mm_release(struct proc *p);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            setkilled(struct proc*);
-void            sleep(void*, struct spinlock*);
 void            userinit(void);
+int             kthread_create(char *name, void (*fn)(void));
 int             wait4(pid_t pid, uint64_t status, int options, uint64_t ru);
-void            wakeup(void*);
 void            yield(void);
 void            check_pending_signal(void);
 long            sigsuspend(sigset_t *mask);
@@ -198,6 +256,8 @@ long            sigpending(uint64_t pending);
 long            sigprocmask(int how, sigset_t *set, uint64_t oldset);
 long            sigreturn(void);
 void            send_signal(struct proc *p, int sig);
+struct proc    *signal_target(struct proc *p);
+int             signal_pending(struct proc *p);
 //void            flush_signal_handlers(struct proc *p);
 long            ppoll(struct pollfd *fds, nfds_t nfds, struct timespec *timeout_ts, sigset_t *sigmask);
 pid_t           getpgid(pid_t pid);
@@ -219,10 +279,52 @@ void            rtc_now(void);
 #ifndef CONFIG_RISCV_M_MODE
 void            sbiinit(void);
 void sbi_set_timer(unsigned long stime_value);
+void            sbi_send_ipi(unsigned long hart_mask);
+void            sbi_remote_sfence_vma(unsigned long hart_mask, uint64_t start, uint64_t size);
+void            sbi_remote_sfence_vma_asid(unsigned long hart_mask, uint64_t start, uint64_t size, uint64_t asid);
 #else
 static inline void sbiinit(void) { }
+static inline void sbi_send_ipi(unsigned long hart_mask) { }
+static inline void sbi_remote_sfence_vma(unsigned long hart_mask, uint64_t start, uint64_t size) { }
+static inline void sbi_remote_sfence_vma_asid(unsigned long hart_mask, uint64_t start, uint64_t size, uint64_t asid) { }
 #endif
 
+// rusage.c
+void            acct_utime(struct proc *p);
+void            acct_stime(struct proc *p);
+void            acct_switch_in(struct proc *p);
+void            acct_switch_out(struct proc *p);
+void            acct_fault(struct proc *p, long inblock);
+void            acct_block_io(int write);
+void            acct_thread_exit(struct proc *p);
+void            acct_reap(struct proc *parent, struct proc *child, struct rusage *ru);
+uint64_t        cputime_ns(int group);
+long            getrusage(int who, uint64_t addr);
+long            times(uint64_t addr);
+
+// sched.c
+void            runq_init(void);
+void            sched_init_proc(struct proc *p, int nice);
+void            runq_add(struct proc *p, int how);
+struct proc *   runq_pick(void);
+int             runq_pending(void);
+void            sched_tick(void);
+int             sched_need_resched(void);
+long            setpriority(int which, int who, int nice);
+long            getpriority(int which, int who);
+
+// waitqueue.c
+void            waitinit(void);
+void            wq_init(struct wait_queue *wq, char *name);
+void            wq_sleep(struct wait_queue *wq, struct spinlock *lk);
+void            wq_sleep_exclusive(struct wait_queue *wq, struct spinlock *lk);
+int             wq_wakeup(struct wait_queue *wq);
+int             wq_wakeup_all(struct wait_queue *wq);
+void            sleep(void*, struct spinlock*);
+void            wakeup(void*);
+int             sleep_intr(void*, struct spinlock*);
+int             wakeup_intr(struct proc *p);
+
 // signal.c
 int     sigemptyset(sigset_t *set);
 int     sigfillset(sigset_t *set);
@@ -248,6 +350,28 @@ struct slab_cache *slab_cache_create(const char *name, uint32_t size, uint32_t a
 void            slab_cache_destroy(struct slab_cache *cache);
 void *          slab_cache_alloc(struct slab_cache *cache);
 void            slab_cache_free(struct slab_cache *cache, void *obj);
+void            slab_cache_set_magazine(struct slab_cache *cache);
+void            slab_cache_set_typesafe(struct slab_cache *cache, void (*ctor)(void *));
+int             slab_cache_reclaim(void);
+
+// socache.c
+void            socache_init(void);
+void            socache_register(struct inode *ip);
+void            socache_forget(struct inode *ip);
+int             socache_reclaim(void);
+long            socache_map(pagetable_t pagetable, uint64_t va, uint64_t length, uint64_t perm, struct file *f, off_t offset);
+
+// writeback.c
+uint64_t        wb_dirty(struct inode *ip, uint32_t off, uint64_t pa, int wait);
+uint64_t        wb_seq(void);
+void            wb_kick(void);
+long            wb_wait(uint64_t from, uint64_t to);
+void            wb_tick(void);
+void            wb_init(void);
+
+// readahead.c
+void            ra_queue(struct mm *mm, uint64_t start, uint64_t end);
+void            ra_init(void);
 
 // spinlock.c
 void            acquire(struct spinlock*);
@@ -281,7 +405,6 @@ int             argu64(int n, uint64_t *u64);
 int             argptr(int n, char *pp, size_t size);
 int             fetchstr(uint64_t addr, char *buf, int max);
 int             fetchaddr(uint64_t addr, uint64_t *ip);
-int             fdalloc(struct file *f, int from);
 void            syscall(void);
 
 // trap.c
@@ -289,6 +412,19 @@ void            trapinit(void);
 void            trapinithart(void);
 void            usertrapret(void);
 
+// timer.c
+void            timerinit(void);
+void            timerinithart(void);
+void            timer_interrupt(void);
+void            timer_kick(int cpu);
+void            timer_idle_enter(void);
+void            timer_idle_exit(void);
+long            timer_sleep_until(uint64_t expires);
+long            timer_sleep(struct timespec *timeout);
+uint64_t        timespec_to_cycles(const struct timespec *ts);
+long            nanosleep(struct timespec *req, struct timespec *rem);
+void            exit_itimers(struct proc *p);
+
 // uart.c
 void            uartinit(void);
 void            uartintr(void);
@@ -299,8 +435,14 @@ int             uartgetc(void);
 // vm.c
 void            kvminit(void);
 void            kvminithart(void);
+uint64_t        proc_asid(struct proc *p);
+void            uvmflush(pagetable_t pagetable);
+void            uvmflush_page(pagetable_t pagetable, uint64_t va);
+void            uvmflush_range(pagetable_t pagetable, uint64_t va, uint64_t size);
 void            kvmmap(pagetable_t kpgtbl, uint64_t va, uint64_t pa, uint64_t sz, uint64_t perm);
 int             mappages(pagetable_t pagetable, uint64_t va, uint64_t size, uint64_t pa, uint64_t perm);
+int             mapmegapages(pagetable_t pagetable, uint64_t va, uint64_t size, uint64_t pa, uint64_t perm);
+int             uvmalloc_megapage(pagetable_t pagetable, uint64_t va, uint64_t perm);
 pagetable_t     uvmcreate(void);
 void            uvmfirst(pagetable_t pagetable, uchar *src, uint32_t sz);
 uint64_t        uvmalloc(pagetable_t pagetable, uint64_t oldsz, uint64_t newsz, int xperm);
@@ -310,6 +452,7 @@ void            uvmfree(pagetable_t pagetable, uint64_t sz);
 void            uvmunmap(pagetable_t pagetable, uint64_t va, uint64_t npages, int do_free);
 void            uvmclear(pagetable_t pagetable, uint64_t va);
 pte_t *         walk(pagetable_t pagetable, uint64_t va, int alloc);
+pte_t *         walkmega(pagetable_t pagetable, uint64_t va);
 uint64_t        walkaddr(pagetable_t pagetable, uint64_t va);
 int             copyout(pagetable_t pagetable, uint64_t dstva, char *src, uint64_t len);
 int             copyin(pagetable_t pagetable, char *dst, uint64_t srcva, uint64_t len);
@@ -5,6 +5,7 @@
 #include <common/memlayout.h>
 #include <elf.h>
 #include <linux/capability.h>
+#include <spinlock.h>
 
 #define EM_RISCV            243
 #define ELF_ARCH            EM_RISCV
@@ -33,6 +34,28 @@
 #define ELF_HWCAP2          0
 #define ELF_PLATFORM        "riscv"
 
+// 実行ファイルの遅延ロード
+#define EXEC_MAXSEG         4       // 遅延ロードするセグメントの最大数
+#define EXEC_FAULT_AROUND   16      // 1回のページフォルトでマップする最大ページ数
+
+// 遅延ロードするPT_LOADセグメント（書き込み不可のテキスト部分）
+struct exec_seg {
+    uint64_t vaddr;         // 先頭仮想アドレス
+    uint64_t memsz;         // メモリサイズ
+    uint64_t off;           // ファイルオフセット
+    uint64_t filesz;        // ファイルサイズ
+    uint64_t perm;          // PTE_R/PTE_X
+};
+
+// 実行ファイルのイメージ. forkした子プロセスとは共有する
+struct exec_image {
+    struct spinlock lock;
+    int ref;                // 参照カウンタ: lockで保護
+    struct inode *ip;       // 実行ファイルのinode
+    int nseg;
+    struct exec_seg seg[EXEC_MAXSEG];
+};
+
 #ifndef elf_addr_t
 #define elf_addr_t          uint64_t
 #define elf_caddr_t         char *
@@ -0,0 +1,23 @@
+#ifndef INC_LINUX_FUTEX_H
+#define INC_LINUX_FUTEX_H
+
+// futex(2)のop
+#define FUTEX_WAIT              0
+#define FUTEX_WAKE              1
+#define FUTEX_FD                2
+#define FUTEX_REQUEUE           3
+#define FUTEX_CMP_REQUEUE       4
+#define FUTEX_WAKE_OP           5
+#define FUTEX_LOCK_PI           6
+#define FUTEX_UNLOCK_PI         7
+#define FUTEX_TRYLOCK_PI        8
+#define FUTEX_WAIT_BITSET       9
+#define FUTEX_WAKE_BITSET       10
+
+#define FUTEX_PRIVATE_FLAG      128     /* 同じアドレス空間のスレッドだけで使う */
+#define FUTEX_CLOCK_REALTIME    256     /* WAIT_BITSETの絶対時刻はCLOCK_REALTIME */
+#define FUTEX_CMD_MASK          ~(FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME)
+
+#define FUTEX_BITSET_MATCH_ANY  0xffffffff
+
+#endif
@@ -31,20 +31,19 @@ struct tm {
 };
 
 
+// times(2): 単位はclock tick（1/100秒）
+struct tms {
+    long tms_utime;             /* ユーザー時間 */
+    long tms_stime;             /* システム時間 */
+    long tms_cutime;            /* wait済みの子のユーザー時間 */
+    long tms_cstime;            /* wait済みの子のシステム時間 */
+};
+
 struct itimerval {
     struct timeval it_interval; /* 周期的タイマーのInterval */
     struct timeval it_value;    /* 次の時間切れまでの時間 */
 };
 
-#if 0
-struct timer_list {
-    struct list_head list;
-    uint64_t expires;
-    uint64_t data;
-    void (*function)(uint64_t);
-};
-#endif
-
 extern uint64_t jiffies;
 extern struct timespec xtime;
 
@@ -70,40 +69,4 @@ extern struct timespec xtime;
 
 #define TIME_UTC                1
 
-#if 0
-// FIXEME: externは必要？
-// タイマーの登録
-extern void add_timer(struct timer_list *timer);
-// タイマーのキャンセル
-extern int del_timer(struct timer_list *timer);
-// すでに実行中の場合は終了を待つ
-#define del_timer_sync(t)   del_timer(t)
-#define sync_timers()       do { } while (0)
-
-// expireの変更
-int mod_timer(struct timer_list *timer, uint64_t expires);
-
-static inline void init_timer(struct timer_list * timer)
-{
-	timer->list.next = timer->list.prev = NULL;
-}
-
-static inline int timer_pending(const struct timer_list * timer)
-{
-	return timer->list.next != NULL;
-}
-
-#define time_after(a,b)     ((int64_t)(b) - (int64_t)(a) < 0)
-#define time_before(a,b)    time_after(b,a)
-
-#define time_after_eq(a,b)  ((int64_t)(a) - (int64_t)(b) >= 0)
-#define time_before_eq(a,b) time_after_eq(b,a)
-
-void init_timervecs(void);
-void run_timer_list(void);
-long getitimer(int, struct itimerval *);
-void it_real_fn(uint64_t);
-long setitimer(int, struct itimerval *, struct itimerval *);
-#endif
-
 #endif
@@ -72,6 +72,12 @@ limitations under the License.
  * @brief ページフラグ: 2分割の前方ブロック
  */
 #define PF_FIRST_PAGE (1 << 1)
+/**
+ * @ingroup page
+ * @def PF_PGTBL_LOADED
+ * @brief ページフラグ: satpに設定したことのあるユーザページテーブルのルート
+ */
+#define PF_PGTBL_LOADED (1 << 2)
 /**
  * @ingroup page
  * @def _page_cleanup_
@@ -4,6 +4,7 @@
 #include <common/types.h>
 #include <linux/fcntl.h>
 #include <spinlock.h>
+#include <waitqueue.h>
 
 #define PIPESIZE 512
 
@@ -16,6 +17,8 @@ struct pipe {
   uint32_t nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  struct wait_queue rwait;  // データを待つ読み手（排他的）
+  struct wait_queue wwait;  // 空きを待つ書き手（排他的）
 };
 
 #endif
@@ -5,7 +5,14 @@
 #include <common/param.h>
 #include <common/file.h>
 #include <linux/signal.h>
+#include <linux/resources.h>
 #include <spinlock.h>
+#include <sleeplock.h>
+#include <list.h>
+#include <timer.h>
+
+struct exec_image;
+struct prio_array;
 
 extern struct slab_cache *MMAPREGIONS;
 
@@ -35,9 +42,13 @@ struct cpu {
     struct context context;     // コンテキストスイッチ用のコンテキスト(scheduler()に入るためにここにswtch()する)
     int noff;                   // push_off() した回数.
     int intena;                 // push_off() 最初にpush_off()した際に割り込みが有効であったか?
+    int idle;                   // schedulerがwfiで割り込みを待っている
+    int resched;                // 実行中のプロセスにCPUを手放させる
+    uint64_t asid_gen;          // このhartのTLBをフラッシュしたASIDの世代
 };
 
 extern struct cpu cpus[NCPU];
+extern volatile uint64_t cpus_online;   // 起動済みのhartのビットマスク
 
 // trampoline.Sにあるトラップ処理コードのためのプロセスごとのデータ。
 // ユーザページテーブルのtrampolineページのすぐ下のそれ自身のページに
@@ -92,6 +103,13 @@ struct trapframe {
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// 実行キューの優先度の数（nice -20..19に対応）
+#define NPRIO       40
+
+// runq_add()のhow
+#define RQ_WAKEUP   1       // sleepから起床した
+#define RQ_YIELD    2       // 実行中にCPUを明け渡した
+
 struct signal {
     sigset_t mask;
     sigset_t pending;
@@ -106,7 +124,61 @@ struct mmap_region {
     struct file *f;
     int         prot;
     int         flags;
-    struct mmap_region  *next;
+    int         advice;             // madviseのヒント（MADV_NORMAL等）
+    int         ra_pages;           // fault-aroundで一度にマッピングするページ数
+    uint64_t    ra_next;            // 前回のfault-aroundでマッピングした範囲の次のアドレス
+    struct mmap_region  *next;      // アドレス順リスト
+    struct mmap_region  *left;      // アドレス索引（AVL木）
+    struct mmap_region  *right;
+    int         height;
+};
+
+// アドレス空間. CLONE_VMで作成したスレッドとvforkの子が共有する.
+// pagetableは作成してから解放するまで変わらない（execは新しいmmを作る）.
+struct mm {
+    struct spinlock lock;           // refとtf_slotsを保護する
+    struct sleeplock mmap_lock;     // mmap領域とページフォルトの処理を直列化する
+    int ref;                        // 参照しているスレッドの数（先読み中のreadaheadスレッドを含む）
+    uint64_t tf_slots;              // 使用中のトラップフレームのスロット（ビットマスク）
+    pagetable_t pagetable;          // ユーザページテーブル
+    uint64_t sz;                    // プロセスメモリサイズ（バイト単位）
+    struct mmap_region *regions;    // map済みのmmap領域のリストの先頭のポインタ
+    struct mmap_region *region_root;    // mmap領域のAVL木の根
+    struct mmap_region *region_hint;    // 最後にfind_mmap_region()でヒットした領域
+    struct exec_image *image;       // 遅延ロード中の実行ファイル
+    uint64_t asid;                  // TLBのアドレス空間識別子
+    uint64_t asid_gen;              // asidを割り当てた世代（0は未割り当て）
+    uint64_t asid_harts;            // asidでこのアドレス空間を実行したhartのビットマスク
+};
+
+#define NR_OPEN_DEFAULT 64          // struct filesに埋め込んだfd表の大きさ（64の倍数）
+#define NFDREF          8           // 1つのシステムコールでfdget()できるファイルの数
+
+// オープンファイルの表. CLONE_FILESで作成したスレッドが共有する.
+// 最初は埋め込みの表を使い、足りなくなったらfdtable.cが拡張する.
+struct files {
+    struct spinlock lock;           // 以下のすべてを保護する
+    int ref;                        // 参照しているスレッドの数
+    int max_fds;                    // 表の大きさ（64の倍数）
+    int next_fd;                    // これより小さいfdはすべて使用中
+    struct file **ofile;            // オープンしているファイル
+    uint64_t *open_fds;             // 使用中のfdのビットマップ
+    uint64_t *close_on_exec;        // close-on-execのfdのビットマップ
+    struct file *fd_array[NR_OPEN_DEFAULT];
+    uint64_t open_fds_init[NR_OPEN_DEFAULT / 64];
+    uint64_t close_on_exec_init[NR_OPEN_DEFAULT / 64];
+};
+
+// 資源の使用量（getrusage, wait4, times）. 時間の単位はr_time()
+struct proc_acct {
+    uint64_t utime;                 // ユーザーモードの時間
+    uint64_t stime;                 // カーネルモードの時間
+    long minflt;                    // I/Oなしで解決したページフォルト
+    long majflt;                    // ディスクを読んだページフォルト
+    long inblock;                   // 読み込んだブロック（512バイト単位）
+    long oublock;                   // 書き出したブロック（512バイト単位）
+    long nvcsw;                     // 眠るために明け渡した回数
+    long nivcsw;                    // 横取りされた回数
 };
 
 // プロセスごとの状態
@@ -118,31 +190,72 @@ struct proc {
     void *chan;                     // 0でない場合、chanでsleep中
     int killed;                     // 0でない場合、プロセスはkillされた
     int paused;                     // 一時停止しているか
+    int sleep_intr;                 // sleep_intr()で眠っている（シグナルで起こせる）
     int xstate;                     // 親のwait()に返すExit状態
-    pid_t pid;                      // プロセス ID
+    pid_t pid;                      // プロセス ID（スレッドID）
+    pid_t tgid;                     // スレッドグループ ID（getpid()が返す値）
     pid_t pgid;                     // プロセスグループ ID
     pid_t sid;                      // セッション ID
+    int nice;                       // nice値（-20..19）
+    int prio;                       // 実行キューの優先度（0..NPRIO-1, 0が最高）
+    int slice;                      // 残りのタイムスライス（tick）
+    int rq_cpu;                     // 入っている実行キューのCPU（-1は入っていない）
+    int last_cpu;                   // 最後に実行したCPU（-1は未実行）
+    struct prio_array *rq_array;    // 入っている実行キューの配列
+    struct list_head rq_link;       // 実行キューのリスト
 
     // 次の項目を使用する場合はwait_lockを保持する必要がある:
     struct proc *parent;            // 親プロセスへのポインタ
+    struct proc *vfork_parent;      // CLONE_VFORKでexec/exitを待っている親
+    struct proc *group_leader;      // スレッドグループのリーダー（自身の場合もある）
+    struct list_head thread_group;  // 同じスレッドグループのスレッドのリスト
+    int nr_threads;                 // リーダーのみ: 終了していないスレッドの数
+    int group_exit;                 // リーダーのみ: exit_groupで終了中
+    int live;                       // リーダーのみ: exit()に入っていないスレッドの数
+    struct list_head children;      // リーダーのみ: waitで回収する子プロセスのリスト
+    struct list_head sibling;       // 親のchildrenのリスト
+
+    // 次の項目を使用する場合はpidhash_lock（pid.c）を保持する必要がある:
+    struct list_head pid_link;      // pidのハッシュのリスト
+    struct list_head pgrp_link;     // リーダーのみ: プロセスグループのハッシュのリスト
 
     // 以下の項目はプロセス私用なので操作の際にp->lockは不要
     uid_t uid, euid, suid, fsuid;   // ユーザーID
     gid_t gid, egid, sgid, fsgid;   // グループID
     kernel_cap_t   cap_effective, cap_inheritable, cap_permitted;   // capabilities
-    uint64_t kstack;                // カーネルスタックの仮想アドレス
-    uint64_t sz;                    // プロセスメモリサイズ（バイト単位）
-    pagetable_t pagetable;          // ユーザページテーブル
+    uint64_t kstack;                // カーネルスタックのアドレス（procと一緒に保持する）
+    struct mm *mm;                  // アドレス空間
+    pagetable_t pagetable;          // mm->pagetableと同じ（mmと同時に設定する）
+    uint64_t uva_va;                // copyin/copyoutが最後に変換したユーザページ
+    uint64_t uva_pa;                //   その物理アドレス
+    uint64_t uva_gen;               //   変換した時のuvm_gen（異なれば無効）
+    int uva_write;                  //   copyoutで書き込めることを確認済みか
     struct trapframe *trapframe;    // trampoline.S用のデータページへのポインタ
+    int tf_slot;                    // trapframeをマッピングしたmmのスロット（-1はなし）
+    uint64_t clear_child_tid;       // 終了時に0を書いてfutexで起こすユーザアドレス
     struct context context;         // プロセスを実行するにはここにswtch()
     mode_t umask;                   // umask
-    int fdflag;                     // fdフラグ（1ビット/ファイル）
-    struct file *ofile[NOFILE];     // オープンしているフィル
+    struct files *files;            // オープンファイルの表
+    struct file *fdrefs[NFDREF];    // 実行中のシステムコールでfdget()が参照を取ったファイル
+    int nfdref;                     //   その数
     struct inode *cwd;              // カレントワーキングディレクトリ
     char name[16];                  // プロセス名（デバッグ用）
-    struct mmap_region *regions;    // map済みのmmap領域のリストの先頭のポインタ
+    void (*kfunc)(void);            // カーネルスレッドの場合はその関数
     struct signal signal;           // シグナル
     struct trapframe *oldtf;        // 旧trapframeを保存
+    struct timer_list it_real;      // リーダーのみ: ITIMER_REALのタイマー
+    uint64_t it_real_incr;          // リーダーのみ: ITIMER_REALの周期（r_time()の単位, 0は一度だけ）
+    struct rlimit rlim[RLIM_NLIMITS];   // リーダーのみ: 資源の制限（prlimit64）
+    struct proc_acct acct;          // このスレッドの資源の使用量
+    uint64_t acct_stamp;            // 最後にacctに時間を計上したr_time()
+    struct proc_acct dead_acct;     // リーダーのみ: 終了したスレッドの使用量の合計
+    struct proc_acct child_acct;    // リーダーのみ: wait済みの子の使用量の合計
+};
+
+// collect_pgrp()の走査位置
+struct pgrp_pos {
+    int bucket;                     // 次に走査するバケット
+    pid_t pid;                      // バケット内で最後に返したpid
 };
 
 typedef struct cpu_set_t { unsigned long __bits[128/sizeof(long)]; } cpu_set_t;
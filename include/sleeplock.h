@@ -2,11 +2,13 @@
 #define INC_SLEEPLOCK_H
 
 #include "spinlock.h"
+#include "waitqueue.h"
 
 // Long-term locks for processes
 struct sleeplock {
   uint32_t locked;       // Is the lock held?
   struct spinlock lk; // spinlock protecting this sleep lock
+  struct wait_queue wait; // 獲得を待つプロセス（解放時に1つだけ起こす）
 
   // For debugging:
   char *name;        // Name of lock.
@@ -0,0 +1,42 @@
+#ifndef INC_TIMER_H
+#define INC_TIMER_H
+
+#include <common/types.h>
+#include <list.h>
+#include <linux/time.h>
+
+// カーネルタイマー. expiresはr_time()の値（US_INTERVALで1マイクロ秒）.
+// functionは時間切れになったhartのタイマー割り込みで呼び出される.
+struct timer_list {
+    struct list_head list;      // 登録中はtimer_baseのリスト（期限順）
+    uint64_t expires;
+    uint64_t data;
+    void (*function)(uint64_t);
+    int cpu;                    // 登録したCPU（-1は未登録）
+};
+
+// タイマーの登録
+void add_timer(struct timer_list *timer);
+// タイマーのキャンセル
+int del_timer(struct timer_list *timer);
+// すでに実行中の場合は終了を待つ
+int del_timer_sync(struct timer_list *timer);
+// expireの変更
+int mod_timer(struct timer_list *timer, uint64_t expires);
+
+static inline void init_timer(struct timer_list *timer)
+{
+    list_init(&timer->list);
+    timer->cpu = -1;
+}
+
+static inline int timer_pending(struct timer_list *timer)
+{
+    return !list_empty(&timer->list);
+}
+
+long getitimer(int, struct itimerval *);
+void it_real_fn(uint64_t);
+long setitimer(int, struct itimerval *, struct itimerval *);
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef INC_WAITQUEUE_H
+#define INC_WAITQUEUE_H
+
+#include <common/types.h>
+#include <spinlock.h>
+#include <list.h>
+
+struct proc;
+
+// 待ち行列. 待っているプロセスはそれぞれのカーネルスタック上の
+// wait_entryをつなぐので、起床にかかる時間は待っている数に比例する.
+// 非排他的な待ちは先頭に、排他的な待ちは末尾につなぐ.
+struct wait_queue {
+    struct spinlock lock;
+    struct list_head head;
+};
+
+struct wait_entry {
+    struct proc *p;
+    void *chan;                 // sleep()のchan（待ち行列自身で待つ場合はNULL）
+    int exclusive;              // wq_wakeup()で1つだけ起こす
+    struct list_head link;      // 起床させたらlist_init()する
+};
+
+#endif
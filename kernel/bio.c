@@ -42,6 +42,7 @@ void binit(void)
 {
     struct buf *b;
     BUFDATA = slab_cache_create("buf.data", 4096, ARCH_DMA_MINALIGN);
+    slab_cache_set_magazine(BUFDATA);
 
     initlock(&bcache.lock, "bcache");
 
@@ -49,6 +50,7 @@ void binit(void)
     list_init(&bcache.head);
     for(b = bcache.buf; b < bcache.buf+NBUF; b++){
         list_push_back(&bcache.head, &b->clink);
+        wq_init(&b->wait, "buf");
   }
 }
 
@@ -76,7 +78,8 @@ loop:
                 release(&bcache.lock);
                 return b;
             }
-            sleep(b, &bcache.lock);
+            // 解放時に1つだけ起こされる
+            wq_sleep_exclusive(&b->wait, &bcache.lock);
             goto loop;
         }
     }
@@ -86,6 +89,8 @@ loop:
     // find_free_entry()にあたる
     list_foreach_reverse(b, &bcache.head, clink) {
         if ((b->flags & B_BUSY) == 0 /* && b->refcnt == 0 */ && (b->flags & B_DIRTY) == 0) {
+            // 別のブロックになるので待っていたプロセスには探し直させる
+            wq_wakeup_all(&b->wait);
             b->dev = dev;
             b->blockno = blockno;
             b->flags = B_BUSY;
@@ -112,6 +117,7 @@ struct buf* bread(uint32_t dev, uint32_t bno)
     struct buf *b = bget(dev, bno);
     if ((b->flags & B_VALID) == 0) {
         sd_rw(b);
+        acct_block_io(0);
     }
     return b;
 }
@@ -129,6 +135,7 @@ void bwrite(struct buf *b)
     }
     b->flags |= B_DIRTY;
     sd_rw(b);
+    acct_block_io(1);
 }
 
 // リリースするバッファのB_BUSYフラグを外しCLISTの末尾に移動する.
@@ -145,7 +152,7 @@ void brelse(struct buf *b)
     list_push_back(&bcache.head, &b->clink);
     b->refcnt--;
     b->flags &= ~B_BUSY;
-    wakeup(b);
+    wq_wakeup(&b->wait);
     release(&bcache.lock);
 }
 
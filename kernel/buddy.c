@@ -213,7 +213,7 @@ void buddy_init(void) {
  *
  * @param from 必要なデータブロックのオーダー
  * @return データブロックの先頭ページのページ構造体へのポインタ。
- *         全て使用済みの場合はpanic
+ *         全て使用済みの場合はNULL
  */
 static struct page* buddy_pull_block(int from) {
     int i, to = 0;
@@ -233,7 +233,7 @@ static struct page* buddy_pull_block(int from) {
 
     /* 2. すべてのオーダーに空きブロックがなければエラー */
     if (i == PAGE_MAX_DEPTH) {
-        panic("out of memory");
+        return NULL;
     }
     // debug("from: %d, to: %d", from, to);
     /* 3. 得られた空きブロックから必要なブロックに分割する */
@@ -266,10 +266,11 @@ static struct page* buddy_pull_block(int from) {
  * @return 必要なサイズを満たすページブロックの先頭ページ構造体へのポインタ
  */
 struct page *buddy_alloc(size_t size) {
-    int i;
+    int i, reclaimed = 0;
     struct free_list *list;
     struct page *page = NULL;
 
+retry:
     /* 1. lockを取得 */
     acquire(&buddy_lock);
 
@@ -298,6 +299,15 @@ struct page *buddy_alloc(size_t size) {
         error("requested page is too large: size=0x%x", size);
         panic("No memory");
     }
+    /* 4.1 空きブロックがない場合はスラブの空きと共有オブジェクトの
+     *     キャッシュページを回収して1度だけ再試行する */
+    if (!page) {
+        if (!reclaimed && slab_cache_reclaim() + kalloc_drain() + socache_reclaim() > 0) {
+            reclaimed = 1;
+            goto retry;
+        }
+        panic("out of memory");
+    }
     /* 5. 前方ブロックフラグをたてる。相棒にはこのフラグがない */
     page->flags |= PF_FIRST_PAGE;   // 使用済みフラグ
 
@@ -311,6 +321,100 @@ struct page *buddy_alloc(size_t size) {
     return page;
 }
 
+/**
+ * @ingroup buddy
+ * @brief 指定されたサイズのページブロックを割り当てる.
+ *        buddy_alloc()と異なり、空きブロックがない場合はスラブの回収も
+ *        panicもせずにNULLを返す。2MBページのように、割り当てられなければ
+ *        小さなページで代替できる場合に使用する。
+ *
+ * @param size 必要なサイズ
+ * @return ページブロックの先頭ページ構造体へのポインタ. 空きがなければNULL
+ */
+struct page *buddy_try_alloc(size_t size) {
+    struct page *page = NULL;
+    int i;
+
+    acquire(&buddy_lock);
+    for (i = 0; i < PAGE_MAX_DEPTH; ++i) {
+        if (((1UL << i) * PAGE_SIZE) >= size) {
+            if ((page = buddy_list_pop(&free_lists[i])) == NULL)
+                page = buddy_pull_block(i);
+            break;
+        }
+    }
+    if (page)
+        page->flags |= PF_FIRST_PAGE;
+    release(&buddy_lock);
+    if (!page)
+        return NULL;
+
+    acquire(&pages_ref.lock);
+    page->refcnt = 1;
+    release(&pages_ref.lock);
+    return page;
+}
+
+/**
+ * @ingroup buddy
+ * @brief 割り当て済みのページブロックを独立したオーダー0のページに分割する.
+ *        2MBページを4KBページに分割する際に使用する。分割後の各ページは
+ *        先頭ページの参照カウンタを引き継ぎ、個別にkfree()できる。
+ *
+ * @param page ページブロックの先頭ページ構造体へのポインタ
+ */
+void buddy_split(struct page *page) {
+    int i, n = 1 << page->order;
+
+    acquire(&buddy_lock);
+    for (i = 0; i < n; i++) {
+        page[i].order = 0;
+        page[i].flags |= PF_FIRST_PAGE;
+    }
+    release(&buddy_lock);
+
+    acquire(&pages_ref.lock);
+    for (i = 1; i < n; i++)
+        page[i].refcnt = page->refcnt;
+    release(&pages_ref.lock);
+}
+
+/**
+ * @ingroup buddy
+ * @brief オーダー0のページをまとめて割り当てる.
+ *        buddy_lockの取得を1回で済ませるためのCPUごとのページキャッシュ用の関数。
+ *        空きがなくなった場合は割り当てられた分だけを返す（panicしない）。
+ *
+ * @param head 割り当てたページをnextでつないで返すリストの先頭
+ * @param count 割り当てるページ数
+ * @return 割り当てたページ数
+ */
+int buddy_alloc_batch(struct page **head, int count) {
+    struct page *page;
+    int i, n;
+
+    /* 1. lockを取得してまとめて取り出す */
+    acquire(&buddy_lock);
+    for (n = 0; n < count; n++) {
+        page = buddy_list_pop(&free_lists[0]);
+        if (!page && (page = buddy_pull_block(0)) == NULL)
+            break;
+        page->order = 0;
+        page->flags |= PF_FIRST_PAGE;
+        page->next = *head;
+        *head = page;
+    }
+    release(&buddy_lock);
+
+    /* 2. 参照カウンタをセットする */
+    acquire(&pages_ref.lock);
+    for (i = 0, page = *head; i < n; i++, page = page->next)
+        page->refcnt = 1;
+    release(&pages_ref.lock);
+
+    return n;
+}
+
 /**
  * @ingroup buddy
  * @brief ページブロックを解放し、相棒があればブロックをまとめる.
@@ -1,5 +1,8 @@
 #include <defs.h>
 #include <common/types.h>
+#include <common/param.h>
+#include <common/riscv.h>
+#include <config.h>
 #include <linux/time.h>
 #include <linux/capability.h>
 #include <proc.h>
@@ -20,20 +23,19 @@ uint64_t jiffies = 0;
 struct timespec xtime  __attribute__ ((aligned (16)));
 // 直近のwall time更新時のjiffies
 uint64_t wall_jiffies = 0;
+// jiffiesが0だった時のr_time()
+static uint64_t clock_start;
 
 struct spinlock clocklock;
 
 // 現在時の更新
+// tickが止まっていた間の分もまとめて進める
 static void update_wall_time(uint64_t ticks)
 {
-    do {
-        ticks--;
-        xtime.tv_nsec += TICK_NSEC;         // 1 tick = 10ms = 10 * 10^6
-        if (xtime.tv_nsec >= 1000000000) {  // nsec部分が1秒を超えたら
-            xtime.tv_nsec -= 1000000000;    // nsecから1秒引いて
-            xtime.tv_sec++;                 // secに1秒足す
-        }
-    } while (ticks);
+    uint64_t nsec = xtime.tv_nsec + ticks * TICK_NSEC;  // 1 tick = 10ms = 10 * 10^6
+
+    xtime.tv_sec += nsec / 1000000000;
+    xtime.tv_nsec = nsec % 1000000000;
 }
 
 // 現在時の調整
@@ -55,17 +57,36 @@ void clockinit(void)
         xtime.tv_nsec = 0;
         xtime.tv_sec = 1744166080;
     }
+    clock_start = r_time();
     info("clockinit ok");
 }
 
+// jiffiesとxtimeを現在時刻まで進める. 進めたら1を返す.
+// clocklockを保持して呼び出す.
+// jiffiesはtime CSRから求めるので、idleや1つのプロセスだけが動いている
+// hartがtickを止めたり延ばしたりしても進み方は変わらない.
+static int update_jiffies(void)
+{
+    uint64_t now = (r_time() - clock_start) / INTERVAL;
+
+    if (now <= jiffies)
+        return 0;
+    jiffies = now;
+    update_times();
+    return 1;
+}
+
+// 各hartのtickから呼び出す. 進めるのは最初に気づいたhartだけ.
 void clockintr(void)
 {
+    if ((r_time() - clock_start) / INTERVAL <= __atomic_load_n(&jiffies, __ATOMIC_RELAXED))
+        return;
     acquire(&clocklock);
-    jiffies++;
-    update_times();
-    //run_timer_list();
-    //clock_reset();
-    wakeup(&jiffies);
+    if (update_jiffies()) {
+        //clock_reset();
+        wakeup(&jiffies);
+        wb_tick();
+    }
     release(&clocklock);
 }
 
@@ -78,18 +99,27 @@ int clock_gettime(int userout, clockid_t clk_id, struct timespec *tp_addr)
         default:
             return -EINVAL;
         case CLOCK_REALTIME:
+            // tickが延びていてもxtimeを現在時刻まで進めておく
+            acquire(&clocklock);
+            update_jiffies();
             tp.tv_nsec = xtime.tv_nsec;
             tp.tv_sec = xtime.tv_sec;
+            release(&clocklock);
             break;
+        case CLOCK_MONOTONIC: {
+            // clockinit()からの経過時間
+            uint64_t us = (r_time() - clock_start) / US_INTERVAL;
+            tp.tv_sec = us / 1000000;
+            tp.tv_nsec = (us % 1000000) * 1000;
+            break;
+        }
         case CLOCK_PROCESS_CPUTIME_ID:
-        /*
-            uint64_t ptime = (p->stime + p->utime) * TICK_NSEC;
-            tp.tv_nsec = ptime % 1000000000;
-            tp.tv_sec  = ptime / 1000000000;
-        */
-            tp.tv_nsec = 0;
-            tp.tv_sec  = 0;
+        case CLOCK_THREAD_CPUTIME_ID: {
+            uint64_t ns = cputime_ns(clk_id == CLOCK_PROCESS_CPUTIME_ID);
+            tp.tv_sec  = ns / 1000000000;
+            tp.tv_nsec = ns % 1000000000;
             break;
+        }
     }
     trace("clk: %d, tv_sec: %lld, tv_nsec: %lld", clk_id, tp.tv_sec, tp.tv_nsec);
     if (userout) {
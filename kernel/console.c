@@ -190,7 +190,7 @@ static int consoleioctl(int fd, uint64_t req, void *argp)
             // Windowサイズ設定: 当面何もしない
             break;
         case TIOCSPGRP:  // TODO: 本来、dev(tty)用なのでp->sgid?
-            p->pgid = (pid_t)(uint64_t)argp;
+            change_pgrp(p->group_leader, (pid_t)(uint64_t)argp);
             break;
         case TIOCGPGRP:
             if (copyout(p->pagetable, (uint64_t)argp, (char *)&p->pgid, sizeof(pid_t)) < 0) {
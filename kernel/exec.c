@@ -17,18 +17,162 @@
 
 static int loadseg(pde_t *, uint64_t, struct inode *, uint32_t, uint32_t);
 
-static void flush_parent_data(struct proc *p)
+// 実行ファイルイメージを作成する. ipは呼び出し側で参照を持ち、
+// ロックしていること. イメージがある間はipへの書き込みをETXTBSYにする
+static struct exec_image *exec_image_alloc(struct inode *ip)
 {
+    struct exec_image *im;
+
+    if ((im = kmalloc(sizeof(struct exec_image))) == NULL)
+        return NULL;
+    memset(im, 0, sizeof(struct exec_image));
+    initlock(&im->lock, "exec_image");
+    im->ref = 1;
+    im->ip = idup(ip);
+    ip->nexec++;
+    return im;
+}
+
+struct exec_image *exec_image_dup(struct exec_image *im)
+{
+    if (im) {
+        acquire(&im->lock);
+        im->ref++;
+        release(&im->lock);
+    }
+    return im;
+}
+
+// 参照を解放する. 最後の参照の場合はinodeを解放する.
+// iputするのでトランザクションの外から呼び出すこと.
+void exec_image_put(struct exec_image *im)
+{
+    int ref;
+
+    if (im == NULL)
+        return;
+    acquire(&im->lock);
+    ref = --im->ref;
+    release(&im->lock);
+    if (ref > 0)
+        return;
+
+    begin_op();
+    ilock(im->ip);
+    im->ip->nexec--;
+    iunlockput(im->ip);
+    end_op();
+    kmfree(im);
+}
+
+// セグメントsの[start, end)のうち未マップのページを割り当て、
+// ファイルから読み込んでマップする. im->ipはロック済みであること.
+// 成功したら0, 失敗したら-1を返す.
+static int exec_image_map(pagetable_t pagetable, struct exec_image *im,
+                          struct exec_seg *s, uint64_t start, uint64_t end)
+{
+    struct exec_seg *t;
+    uint64_t a, lo, hi, perm;
+    pte_t *pte;
+    char *mem;
+
+    for (a = start; a < end; a += PGSIZE) {
+        pte = walk(pagetable, a, 0);
+        if (pte && (*pte & PTE_V))
+            continue;
+        if ((mem = kalloc_zeroed()) == 0)
+            return -1;
+        // 同じページにかかるすべてのセグメントの内容を読み込む
+        perm = s->perm;
+        for (t = im->seg; t < &im->seg[im->nseg]; t++) {
+            if (a + PGSIZE <= t->vaddr || t->vaddr + t->memsz <= a)
+                continue;
+            perm |= t->perm;
+            lo = a > t->vaddr ? a : t->vaddr;
+            hi = a + PGSIZE < t->vaddr + t->filesz ? a + PGSIZE : t->vaddr + t->filesz;
+            if (lo < hi && readi(im->ip, 0, (uint64_t)mem + (lo - a),
+                            t->off + (lo - t->vaddr), hi - lo) != hi - lo) {
+                kfree(mem);
+                return -1;
+            }
+        }
+        if (mappages(pagetable, a, PGSIZE, (uint64_t)mem, PTE_RO|PTE_U|perm) != 0) {
+            kfree(mem);
+            return -1;
+        }
+    }
+    fence_i();
+    return 0;
+}
+
+// 実行ファイルのテキスト領域へのページフォルトを処理する.
+// フォルトしたページを含むEXEC_FAULT_AROUNDページ境界の範囲を
+// まとめて読み込む.
+// 処理した場合は0, 対象外のアドレスの場合は1, エラーの場合は-1を返す.
+int exec_fault(struct proc *p, uint64_t va)
+{
+    struct exec_image *im = p->mm->image;
+    struct exec_seg *s;
+    uint64_t va0 = PGROUNDDOWN(va), start, end;
+    int locked, ret;
+
+    if (im == NULL)
+        return 1;
+    for (s = im->seg; s < &im->seg[im->nseg]; s++) {
+        if (PGROUNDDOWN(s->vaddr) <= va0 && va0 < PGROUNDUP(s->vaddr + s->memsz))
+            break;
+    }
+    if (s == &im->seg[im->nseg])
+        return 1;
+
+    // スピンロック保持中（copyinなど）はinodeを読めない
+    if (mycpu()->noff > 0)
+        return -1;
+
+    start = va0 & ~((uint64_t)EXEC_FAULT_AROUND * PGSIZE - 1);
+    if (start < PGROUNDDOWN(s->vaddr))
+        start = PGROUNDDOWN(s->vaddr);
+    end = start + EXEC_FAULT_AROUND * PGSIZE;
+    if (end > PGROUNDUP(s->vaddr + s->memsz))
+        end = PGROUNDUP(s->vaddr + s->memsz);
+
+    // 自身の実行ファイルをreadしている最中の場合はロック済み
+    locked = holdingsleep(&im->ip->lock);
+    if (!locked)
+        ilock(im->ip);
+    ret = exec_image_map(p->pagetable, im, s, start, end);
+    if (!locked)
+        iunlock(im->ip);
+    trace("pid[%d] va: 0x%lx, map 0x%lx - 0x%lx: %d", p->pid, va, start, end, ret);
+    return ret;
+}
+
+// execve中に遅延セグメントのページvaを1ページだけロードする. ipはロック済み
+static int exec_fault_image_page(pagetable_t pagetable, struct exec_image *im, uint64_t va)
+{
+    struct exec_seg *s;
+
+    for (s = im->seg; s < &im->seg[im->nseg]; s++) {
+        if (PGROUNDDOWN(s->vaddr) <= va && va < PGROUNDUP(s->vaddr + s->memsz))
+            return exec_image_map(pagetable, im, s, va, va + PGSIZE);
+    }
+    return 0;
+}
+
+// 親プロセスから受け継いだ情報を破棄して新しいアドレス空間mmに切り替え、
+// 古いアドレス空間を返す. 古いアドレス空間はファイルを閉じたり書き戻したり
+// するので、呼び出し側がトランザクションを終えてからmm_put()で手放す.
+static struct mm *flush_parent_data(struct proc *p, struct mm *mm, int slot)
+{
+    struct mm *old;
+    struct files *files = p->files;
+
+    // (0) vforkの親を起こす
+    vfork_release(p);
     // (1) signalを開放
     flush_signal_handlers(p);
     // (2) close_on_execのfileをclose
-    for (int i = 0; i < NOFILE; i++) {
-        if (p->ofile[i] && bit_test(p->fdflag, i)) {
-            fileclose(p->ofile[i]);
-            p->ofile[i] = 0;
-            bit_remove(p->fdflag, i);
-        }
-    }
+    files_close_on_exec(files);
     // (3) capabilityを再設定
     cap_clear(p->cap_inheritable);
     cap_clear(p->cap_permitted);
@@ -42,8 +186,14 @@ static void flush_parent_data(struct proc *p)
     if (p->euid == 0 || p->fsuid == 0)
         cap_set_full(p->cap_effective);
 
-    // (4) mmap領域を解放
-    free_mmap_list(p);
+    // (4) 新しいアドレス空間に切り替える.
+    //     vforkの親と共有していた場合は親がそのまま使い続ける
+    p->clear_child_tid = 0;
+    old = mm_detach(p);
+    p->mm = mm;
+    p->pagetable = mm->pagetable;
+    p->tf_slot = slot;
+    return old;
 }
 
 static int flags2perm(int flags)
@@ -128,6 +278,9 @@ static uint64_t load_interpreter(char *path, uint64_t *base)
     if (elf.phnum > ELF_MIN_ALIGN / sizeof(struct proghdr))
         goto out;
 
+    // インタプリタのページはプロセス間で共有する
+    socache_register(f->ip);
+
     // 3. プログラムヘッダを処理
     for (i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)) {
         int flags = 0;
@@ -230,14 +383,21 @@ int execve(char *path, char *const argv[], char *const envp[], int argc, int env
     int has_interp = 0;             // インタプリタを持つか(dynamicか)
     uint64_t interp_entry = 0;      // インタプリタのエントリポイント
     uint64_t interp_base = 0;       // インタプリタのベースアドレス
-    int i, off, errno = 0;
+    int i, off, slot = -1, errno = 0;
     uint64_t sp = USERTOP, len, ustack[MAXARG], estack[MAXARG];
     struct inode *ip;
     struct elfhdr elf;
     struct proghdr ph;
-    pagetable_t pagetable = 0, oldpagetable;
+    pagetable_t pagetable = 0;
+    struct mm *mm = 0, *oldmm = 0;
+    struct exec_image *image = 0;
     struct proc *p = myproc();
 
+    // 他のスレッドを終了させる. 終了するスレッドがログを使えるよう
+    // トランザクションを始める前に行う
+    if ((errno = de_thread(p)) < 0)
+        return errno;
+
     begin_op();
 
     if ((ip = namei(path, AT_FDCWD)) == 0) {
@@ -261,12 +421,17 @@ int execve(char *path, char *const argv[], char *const envp[], int argc, int env
         goto bad;
     }
 
-    // trampoline/p->trapframeをマッピングしたユーザページテーブルを作成する
-    if ((pagetable = proc_pagetable(p)) == 0) {
+    // trampoline/p->trapframeをマッピングした新しいアドレス空間を作成する
+    if ((mm = mm_alloc()) == 0) {
         warn("couldn't make pagetable: pid=%d", p->pid);
         errno = -ENOMEM;
         goto bad;
     }
+    pagetable = mm->pagetable;
+    if ((slot = mm_map_trapframe(mm, p)) < 0) {
+        errno = slot;
+        goto bad;
+    }
 
     // ファイルのSet-uidをセットする: stickyビットの対応
     if (ip->mode & S_ISUID && p->uid != 0)
@@ -279,12 +444,9 @@ int execve(char *path, char *const argv[], char *const envp[], int argc, int env
     else
         p->fsgid = p->gid;
 
-    // 親プロセスから受け継いだ情報を破棄する
-    flush_parent_data(p);
-
-    // pagetableを設定する
-    oldpagetable = p->pagetable;
-    p->pagetable = pagetable;
+    // 親プロセスから受け継いだ情報を破棄して新しいアドレス空間に切り替える.
+    // 新しいアドレス空間は新しいASIDを使うので古いTLBエントリは使われない
+    oldmm = flush_parent_data(p, mm, slot);
 
     int nph = 0;
     uint64_t sz = 0;
@@ -348,6 +510,28 @@ int execve(char *path, char *const argv[], char *const envp[], int argc, int env
         }
         nph++;
 
+        // 書き込み不可のセグメント（テキスト）はここではロードせず、
+        // 最初にアクセスされた時にexec_fault()で読み込む
+        if (!(ph.flags & PF_W) && (image || (image = exec_image_alloc(ip)) != 0)
+         && image->nseg < EXEC_MAXSEG) {
+            struct exec_seg *s = &image->seg[image->nseg++];
+            s->vaddr  = ph.vaddr;
+            s->memsz  = ph.memsz;
+            s->off    = ph.off;
+            s->filesz = ph.filesz;
+            s->perm   = flags2perm(ph.flags);
+            trace("LAZY[%d] addr: 0x%lx, off: 0x%lx, fsz: 0x%lx", i, ph.vaddr, ph.off, ph.filesz);
+            sz = ph.vaddr + ph.memsz;
+            continue;
+        }
+
+        // 直前の遅延セグメントと先頭ページを共有する場合はそのページを先にロードする
+        if (image && PGROUNDDOWN(ph.vaddr) < PGROUNDUP(sz)
+         && exec_fault_image_page(pagetable, image, PGROUNDDOWN(ph.vaddr)) < 0) {
+            errno = -EIO;
+            goto bad;
+        }
+
         // コード用のメモリを割り当ててマッピング
         uint64_t sz1;
         if ((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0) {
@@ -369,6 +553,8 @@ int execve(char *path, char *const argv[], char *const envp[], int argc, int env
     iunlockput(ip);
     end_op();
     ip = 0;
+    mm_put(oldmm);
+    oldmm = 0;
 
     // Synchronize the instruction and data streams.
     fence_i();
@@ -508,10 +694,7 @@ int execve(char *path, char *const argv[], char *const envp[], int argc, int env
             last = s+1;
     safestrcpy(p->name, last, sizeof(p->name));
 
-    uint64_t oldsz = p->sz;
-    //oldpagetable = p->pagetable;
-    //p->pagetable = pagetable;
-    p->sz = sz;
+    p->mm->sz = sz;
     // 実行するプログラムカウンタは動的リンクの場合はインタプリタの、
     // 静的リンクの場合はプログラムのエントリポインタ
     if (has_interp)
@@ -520,18 +703,18 @@ int execve(char *path, char *const argv[], char *const envp[], int argc, int env
         p->trapframe->epc = elf.entry;
     // スタックポインタ
     p->trapframe->sp = sp;
-    trace("pid[%d] sz: 0x%lx, sp: 0x%lx, interp: %d, epc: 0x%lx", p->pid, p->sz, p->trapframe->sp, has_interp, p->trapframe->epc);
+    trace("pid[%d] sz: 0x%lx, sp: 0x%lx, interp: %d, epc: 0x%lx", p->pid, p->mm->sz, p->trapframe->sp, has_interp, p->trapframe->epc);
 
 #if 0
     debug("free old pagetable: pid=%d", p->pid);
     //if (p->pid == 8) {
         uvmdump(pagetable, p->pid, "new");
-        uvmdump(oldpagetable, p->pid, "old");
     //}
     //print_mmap_list(p, "new proc");
 #endif
 
-    proc_freepagetable(oldpagetable, oldsz);
+    // 遅延ロード用のイメージを設定する
+    p->mm->image = image;
 
 #if 0
     if (p->pid == 7) {
@@ -551,14 +734,20 @@ int execve(char *path, char *const argv[], char *const envp[], int argc, int env
 bad:
     if (interp)
         kmfree(interp);
-    if (pagetable) {
+    // 切り替える前であれば新しいアドレス空間を解放する
+    if (mm && mm != p->mm) {
         trace("free pagetable for bad");
-        proc_freepagetable(pagetable, sz);
+        if (slot >= 0)
+            mm_unmap_trapframe(mm, slot);
+        proc_freepagetable(pagetable, 0);
+        kmfree(mm);
     }
     if (ip) {
         iunlockput(ip);
         end_op();
     }
+    mm_put(oldmm);
+    exec_image_put(image);
 
     return errno;
 }
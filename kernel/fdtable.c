@@ -0,0 +1,377 @@
+// オープンファイルの表（fd表）.
+//
+// fdはfiles->ofileの添字で、使用中のfdとclose-on-execのfdをそれぞれ
+// ビットマップで持つ. 最初はstruct filesに埋め込んだNR_OPEN_DEFAULT個の
+// 表を使い、足りなくなったらRLIMIT_NOFILEを上限として倍々に拡張する.
+// 拡張した表はbuddyから割り当てたブロックにofile, open_fds,
+// close_on_execの順に置く.
+// 空いているfdはビットマップを64個ずつ探し、next_fdより小さいfdは
+// 使用中であることがわかっているので飛ばす.
+//
+// 表はCLONE_FILESで共有され、拡張すると古い表は解放されるので、
+// 参照する場合も変更する場合もfiles->lockを保持する.
+
+#include <common/types.h>
+#include <common/param.h>
+#include <common/riscv.h>
+#include <spinlock.h>
+#include <proc.h>
+#include <defs.h>
+#include <errno.h>
+#include <printf.h>
+#include <page.h>
+#include <linux/fcntl.h>
+
+static struct slab_cache *FILESCACHE;
+
+static inline int fd_isset(uint64_t *map, int fd)
+{
+    return (map[fd / 64] >> (fd % 64)) & 1;
+}
+
+static inline void fd_set(uint64_t *map, int fd)
+{
+    map[fd / 64] |= 1UL << (fd % 64);
+}
+
+static inline void fd_clear(uint64_t *map, int fd)
+{
+    map[fd / 64] &= ~(1UL << (fd % 64));
+}
+
+// mapのfrom以降で最初の0のビットを返す. なければmaxを返す
+static int find_zero_fd(uint64_t *map, int max, int from)
+{
+    int w = from / 64;
+    uint64_t word;
+
+    if (from >= max)
+        return max;
+    word = ~map[w] & (~0UL << (from % 64));
+    while (word == 0) {
+        if (++w >= max / 64)
+            return max;
+        word = ~map[w];
+    }
+    return w * 64 + __builtin_ctzl(word);
+}
+
+// 呼び出したプロセスのRLIMIT_NOFILE
+static int nofile_limit(void)
+{
+    rlim_t cur = myproc()->group_leader->rlim[RLIMIT_NOFILE].rlim_cur;
+
+    return cur > NR_OPEN ? NR_OPEN : (int)cur;
+}
+
+// 大きさnの表のバイト数
+static uint64_t table_size(int n)
+{
+    return n * sizeof(struct file *) + 2 * (n / 64) * sizeof(uint64_t);
+}
+
+// filesの表を大きさn（64の倍数）の表に入れ替えて内容をコピーする.
+// files->lockを保持するか、filesが他から参照されていないこと.
+// buddy_try_alloc()は眠らないのでロックを保持したまま割り当てる.
+static int expand_table(struct files *files, int n)
+{
+    struct page *page;
+    struct file **ofile;
+    uint64_t *open_fds, *close_on_exec;
+    int words = n / 64, oldwords = files->max_fds / 64;
+
+    if ((page = buddy_try_alloc(table_size(n))) == 0)
+        return -ENOMEM;
+    ofile = page_address(page);
+    memset(ofile, 0, table_size(n));
+    open_fds = (uint64_t *)(ofile + n);
+    close_on_exec = open_fds + words;
+
+    memmove(ofile, files->ofile, files->max_fds * sizeof(struct file *));
+    memmove(open_fds, files->open_fds, oldwords * sizeof(uint64_t));
+    memmove(close_on_exec, files->close_on_exec, oldwords * sizeof(uint64_t));
+    if (files->ofile != files->fd_array)
+        buddy_free(page_find_by_address(files->ofile));
+    files->ofile = ofile;
+    files->open_fds = open_fds;
+    files->close_on_exec = close_on_exec;
+    files->max_fds = n;
+    trace("expanded to %d fds", n);
+    return 0;
+}
+
+// fdを格納できるように表を拡張する. files->lockを保持して呼び出す
+static int expand_files(struct files *files, int fd)
+{
+    int n;
+
+    if (fd < files->max_fds)
+        return 0;
+    if (fd >= nofile_limit())
+        return -EMFILE;
+    for (n = files->max_fds; n <= fd; n *= 2)
+        ;
+    return expand_table(files, n);
+}
+
+void fdtableinit(void)
+{
+    FILESCACHE = slab_cache_create("files", sizeof(struct files), 0);
+}
+
+// 空のオープンファイル表を作成する
+struct files *files_alloc(void)
+{
+    struct files *files;
+
+    if ((files = slab_cache_alloc(FILESCACHE)) == 0)
+        return 0;
+    memset(files, 0, sizeof(struct files));
+    initlock(&files->lock, "files");
+    files->ref = 1;
+    files->max_fds = NR_OPEN_DEFAULT;
+    files->ofile = files->fd_array;
+    files->open_fds = files->open_fds_init;
+    files->close_on_exec = files->close_on_exec_init;
+    return files;
+}
+
+static void files_free(struct files *files)
+{
+    if (files->ofile != files->fd_array)
+        buddy_free(page_find_by_address(files->ofile));
+    slab_cache_free(FILESCACHE, files);
+}
+
+// オープンファイル表を複製する（CLONE_FILESなしのclone）
+struct files *files_dup(struct files *old)
+{
+    struct files *files;
+    int n;
+
+    if ((files = files_alloc()) == 0)
+        return 0;
+    acquire(&old->lock);
+    if (old->max_fds > files->max_fds && expand_table(files, old->max_fds) < 0) {
+        release(&old->lock);
+        files_free(files);
+        return 0;
+    }
+    n = old->max_fds;
+    for (int fd = 0; fd < n; fd++) {
+        if (fd_isset(old->open_fds, fd))
+            files->ofile[fd] = filedup(old->ofile[fd]);
+    }
+    memmove(files->open_fds, old->open_fds, (n / 64) * sizeof(uint64_t));
+    memmove(files->close_on_exec, old->close_on_exec, (n / 64) * sizeof(uint64_t));
+    files->next_fd = old->next_fd;
+    release(&old->lock);
+    return files;
+}
+
+// pのオープンファイル表を手放す. 最後の参照であればすべて閉じる.
+void files_release(struct proc *p)
+{
+    struct files *files = p->files;
+    int ref;
+
+    if (files == 0)
+        return;
+    acquire(&files->lock);
+    ref = --files->ref;
+    release(&files->lock);
+    if (ref == 0) {
+        for (int fd = 0; fd < files->max_fds; fd++) {
+            if (fd_isset(files->open_fds, fd)) {
+                trace("pid[%d] close fd %d", p->pid, fd);
+                fileclose(files->ofile[fd]);
+            }
+        }
+        files_free(files);
+    }
+    p->files = 0;
+}
+
+// close-on-execのfdを閉じる（execve）
+void files_close_on_exec(struct files *files)
+{
+    struct file *f;
+
+    acquire(&files->lock);
+    for (int w = 0; w < files->max_fds / 64; w++) {
+        while (files->close_on_exec[w]) {
+            int fd = w * 64 + __builtin_ctzl(files->close_on_exec[w]);
+            f = files->ofile[fd];
+            files->ofile[fd] = 0;
+            fd_clear(files->open_fds, fd);
+            fd_clear(files->close_on_exec, fd);
+            if (fd < files->next_fd)
+                files->next_fd = fd;
+            // fileclose()は眠る可能性があるのでロックを外す
+            release(&files->lock);
+            if (f)
+                fileclose(f);
+            acquire(&files->lock);
+        }
+    }
+    release(&files->lock);
+}
+
+// fdのファイルを返す. 開いていなければ0を返す.
+// 表を他のスレッドと共有している場合は、そのスレッドがclose()しても
+// ファイルが解放されないように参照を取る. 取った参照はシステムコールから
+// 戻る際にfdput()で手放すので、呼び出し側はfileclose()しない.
+// 共有していなければfdを閉じられるのは自分だけなので参照は取らない.
+struct file *fdget(int fd)
+{
+    struct proc *p = myproc();
+    struct files *files = p->files;
+    struct file *f = 0;
+
+    if (fd < 0)
+        return 0;
+    acquire(&files->lock);
+    if (fd < files->max_fds && (f = files->ofile[fd]) != 0 && files->ref > 1) {
+        if (p->nfdref == NFDREF)
+            panic("fdget: too many");
+        p->fdrefs[p->nfdref++] = filedup(f);
+    }
+    release(&files->lock);
+    return f;
+}
+
+// 実行中のシステムコールでfdget()が取った参照を手放す.
+void fdput(struct proc *p)
+{
+    while (p->nfdref > 0)
+        fileclose(p->fdrefs[--p->nfdref]);
+}
+
+// fromより大きいか等しい最小の空いているfdをfに割り当てる.
+// 成功時は呼び出し元からファイル参照を引き継ぐ.
+// fromがRLIMIT_NOFILE以上の場合は-EINVAL（F_DUPFD）、
+// 空いているfdがない場合は-EMFILEを返す.
+int fdalloc(struct file *f, int from, int cloexec)
+{
+    struct files *files = myproc()->files;
+    int fd, err;
+
+    if (from < 0 || (from > 0 && from >= nofile_limit()))
+        return -EINVAL;
+    acquire(&files->lock);
+    while (1) {
+        fd = find_zero_fd(files->open_fds, files->max_fds,
+                          from < files->next_fd ? files->next_fd : from);
+        if (fd < files->max_fds)
+            break;
+        if ((err = expand_files(files, fd)) < 0) {
+            release(&files->lock);
+            return err;
+        }
+    }
+    // RLIMIT_NOFILEを下げた場合は表の方が大きい
+    if (fd >= nofile_limit()) {
+        release(&files->lock);
+        return -EMFILE;
+    }
+    fd_set(files->open_fds, fd);
+    if (cloexec)
+        fd_set(files->close_on_exec, fd);
+    else
+        fd_clear(files->close_on_exec, fd);
+    files->ofile[fd] = f;
+    if (from <= files->next_fd)
+        files->next_fd = fd + 1;
+    release(&files->lock);
+    return fd;
+}
+
+// oldfdのファイルをnewfdにも割り当てる（dup2, dup3）.
+// newfdで開いていたファイルは閉じる.
+int fddup3(int oldfd, int newfd, int cloexec)
+{
+    struct files *files = myproc()->files;
+    struct file *f, *old;
+    int err;
+
+    if (oldfd < 0 || newfd < 0 || newfd >= nofile_limit())
+        return -EBADF;
+    acquire(&files->lock);
+    if (oldfd >= files->max_fds || (f = files->ofile[oldfd]) == 0) {
+        release(&files->lock);
+        return -EBADF;
+    }
+    if ((err = expand_files(files, newfd)) < 0) {
+        release(&files->lock);
+        return err;
+    }
+    filedup(f);
+    old = files->ofile[newfd];
+    files->ofile[newfd] = f;
+    fd_set(files->open_fds, newfd);
+    if (cloexec)
+        fd_set(files->close_on_exec, newfd);
+    else
+        fd_clear(files->close_on_exec, newfd);
+    release(&files->lock);
+    // fileclose()は眠る可能性があるのでロックを外してから閉じる
+    if (old)
+        fileclose(old);
+    return newfd;
+}
+
+// fdを解放してそのファイルを返す. 呼び出し側がfileclose()する.
+// 開いていなければ0を返す.
+struct file *fdremove(int fd)
+{
+    struct files *files = myproc()->files;
+    struct file *f = 0;
+
+    if (fd < 0)
+        return 0;
+    acquire(&files->lock);
+    if (fd < files->max_fds && (f = files->ofile[fd]) != 0) {
+        files->ofile[fd] = 0;
+        fd_clear(files->open_fds, fd);
+        fd_clear(files->close_on_exec, fd);
+        if (fd < files->next_fd)
+            files->next_fd = fd;
+    }
+    release(&files->lock);
+    return f;
+}
+
+// fdのfdフラグ（FD_CLOEXEC）を返す
+int fdgetflags(int fd)
+{
+    struct files *files = myproc()->files;
+    int flags = -EBADF;
+
+    if (fd < 0)
+        return -EBADF;
+    acquire(&files->lock);
+    if (fd < files->max_fds && files->ofile[fd])
+        flags = fd_isset(files->close_on_exec, fd) ? FD_CLOEXEC : 0;
+    release(&files->lock);
+    return flags;
+}
+
+// fdのfdフラグ（FD_CLOEXEC）を設定する
+int fdsetflags(int fd, int flags)
+{
+    struct files *files = myproc()->files;
+    int err = -EBADF;
+
+    if (fd < 0)
+        return -EBADF;
+    acquire(&files->lock);
+    if (fd < files->max_fds && files->ofile[fd]) {
+        if (flags & FD_CLOEXEC)
+            fd_set(files->close_on_exec, fd);
+        else
+            fd_clear(files->close_on_exec, fd);
+        err = 0;
+    }
+    release(&files->lock);
+    return err;
+}
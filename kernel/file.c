@@ -19,15 +19,20 @@
 #include <printf.h>
 
 struct devsw devsw[NDEV];
+// ファイル構造体はslabから割り当てる. ftable.lockは参照カウンタを保護する.
+// fdを閉じた後も古いポインタからref == 0が見えるように型を保つ.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct slab_cache *cache;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  ftable.cache = slab_cache_create("file", sizeof(struct file), sizeof(uint64_t));
+  slab_cache_set_typesafe(ftable.cache, 0);
+  fdtableinit();
 }
 
 // Is the directory dp empty except for "." and ".." ?
@@ -51,16 +56,13 @@ filealloc(void)
 {
     struct file *f;
 
+    if ((f = slab_cache_alloc(ftable.cache)) == 0)
+        return 0;
+    memset(f, 0, sizeof(struct file));
     acquire(&ftable.lock);
-    for (f = ftable.file; f < ftable.file + NFILE; f++) {
-        if(f->ref == 0) {
-            f->ref = 1;
-            release(&ftable.lock);
-            return f;
-        }
-    }
+    f->ref = 1;
     release(&ftable.lock);
-    return 0;
+    return f;
 }
 
 // ファイルfのrefカウンタを増分.
@@ -91,6 +93,7 @@ void fileclose(struct file *f)
     f->ref = 0;
     f->type = FD_NONE;
     release(&ftable.lock);
+    slab_cache_free(ftable.cache, f);
 
     if (ff.type == FD_PIPE){
         pipeclose(ff.pipe, ff.writable);
@@ -190,6 +193,12 @@ filewrite(struct file *f, uint64_t addr, int n, int user)
             ssize_t n1 = MIN(max, n - i);
             begin_op();
             ilock(f->ip);
+            // 実行中のプログラムは書き換えさせない
+            if (f->ip->nexec > 0) {
+                iunlock(f->ip);
+                end_op();
+                return i > 0 ? i : -ETXTBSY;
+            }
             if ((r = writei(f->ip, user, addr + i, f->off, n1)) > 0)
                 f->off += r;
             clock_gettime(0, CLOCK_REALTIME, &ts);
@@ -252,30 +261,6 @@ out:
     return ret < 0 ? ret : bytes;
 }
 
-// 書き込みのあったMAP_SHAREのmmap領域の1ページをファイルに書き戻す
-// 書き戻しはファイルのサイズ内部分のみ行う。サイズ外の変更は無視する。
-
-int writeback(struct file *f, off_t off, uint64_t addr)
-{
-    int r;
-    struct timespec ts;
-
-    if (f == NULL || f->writable == 0 || f->type != FD_INODE) {
-        return 0;
-    }
-
-    uint32_t n = off + PGSIZE > f->ip->size ? f->ip->size - off : PGSIZE;
-    begin_op();
-    ilock(f->ip);
-    r = writei(f->ip, 1, addr, off, n);
-    clock_gettime(0, CLOCK_REALTIME, &ts);
-    f->ip->mtime = f->ip->atime = ts;
-    iunlock(f->ip);
-    end_op();
-    trace("addr: 0x%lx, off: 0x%lx, n: %d, r: %d", addr, off, n, r);
-    return r == n ? r : -1;
-}
-
 // ioctl request with arg from/to f
 int fileioctl(struct file *f, unsigned long request, void *argp)
 {
@@ -538,6 +523,9 @@ long fileunlink(char *path, int dirfd, int flags)
 
     ip->nlink--;
     iupdate(ip);
+    // 共有オブジェクトのキャッシュが持つ参照を手放して削除できるようにする
+    if (ip->nlink == 0)
+        socache_forget(ip);
     iunlockput(ip);
     end_op();
     return 0;
@@ -686,13 +674,22 @@ loop:
         goto bad;
     if (writable && (permission(ip, MAY_WRITE) < 0))
         goto bad;
+    if (writable && ip->nexec > 0) {
+        iunlockput(ip);
+        end_op();
+        return -ETXTBSY;
+    }
 
-    if ((f = filealloc()) == 0 || (fd = fdalloc(f, 0)) < 0) {
-        iunlock(ip);
+    if ((f = filealloc()) == 0) {
+        iunlockput(ip);
         end_op();
-        if (f) fileclose(f);
-        warn("cant alloc file\n");
-        return -ENOSPC;
+        return -ENFILE;
+    }
+    if ((fd = fdalloc(f, 0, flags & O_CLOEXEC)) < 0) {
+        iunlockput(ip);
+        end_op();
+        fileclose(f);
+        return fd;
     }
 
     if (ip->type == T_DEVICE) {
@@ -707,8 +704,6 @@ loop:
     f->flags    = flags;
     f->readable = readable;
     f->writable = writable;
-    if (flags & O_CLOEXEC)
-        bit_add(myproc()->fdflag, fd);
 
     trace("inum: %d, fd: %d", ip->inum, fd);
 
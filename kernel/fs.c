@@ -793,13 +793,16 @@ static struct inode*
 namex(char *path, int nameiparent, char *name, int dirfd)
 {
     struct inode *ip, *next;
+    struct file *f;
 
     if (*path == '/')
         ip = iget(ROOTDEV, ROOTINO);
     else if (dirfd == AT_FDCWD)
         ip = idup(myproc()->cwd);
+    else if ((f = fdget(dirfd)) != 0)
+        ip = idup(f->ip);
     else
-        ip = idup(myproc()->ofile[dirfd]->ip);
+        return 0;
 
     while ((path = skipelem(path, name)) != 0) {
         ilock(ip);
@@ -0,0 +1,358 @@
+// futex(2).
+//
+// 待っているプロセスはキーのハッシュで選んだバケットのリストにfutex_qを
+// つないで眠る. キーはFUTEX_PRIVATE_FLAGがあれば（ページテーブル, 仮想
+// アドレス）、なければMAP_SHAREDで共有したページでも一致するように
+// （0, 物理アドレス）とする.
+// FUTEX_WAITはバケットのロックを保持して値を確認してからつなぐので、
+// 値を変えてからFUTEX_WAKEする側との間で起床を取りこぼさない.
+// 競合していないロックはユーザ空間だけで完結し、futexは呼ばれない.
+//
+// FUTEX_REQUEUEは待ちを別のバケットに移すので、futex_qのロックは
+// その時点のq->bucketのロックである（lock_q()で獲得する）.
+// ロックの順序はバケット（アドレス順） -> 待ち行列 -> p->lock.
+
+#include <common/types.h>
+#include <common/param.h>
+#include <common/riscv.h>
+#include <spinlock.h>
+#include <proc.h>
+#include <defs.h>
+#include <errno.h>
+#include <printf.h>
+#include <list.h>
+#include <timer.h>
+#include <linux/time.h>
+#include <linux/futex.h>
+
+#define NFUTEXHASH  64      // 2のべき乗
+
+struct futex_key {
+    void *mm;               // FUTEX_PRIVATE_FLAGならページテーブル、でなければ0
+    uint64_t addr;          // mmがあれば仮想アドレス、なければ物理アドレス
+};
+
+struct futex_bucket {
+    struct spinlock lock;
+    struct list_head head;
+};
+
+// 待っているプロセスごとにカーネルスタックに置く
+struct futex_q {
+    struct list_head link;          // バケットのリスト
+    struct futex_bucket *bucket;    // つながっているバケット
+    struct futex_key key;
+    uint32_t bitset;
+    int woken;                      // FUTEX_WAKEで起こされた
+    int timedout;                   // タイムアウトした
+};
+
+static struct futex_bucket buckets[NFUTEXHASH];
+
+void futexinit(void)
+{
+    for (int i = 0; i < NFUTEXHASH; i++) {
+        initlock(&buckets[i].lock, "futex");
+        list_init(&buckets[i].head);
+    }
+}
+
+static struct futex_bucket *hash_futex(struct futex_key *key)
+{
+    uint64_t h = key->addr ^ (uint64_t)key->mm;
+
+    return &buckets[(h * 0x9e3779b97f4a7c15UL) >> 58];
+}
+
+static int match_futex(struct futex_key *a, struct futex_key *b)
+{
+    return a->mm == b->mm && a->addr == b->addr;
+}
+
+// uaddrのキーと値を読むためのカーネルアドレスを求める.
+// まだ読み込まれていないページはcopyin()で読み込ませる.
+static long get_futex_key(uint64_t uaddr, int private, struct futex_key *key, uint32_t **kaddr)
+{
+    struct proc *p = myproc();
+    uint32_t val;
+    uint64_t pa;
+
+    if (uaddr & (sizeof(uint32_t) - 1))
+        return -EINVAL;
+    if (copyin(p->pagetable, (char *)&val, uaddr, sizeof(val)) < 0)
+        return -EFAULT;
+    if ((pa = walkaddr(p->pagetable, PGROUNDDOWN(uaddr))) == 0)
+        return -EFAULT;
+    pa += uaddr - PGROUNDDOWN(uaddr);
+
+    key->mm = private ? (void *)p->pagetable : 0;
+    key->addr = private ? uaddr : pa;
+    if (kaddr)
+        *kaddr = (uint32_t *)pa;
+    return 0;
+}
+
+// qがつながっているバケットをロックして返す
+static struct futex_bucket *lock_q(struct futex_q *q)
+{
+    struct futex_bucket *b;
+
+    for (;;) {
+        b = __atomic_load_n(&q->bucket, __ATOMIC_ACQUIRE);
+        acquire(&b->lock);
+        if (b == q->bucket)
+            return b;
+        release(&b->lock);
+    }
+}
+
+// 2つのバケットをアドレス順にロックする
+static void double_lock(struct futex_bucket *b1, struct futex_bucket *b2)
+{
+    if (b1 > b2) {
+        struct futex_bucket *t = b1;
+        b1 = b2;
+        b2 = t;
+    }
+    acquire(&b1->lock);
+    if (b1 != b2)
+        acquire(&b2->lock);
+}
+
+static void double_unlock(struct futex_bucket *b1, struct futex_bucket *b2)
+{
+    release(&b1->lock);
+    if (b1 != b2)
+        release(&b2->lock);
+}
+
+// qを起こす. qのバケットのロックを保持して呼び出す.
+// 待っている側はバケットのロックを獲得するまでqを手放さない.
+static void wake_futex(struct futex_q *q)
+{
+    list_drop(&q->link);
+    list_init(&q->link);
+    q->woken = 1;
+    wakeup(q);
+}
+
+// FUTEX_WAIT/FUTEX_WAIT_BITSETのタイムアウト. dataはfutex_q
+static void futex_timeout(uint64_t data)
+{
+    struct futex_q *q = (struct futex_q *)data;
+    struct futex_bucket *b = lock_q(q);
+
+    q->timedout = 1;
+    wakeup(q);
+    release(&b->lock);
+}
+
+// *uaddrがvalであれば起こされるまで眠る. expiresが0でなければ
+// r_time()がexpiresになったらタイムアウトする.
+static long futex_wait(uint64_t uaddr, int private, uint32_t val, uint64_t expires, uint32_t bitset)
+{
+    struct futex_q q;
+    struct futex_bucket *b;
+    struct timer_list t;
+    uint32_t *kaddr;
+    long ret;
+
+    if (bitset == 0)
+        return -EINVAL;
+    if ((ret = get_futex_key(uaddr, private, &q.key, &kaddr)) < 0)
+        return ret;
+    q.bitset = bitset;
+    q.woken = q.timedout = 0;
+    list_init(&q.link);
+
+    b = hash_futex(&q.key);
+    acquire(&b->lock);
+    if (__atomic_load_n(kaddr, __ATOMIC_SEQ_CST) != val) {
+        release(&b->lock);
+        return -EAGAIN;
+    }
+    q.bucket = b;
+    list_push_back(&b->head, &q.link);
+
+    init_timer(&t);
+    if (expires) {
+        t.expires = expires;
+        t.function = futex_timeout;
+        t.data = (uint64_t)&q;
+        add_timer(&t);
+    }
+
+    ret = 0;
+    for (;;) {
+        if (q.woken) {
+            ret = 0;
+            break;
+        }
+        if (q.timedout) {
+            ret = -ETIMEDOUT;
+            break;
+        }
+        if (ret == -EINTR)
+            break;
+        ret = sleep_intr(&q, &b->lock);
+        // FUTEX_REQUEUEで別のバケットに移っているかもしれない
+        release(&b->lock);
+        b = lock_q(&q);
+    }
+    if (!q.woken)
+        list_drop(&q.link);
+    release(&b->lock);
+
+    if (expires)
+        del_timer_sync(&t);
+    return ret;
+}
+
+// uaddrで待っているプロセスをnr個まで起こす. 起こした数を返す.
+static long futex_wake(uint64_t uaddr, int private, int nr, uint32_t bitset)
+{
+    struct futex_key key;
+    struct futex_bucket *b;
+    struct futex_q *q, *n;
+    long ret;
+
+    if (bitset == 0)
+        return -EINVAL;
+    if ((ret = get_futex_key(uaddr, private, &key, 0)) < 0)
+        return ret;
+
+    b = hash_futex(&key);
+    acquire(&b->lock);
+    list_foreach_safe(q, n, &b->head, link) {
+        if (ret >= nr)
+            break;
+        if (match_futex(&q->key, &key) && (q->bitset & bitset)) {
+            wake_futex(q);
+            ret++;
+        }
+    }
+    release(&b->lock);
+    return ret;
+}
+
+// uaddrで待っているプロセスをnr_wake個まで起こし、残りをnr_requeue個まで
+// uaddr2の待ちに移す. cmpであれば*uaddrがcmpvalでなければ-EAGAIN.
+// 起こした数と移した数の合計を返す.
+static long futex_requeue(uint64_t uaddr, int private, uint64_t uaddr2, int nr_wake,
+                          int nr_requeue, int cmp, uint32_t cmpval)
+{
+    struct futex_key key1, key2;
+    struct futex_bucket *b1, *b2;
+    struct futex_q *q, *n;
+    uint32_t *kaddr;
+    long ret, woken = 0, requeued = 0;
+
+    if (nr_wake < 0 || nr_requeue < 0)
+        return -EINVAL;
+    if ((ret = get_futex_key(uaddr, private, &key1, &kaddr)) < 0
+     || (ret = get_futex_key(uaddr2, private, &key2, 0)) < 0)
+        return ret;
+
+    b1 = hash_futex(&key1);
+    b2 = hash_futex(&key2);
+    double_lock(b1, b2);
+    if (cmp && __atomic_load_n(kaddr, __ATOMIC_SEQ_CST) != cmpval) {
+        double_unlock(b1, b2);
+        return -EAGAIN;
+    }
+    list_foreach_safe(q, n, &b1->head, link) {
+        if (!match_futex(&q->key, &key1))
+            continue;
+        if (woken < nr_wake) {
+            wake_futex(q);
+            woken++;
+        } else if (requeued < nr_requeue) {
+            q->key = key2;
+            if (b1 != b2) {
+                list_drop(&q->link);
+                list_push_back(&b2->head, &q->link);
+                __atomic_store_n(&q->bucket, b2, __ATOMIC_RELEASE);
+            }
+            requeued++;
+        } else {
+            break;
+        }
+    }
+    double_unlock(b1, b2);
+    return woken + requeued;
+}
+
+// タイムアウトをr_time()の期限に変換する. FUTEX_WAITは相対時間、
+// FUTEX_WAIT_BITSETはclockの絶対時刻.
+static long futex_expires(uint64_t utime, int absolute, clockid_t clock, uint64_t *expires)
+{
+    struct timespec ts, now;
+
+    *expires = 0;
+    if (utime == 0)
+        return 0;
+    if (copyin(myproc()->pagetable, (char *)&ts, utime, sizeof(ts)) < 0)
+        return -EFAULT;
+    if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= 1000000000L)
+        return -EINVAL;
+    if (absolute) {
+        clock_gettime(0, clock, &now);
+        if (ts.tv_sec < now.tv_sec || (ts.tv_sec == now.tv_sec && ts.tv_nsec <= now.tv_nsec))
+            return -ETIMEDOUT;
+        ts.tv_sec -= now.tv_sec;
+        ts.tv_nsec -= now.tv_nsec;
+        if (ts.tv_nsec < 0) {
+            ts.tv_nsec += 1000000000L;
+            ts.tv_sec--;
+        }
+    }
+    *expires = r_time() + timespec_to_cycles(&ts);
+    return 0;
+}
+
+// sys_futexの実装. utimeはWAIT系ではtimespecのユーザアドレス、
+// REQUEUE系では移す数.
+long futex(uint64_t uaddr, int op, uint32_t val, uint64_t utime, uint64_t uaddr2, uint32_t val3)
+{
+    int private = (op & FUTEX_PRIVATE_FLAG) != 0;
+    int cmd = op & FUTEX_CMD_MASK;
+    uint64_t expires;
+    long ret;
+
+    trace("uaddr: 0x%lx, op: %d, val: %d, utime: 0x%lx, uaddr2: 0x%lx, val3: %d", uaddr, op, val, utime, uaddr2, val3);
+    if ((op & FUTEX_CLOCK_REALTIME) && cmd != FUTEX_WAIT_BITSET)
+        return -ENOSYS;
+
+    switch (cmd) {
+    case FUTEX_WAIT:
+        val3 = FUTEX_BITSET_MATCH_ANY;
+        // fall through
+    case FUTEX_WAIT_BITSET:
+        if ((ret = futex_expires(utime, cmd == FUTEX_WAIT_BITSET,
+                (op & FUTEX_CLOCK_REALTIME) ? CLOCK_REALTIME : CLOCK_MONOTONIC, &expires)) < 0)
+            return ret;
+        return futex_wait(uaddr, private, val, expires, val3);
+    case FUTEX_WAKE:
+        val3 = FUTEX_BITSET_MATCH_ANY;
+        // fall through
+    case FUTEX_WAKE_BITSET:
+        return futex_wake(uaddr, private, (int)val, val3);
+    case FUTEX_REQUEUE:
+        return futex_requeue(uaddr, private, uaddr2, (int)val, (int)utime, 0, 0);
+    case FUTEX_CMP_REQUEUE:
+        return futex_requeue(uaddr, private, uaddr2, (int)val, (int)utime, 1, val3);
+    }
+    return -ENOSYS;
+}
+
+// uaddrで待っているプロセスを1つ起こす. CLONE_CHILD_CLEARTIDのスレッドの
+// 終了時等、カーネルから呼び出す. 待つ側がFUTEX_PRIVATE_FLAGを
+// 使ったかどうかはわからないので両方のキーで探す.
+long futex_wake_one(uint64_t uaddr)
+{
+    long ret = futex_wake(uaddr, 1, 1, FUTEX_BITSET_MATCH_ANY);
+
+    if (ret == 0)
+        ret = futex_wake(uaddr, 0, 1, FUTEX_BITSET_MATCH_ANY);
+    return ret;
+}
@@ -12,6 +12,33 @@
 #include "common/riscv.h"
 #include "printf.h"
 
+// CPUごとのオーダー0ページキャッシュ.
+// kalloc()/kfree()はまずここを使い、buddy_lockを取るのは
+// PCP_BATCHページ単位の補充/返却の時だけにする.
+// hotは直前に解放された（キャッシュに載っている可能性が高い）ページ,
+// coldは補充したばかりのページやkfree_cold()で返されたページ.
+#define PCP_HIGH    64      // これを超えたらPCP_BATCHページをbuddyに返す
+#define PCP_BATCH   16      // 補充/返却の単位
+
+struct per_cpu_pages {
+    struct page *hot;       // LIFO: 先頭が最も新しい
+    struct page *cold;
+    int count;              // hot + coldのページ数
+};
+
+static struct per_cpu_pages pcp_pages[NCPU];
+
+// ゼロクリア済みページのプール.
+// schedulerのアイドル時にkalloc_zero_idle()で補充し、
+// kalloc_zeroed()はここから取り出すことでmemsetを省く.
+#define ZPOOL_HIGH  64
+
+struct {
+    struct spinlock lock;
+    struct page *head;
+    int count;
+} zpool;
+
 #if 0
 void freerange(void *pa_start, void *pa_end);
 
@@ -44,6 +71,59 @@ freerange(void *pa_start, void *pa_end)
 }
 #endif
 
+// 割り込みを禁止して呼び出すこと.
+static struct page *pcp_pop(struct page **list)
+{
+    struct page *page = *list;
+    *list = page->next;
+    page->next = NULL;
+    return page;
+}
+
+// pcpからcount枚をbuddyに返す. coldから先に返す.
+// 割り込みを禁止して呼び出すこと.
+static int pcp_drain(struct per_cpu_pages *pcp, int count)
+{
+    struct page *page;
+    int n;
+
+    for (n = 0; n < count && pcp->count > 0; n++) {
+        page = pcp_pop(pcp->cold ? &pcp->cold : &pcp->hot);
+        pcp->count--;
+        buddy_free(page);
+    }
+    return n;
+}
+
+// pageをpcpのlistに入れる. ページの参照が残っている場合や
+// オーダー0以外のブロックは従来通りbuddy_free()で処理する.
+static void pcp_free(void *pa, int cold)
+{
+    struct page *page = page_find_by_address(pa);
+    struct per_cpu_pages *pcp;
+
+    acquire(&pages_ref.lock);
+    if (page->refcnt > 1 || page->order != 0) {
+        release(&pages_ref.lock);
+        buddy_free(page);
+        return;
+    }
+    release(&pages_ref.lock);
+
+    push_off();
+    pcp = &pcp_pages[cpuid()];
+    if (cold) {
+        page->next = pcp->cold;
+        pcp->cold = page;
+    } else {
+        page->next = pcp->hot;
+        pcp->hot = page;
+    }
+    if (++pcp->count > PCP_HIGH)
+        pcp_drain(pcp, PCP_BATCH);
+    pop_off();
+}
+
 // Free the page of physical memory pointed at by pa,
 // which normally should have been returned by a
 // call to kalloc().  (The exception is when
@@ -66,7 +146,14 @@ void kfree(void *pa)
     kmem.freelist = r;
     release(&kmem.lock);
 #endif
-    buddy_free(page_find_by_address(pa));
+    pcp_free(pa, 0);
+}
+
+// 内容がすぐには参照されないページ（ページテーブルなど）を解放する.
+// coldリストに入れ、kalloc()では後回しにする.
+void kfree_cold(void *pa)
+{
+    pcp_free(pa, 1);
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -87,9 +174,103 @@ void *kalloc(void)
         memset((char*)r, 5, PGSIZE); // fill with junk
     return (void*)r;
 #endif
-    struct page *page = buddy_alloc(PGSIZE);
-    // return page_address(page);
+    struct per_cpu_pages *pcp;
+    struct page *page;
+
+    push_off();
+    pcp = &pcp_pages[cpuid()];
+    // 空ならbuddyからまとめて補充する
+    if (pcp->count == 0)
+        pcp->count = buddy_alloc_batch(&pcp->cold, PCP_BATCH);
+    if (pcp->count > 0) {
+        page = pcp_pop(pcp->hot ? &pcp->hot : &pcp->cold);
+        pcp->count--;
+    } else {
+        // buddyが空: buddy_alloc()に回収と再試行を任せる
+        page = buddy_alloc(PGSIZE);
+    }
+    pop_off();
+
     void *addr = page_address(page);
     //debug("addr: 0x%08x\n", addr);
     return addr;
 }
+
+// ゼロクリアされたページを1つ割り当てる.
+// プールが空の場合はkalloc()してその場でクリアする.
+void *kalloc_zeroed(void)
+{
+    struct page *page = NULL;
+    void *pa;
+
+    acquire(&zpool.lock);
+    if (zpool.head) {
+        page = zpool.head;
+        zpool.head = page->next;
+        page->next = NULL;
+        zpool.count--;
+    }
+    release(&zpool.lock);
+
+    if (page)
+        return page_address(page);
+
+    if ((pa = kalloc()) != 0)
+        memset(pa, 0, PGSIZE);
+    return pa;
+}
+
+// アイドルループから呼び出し、空きページを1つクリアして
+// プールに追加する. クリアした場合は1, 何もしなかった場合は0を返す.
+// 割り込みは許可したままmemsetするので、1回に1ページだけ処理する.
+int kalloc_zero_idle(void)
+{
+    struct page *page = NULL;
+
+    if (zpool.count >= ZPOOL_HIGH)
+        return 0;
+    // pcpのhotページを奪わないようにbuddyから直接取る
+    if (buddy_alloc_batch(&page, 1) == 0)
+        return 0;
+
+    memset(page_address(page), 0, PGSIZE);
+
+    acquire(&zpool.lock);
+    page->next = zpool.head;
+    zpool.head = page;
+    zpool.count++;
+    release(&zpool.lock);
+    return 1;
+}
+
+// このCPUのページキャッシュとゼロクリア済みプールをすべてbuddyに返す.
+// メモリ不足時にbuddy_alloc()から呼び出される.
+int kalloc_drain(void)
+{
+    struct page *page, *head;
+    int n;
+
+    push_off();
+    struct per_cpu_pages *pcp = &pcp_pages[cpuid()];
+    n = pcp_drain(pcp, pcp->count);
+    pop_off();
+
+    acquire(&zpool.lock);
+    head = zpool.head;
+    zpool.head = NULL;
+    zpool.count = 0;
+    release(&zpool.lock);
+
+    while ((page = head) != NULL) {
+        head = page->next;
+        page->next = NULL;
+        buddy_free(page);
+        n++;
+    }
+    return n;
+}
+
+void kalloc_init(void)
+{
+    initlock(&zpool.lock, "zpool");
+}
@@ -52,10 +52,9 @@ morecore()
     char *p;
     Header *hp;
 
-    p = kalloc();
+    p = kalloc_zeroed();
     if (p == 0)
         return NULL;
-    memset(p, 0, PGSIZE);
     hp = (Header*)p;
     hp->s.size = PGSIZE / sizeof(Header);
     kmfree((void*)(hp + 1));
@@ -36,16 +36,22 @@ main()
         trapinit();         // trap vectors
         rtc_init();
         clockinit();        // clock system
+        timerinit();        // kernel timers
+        futexinit();        // futex hash table
         trapinithart();     // install kernel trap vector
+        timerinithart();    // start this hart's timer
         plicinit();         // set up interrupt controller
         plicinithart();     // ask PLIC for device interrupts
         binit();            // buffer cache
         iinit();            // inode table
         fileinit();         // file table
+        socache_init();     // shared object page cache
         //virtio_disk_init(); // emulated hard disk
         //ramdiskinit();
         sd_init();
         userinit();      // first user process
+        wb_init();       // mmap write-back thread
+        ra_init();       // MADV_WILLNEED readahead thread
         __sync_synchronize();
         started = 1;
     } else {
@@ -55,8 +61,10 @@ main()
         kvminithart();    // turn on paging
         trapinithart();   // install kernel trap vector
         plicinithart();   // ask PLIC for device interrupts
-        printf("hart %d init ok", cpuid());
+        timerinithart();  // start this hart's timer
+        printf("hart %d init ok\n", cpuid());
     }
 
+    procinithart();     // mark this hart online
     scheduler();
 }
@@ -13,65 +13,207 @@
 /* utils */
 #define NOT_PAGEALIGN(a)  ((uint64_t)(a) & (PGSIZE-1))
 
+/* 書き戻しが必要な共有書き込みファイルマッピングか */
+#define IS_SHARED_WRITABLE(prot, flags) \
+    (!((flags) & MAP_ANONYMOUS) && ((flags) & MAP_SHARED) && ((prot) & PROT_WRITE))
+
+/* ファイルマッピングのfault-aroundのページ数 */
+#define FAULT_AROUND_MIN    1
+#define FAULT_AROUND_INIT   4
+#define FAULT_AROUND_MAX    32
+
 /*
- * struct mmap_regionリンクリストからnodeを削除して、node->nextをprevに
- * つなぐ。munmap()が呼ばれた時に呼び出される
+ * mmap_regionのアドレス索引（AVL木）.
+ * p->mm->regionsのアドレス順リストはそのまま残し、アドレスによる検索は
+ * p->mm->region_rootの木で行う. regionは互いに重ならないのでキーは
+ * region->addrだけでよい.
  */
-static void delete_mmap_node(struct proc *p, struct mmap_region *node)
+static inline int region_height(struct mmap_region *r)
 {
-    if (p->regions == NULL) return;
+    return r ? r->height : 0;
+}
 
-    //trace("delete_mmap_node[%d]: addr=%p", p->pid, node->addr);
+static void region_update(struct mmap_region *r)
+{
+    int hl = region_height(r->left), hr = region_height(r->right);
+    r->height = (hl > hr ? hl : hr) + 1;
+}
 
-    //print_mmap_list(p, "delete node before");
+static struct mmap_region *region_rotate_right(struct mmap_region *r)
+{
+    struct mmap_region *l = r->left;
 
-    struct mmap_region *region, *prev;
-    // nodeがp->regionsの先頭region
-    if (node->addr == p->regions->addr) {
-        if (p->regions->next != NULL)
-            p->regions = p->regions->next;
-        else
-            p->regions = NULL;
+    r->left = l->right;
+    l->right = r;
+    region_update(r);
+    region_update(l);
+    return l;
+}
+
+static struct mmap_region *region_rotate_left(struct mmap_region *r)
+{
+    struct mmap_region *rr = r->right;
+
+    r->right = rr->left;
+    rr->left = r;
+    region_update(r);
+    region_update(rr);
+    return rr;
+}
+
+// rの左右の高さの差が2になっていたら回転して戻す
+static struct mmap_region *region_balance(struct mmap_region *r)
+{
+    int bf;
+
+    region_update(r);
+    bf = region_height(r->left) - region_height(r->right);
+    if (bf > 1) {
+        if (region_height(r->left->left) < region_height(r->left->right))
+            r->left = region_rotate_left(r->left);
+        return region_rotate_right(r);
+    }
+    if (bf < -1) {
+        if (region_height(r->right->right) < region_height(r->right->left))
+            r->right = region_rotate_right(r->right);
+        return region_rotate_left(r);
+    }
+    return r;
+}
+
+static struct mmap_region *region_tree_insert(struct mmap_region *root, struct mmap_region *node)
+{
+    if (root == NULL) {
+        node->left = node->right = NULL;
+        node->height = 1;
+        return node;
+    }
+    if (node->addr < root->addr)
+        root->left = region_tree_insert(root->left, node);
+    else
+        root->right = region_tree_insert(root->right, node);
+    return region_balance(root);
+}
+
+// 最小のノードを木から外して*minに返す
+static struct mmap_region *region_tree_remove_min(struct mmap_region *root, struct mmap_region **min)
+{
+    if (root->left == NULL) {
+        *min = root;
+        return root->right;
+    }
+    root->left = region_tree_remove_min(root->left, min);
+    return region_balance(root);
+}
+
+static struct mmap_region *region_tree_remove(struct mmap_region *root, struct mmap_region *node)
+{
+    struct mmap_region *min;
+
+    if (root == NULL)
+        return NULL;
+    if (node->addr < root->addr) {
+        root->left = region_tree_remove(root->left, node);
+    } else if (node->addr > root->addr) {
+        root->right = region_tree_remove(root->right, node);
     } else {
-        region = prev = p->regions;
-        while (region) {
-            if (node->addr == region->addr) {
-                if (region->next != NULL)
-                    prev->next = region->next;
-                else
-                    prev->next = NULL;
-                break;
-            }
-            prev = region;
-            region = region->next;
+        if (root->right == NULL)
+            return root->left;
+        root->right = region_tree_remove_min(root->right, &min);
+        min->left = root->left;
+        min->right = root->right;
+        return region_balance(min);
+    }
+    return region_balance(root);
+}
+
+// region->addr <= addr である最後のregionを返す
+static struct mmap_region *region_tree_floor(struct mmap_region *root, void *addr)
+{
+    struct mmap_region *found = NULL;
+
+    while (root) {
+        if (root->addr <= addr) {
+            found = root;
+            root = root->right;
+        } else {
+            root = root->left;
         }
     }
+    return found;
+}
+
+// regionをp->mm->regionsのリストと木に追加する
+static void link_mmap_region(struct proc *p, struct mmap_region *region)
+{
+    struct mmap_region *prev = region_tree_floor(p->mm->region_root, region->addr);
+
+    if (prev) {
+        region->next = prev->next;
+        prev->next = region;
+    } else {
+        region->next = p->mm->regions;
+        p->mm->regions = region;
+    }
+    p->mm->region_root = region_tree_insert(p->mm->region_root, region);
+}
+
+// regionをp->mm->regionsのリストと木から外す
+static void unlink_mmap_region(struct proc *p, struct mmap_region *region)
+{
+    struct mmap_region *prev = region_tree_floor(p->mm->region_root, (char *)region->addr - 1);
+
+    if (prev)
+        prev->next = region->next;
+    else
+        p->mm->regions = region->next;
+    p->mm->region_root = region_tree_remove(p->mm->region_root, region);
+    if (p->mm->region_hint == region)
+        p->mm->region_hint = NULL;
+}
+
+/*
+ * nodeをp->mm->regionsから外して、マッピングを解除する。
+ * munmap()が呼ばれた時に呼び出される
+ */
+static void delete_mmap_node(struct proc *p, struct mmap_region *node)
+{
+    if (p->mm->regions == NULL) return;
+
+    unlink_mmap_region(p, node);
     trace("uvmunmp: pid=%d, addr=%p", p->pid, node->addr);
     uvmunmap(p->pagetable, (uint64_t)node->addr, (((uint64_t)node->length + PGSIZE - 1) / PGSIZE), 1);
     slab_cache_free(MMAPREGIONS, node);
-    node = NULL;
-
-    //print_mmap_list(p, "delete node after");
 }
 
+static long mmap_writeback(pagetable_t pagetable, struct mmap_region *region, uint64_t start, uint64_t end, int sync);
+
 /*
  * struct mmap_regionリンクリスト全体をクリアする。
- * ユーザ空間にあるメモリページをすべて開放しなければ
- * ならない時にexecから呼び出される
+ * アドレス空間の最後の参照を手放す時にmm_put()から
+ * 呼び出される. MAP_SHARED領域の書き込みは書き戻してから解放する
  */
-void free_mmap_list(struct proc *p)
+void free_mmap_list(struct mm *mm)
 {
-    struct mmap_region* region = p->regions;
-    struct mmap_region* temp;
+    struct mmap_region* region = mm->regions;
+    struct mmap_region* next;
 
     while (region) {
-        temp = region;
+        next = region->next;
+        if (IS_SHARED_WRITABLE(region->prot, region->flags)
+         && mmap_writeback(mm->pagetable, region, (uint64_t)region->addr,
+                           (uint64_t)region->addr + region->length, 1) < 0)
+            error("failed writeback");
         if (region->f) {
             fileclose(region->f);
         }
-        delete_mmap_node(p, region);
-        region = temp->next;
+        uvmunmap(mm->pagetable, (uint64_t)region->addr, (((uint64_t)region->length + PGSIZE - 1) / PGSIZE), 1);
+        slab_cache_free(MMAPREGIONS, region);
+        region = next;
     }
+    mm->regions = NULL;
+    mm->region_root = NULL;
+    mm->region_hint = NULL;
 }
 
 // srcからdestにmmap_regionをコピー
@@ -82,6 +224,9 @@ static void copy_mmap_region(struct mmap_region *dest, struct mmap_region *src)
     dest->flags         = src->flags;
     dest->prot          = src->prot;
     dest->offset        = src->offset;
+    dest->advice        = src->advice;
+    dest->ra_pages      = src->ra_pages;
+    dest->ra_next       = 0;
     dest->next          = NULL;
 
     if (!(src->flags & MAP_ANONYMOUS) && src->f) {
@@ -124,62 +269,61 @@ static int is_usable(void *addr, size_t length)
     if (addr < (void *)ELF_ET_DYN_BASE || addr > (void *)USERTOP)
         return 0;
 
-    struct mmap_region *cursor = p->regions;
-    // regionが一つも作成されていなければ使用可能
-    if (cursor == NULL)
-        return 1;
+    // addrの直前と直後のregionとだけ重ならなければよい
+    struct mmap_region *prev = region_tree_floor(p->mm->region_root, addr);
+    struct mmap_region *next = prev ? prev->next : p->mm->regions;
 
-    while (cursor) {
-        // 1. 使用済み
-        if (addr == cursor->addr)
-            return 0;
-        // 2: 右端が最左のregionより小さい
-        if (addr + length <= cursor->addr)
-            return 1;
-        // 3: 左端が最左のregionより大きい、かつ、次のregionがないか、右端が次のregionより小さい
-        if (cursor->addr + cursor->length <= addr && (cursor->next == 0 || addr + length <= cursor->next->addr))
-            return 1;
-        cursor = cursor->next;
-    }
+    if (prev && addr < prev->addr + prev->length)
+        return 0;
+    if (next && addr + length > next->addr)
+        return 0;
 
-    return 0;
+    return 1;
 }
 
 /*
- * offsetからファイルの内容をaddrにlengthマッピングする
+ * offsetからファイルの内容をaddrにlengthマッピングする.
+ * 複数ページの場合もilockは一度だけ取る.
  */
-static long map_file_pages(struct proc *p, void *addr, uint64_t length, uint64_t perm, struct file *f, off_t offset)
+static long map_file_pages(pagetable_t pagetable, void *addr, uint64_t length, uint64_t perm, struct file *f, off_t offset)
 {
-    long ret;
+    struct inode *ip = f->ip;
+    long ret = 0;
     uint64_t cur;
-
-    for (cur = 0; cur < length; cur += PGSIZE) {
-        f->off = offset;
-        int len = (f->ip->size - f->off) > PGSIZE ? PGSIZE : (f->ip->size - f->off);
-        if (len == 0)
-            break;
+    int len, locked;
+
+    // 同じファイルのread/write中のcopyin/copyoutから呼ばれた場合はロック済み
+    locked = holdingsleep(&ip->lock);
+    if (!locked)
+        ilock(ip);
+    for (cur = 0; cur < length; cur += PGSIZE, offset += PGSIZE) {
+        // EOFを超えるページは0で埋めたページをマッピングする
+        if (offset >= ip->size)
+            len = 0;
+        else
+            len = (ip->size - offset) > PGSIZE ? PGSIZE : (ip->size - offset);
         //trace("addr=%p, length=0x%x, offset=0x%x", addr, length, offset);
-        char *mem = kalloc();
+        char *mem = kalloc_zeroed();
         if (!mem) {
             ret = -ENOMEM;
             goto err;
         }
-        memset(mem, 0, PGSIZE);
-        if ((ret = fileread(f, (uint64_t)mem, len, 0)) < 0) {
-            error("fileread failed");
+        if (len > 0 && readi(ip, 0, (uint64_t)mem, offset, len) != len) {
+            error("readi failed");
             kfree(mem);
+            ret = -EIO;
             goto err;
         }
 
         // メモリをユーザプロセスにマッピング
-        if (p->pid == 7)
-            trace("pid[%d] mapping: addr=%p, mem=%p, offset: 0x%x, len: 0x%x", p->pid, addr+cur, mem, offset, len);
-        if ((ret = mappages(p->pagetable, (uint64_t)addr + cur, (uint64_t)len, (uint64_t)mem, perm)) < 0) {
+        trace("mapping: addr=%p, mem=%p, offset: 0x%x, len: 0x%x", addr+cur, mem, offset, len);
+        if ((ret = mappages(pagetable, (uint64_t)addr + cur, PGSIZE, (uint64_t)mem, perm)) < 0) {
             kfree(mem);
-            return ret;
+            goto err;
         }
-        offset += len;
     }
+    if (!locked)
+        iunlock(ip);
 
     fence_i();
     fence_rw();
@@ -187,29 +331,37 @@ static long map_file_pages(struct proc *p, void *addr, uint64_t length, uint64_t
     return 0;
 
 err:
+    if (!locked)
+        iunlock(ip);
     if (cur != 0) {
-        uvmunmap(p->pagetable, (uint64_t)addr, cur / PGSIZE, 1);
+        uvmunmap(pagetable, (uint64_t)addr, cur / PGSIZE, 1);
     }
     return ret;
 }
 
 // 無名ページに（複数）ページを割り当てる
-static long map_anon_pages(struct proc *p, void *addr, uint64_t length, uint64_t perm)
+static long map_anon_pages(pagetable_t pagetable, void *addr, uint64_t length, uint64_t perm)
 {
     long ret;
-    uint64_t cur;
+    uint64_t cur, va;
 
     for (cur = 0; cur < length; cur += PGSIZE) {
-        char *page = kalloc();
+        va = (uint64_t)addr + cur;
+        // 2MB境界から2MB以上残っている部分は2MBページを試す.
+        // 割り当てられなければ4KBページで続ける
+        if ((va & (MEGAPGSIZE - 1)) == 0 && length - cur >= MEGAPGSIZE
+         && uvmalloc_megapage(pagetable, va, perm) == 0) {
+            cur += MEGAPGSIZE - PGSIZE;
+            continue;
+        }
+        char *page = kalloc_zeroed();
         if (!page) {
             error("map_anon_page: memory exhausted");
             ret = -ENOMEM;
             goto err;
         }
-        memset(page, 0, PGSIZE);
-        if (p->pid == 7)
-            trace("pid[%d] map addr %p to page %p with perm 0x%lx", p->pid, addr+cur, page, perm);
-        if (mappages(p->pagetable, (uint64_t)addr + cur, PGSIZE, (uint64_t)page, perm) < 0) {
+        trace("map addr %p to page %p with perm 0x%lx", addr+cur, page, perm);
+        if (mappages(pagetable, (uint64_t)addr + cur, PGSIZE, (uint64_t)page, perm) < 0) {
             kfree(page);
             ret = -EINVAL;
             goto err;
@@ -223,23 +375,37 @@ static long map_anon_pages(struct proc *p, void *addr, uint64_t length, uint64_t
 
 err:
     if (cur != 0) {
-        uvmunmap(p->pagetable, (uint64_t)addr, cur / PGSIZE, 1);
+        uvmunmap(pagetable, (uint64_t)addr, cur / PGSIZE, 1);
     }
     return ret;
 }
 
-/* addrにメモリを割り当てる */
-long mmap_load_pages(void *addr, uint64_t length, int prot, int flags, struct file *f, off_t offset)
+/* pagetableのaddrにメモリを割り当てる */
+static long load_pages(pagetable_t pagetable, void *addr, uint64_t length, int prot, int flags, struct file *f, off_t offset)
 {
-    struct proc *p = myproc();
-
     uint64_t perm = get_perm(prot, flags);
     //if (flags & MAP_SHARED) perm |= PTE_W;
 
     if (flags & MAP_ANONYMOUS)
-        return map_anon_pages(p, addr, length, perm);
-    else
-        return map_file_pages(p, addr, length, perm, f, offset);
+        return map_anon_pages(pagetable, addr, length, perm);
+
+    // 共有書き込みマッピングは書き込まれたページを検出するために
+    // 書き込み禁止でマッピングする（alloc_cow_page()を参照）.
+    // それ以外は共有キャッシュを試す
+    if (IS_SHARED_WRITABLE(prot, flags)) {
+        perm = (perm & ~PTE_W) | PTE_WP;
+    } else {
+        long ret = socache_map(pagetable, (uint64_t)addr, length, perm, f, offset);
+        if (ret <= 0)
+            return ret;
+    }
+    return map_file_pages(pagetable, addr, length, perm, f, offset);
+}
+
+/* addrにメモリを割り当てる */
+long mmap_load_pages(void *addr, uint64_t length, int prot, int flags, struct file *f, off_t offset)
+{
+    return load_pages(myproc()->pagetable, addr, length, prot, flags, f, offset);
 }
 
 
@@ -270,9 +436,9 @@ static long scale_mmap_region(struct mmap_region *region, uint64_t size)
 // struct mmap_region listを出力
 void print_mmap_list(struct proc *p, const char *title)
 {
-    printf("[INFO] pid[%d]: mmap_region list (%s) at %p\n", p->pid, title, p->regions);
+    printf("[INFO] pid[%d]: mmap_region list (%s) at %p\n", p->pid, title, p->mm->regions);
 
-    struct mmap_region *region = p->regions;
+    struct mmap_region *region = p->mm->regions;
     int i=0;
     while (region) {
         printf(" - region[%d]: addr=%p, length=0x%x, prot=0x%x, flags=0x%x, f=%d, offset=0x%x\n",
@@ -284,8 +450,8 @@ void print_mmap_list(struct proc *p, const char *title)
 // 親プロセスから子プロセスにmmap_regionをコピー.
 long copy_mmap_regions(struct proc *parent, struct proc *child)
 {
-    struct mmap_region *node = parent->regions;
-    struct mmap_region *cnode = NULL, *tail = 0;
+    struct mmap_region *node = parent->mm->regions;
+    struct mmap_region *cnode = NULL, *tail = 0, *root = NULL;
 
     while (node) {
         struct mmap_region *region = slab_cache_alloc(MMAPREGIONS);
@@ -301,28 +467,40 @@ long copy_mmap_regions(struct proc *parent, struct proc *child)
             tail->next = region;
 
         tail = region;
+        root = region_tree_insert(root, region);
         node = node->next;
     }
 
-    child->regions = cnode;
+    child->mm->regions = cnode;
+    child->mm->region_root = root;
+    child->mm->region_hint = NULL;
 
     return 0;
 }
 
-/* startを含むregionを探す */
-struct mmap_region *find_mmap_region(struct proc *p, void *start)
+/* mmのstartを含むregionを探す */
+static struct mmap_region *mm_find_region(struct mm *mm, void *start)
 {
-    struct mmap_region *region = p->regions;
-
-    while (region) {
-        if (region->addr <= start && start < (region->addr + region->length))
-            return region;
-        region = region->next;
+    // ページフォルトは同じregionに続けて起きることが多い
+    struct mmap_region *region = mm->region_hint;
+    if (region && region->addr <= start && start < (region->addr + region->length))
+        return region;
+
+    region = region_tree_floor(mm->region_root, start);
+    if (region && start < (region->addr + region->length)) {
+        mm->region_hint = region;
+        return region;
     }
     return NULL;
 }
 
-/* addr + length はp->regionsに含まれるか */
+/* startを含むregionを探す */
+struct mmap_region *find_mmap_region(struct proc *p, void *start)
+{
+    return mm_find_region(p->mm, start);
+}
+
+/* addr + length はp->mm->regionsに含まれるか */
 bool is_mmap_region(struct proc *p, void *addr, uint64_t length)
 {
     struct mmap_region *region = find_mmap_region(p, addr);
@@ -331,10 +509,36 @@ bool is_mmap_region(struct proc *p, void *addr, uint64_t length)
     return ((uint64_t)addr + length <= (uint64_t)region->addr + region->length);
 }
 
+// ファイルマッピングのフォルトでまとめてマッピングするページ数を決める.
+// 前回マッピングした範囲の直後でフォルトした場合はシーケンシャルアクセスと
+// みなして倍に、そうでなければ半分にする.
+static int fault_around_pages(struct mmap_region *region, uint64_t va)
+{
+    switch (region->advice) {
+    case MADV_RANDOM:
+        return FAULT_AROUND_MIN;
+    case MADV_SEQUENTIAL:
+        return FAULT_AROUND_MAX;
+    }
+
+    // 最初のフォルトは初期値のまま
+    if (region->ra_next == 0)
+        return region->ra_pages;
+    if (va == region->ra_next) {
+        if (region->ra_pages < FAULT_AROUND_MAX)
+            region->ra_pages *= 2;
+    } else if (region->ra_pages > FAULT_AROUND_MIN) {
+        region->ra_pages /= 2;
+    }
+    return region->ra_pages;
+}
+
 // 遅延mapを実装（trap.cから呼び出される）
-// 該当するアドレスを含む1ページ分の割り当て/ファイル読み込みをする
+// 該当するアドレスを含むページの割り当て/ファイル読み込みをする.
+// ファイルマッピングの場合は後続の未マッピングのページもまとめて読み込む
 long alloc_mmap_page(struct proc *p, uint64_t addr,  uint64_t scause) {
     off_t offset = 0;
+    uint64_t length = PGSIZE;
 
     uint64_t rounddown = PGROUNDDOWN(addr);
     struct mmap_region *region = find_mmap_region(p, (void *)rounddown);
@@ -351,11 +555,24 @@ long alloc_mmap_page(struct proc *p, uint64_t addr,  uint64_t scause) {
     // ファイルオフセットの計算
     if (region->f) {
         offset = region->offset + ((rounddown - (uint64_t)region->addr) / PGSIZE) * PGSIZE;
+        // region内、ファイル内で、まだマッピングされていないページまで広げる
+        uint64_t end = (uint64_t)region->addr + region->length;
+        int n = fault_around_pages(region, rounddown);
+        for (int i = 1; i < n; i++) {
+            uint64_t va = rounddown + length;
+            pte_t *pte;
+            if (va >= end || offset + length >= region->f->ip->size)
+                break;
+            if ((pte = walk(p->pagetable, va, 0)) != NULL && (*pte & PTE_V))
+                break;
+            length += PGSIZE;
+        }
+        region->ra_next = rounddown + length;
     }
-    trace("pid[%d] addr: 0x%lx, rounddown: 0x%lx, offset: %ld", p->pid, addr, rounddown, offset);
-    if (mmap_load_pages((void *)rounddown, PGSIZE, region->prot, region->flags, region->f, offset) < 0) {
-        error("loading page failed: addr: 0x%lx, length: 0x%x, prot: 0x%x, flags: 0x%x, f: %d, offset: 0x%x",
-            rounddown, PGSIZE, region->prot, region->flags, region->f ? region->f->ip->inum : -1, offset);
+    trace("pid[%d] addr: 0x%lx, rounddown: 0x%lx, offset: %ld, length: 0x%lx", p->pid, addr, rounddown, offset, length);
+    if (mmap_load_pages((void *)rounddown, length, region->prot, region->flags, region->f, offset) < 0) {
+        error("loading page failed: addr: 0x%lx, length: 0x%lx, prot: 0x%x, flags: 0x%x, f: %d, offset: 0x%x",
+            rounddown, length, region->prot, region->flags, region->f ? region->f->ip->inum : -1, offset);
         return -1;
     }
     return 0;
@@ -367,11 +584,17 @@ long mmap(void *addr, size_t length, int prot, int flags, struct file *f, off_t
     struct proc *p = myproc();
     struct mmap_region *node;
     long error = -EINVAL;
+    uint64_t search_len = PGROUNDUP(length);
 
     if (p->pid == 7)
         trace("addr: %p, length: 0x%lx, prot: 0x%x, flags: 0x%x, f: %d, off: 0x%lx",
         addr, length, prot, flags, f ? f->ip->inum : 0, offset);
 
+    // 2MB以上の無名マッピングは2MBページを使えるように先頭を2MB境界に
+    // 揃える. アドレスを選ぶ際は境界までの余分を含めた大きさの空きを探す
+    if ((flags & MAP_ANONYMOUS) && search_len >= MEGAPGSIZE)
+        search_len += MEGAPGSIZE - PGSIZE;
+
     // MAP_FIXEDの指定アドレスはページ境界にあり、割り当て領域がMMAPエリア内に入ること
     // 1. addrを確定する
     // 1.1. アドレスが指定されている場合
@@ -399,6 +622,7 @@ long mmap(void *addr, size_t length, int prot, int flags, struct file *f, off_t
                     }
                     // ユーザアクセスを禁止にする
                     *pte &= ~PTE_U;
+                    uvmflush_page(p->pagetable, (uint64_t)addr + i * PGSIZE);
                 }
                 return (long)addr;
             } else {
@@ -416,19 +640,22 @@ long mmap(void *addr, size_t length, int prot, int flags, struct file *f, off_t
     // 1.2. アドレスが指定されていない場合
     } else {
         // 1.2.1 最初のアドレス候補
-        if (p->regions)
-            addr = p->regions->addr;
+        if (p->mm->regions)
+            addr = p->mm->regions->addr;
         else
             addr = (void *)MMAPBASE;
 select_addr:
-        node = p->regions;
+        // addrより前のregionは候補に影響しないのでaddrの直前から探す
+        node = region_tree_floor(p->mm->region_root, addr);
+        if (node == NULL)
+            node = p->mm->regions;
         while (node) {
             trace("- addr=0x%x, node->addr=0x%x, node->next->addr=0x%x", addr, node->addr, node->next ? node->next->addr : NULL);
             // 1.2.31 作成マッピングが現在のノードアドレスより小さい場合はこの候補を使用する
-            if (addr + PGROUNDUP(length) <= node->addr)
+            if (addr + search_len <= node->addr)
                 break;
             // 1.2.2 次のマッピングがない、または次のマッピングとの間に置ける場合はこの候補を使用する
-            if (node->addr + node->length <= addr && (node->next == 0 || addr + PGROUNDUP(length) <= node->next->addr))
+            if (node->addr + node->length <= addr && (node->next == 0 || addr + search_len <= node->next->addr))
                 break;
             // 1.2.5 それ以外は、現在のマッピングの右端をアドレス候補とする
             if (addr <= node->addr + node->length)
@@ -436,6 +663,8 @@ select_addr:
             // 1.2.6 次のマッピングと比較する
             node = node->next;
         }
+        if (search_len > PGROUNDUP(length))
+            addr = (void *)MEGAPGROUNDUP((uint64_t)addr);
     }
     // 1.3 決定したアドレスがマップ範囲に含まれていることをチェックする
     if (addr + PGROUNDUP(length) > (void *)USERTOP)
@@ -452,6 +681,9 @@ select_addr:
     region->flags  = flags;
     region->offset = offset;
     region->prot   = prot;
+    region->advice = MADV_NORMAL;
+    region->ra_pages = FAULT_AROUND_INIT;
+    region->ra_next = 0;
     region->next   = NULL;
 
     // 2.2 fを設定
@@ -466,42 +698,21 @@ select_addr:
         region->f = NULL;
     }
 
-    // 3. p->regionsに作成したmmap_regionを追加する
-    // 3.1 これがプロセスの最初のmmap_regionの場合はp->regionsに追加する
-    if (p->regions == NULL) {
-        p->regions = region;
-        goto load_pages;
-    }
-
-    // 3.2 そうでない場合は適切な位置に追加して、p->regionsを更新する
-    node = p->regions;
-    struct mmap_region *prev = p->regions;
-    while (node) {
-        //cprintf("addr=%p, node->addr=%p\n", addr, node->addr);
-        if (addr < node->addr) {
-            region->next = node;
-            prev = region;
-            break;
-        } else if (addr > node->addr && node->next && addr < node->next->addr) {
-            region->next = node->next;
-            node->next = region;
-            break;
-        }
-        if (!node->next) {
-            node->next = region;
-            break;
-        }
-        node = node->next;
+    // 実行可能なファイルマッピングは共有ライブラリとみなしてキャッシュする
+    if (f && !(flags & MAP_ANONYMOUS) && (prot & PROT_EXEC))
+        socache_register(f->ip);
+    // ファイルマッピングはフォルト時にalloc_mmap_page()でまとめて読み込む.
+    // ただし、書き戻しが必要な共有書き込みマッピングはすぐに読み込む
+    if ((flags & MAP_ANONYMOUS) || !f || IS_SHARED_WRITABLE(prot, flags)) {
+        if ((error = mmap_load_pages(addr, length, prot, flags, f, offset)) < 0)
+            goto out;
     }
-    p->regions = prev;
-
-load_pages:
-    if ((error = mmap_load_pages(addr, length, prot, flags, f, offset)) < 0)
-        goto out;
 
     region->addr = addr;
     // ファイルオフセットを正しく処理するためにlengthはここで切り上げる
     region->length = PGROUNDUP(length);
+    // 3. p->mm->regionsに作成したmmap_regionを追加する
+    link_mmap_region(p, region);
     trace("return addr: %p, length: 0x%lx", region->addr, region->length);
     return (long)region->addr;
 
@@ -511,6 +722,51 @@ out:
     return error;
 }
 
+// alloc_cow_page()から呼び出す. 共有書き込みマッピングのページvaに
+// 最初の書き込みがあったので書き戻しキューに登録する.
+// キューが一杯の場合はmsync/munmap/exitで書き戻す.
+void mmap_dirty(struct proc *p, uint64_t va, uint64_t pa)
+{
+    struct mmap_region *region = find_mmap_region(p, (void *)va);
+
+    if (region == NULL || !IS_SHARED_WRITABLE(region->prot, region->flags))
+        return;
+    wb_dirty(region->f->ip, region->offset + (va - (uint64_t)region->addr), pa, 0);
+}
+
+// 共有書き込みマッピングの[start, end)のうち書き込まれたページを
+// 書き込み禁止に戻して書き戻しキューに登録する.
+// syncが0でなければ書き戻しの完了を待つ.
+static long mmap_writeback(pagetable_t pagetable, struct mmap_region *region, uint64_t start, uint64_t end, int sync)
+{
+    struct inode *ip = region->f->ip;
+    uint64_t va, from, seq, last = 0;
+    off_t offset;
+    pte_t *pte;
+
+    from = wb_seq();
+    for (va = start; va < end; va += PGSIZE) {
+        offset = region->offset + (va - (uint64_t)region->addr);
+        if (offset >= ip->size)
+            break;
+        pte = walk(pagetable, va, 0);
+        if (pte == NULL || !(*pte & PTE_V) || !(*pte & PTE_WP) || !(*pte & PTE_W))
+            continue;
+        *pte &= ~PTE_W;
+        uvmflush_page(pagetable, va);
+        seq = wb_dirty(ip, offset, PTE2PA(*pte), 1);
+        if (seq > last)
+            last = seq;
+    }
+    if (last == 0)
+        return 0;
+    if (!sync) {
+        wb_kick();
+        return 0;
+    }
+    return wb_wait(from, last);
+}
+
 // sys_munmapのメイン関数
 long munmap(void *addr, size_t length)
 {
@@ -536,21 +792,10 @@ long munmap(void *addr, size_t length)
     }
     trace(" - found: addr=%p", region->addr);
     // MAP_SHARED領域で背後にあるファイルに書き込みがあったら書き戻す
-    //int len = (f->ip->size - f->off) > PGSIZE ? PGSIZE : (f->ip->size - f->off);
-    if ((region->flags & MAP_ANONYMOUS) == 0 && region->flags & MAP_SHARED && region->prot & PROT_WRITE) {
-        for (uint64_t ra = (uint64_t)addr; ra < (uint64_t)addr + length; ra += PGSIZE) {
-            pte_t *pte = walk(p->pagetable, ra, 0);
-            if (!pte) panic("no pte");
-            uint64_t flags = PTE_FLAGS(*pte);
-            off_t offset = region->offset + ra - (uint64_t)region->addr;
-            if (flags & PTE_D) {
-                if (writeback(region->f, offset, ra) < 0) {
-                    error("failed writeback");
-                    return -EACCES;
-                }
-            }
-            if (region->f->ip->size <= offset + PGSIZE)
-                break;
+    if (IS_SHARED_WRITABLE(region->prot, region->flags)) {
+        if (mmap_writeback(p->pagetable, region, (uint64_t)addr, (uint64_t)addr + length, 1) < 0) {
+            error("failed writeback");
+            return -EACCES;
         }
     }
 
@@ -638,9 +883,12 @@ long mprotect(void *addr, size_t length, int prot)
     long error;
 
     uint64_t addrp = (uint64_t)addr;
-    if (addrp <= p->sz) {
+    if (addrp <= p->mm->sz) {
         for (; addrp < (uint64_t)addr + length; addrp += PGSIZE) {
             pte_t *pte = walk(p->pagetable, addrp, 0);
+            // 未ロードのテキストページは先に読み込む
+            if ((pte == NULL || !(*pte & PTE_V)) && exec_fault(p, addrp) == 0)
+                pte = walk(p->pagetable, addrp, 0);
             if (pte == NULL) {
                 error("addr: 0x%lx is not mapping", addrp);
                 return -ENOMEM;
@@ -656,12 +904,14 @@ long mprotect(void *addr, size_t length, int prot)
             } else {
                 if (prot == PROT_READ)
                     *pte |= PTE_R;
-                if (prot == PROT_WRITE)
+                // COWページは書き込み時にalloc_cow_page()でPTE_Wを立てる
+                if (prot == PROT_WRITE && !(*pte & PTE_COW))
                     *pte |= PTE_W;
                 if (prot == PROT_EXEC)
                     *pte |= PTE_X;
                 *pte |= PTE_U;
             }
+            uvmflush_page(p->pagetable, PGROUNDDOWN(addrp));
         }
 
         return 0;
@@ -741,11 +991,6 @@ long msync(void *addr, size_t length, int flags)
         flags |= MS_ASYNC;
     }
 
-    if (flags & MS_ASYNC) {
-        // Since  Linux  2.6.19, MS_ASYNC  is  in  fact  a no-op (from man(2))
-        return 0;
-    }
-
     // addrはページ境界になければならない。
     if (NOT_PAGEALIGN((uint64_t)addr)) return error;
 
@@ -760,23 +1005,123 @@ long msync(void *addr, size_t length, int flags)
         length = region->length;
     }
 
+    // MS_ASYNCは書き戻しを依頼するだけ、MS_SYNCは完了を待つ
+    if (IS_SHARED_WRITABLE(region->prot, region->flags)) {
+        if ((error = mmap_writeback(p->pagetable, region, (uint64_t)addr, (uint64_t)addr + PGROUNDUP(length), flags & MS_SYNC)) < 0) {
+            error("failed writeback");
+            return error;
+        }
+    }
 
-    if ((region->flags & MAP_ANONYMOUS) == 0 && region->flags & MAP_SHARED && region->prot & PROT_WRITE) {
-        for (uint64_t ra = (uint64_t)addr; ra < (uint64_t)addr + length; ra += PGSIZE) {
-            pte_t *pte = walk(p->pagetable, ra, 0);
-            if (!pte) panic("no pte");
-            uint64_t flags = PTE_FLAGS(*pte);
-            off_t offset = region->offset + ra - (uint64_t)region->addr;
-            if (flags & PTE_D) {
-                if (writeback(region->f, offset, ra) < 0) {
-                    error("failed writeback");
-                    return -EACCES;
-                }
-            }
-            if (region->f->ip->size <= offset + PGSIZE)
+    return 0;
+}
+
+// MADV_WILLNEEDの先読み. readaheadスレッドから呼び出す.
+// mmの[start, end)にあるファイルマッピングのまだマッピングされていない
+// ページを連続した範囲ごとにまとめて読み込む. madvise()の後に領域が
+// 変更されていることがあるので、ここで改めて領域を探す.
+// 呼び出し元はmm->mmap_lockを保持していなければならない.
+long mmap_readahead(struct mm *mm, uint64_t start, uint64_t end)
+{
+    struct mmap_region *region;
+    uint64_t va, next, rend;
+    off_t offset;
+    pte_t *pte;
+    long error;
+
+    for (va = start; va < end; va = next) {
+        if ((region = mm_find_region(mm, (void *)va)) == NULL)
+            return 0;
+        rend = (uint64_t)region->addr + region->length;
+        if (rend > end)
+            rend = end;
+        if (region->f == NULL) {
+            next = rend;
+            continue;
+        }
+        pte = walk(mm->pagetable, va, 0);
+        if (pte && (*pte & PTE_V)) {
+            next = va + PGSIZE;
+            continue;
+        }
+        for (next = va + PGSIZE; next < rend; next += PGSIZE) {
+            pte = walk(mm->pagetable, next, 0);
+            if (pte && (*pte & PTE_V))
                 break;
         }
+        offset = region->offset + (va - (uint64_t)region->addr);
+        if ((error = load_pages(mm->pagetable, (void *)va, next - va, region->prot, region->flags, region->f, offset)) < 0)
+            return error;
     }
+    return 0;
+}
+
+// sys_madviseのメイン関数
+long madvise(void *addr, size_t length, int advice)
+{
+    struct proc *p = myproc();
+    struct mmap_region *region;
+    uint64_t start, end, va, rend;
+
+    if (NOT_PAGEALIGN(addr))
+        return -EINVAL;
+    switch (advice) {
+    case MADV_NORMAL:
+    case MADV_RANDOM:
+    case MADV_SEQUENTIAL:
+    case MADV_WILLNEED:
+    case MADV_DONTNEED:
+    case MADV_FREE:
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    start = (uint64_t)addr;
+    end = start + PGROUNDUP(length);
+    if (end < start)
+        return -EINVAL;
 
+    // brk領域はmmap_regionがなく、遅延割り当てもできないので
+    // ヒントとして受け付けるだけにする
+    if (end <= p->mm->sz)
+        return 0;
+
+    for (va = start; va < end; va = rend) {
+        if ((region = find_mmap_region(p, (void *)va)) == NULL)
+            return -ENOMEM;
+        rend = (uint64_t)region->addr + region->length;
+        if (rend > end)
+            rend = end;
+
+        switch (advice) {
+        // fault-aroundのヒントはregion単位で保持する（regionは分割しない）
+        case MADV_NORMAL:
+            region->ra_pages = FAULT_AROUND_INIT;
+            // fallthrough
+        case MADV_RANDOM:
+        case MADV_SEQUENTIAL:
+            region->advice = advice;
+            break;
+        // 読み込みはreadaheadスレッドに任せてすぐに戻る
+        case MADV_WILLNEED:
+            if (region->f)
+                ra_queue(p->mm, va, rend);
+            break;
+        case MADV_FREE:
+            // MADV_FREEは私有無名マッピングのみ
+            if (region->f || (region->flags & MAP_SHARED))
+                return -EINVAL;
+            // fallthrough
+        case MADV_DONTNEED:
+            // 共有無名マッピングと共有書き込みマッピングは他のプロセスや
+            // ファイルとページを共有しているので捨てない.
+            // それ以外は次のフォルトで0埋めページかファイルの内容が読み込まれる
+            if ((region->flags & MAP_SHARED) && (region->f == NULL || (region->prot & PROT_WRITE)))
+                break;
+            uvmunmap(p->pagetable, va, (rend - va) / PGSIZE, 1);
+            break;
+        }
+    }
     return 0;
 }
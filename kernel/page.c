@@ -32,6 +32,7 @@ struct pages_ref pages_ref;
  */
 void page_init(void) {
     buddy_init();
+    kalloc_init();
     slab_cache_init();
 }
 
@@ -99,12 +100,16 @@ void page_cleanup(struct page **page) {
 
 // ページの参照カウンタをインクリメントする
 void page_refcnt_inc(void *pa) {
+    acquire(&pages_ref.lock);
     page_find_by_address(pa)->refcnt++;
+    release(&pages_ref.lock);
 }
 
 // ページの参照カウンタをデクリメントする
 void page_refcnt_dec(void *pa) {
+    acquire(&pages_ref.lock);
     page_find_by_address(pa)->refcnt--;
+    release(&pages_ref.lock);
 }
 
 // ページの参照カウンタを返す
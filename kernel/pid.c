@@ -0,0 +1,197 @@
+// プロセスの索引.
+//
+// pidからprocを引くハッシュ表と、pgidからプロセスグループのメンバーを
+// 引くハッシュ表を持つ. pidのハッシュにはスレッドも含めてすべての
+// procをつなぎ、プロセスグループのハッシュにはスレッドグループの
+// リーダーだけをつなぐ. バケットには異なるpgidのprocも入っているので
+// 走査する際はpgidを比べる. セッションはsetsid()がないので独自の表は
+// 持たず、プロセスグループのメンバーのp->sidで判断する.
+// 親子関係（p->children, p->sibling）はwait_lockで保護し、proc.cで扱う.
+//
+// プロセスグループのバケットはpidの昇順に並べ、killなどが固定長の
+// 配列で少しずつ取り出せるようにする.
+//
+// pidhash_lockはforeach_proc()のコールバックがp->lockを獲得する以外は
+// 保持したまま他のロックを獲得しない. p->lockを保持してpidhash_lockを
+// 獲得してはならない.
+// 返したprocはロックを外した後に解放される可能性があるが、procは
+// 型を保ったまま再利用されるだけのslab（slab_cache_set_typesafe()）に
+// あるので、従来の表の走査と同じ扱いとする.
+
+#include <common/types.h>
+#include <common/param.h>
+#include <common/riscv.h>
+#include <spinlock.h>
+#include <proc.h>
+#include <defs.h>
+#include <errno.h>
+#include <printf.h>
+#include <list.h>
+
+#define NPIDHASH    32      // 2のべき乗
+
+extern struct spinlock wait_lock;
+
+static struct spinlock pidhash_lock;
+static struct list_head pid_hash[NPIDHASH];
+static struct list_head pgrp_hash[NPIDHASH];
+
+static inline struct list_head *pid_bucket(struct list_head *table, pid_t pid)
+{
+    return &table[pid & (NPIDHASH - 1)];
+}
+
+void pidinit(void)
+{
+    initlock(&pidhash_lock, "pidhash");
+    for (int i = 0; i < NPIDHASH; i++) {
+        list_init(&pid_hash[i]);
+        list_init(&pgrp_hash[i]);
+    }
+}
+
+// pをpidのハッシュにつなぐ. allocproc()がpidを割り当てた直後に呼び出す
+void attach_pid(struct proc *p)
+{
+    list_init(&p->pgrp_link);
+    acquire(&pidhash_lock);
+    list_push_back(pid_bucket(pid_hash, p->pid), &p->pid_link);
+    release(&pidhash_lock);
+}
+
+// pをpidとプロセスグループのハッシュから外す. proc_free()が呼び出す.
+// 一度もつないでいないpでもよい
+void detach_pid(struct proc *p)
+{
+    acquire(&pidhash_lock);
+    list_drop(&p->pid_link);
+    list_init(&p->pid_link);
+    if (!list_empty(&p->pgrp_link)) {
+        list_drop(&p->pgrp_link);
+        list_init(&p->pgrp_link);
+    }
+    release(&pidhash_lock);
+}
+
+// pをプロセスグループpgidのバケットにpidの昇順でつなぐ.
+// pidhash_lockを保持して呼び出す
+static void pgrp_insert(struct proc *p, pid_t pgid)
+{
+    struct list_head *head = pid_bucket(pgrp_hash, pgid);
+    struct proc *q;
+
+    list_foreach(q, head, pgrp_link) {
+        if (q->pid > p->pid)
+            break;
+    }
+    list_insert(&p->pgrp_link, q->pgrp_link.prev, &q->pgrp_link);
+}
+
+// スレッドグループのリーダーpをプロセスグループp->pgidにつなぐ
+void attach_pgrp(struct proc *p)
+{
+    acquire(&pidhash_lock);
+    pgrp_insert(p, p->pgid);
+    release(&pidhash_lock);
+}
+
+// リーダーpのスレッドグループのプロセスグループをpgidに変更する.
+// スレッドのpgidもあわせて変更する.
+void change_pgrp(struct proc *p, pid_t pgid)
+{
+    struct proc *t;
+
+    acquire(&wait_lock);
+    acquire(&pidhash_lock);
+    if (!list_empty(&p->pgrp_link)) {
+        list_drop(&p->pgrp_link);
+        pgrp_insert(p, pgid);
+    }
+    p->pgid = pgid;
+    release(&pidhash_lock);
+    list_foreach(t, &p->thread_group, thread_group)
+        t->pgid = pgid;
+    release(&wait_lock);
+}
+
+// IDがpidのproc（スレッドを含む）を返す. なければ0を返す
+struct proc *find_proc(pid_t pid)
+{
+    struct list_head *head = pid_bucket(pid_hash, pid);
+    struct proc *p;
+
+    if (pid <= 0)
+        return 0;
+    acquire(&pidhash_lock);
+    list_foreach(p, head, pid_link) {
+        if (p->pid == pid) {
+            release(&pidhash_lock);
+            return p;
+        }
+    }
+    release(&pidhash_lock);
+    return 0;
+}
+
+// プロセスグループpgidのリーダーを*posの続きから最大n個procsに入れて
+// その数を返す. pgidが-1の場合はすべてのプロセスグループのリーダーを返す.
+// *posは最初に0としておき、0が返るまで繰り返し呼び出す. 呼び出しの間に
+// 加わったプロセスは返らないことがあるが、同じプロセスを2度は返さない.
+int collect_pgrp(pid_t pgid, struct proc **procs, int n, struct pgrp_pos *pos)
+{
+    struct proc *p;
+    int i, cnt = 0;
+
+    acquire(&pidhash_lock);
+    for (i = pos->bucket; i < NPIDHASH && cnt < n; i++) {
+        if (pgid != -1 && &pgrp_hash[i] != pid_bucket(pgrp_hash, pgid))
+            continue;
+        if (i != pos->bucket)
+            pos->pid = 0;
+        list_foreach(p, &pgrp_hash[i], pgrp_link) {
+            if (p->pid <= pos->pid || (pgid != -1 && p->pgid != pgid))
+                continue;
+            procs[cnt++] = p;
+            pos->pid = p->pid;
+            if (cnt == n)
+                break;
+        }
+        pos->bucket = i;
+    }
+    // このバケットを最後まで見たら次のバケットから始める
+    if (cnt < n)
+        pos->bucket = NPIDHASH;
+    release(&pidhash_lock);
+    return cnt;
+}
+
+// スレッドを含むすべてのprocについてfn(p, arg)を呼び出す.
+// fnはpidhash_lockを保持したまま呼び出されるので、眠ってはならない.
+// p->lockは獲得してよい.
+void foreach_proc(void (*fn)(struct proc *, void *), void *arg)
+{
+    struct proc *p;
+
+    acquire(&pidhash_lock);
+    for (int i = 0; i < NPIDHASH; i++) {
+        list_foreach(p, &pid_hash[i], pid_link)
+            fn(p, arg);
+    }
+    release(&pidhash_lock);
+}
+
+// セッションsidにプロセスグループpgidがあるか
+int pgrp_in_session(pid_t pgid, pid_t sid)
+{
+    struct proc *p;
+
+    acquire(&pidhash_lock);
+    list_foreach(p, pid_bucket(pgrp_hash, pgid), pgrp_link) {
+        if (p->pgid == pgid && p->sid == sid) {
+            release(&pidhash_lock);
+            return 1;
+        }
+    }
+    release(&pidhash_lock);
+    return 0;
+}
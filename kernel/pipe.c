@@ -25,6 +25,8 @@ pipealloc(struct file **f0, struct file **f1, int flags)
     pi->nwrite = 0;
     pi->nread = 0;
     initlock(&pi->lock, "pipe");
+    wq_init(&pi->rwait, "pipe read");
+    wq_init(&pi->wwait, "pipe write");
     (*f0)->type = FD_PIPE;
     (*f0)->readable = 1;
     (*f0)->writable = 0;
@@ -55,10 +57,10 @@ pipeclose(struct pipe *pi, int writable)
     acquire(&pi->lock);
     if (writable) {
         pi->writeopen = 0;
-        wakeup(&pi->nread);
+        wq_wakeup_all(&pi->rwait);
     } else {
         pi->readopen = 0;
-        wakeup(&pi->nwrite);
+        wq_wakeup_all(&pi->wwait);
     }
     if (pi->readopen == 0 && pi->writeopen == 0) {
         release(&pi->lock);
@@ -76,12 +78,15 @@ pipewrite(struct pipe *pi, uint64_t addr, int n)
     acquire(&pi->lock);
     while (i < n) {
         if (pi->readopen == 0 || killed(pr)) {
+            // 起こされた書き手が書かずに終わる場合は次の書き手に譲る
+            if (pi->nwrite < pi->nread + PIPESIZE)
+                wq_wakeup(&pi->wwait);
             release(&pi->lock);
             return -1;
         }
         if (pi->nwrite == pi->nread + PIPESIZE) { //DOC: pipewrite-full
-            wakeup(&pi->nread);
-            sleep(&pi->nwrite, &pi->lock);
+            wq_wakeup(&pi->rwait);
+            wq_sleep_exclusive(&pi->wwait, &pi->lock);
         } else {
             char ch;
             if (copyin(pr->pagetable, &ch, addr + i, 1) == -1)
@@ -90,7 +95,10 @@ pipewrite(struct pipe *pi, uint64_t addr, int n)
             i++;
         }
     }
-    wakeup(&pi->nread);
+    wq_wakeup(&pi->rwait);
+    // まだ空きがあれば待っている次の書き手を起こす
+    if (pi->nwrite < pi->nread + PIPESIZE)
+        wq_wakeup(&pi->wwait);
     release(&pi->lock);
 
     return i;
@@ -109,7 +117,7 @@ piperead(struct pipe *pi, uint64_t addr, int n)
             release(&pi->lock);
             return -1;
         }
-        sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
+        wq_sleep_exclusive(&pi->rwait, &pi->lock); //DOC: piperead-sleep
     }
 
     for (i = 0; i < n; i++) {  //DOC: piperead-copy
@@ -119,7 +127,10 @@ piperead(struct pipe *pi, uint64_t addr, int n)
         if (copyout(pr->pagetable, addr + i, &ch, 1) == -1)
             break;
     }
-    wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+    wq_wakeup(&pi->wwait);  //DOC: piperead-wakeup
+    // 読み残しがあれば待っている次の読み手を起こす
+    if (pi->nread != pi->nwrite)
+        wq_wakeup(&pi->rwait);
     release(&pi->lock);
     return i;
 }
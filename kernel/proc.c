@@ -11,11 +11,17 @@
 #include <linux/wait.h>
 #include <linux/ppoll.h>
 #include <linux/time.h>
+#include <linux/sched.h>
 #include <linux/capability.h>
 
 struct cpu cpus[NCPU];
+volatile uint64_t cpus_online;
 
-struct proc proc[NPROC];
+// procはslabから割り当てる. 解放したprocもpid.cの索引から得た古い
+// ポインタでp->lockを獲得できるように型を保ったまま再利用する.
+static struct slab_cache *PROCCACHE;
+
+#define KILL_BATCH  16      // kill()が一度に集めるプロセスの数
 
 struct _q {
     struct spinlock lock;
@@ -29,6 +35,7 @@ int nextpid = 1;
 struct spinlock pid_lock;
 
 static void freeproc(struct proc *p);
+static void proc_free(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 
@@ -37,55 +44,49 @@ extern char trampoline[]; // trampoline.S
 // p->lockする前に獲得しなければならない。
 struct spinlock wait_lock;
 
-// 各プロセス用のカーネルスタック用のページを割り当てる.
-// トランポリン領域の下にプロセスごとに2ページ割り当て、
-// 高位1ページはガードページで、下位1ページがスタック
-// KSTACK(p) (TRAMPOLINE - ((p)+1) * 2 * PGSIZE) ; p = 0 - NPROC
-void
-proc_mapstacks(pagetable_t kpgtbl)
+// PROCCACHEの新規スラブのprocを初期化する.
+// カーネルスタックは最初にallocproc()で使う際に割り当てる.
+static void proc_ctor(void *obj)
 {
-    struct proc *p;
+    struct proc *p = obj;
 
-    for (p = proc; p < &proc[NPROC]; p++) {
-        char *pa = kalloc();
-        if (pa == 0)
-            panic("kalloc");
-        // 2ページを割り当て
-        uint64_t va = KSTACK((int) (p - proc));
-        trace("va: 0x%lx", va);
-        // 1ページ分だけマッピングする
-        kvmmap(kpgtbl, va, (uint64_t)pa, PGSIZE, PTE_NORMAL);
-    }
+    memset(p, 0, sizeof(struct proc));
+    initlock(&p->lock, "proc");
+    p->state = UNUSED;
+    list_init(&p->pid_link);
+    list_init(&p->pgrp_link);
 }
 
 // プロセステーブルの初期化
 void
 procinit(void)
 {
-    struct proc *p;
-
     initlock(&pid_lock, "nextpid");
     initlock(&wait_lock, "wait_lock");
     initlock(&q.lock, "qlock");
     initlock(&q.siglock, "siglock");
-    for (p = proc; p < &proc[NPROC]; p++) {
-        initlock(&p->lock, "proc");
-        p->state = UNUSED;
-        p->kstack = KSTACK((int) (p - proc));
-    }
+    PROCCACHE = slab_cache_create("proc", sizeof(struct proc), sizeof(uint64_t));
+    slab_cache_set_typesafe(PROCCACHE, proc_ctor);
+    runq_init();
+    waitinit();
+    pidinit();
 
     MMAPREGIONS = slab_cache_create("mmap_region", sizeof(struct mmap_region), 0);
+    slab_cache_set_magazine(MMAPREGIONS);
 }
 
 // 別のCPUに移されるプロセスとの競合を防ぐため、
 // 割り込みを無効にして呼び出さなければならない。
 int cpuid()
 {
-#if 0
     int id = r_tp();
     return id;
-#endif
-    return 0;
+}
+
+// このhartを起動済みにする. scheduler()に入る前に各hartが呼び出す.
+void procinithart(void)
+{
+    __atomic_fetch_or(&cpus_online, 1UL << cpuid(), __ATOMIC_SEQ_CST);
 }
 
 // このCPUのCPU構造体を返す。
@@ -139,45 +140,65 @@ static void forkret(void)
     usertrapret();
 }
 
-// Look in the process table for an UNUSED proc.
-// If found, initialize state required to run in the kernel,
-// and return with p->lock held.
-// If there are no free procs, or a memory allocation fails, return 0.
+// slabからprocを割り当て、カーネル内で実行するために
+// 必要な状態を初期化して、p->lockを保持したまま返す.
+// メモリの割り当てに失敗した場合は0を返す.
 static struct proc*
 allocproc(void)
 {
     struct proc *p;
 
-    for (p = proc; p < &proc[NPROC]; p++) {
-        acquire(&p->lock);
-        if (p->state == UNUSED) {
-            goto found;
-        } else {
-            release(&p->lock);
-        }
+    if ((p = slab_cache_alloc(PROCCACHE)) == 0)
+        return 0;
+    // カーネルスタックは解放後もprocと一緒に保持して再利用する
+    if (p->kstack == 0 && (p->kstack = (uint64_t)kalloc()) == 0) {
+        slab_cache_free(PROCCACHE, p);
+        return 0;
     }
 
-    return 0;
-
-found:
     p->pid = allocpid();
+    p->tgid = p->pid;
     p->pgid = p->sid = p->pid;
+    for (int i = 0; i < RLIM_NLIMITS; i++)
+        p->rlim[i].rlim_cur = p->rlim[i].rlim_max = RLIM_INFINITY;
+    p->rlim[RLIMIT_NOFILE].rlim_cur = NOFILE;
+    p->rlim[RLIMIT_NOFILE].rlim_max = NR_OPEN;
+    // pidhash_lockはp->lockの外側で獲得する
+    attach_pid(p);
+    acquire(&p->lock);
+    list_init(&p->children);
+    list_init(&p->sibling);
     p->state = USED;
-    p->regions = NULL;
+    p->mm = 0;
+    p->pagetable = 0;
+    p->tf_slot = -1;
+    p->files = 0;
+    p->nfdref = 0;
+    p->group_leader = p;
+    list_init(&p->thread_group);
+    p->nr_threads = 1;
+    p->group_exit = 0;
+    p->live = 1;
+    p->clear_child_tid = 0;
+    p->kfunc = 0;
+    sched_init_proc(p, 0);
+    p->last_cpu = -1;
+    p->sleep_intr = 0;
+    init_timer(&p->it_real);
+    p->it_real_incr = 0;
+    p->uva_gen = 0;
     p->umask = 0002;
+    memset(&p->acct, 0, sizeof(p->acct));
+    memset(&p->dead_acct, 0, sizeof(p->dead_acct));
+    memset(&p->child_acct, 0, sizeof(p->child_acct));
+    p->acct_stamp = 0;
 
     // trapframeページを割り当てる.
+    // ユーザページテーブルへのマッピングはアドレス空間を決めてから行う.
     if ((p->trapframe = (struct trapframe *)kalloc()) == 0) {
         freeproc(p);
         release(&p->lock);
-        return 0;
-    }
-
-    // trampolinとtrapframeだけマップしたユーザページテーブルを作成する.
-    p->pagetable = proc_pagetable(p);
-    if (p->pagetable == 0) {
-        freeproc(p);
-        release(&p->lock);
+        proc_free(p);
         return 0;
     }
 
@@ -190,47 +211,53 @@ found:
     return p;
 }
 
-// free a proc structure and the data hanging from it,
+// free the data hanging from a proc structure,
 // including user pages.
-// p->lock must be held.
+// p->lock must be held. p->lockを外した後にproc_free()でslabに返す.
 static void
 freeproc(struct proc *p)
 {
     trace("pid: %d", p->pid);
+    // 通常はexit()で手放しているので、ここで解放するのは
+    // clone()が失敗した場合だけ
+    mm_release(p);
+    files_release(p);
     if (p->trapframe)
         kfree((void*)p->trapframe);
     p->trapframe = 0;
-    free_mmap_list(p);
-    p->regions = NULL;
-    if (p->pagetable) {
-        trace("free pagetable: pid=%d", p->pid);
-        proc_freepagetable(p->pagetable, p->sz);
-    }
-    p->pagetable = 0;
-    p->sz = 0;
     p->pid = 0;
+    p->tgid = 0;
     p->pgid = 0;
     p->sid = 0;
     p->uid = p->euid = p->suid = p->fsuid = -1;
     p->gid = p->egid = p->sgid = p->fsgid = -1;
     p->cap_effective = p->cap_inheritable = p->cap_permitted = 0;
     p->umask = 0;
-    p->fdflag = 0;
     p->parent = 0;
+    p->vfork_parent = 0;
+    p->group_leader = 0;
+    p->clear_child_tid = 0;
     p->name[0] = 0;
     p->chan = 0;
     p->killed = 0;
     p->xstate = 0;
-    p->regions = NULL;
     memset(&p->signal, 0, sizeof(struct signal));
     p->state = UNUSED;
 }
 
-// 指定されたプロセスのユーザページテーブルを作成する。
-// ここではユーザメモリは持たず、trampolineとtrapframe/tls
-// 用のページだけをマッピングする。
+// freeproc()したpを索引から外してslabに返す. p->lockは保持しないこと.
+static void
+proc_free(struct proc *p)
+{
+    detach_pid(p);
+    slab_cache_free(PROCCACHE, p);
+}
+
+// ユーザページテーブルを作成する。
+// ここではユーザメモリは持たず、trampolineだけをマッピングする。
+// スレッドのtrapframeはmm_map_trapframe()でマッピングする。
 pagetable_t
-proc_pagetable(struct proc *p)
+proc_pagetable(void)
 {
     pagetable_t pagetable;
 
@@ -249,29 +276,154 @@ proc_pagetable(struct proc *p)
         return 0;
     }
 
-    // trampoline.S用にtrampolineページの直下にtrapframe
-    // ページをマッピングする
-    if (mappages(pagetable, TRAPFRAME, PGSIZE,
-                (uint64_t)(p->trapframe), PTE_NORMAL) < 0) {
-        uvmunmap(pagetable, TRAMPOLINE, 1, 0);
-        uvmfree(pagetable, 0);
-        return 0;
-    }
-
     return pagetable;
 }
 
 // Free a process's page table, and free the
 // physical memory it refers to.
+// trapframeのマッピングはmm_unmap_trapframe()で外しておくこと.
 void
 proc_freepagetable(pagetable_t pagetable, uint64_t sz)
 {
     uvmunmap(pagetable, TRAMPOLINE, 1, 0);
-    uvmunmap(pagetable, TRAPFRAME, 1, 0);
     uvmunmap(pagetable, STACKBASE, STACKPAGE, 1);
     uvmfree(pagetable, sz);
 }
 
+// 空のアドレス空間を作成する.
+struct mm *mm_alloc(void)
+{
+    struct mm *mm;
+
+    if ((mm = kmalloc(sizeof(struct mm))) == 0)
+        return 0;
+    memset(mm, 0, sizeof(struct mm));
+    if ((mm->pagetable = proc_pagetable()) == 0) {
+        kmfree(mm);
+        return 0;
+    }
+    initlock(&mm->lock, "mm");
+    initsleeplock(&mm->mmap_lock, "mmap_lock");
+    mm->ref = 1;
+    return mm;
+}
+
+// pのtrapframeをmmの空いているスロットにマッピングし、スロット番号を返す.
+// trampoline.Sはこのスロットのアドレスでtrapframeにアクセスする.
+// 各スロットはtrampolineと同じリーフページテーブルにあるので、
+// 他のスレッドと並行してページテーブルを変更しても競合しない.
+int mm_map_trapframe(struct mm *mm, struct proc *p)
+{
+    int slot;
+
+    acquire(&mm->lock);
+    for (slot = 0; slot < NTFSLOT; slot++) {
+        if (!(mm->tf_slots & (1UL << slot)))
+            break;
+    }
+    if (slot == NTFSLOT) {
+        release(&mm->lock);
+        return -EAGAIN;
+    }
+    mm->tf_slots |= 1UL << slot;
+    release(&mm->lock);
+
+    if (mappages(mm->pagetable, TRAPFRAME_SLOT(slot), PGSIZE,
+                (uint64_t)(p->trapframe), PTE_NORMAL) < 0) {
+        acquire(&mm->lock);
+        mm->tf_slots &= ~(1UL << slot);
+        release(&mm->lock);
+        return -ENOMEM;
+    }
+    return slot;
+}
+
+// mm_map_trapframe()でマッピングしたスロットを解放する.
+// スロットを再利用するスレッドが古いtrapframeを使わないよう
+// uvmunmap()がTLBをフラッシュする.
+void mm_unmap_trapframe(struct mm *mm, int slot)
+{
+    uvmunmap(mm->pagetable, TRAPFRAME_SLOT(slot), 1, 0);
+    acquire(&mm->lock);
+    mm->tf_slots &= ~(1UL << slot);
+    release(&mm->lock);
+}
+
+// pからアドレス空間を切り離して返す. pのtrapframeのマッピングは外す.
+// 返したアドレス空間はmm_put()で手放す.
+struct mm *mm_detach(struct proc *p)
+{
+    struct mm *mm = p->mm;
+
+    if (mm && p->tf_slot >= 0)
+        mm_unmap_trapframe(mm, p->tf_slot);
+    p->tf_slot = -1;
+    p->mm = 0;
+    p->pagetable = 0;
+    return mm;
+}
+
+// アドレス空間の参照を手放す. 最後の参照であればmmap領域（MAP_SHAREDの
+// 書き込みは書き戻す）とページテーブルを解放する.
+// ファイルを閉じて書き戻すのでトランザクションの外で呼び出すこと.
+void mm_put(struct mm *mm)
+{
+    int ref;
+
+    if (mm == 0)
+        return;
+    acquire(&mm->lock);
+    ref = --mm->ref;
+    release(&mm->lock);
+    if (ref == 0) {
+        free_mmap_list(mm);
+        exec_image_put(mm->image);
+        proc_freepagetable(mm->pagetable, mm->sz);
+        kmfree(mm);
+    }
+}
+
+// pのアドレス空間を手放す.
+void mm_release(struct proc *p)
+{
+    mm_put(mm_detach(p));
+}
+
+// 新しいアドレス空間を作成してpに設定する
+static int proc_new_mm(struct proc *p)
+{
+    struct mm *mm;
+    int slot;
+
+    if ((mm = mm_alloc()) == 0)
+        return -ENOMEM;
+    if ((slot = mm_map_trapframe(mm, p)) < 0) {
+        proc_freepagetable(mm->pagetable, 0);
+        kmfree(mm);
+        return slot;
+    }
+    p->mm = mm;
+    p->pagetable = mm->pagetable;
+    p->tf_slot = slot;
+    return 0;
+}
+
+// pに既存のアドレス空間mmを共有させる（CLONE_VM）
+static int proc_share_mm(struct proc *p, struct mm *mm)
+{
+    int slot;
+
+    if ((slot = mm_map_trapframe(mm, p)) < 0)
+        return slot;
+    acquire(&mm->lock);
+    mm->ref++;
+    release(&mm->lock);
+    p->mm = mm;
+    p->pagetable = mm->pagetable;
+    p->tf_slot = slot;
+    return 0;
+}
+
 // a user program that calls exec("/init")
 // assembled from ../user/initcode.S
 // od -t xC ../user/initcode
@@ -311,11 +463,13 @@ userinit(void)
 
     p = allocproc();
     initproc = p;
+    if (proc_new_mm(p) < 0 || (p->files = files_alloc()) == 0)
+        panic("userinit");
 
     // allocate one user page and copy initcode's instructions
     // and data into it.
     uvmfirst(p->pagetable, initcode, sizeof(initcode));
-    p->sz = PGSIZE;
+    p->mm->sz = PGSIZE;
 
     // prepare for the very first "return" from kernel to user.
     p->trapframe->epc = 0;      // user program counter
@@ -328,22 +482,55 @@ userinit(void)
     p->gid = p->egid = p->sgid = p->fsgid = 0;
 
     p->cap_effective = p->cap_inheritable = p->cap_permitted = CAP_INIT_EFF_SET;
+    attach_pgrp(p);
 
     p->state = RUNNABLE;
+    runq_add(p, 0);
 
     release(&p->lock);
     trace("initproc pid: %d, addr: %p", initproc->pid, initproc);
 }
 
+// カーネルスレッドはforkretの代わりにここから始まる.
+static void kthread_start(void)
+{
+    struct proc *p = myproc();
+
+    // まだschedulerからのp->lockを保持している.
+    release(&p->lock);
+    p->kfunc();
+    panic("kthread returned");
+}
+
+// カーネル内だけで動作するプロセスを作成する. fnは戻ってはならない.
+// ユーザメモリを持たないのでユーザ空間には戻らず、シグナルも処理しない.
+int kthread_create(char *name, void (*fn)(void))
+{
+    struct proc *p;
+    int pid;
+
+    if ((p = allocproc()) == 0)
+        return -ENOMEM;
+    p->kfunc = fn;
+    p->context.ra = (uint64_t)kthread_start;
+    safestrcpy(p->name, name, sizeof(p->name));
+    p->state = RUNNABLE;
+    runq_add(p, 0);
+    pid = p->pid;
+    release(&p->lock);
+    return pid;
+}
+
 // Grow or shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
+// 呼び出し元はp->mm->mmap_lockを保持していなければならない.
 int
 growproc(int n)
 {
     uint64_t sz;
     struct proc *p = myproc();
 
-    sz = p->sz;
+    sz = p->mm->sz;
     if (n > 0) {
         if ((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
             return -1;
@@ -351,7 +538,7 @@ growproc(int n)
     } else if(n < 0){
         sz = uvmdealloc(p->pagetable, sz, sz + n);
     }
-    p->sz = sz;
+    p->mm->sz = sz;
     return 0;
 }
 
@@ -360,8 +547,35 @@ growproc(int n)
 // fork()システムコールから復帰するかのようにこのカーネルスタックをセットする.
 int fork(void)
 {
-    int i, pid;
-    struct proc *np;
+    return clone(SIGCHLD, 0, 0, 0, 0);
+}
+
+// CLONE_VFORKの子がexecまたはexitする際に呼び出し、待っている親を起こす.
+// 共有しているアドレス空間はexecまたはexitがmm_release()で手放す.
+void vfork_release(struct proc *p)
+{
+    acquire(&wait_lock);
+    if (p->vfork_parent == 0) {
+        release(&wait_lock);
+        return;
+    }
+    p->vfork_parent = 0;
+    wakeup(&p->vfork_parent);
+    release(&wait_lock);
+}
+
+// clone(2)の本体.
+// CLONE_VMは子が親のアドレス空間を共有する. CLONE_FILESはオープンファイルの
+// 表を共有する. CLONE_THREADは子を親と同じスレッドグループに入れる.
+// CLONE_VFORKは子がexecまたはexitするまで親を眠らせる.
+// stackが0でない場合は子のスタックポインタとする.
+// CLONE_SETTLSはtlsを子のtpにする. CLONE_PARENT_SETTIDはptidに、
+// CLONE_CHILD_SETTIDは子のctidに子のIDを書き込む. CLONE_CHILD_CLEARTIDは
+// 子が終了する際にctidに0を書いてfutexで待っているスレッドを起こす.
+int clone(uint64_t flags, uint64_t stack, uint64_t ptid, uint64_t tls, uint64_t ctid)
+{
+    int pid;
+    struct proc *np, *leader;
     struct proc *p = myproc();
     int ret = 0;
 
@@ -369,26 +583,47 @@ int fork(void)
     if ((np = allocproc()) == 0) {
         return -ENOMEM;
     }
+    // npはまだRUNNABLEではないので他から使われない.
+    // アドレス空間のコピーはmmap_lockで眠る可能性があるので解放しておく
+    pid = np->pid;
+    release(&np->lock);
 
-    // 親プロセスから子プロセスにmmap_regionsをコピーする
-    if ((ret = copy_mmap_regions(p, np)) < 0) {
-        //debug("ret=%d", ret);
-        freeproc(np);
-        release(&np->lock);
-        error("failed copy_mmap_regions");
-        return ret;
+    if (flags & CLONE_VM) {
+        // アドレス空間を共有するのでmmap_regionsもページもコピーしない
+        ret = proc_share_mm(np, p->mm);
+    } else if ((ret = proc_new_mm(np)) == 0) {
+        // 他のスレッドがmmapやページフォルトで並行して変更しないようにする
+        acquiresleep(&p->mm->mmap_lock);
+        // 親プロセスから子プロセスにmmap_regionsをコピーする
+        if ((ret = copy_mmap_regions(p, np)) < 0) {
+            error("failed copy_mmap_regions");
+        } else {
+            // 親プロセスから子プロセスにユーザメモリをコピーする.
+            trace("uvmcopy pid[%d] to new_pid[%d]", p->pid, np->pid);
+            if (uvmcopy(p, np) < 0) {
+                error("failed uvmcopy");
+                ret = -ENOMEM;
+            } else {
+                np->mm->sz = p->mm->sz;
+                np->mm->image = exec_image_dup(p->mm->image);
+            }
+        }
+        releasesleep(&p->mm->mmap_lock);
     }
-
-    // 親プロセスから子プロセスにユーザメモリをコピーする.
-    trace("uvmcopy pid[%d] to new_pid[%d]", p->pid, np->pid);
-    if (uvmcopy(p, np) < 0) {
-        freeproc(np);
-        release(&np->lock);
-        error("failed uvmcopy");
-        return -ENOMEM;
+    if (ret < 0)
+        goto bad;
+
+    if (flags & CLONE_FILES) {
+        acquire(&p->files->lock);
+        p->files->ref++;
+        release(&p->files->lock);
+        np->files = p->files;
+    } else if ((np->files = files_dup(p->files)) == 0) {
+        ret = -ENOMEM;
+        goto bad;
     }
 
-    np->sz = p->sz;
+    sched_init_proc(np, p->nice);
     np->pgid = p->pgid;
     np->sid = p->sid;
     np->uid = p->uid;
@@ -402,40 +637,93 @@ int fork(void)
     np->cap_effective = p->cap_effective;
     np->cap_inheritable = p->cap_inheritable;
     np->cap_permitted = p->cap_permitted;
+    memmove(np->rlim, p->group_leader->rlim, sizeof(np->rlim));
 
     // copy saved user registers.
     *(np->trapframe) = *(p->trapframe);
 
     // Cause fork to return 0 in the child.
     np->trapframe->a0 = 0;
+    if (stack)
+        np->trapframe->sp = stack;
+    if (flags & CLONE_SETTLS)
+        np->trapframe->tp = tls;
+
+    if ((flags & CLONE_PARENT_SETTID)
+     && copyout(p->pagetable, ptid, (char *)&pid, sizeof(pid)) < 0) {
+        ret = -EFAULT;
+        goto bad;
+    }
+    if ((flags & CLONE_CHILD_SETTID)
+     && copyout(np->pagetable, ctid, (char *)&pid, sizeof(pid)) < 0) {
+        ret = -EFAULT;
+        goto bad;
+    }
+    if (flags & CLONE_CHILD_CLEARTID)
+        np->clear_child_tid = ctid;
 
-    // increment reference counts on open file descriptors.
-    for (i = 0; i < NOFILE; i++)
-        if (p->ofile[i])
-            np->ofile[i] = filedup(p->ofile[i]);
-    np->fdflag = p->fdflag;
     np->cwd = idup(p->cwd);
     memmove(&np->signal, &p->signal, sizeof(struct signal));
 
     safestrcpy(np->name, p->name, sizeof(p->name));
 
-    pid = np->pid;
-
-    release(&np->lock);
-
     acquire(&wait_lock);
-    np->parent = p;
+    if (flags & CLONE_THREAD) {
+        leader = p->group_leader;
+        // exit_groupまたはexecveで他のスレッドを終了させている最中
+        if (leader->group_exit) {
+            release(&wait_lock);
+            begin_op();
+            iput(np->cwd);
+            end_op();
+            np->cwd = 0;
+            ret = -EAGAIN;
+            goto bad;
+        }
+        np->tgid = leader->tgid;
+        np->group_leader = leader;
+        list_push_back(&leader->thread_group, &np->thread_group);
+        leader->nr_threads++;
+        __atomic_add_fetch(&leader->live, 1, __ATOMIC_RELAXED);
+        // スレッドは親にwaitで回収されないので親のchildrenにはつながない.
+        // 親はリーダーのparentを使う
+        np->parent = leader->parent;
+    } else {
+        // 子はスレッドグループのどのスレッドからもwaitできる
+        np->parent = p->group_leader;
+        list_push_back(&np->parent->children, &np->sibling);
+        attach_pgrp(np);
+    }
+    if (flags & CLONE_VFORK)
+        np->vfork_parent = p;
     release(&wait_lock);
 
     acquire(&np->lock);
     np->state = RUNNABLE;
+    runq_add(np, 0);
     release(&np->lock);
     trace("pid: old: %d, new: %d", p->pid, pid);
 
     fence_i();
     fence_rw();
 
+    // 子がexecかexitするまで待つ. 子は親がwait4で回収するまで
+    // 解放されないのでnpを参照してよい
+    if (flags & CLONE_VFORK) {
+        acquire(&wait_lock);
+        while (np->vfork_parent == p)
+            sleep(&np->vfork_parent, &wait_lock);
+        release(&wait_lock);
+    }
+
     return pid;
+
+bad:
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    proc_free(np);
+    return ret;
 }
 
 // Pass p's abandoned children to init.
@@ -444,51 +732,124 @@ static void reparent(struct proc *p)
 {
     struct proc *pp;
 
-    for (pp = proc; pp < &proc[NPROC]; pp++) {
-        if (pp->parent == p) {
-            trace("pid[%d] reparent", pp->pid);
-            pp->parent = initproc;
-            wakeup(initproc);
+    if (list_empty(&p->children))
+        return;
+    list_foreach(pp, &p->children, sibling) {
+        trace("pid[%d] reparent", pp->pid);
+        pp->parent = initproc;
+    }
+    list_concat(&initproc->children, &p->children);
+    wakeup(initproc);
+}
+
+// pのスレッドグループのp以外のスレッドをkillする.
+// 各スレッドはユーザ空間に戻る前にexit()する.
+// Caller must hold wait_lock.
+static void zap_other_threads(struct proc *p)
+{
+    struct proc *t;
+
+    list_foreach(t, &p->thread_group, thread_group) {
+        acquire(&t->lock);
+        t->killed = 1;
+        if (t->state == SLEEPING) {
+            t->state = RUNNABLE;
+            runq_add(t, RQ_WAKEUP);
         }
+        release(&t->lock);
     }
 }
 
+// pのスレッドグループ全体をxstateで終了させる.
+// すでに終了中であれば何もせず0を返す.
+// Caller must hold wait_lock.
+static int group_kill(struct proc *p, int xstate)
+{
+    struct proc *leader = p->group_leader;
+
+    if (leader->group_exit)
+        return 0;
+    leader->group_exit = 1;
+    leader->xstate = xstate;
+    zap_other_threads(p);
+    return 1;
+}
+
+// exit_group(2)の本体. スレッドグループのすべてのスレッドを終了させる.
+void exit_group(int status)
+{
+    struct proc *p = myproc();
+
+    acquire(&wait_lock);
+    group_kill(p, status);
+    release(&wait_lock);
+    exit(status);
+}
+
+// execveの前に呼び出され、呼び出したスレッド以外のスレッドを終了させて
+// その終了を待つ. 他のスレッドがすでにグループを終了させている場合は
+// -EAGAINを返す.
+int de_thread(struct proc *p)
+{
+    struct proc *leader;
+
+    acquire(&wait_lock);
+    leader = p->group_leader;
+    if (leader->nr_threads == 1) {
+        release(&wait_lock);
+        return 0;
+    }
+    if (!group_kill(p, 0)) {
+        release(&wait_lock);
+        return -EAGAIN;
+    }
+    while (leader->nr_threads > 1)
+        sleep(&leader->nr_threads, &wait_lock);
+    leader->group_exit = 0;
+    release(&wait_lock);
+    return 0;
+}
+
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
 // until its parent calls wait().
+// スレッドグループのリーダー以外のスレッドは親に回収されず、
+// scheduler()が解放する. リーダーはすべてのスレッドが終了してから
+// 親に回収される.
 void
 exit(int status)
 {
     struct proc *p = myproc();
+    struct proc *leader;
+    uint32_t zero = 0;
     trace("pid: %d", p->pid);
 
     if (p == initproc)
         panic("init exiting");
 
-    // mappingを解除する
-    //print_mmap_list(p, "before exit");
-    if (p->regions) {
-        struct mmap_region *region = p->regions;
-        while (region) {
-            if (region->f)
-                trace("pid[%d] f->ip: %d refcnt[1]: %d", p->pid, region->f->ip->inum, region->f->ip->ref);
-            munmap(region->addr, region->length);
-            region = region->next;
-        }
-        p->regions = NULL;
+    // vforkの親を起こす
+    vfork_release(p);
+
+    // グループの最後のスレッドであればalarm等のタイマーを止める.
+    // タイマーのコールバックはwait_lockを獲得するので、wait_lockの外で行う
+    leader = p->group_leader;
+    if (__atomic_sub_fetch(&leader->live, 1, __ATOMIC_ACQ_REL) == 0)
+        exit_itimers(leader);
+
+    // pthread_joinなどで終了を待っているスレッドを起こす
+    if (p->clear_child_tid) {
+        if (copyout(p->pagetable, p->clear_child_tid, (char *)&zero, sizeof(zero)) == 0)
+            futex_wake_one(p->clear_child_tid);
+        p->clear_child_tid = 0;
     }
-    //print_mmap_list(p, "after  exit");
+
+    // 最後の参照であればmm_release()がmappingを解除し、MAP_SHARED領域を
+    // 書き戻す. 他のスレッドやvforkの親が使っている場合はそのまま残す
+    mm_release(p);
 
     // Close all open files.
-    for (int fd = 0; fd < NOFILE; fd++) {
-        if (p->ofile[fd]) {
-            struct file *f = p->ofile[fd];
-            trace("pid[%d] f->ip: %d refcnt[2]: %d", p->pid, f->ip->inum, f->ip->ref);
-            fileclose(f);
-            p->ofile[fd] = 0;
-        }
-    }
-    p->fdflag = 0;
+    fdput(p);
+    files_release(p);
 
     begin_op();
     iput(p->cwd);
@@ -497,16 +858,32 @@ exit(int status)
 
     acquire(&wait_lock);
 
-    // Give any children to init.
-    reparent(p);
-
-    // Parent might be sleeping in wait().
-    trace("pid[%d] wakup parent[%d]", p->pid, p->parent->pid);
-    wakeup(p->parent);
+    leader = p->group_leader;
+    leader->nr_threads--;
+    if (leader->nr_threads == 0) {
+        // グループの最後のスレッド
+        if (!leader->group_exit)
+            leader->xstate = status;
+
+        // Give any children to init.
+        reparent(leader);
+
+        // Parent might be sleeping in wait().
+        trace("pid[%d] wakup parent[%d]", p->pid, leader->parent->pid);
+        wakeup(leader->parent);
+    } else if (leader->group_exit) {
+        // de_thread()が他のスレッドの終了を待っている
+        wakeup(&leader->nr_threads);
+    }
+    if (p != leader) {
+        acct_thread_exit(p);
+        list_drop(&p->thread_group);
+    }
 
     acquire(&p->lock);
 
-    p->xstate = status;
+    if (p == leader && !leader->group_exit && leader->nr_threads > 0)
+        p->xstate = status;
     p->state = ZOMBIE;
 
     release(&wait_lock);
@@ -519,18 +896,20 @@ exit(int status)
 
 // 子プロセスがexitするのを待ち、そのpidを返す.
 // このプロセスが子を持たいない場合、-1 を返す。
+// 子はスレッドグループのリーダーに属するので、どのスレッドからも待てる.
 int
 wait4(pid_t pid, uint64_t status, int options, uint64_t ru)
 {
     struct proc *pp;
     int rpid, kids = 0, xstate;
     struct proc *p = myproc();
+    struct proc *leader = p->group_leader;
+    struct rusage rusage;
 
     acquire(&wait_lock);
     while(1) {
-        // プロセステーブルを走査してexitした子プロセスを見つける
-        for (pp = proc; pp < &proc[NPROC]; pp++) {
-            if (pp->parent != p) continue;
+        // 子プロセスのリストを走査してexitした子プロセスを見つける
+        list_foreach(pp, &leader->children, sibling) {
             if (pid > 0) {
                 if (pp->pid != pid) continue;
             } else if (pid == 0) {
@@ -543,7 +922,8 @@ wait4(pid_t pid, uint64_t status, int options, uint64_t ru)
             // make sure the child isn't still in exit() or swtch().
             acquire(&pp->lock);
             kids = 1;
-            if (pp->state == ZOMBIE
+            // リーダーはすべてのスレッドが終了するまで回収しない
+            if ((pp->state == ZOMBIE && pp->nr_threads == 0)
                 || (options & WUNTRACED && pp->state == SLEEPING)
                 || (options & WNOHANG)) {
                 if (status) {
@@ -556,8 +936,8 @@ wait4(pid_t pid, uint64_t status, int options, uint64_t ru)
                         return -EFAULT;
                     }
                 }
+                acct_reap(leader, pp, &rusage);
                 if (ru) {
-                    struct rusage rusage;
                     if (copyout(p->pagetable, ru, (char *)&rusage,
                                         sizeof(struct rusage)) < 0) {
                         release(&pp->lock);
@@ -566,9 +946,11 @@ wait4(pid_t pid, uint64_t status, int options, uint64_t ru)
                     }
                 }
                 rpid = pp->pid;
+                list_drop(&pp->sibling);
                 freeproc(pp);
                 release(&pp->lock);
                 release(&wait_lock);
+                proc_free(pp);
                 trace("pid[%d] was exit: xstate: 0x%x", rpid, xstate);
                 return rpid;
             }
@@ -581,8 +963,9 @@ wait4(pid_t pid, uint64_t status, int options, uint64_t ru)
         }
 
         // Wait for a child to exit.
+        // exit()はリーダー（子の親）を起こす
         trace("pid[%d] sleep for exit", p->pid)
-        sleep(p, &wait_lock);  //DOC: wait-sleep
+        sleep(leader, &wait_lock);  //DOC: wait-sleep
     }
 }
 
@@ -593,43 +976,68 @@ wait4(pid_t pid, uint64_t status, int options, uint64_t ru)
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
+// 実行するプロセスはsched.cの実行キューから取り出す.
 void
 scheduler(void)
 {
     struct proc *p;
     struct cpu *c = mycpu();
-    int found;
 
     c->proc = 0;
     for(;;) {
         // Avoid deadlock by ensuring that devices can interrupt.
         intr_on();
-        found = 0;
 
-        for(p = proc; p < &proc[NPROC]; p++) {
+        if ((p = runq_pick()) != 0) {
+            // キューから外したプロセスはまだ前のCPUでsched()の途中かも
+            // しれないが、そのCPUがswtchを終えるまでp->lockは獲得できない.
             acquire(&p->lock);
             if (p->state == RUNNABLE) {
                 // Switch to chosen process.  It is the process's job
                 // to release its lock and then reacquire it
                 // before jumping back to us.
-                found = 1;
                 p->state = RUNNING;
+                p->last_cpu = cpuid();
                 c->proc = p;
                 trace("switch to %d", p->pid);
+                acct_switch_in(p);
                 swtch(&c->context, &p->context);
+                acct_switch_out(p);
 
                 // Process is done running for now.
                 // It should have changed its p->state before coming back.
                 c->proc = 0;
+
+                // 終了したスレッドは親に回収されないのでここで解放する.
+                // カーネルスタックはもう使われていない
+                if (p->state == ZOMBIE && p->group_leader != p) {
+                    freeproc(p);
+                    release(&p->lock);
+                    proc_free(p);
+                    continue;
+                }
             }
             release(&p->lock);
+            continue;
         }
 
         // Wait for interrupt if no runnable process is found.
         // Otherwise there would be a high cpu usage.
-        if (!found) {
+        // 待つ前に空きページのゼロクリアを1ページ進める.
+        // クリアした場合は再度プロセスを探す.
+        // idleの間にこのCPUのキューに入れたプロセスはrunq_add()がIPIで知らせる.
+        // wfiは割り込みを無効にしたままでも保留中の割り込みで復帰するので、
+        // idleをセットしてからwfiまでに届いたIPIも取りこぼさない.
+        // 待つ間はtickを止め、次のタイマーの期限まで割り込ませない.
+        if (kalloc_zero_idle() == 0) {
+            intr_off();
+            __atomic_store_n(&c->idle, 1, __ATOMIC_SEQ_CST);
+            timer_idle_enter();
+            if (!runq_pending())
+                asm volatile("wfi");
+            timer_idle_exit();
+            __atomic_store_n(&c->idle, 0, __ATOMIC_SEQ_CST);
             intr_on();
-            asm volatile("wfi");
         }
     }
 }
@@ -668,69 +1076,26 @@ yield(void)
     struct proc *p = myproc();
     acquire(&p->lock);
     p->state = RUNNABLE;
+    runq_add(p, RQ_YIELD);
     sched();
     release(&p->lock);
 }
 
 
 
-// Atomically release lock and sleep on chan.
-// Reacquires lock when awakened.
-void
-sleep(void *chan, struct spinlock *lk)
-{
-    struct proc *p = myproc();
-
-    // Must acquire p->lock in order to
-    // change p->state and then call sched.
-    // Once we hold p->lock, we can be
-    // guaranteed that we won't miss any wakeup
-    // (wakeup locks p->lock),
-    // so it's okay to release lk.
-
-    acquire(&p->lock);  //DOC: sleeplock1
-    release(lk);
-
-    // Go to sleep.
-    p->chan = chan;
-    p->state = SLEEPING;
-
-    sched();
-
-    // Tidy up.
-    p->chan = 0;
-
-    // Reacquire original lock.
-    release(&p->lock);
-    acquire(lk);
-}
-
-// Wake up all processes sleeping on chan.
-// Must be called without any p->lock.
-void
-wakeup(void *chan)
-{
-    struct proc *p;
-
-    for(p = proc; p < &proc[NPROC]; p++) {
-        if (p != myproc()) {
-            acquire(&p->lock);
-            if (p->state == SLEEPING && p->chan == chan) {
-                p->state = RUNNABLE;
-            }
-            release(&p->lock);
-        }
-    }
-}
-
-// プロセスを停止する
+// プロセスを停止する. スレッドグループの他のスレッドも終了させる
 static void term_handler(struct proc *p)
 {
     trace("pid=%d", p->pid);
+    acquire(&wait_lock);
+    group_kill(p, p->xstate ? p->xstate : -1);
+    release(&wait_lock);
     acquire(&p->lock);
     p->killed = 1;
-    if (p->state == SLEEPING)
+    if (p->state == SLEEPING) {
         p->state = RUNNABLE;
+        runq_add(p, RQ_WAKEUP);
+    }
 
     release(&p->lock);
 }
@@ -832,6 +1197,9 @@ void send_signal(struct proc *p, int sig)
 {
     trace("pid=%d, sig=%d, state=%d, paused=%d", p->pid, sig, p->state, p->paused);
     if (sig == SIGKILL) {
+        acquire(&wait_lock);
+        group_kill(p, p->xstate ? p->xstate : -1);
+        release(&wait_lock);
         p->killed = 1;
     } else {
         if (!sigismember(&p->signal.pending, sig))
@@ -840,8 +1208,12 @@ void send_signal(struct proc *p, int sig)
             //debug("sig already pending");
     }
 
-    if (p->state == SLEEPING) {
-        if (p->paused == 1 && (sig == SIGTERM || sig == SIGINT || sig == SIGKILL)) {
+    if (wakeup_intr(p)) {
+        // nanosleep等で眠っていた. シグナルはユーザモードに戻る際に処理する
+    } else if (p->state == SLEEPING) {
+        if (p->paused == 1 && (sig == SIGTERM || sig == SIGINT || sig == SIGKILL
+         || (p->signal.actions[sig].sa_handler != SIG_DFL
+          && p->signal.actions[sig].sa_handler != SIG_IGN))) {
             // For process which are SLEEPING by pause()
             p->paused = 0;
             handle_signal(p, SIGCONT);
@@ -852,44 +1224,87 @@ void send_signal(struct proc *p, int sig)
     }
 }
 
+// プロセス宛てのシグナルを受け取るスレッドを返す.
+// リーダーがすでに終了していれば終了していない他のスレッドに送る.
+struct proc *signal_target(struct proc *p)
+{
+    struct proc *t, *target;
+
+    acquire(&wait_lock);
+    target = p->group_leader ? p->group_leader : p;
+    if (target->state == ZOMBIE) {
+        list_foreach(t, &target->thread_group, thread_group) {
+            if (t->state != ZOMBIE) {
+                target = t;
+                break;
+            }
+        }
+    }
+    release(&wait_lock);
+    return target;
+}
+
 // 与えられたpidを持つプロセスを殺す。
 // 犠牲者は、ユーザ空間に戻ろうとするまで
 // 終了しない(trap.cのusertrap()を参照)。
+// シグナルはスレッドグループに送る（リーダー以外のスレッドのIDでもよい）.
+// send_signal()は眠る可能性があるので、プロセスグループの
+// メンバーは少しずつ集めてからロックを外して送る.
 int kill(pid_t pid, int sig)
 {
     struct proc *p, *cp = myproc();
+    struct proc *procs[KILL_BATCH];
+    struct pgrp_pos pos = { 0, 0 };
     pid_t pgid;
-    int err = -EINVAL;
+    int i, n, err = -EINVAL;
 
     if (pid == 0 || pid < -1) {
         pgid = pid == 0 ? cp->pgid : -pid;
         if (pgid > 0) {
             err = -ESRCH;
-            for (p = proc; p < &proc[NPROC]; p++) {
-                if (p->pgid == pgid) {
-                    send_signal(p, sig);
+            while ((n = collect_pgrp(pgid, procs, KILL_BATCH, &pos)) > 0) {
+                for (i = 0; i < n; i++) {
+                    send_signal(signal_target(procs[i]), sig);
                     err = 0;
                 }
             }
         }
     } else if (pid == -1) {
-        for (p = proc; p < &proc[NPROC]; p++) {
-            if (p->pid > 1 && p != cp) {
-                send_signal(p, sig);
-                err = 0;
+        while ((n = collect_pgrp(-1, procs, KILL_BATCH, &pos)) > 0) {
+            for (i = 0; i < n; i++) {
+                p = procs[i];
+                if (p->pid > 1 && p->tgid != cp->tgid) {
+                    send_signal(signal_target(p), sig);
+                    err = 0;
+                }
             }
         }
     } else {
-        for (p = proc; p < &proc[NPROC]; p++) {
-            if (p->pid == pid) {
-                send_signal(p, sig);
-                err = 0;
-            }
+        err = -ESRCH;
+        if ((p = find_proc(pid)) != 0) {
+            send_signal(signal_target(p), sig);
+            err = 0;
         }
     }
     return err;
 }
 
+// tgkill(2), tkill(2)の本体. スレッドtidだけにシグナルを送る.
+// tgidが0より大きい場合はtidがそのスレッドグループに属していること.
+int tkill(pid_t tgid, pid_t tid, int sig)
+{
+    struct proc *p;
+
+    if (tid <= 0)
+        return -EINVAL;
+    if ((p = find_proc(tid)) == 0 || p->state == ZOMBIE
+     || (tgid > 0 && p->tgid != tgid))
+        return -ESRCH;
+    if (sig != 0)
+        send_signal(p, sig);
+    return 0;
+}
+
 void
 setkilled(struct proc *p)
 {
@@ -940,11 +1355,8 @@ int either_copyin(void *dst, int user_src, uint64_t src, uint64_t len)
     }
 }
 
-// Print a process listing to console.  For debugging.
-// Runs when user types ^P on console.
-// No lock to avoid wedging a stuck machine further.
-void
-procdump(void)
+static void
+procdump_one(struct proc *p, void *arg)
 {
   static char *states[] = {
   [UNUSED]    "unused",
@@ -954,20 +1366,26 @@ procdump(void)
   [RUNNING]   "run   ",
   [ZOMBIE]    "zombie"
   };
-  struct proc *p;
   char *state;
 
+  if(p->state == UNUSED)
+    return;
+  if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
+    state = states[p->state];
+  else
+    state = "???";
+  printf("%d %s %s", p->pid, state, p->name);
   printf("\n");
-  for(p = proc; p < &proc[NPROC]; p++){
-    if(p->state == UNUSED)
-      continue;
-    if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
-      state = states[p->state];
-    else
-      state = "???";
-    printf("%d %s %s", p->pid, state, p->name);
-    printf("\n");
-  }
+}
+
+// Print a process listing to console.  For debugging.
+// Runs when user types ^P on console.
+// 索引のpidhash_lockだけを獲得し、p->lockは獲得しない.
+void
+procdump(void)
+{
+  printf("\n");
+  foreach_proc(procdump_one, 0);
 }
 
 // 10ミリ秒単位のdelay
@@ -1056,6 +1474,15 @@ long sigaction(int sig, struct k_sigaction *act,  uint64_t oldact)
     }
     release(&q.siglock);
 
+    // シグナルハンドラはスレッドグループで共有する
+    if (act) {
+        struct proc *p = myproc(), *t;
+        acquire(&wait_lock);
+        list_foreach(t, &p->thread_group, thread_group)
+            t->signal.actions[sig] = p->signal.actions[sig];
+        release(&wait_lock);
+    }
+
     return 0;
 }
 
@@ -1127,11 +1554,43 @@ void check_pending_signal(void)
     }
 }
 
+// pに処理すべき（ブロックも無視もされていない）シグナルがあるか
+int signal_pending(struct proc *p)
+{
+    void *handler;
+
+    if (p->killed)
+        return 1;
+    for (int sig = 1; sig < NSIG; sig++) {
+        if (sigismember(&p->signal.pending, sig) != 1
+         || sigismember(&p->signal.mask, sig) == 1)
+            continue;
+        handler = p->signal.actions[sig].sa_handler;
+        if (handler == SIG_IGN)
+            continue;
+        if (handler == SIG_DFL && (sig == SIGCHLD || sig == SIGURG || sig == SIGWINCH))
+            continue;
+        return 1;
+    }
+    return 0;
+}
+
+// timeout_tsがNULLでなければその時間でタイムアウトする.
+// sigmaskがNULLでなければ待つ間のシグナルマスクにする.
 long ppoll(struct pollfd *fds, nfds_t nfds, struct timespec *timeout_ts, sigset_t *sigmask) {
     struct proc *p = myproc();
     sigset_t origmask = p->signal.mask;
 
+    if (sigmask)
+        siginitset(&p->signal.mask, sigmask);
+
     if (fds == NULL) {
+        if (timeout_ts) {
+            // pollするfdがなければタイムアウトまで眠るだけ
+            long ret = timer_sleep(timeout_ts);
+            siginitset(&p->signal.mask, &origmask);
+            return ret;
+        }
         p->paused = 1;
         acquire(&q.lock);
         sleep(p, &q.lock);
@@ -1152,78 +1611,50 @@ long ppoll(struct pollfd *fds, nfds_t nfds, struct timespec *timeout_ts, sigset_
     return nfds;
 }
 
+// pidのプロセスグループをpgidにする. 対象は自身か自身の子で、
+// pgidがpidと異なる場合は同じセッションにそのプロセスグループが
+// あること.
 long setpgid(pid_t pid, pid_t pgid)
 {
-    struct proc *cp = myproc(), *p = 0, *pp;
-    long error = -EINVAL;
+    struct proc *cp = myproc()->group_leader, *p;
+    long error = 0;
 
-    if (!pid) pid = cp->pid;
+    if (!pid) pid = cp->tgid;
     if (!pgid) pgid = pid;
     if (pgid < 0) return -EINVAL;
 
-    if (pid != cp->pid) {
-        for (pp = proc; pp < &proc[NPROC]; pp++) {
-            acquire(&pp->lock);
-            if (pp->pid == pid) {
-                p = pp;
-                release(&pp->lock);
-                break;
-            }
-            release(&pp->lock);
-        }
-        error = -ESRCH;
-        if (!p) goto out;
-    } else {
-        p = cp;
-    }
+    if ((p = find_proc(pid)) == 0)
+        return -ESRCH;
+    p = p->group_leader;
 
-    error = -EINVAL;
+    acquire(&wait_lock);
     if (p->parent == cp) {
-        error = -EPERM;
-        if (p->sid != cp->sid) goto out;
-    } else {
+        if (p->sid != cp->sid)
+            error = -EPERM;
+    } else if (p != cp) {
         error = -ESRCH;
-        if (p != cp) goto out;
     }
+    release(&wait_lock);
+    if (error < 0)
+        return error;
 
-    if (pgid != pid) {
-        for (pp = proc; pp < &proc[NPROC]; pp++) {
-            acquire(&pp->lock);
-            if (pp->sid == cp->sid) {
-                release(&pp->lock);
-                goto ok_pgid;
-            }
-            release(&pp->lock);
-        }
-        goto out;
-    }
+    if (pgid != pid && !pgrp_in_session(pgid, cp->sid))
+        return -EPERM;
 
-ok_pgid:
-    if (cp->pgid != pgid) {
-        cp->pgid = pgid;
-    }
-    error = 0;
-out:
-    return error;
+    if (p->pgid != pgid)
+        change_pgrp(p, pgid);
+    return 0;
 }
 
 pid_t getpgid(pid_t pid)
 {
     struct proc *p;
 
-    if (!pid) {
+    if (!pid)
         return myproc()->pgid;
-    } else {
-        for (p = proc; p < &proc[NPROC]; p++) {
-            acquire(&p->lock);
-            if (p->pid == pid) {
-                release(&p->lock);
-                return p->pgid;
-            }
-            release(&p->lock);
-        }
+    if ((p = find_proc(pid)) == 0)
         return -ESRCH;
-    }
+    return p->pgid;
 }
 
 /*
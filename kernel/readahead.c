@@ -0,0 +1,92 @@
+// madvise(MADV_WILLNEED)の先読み.
+//
+// madvise()は範囲をキューに登録するだけですぐに戻り、先読みスレッドが
+// アドレス空間のmmap_lockを取ってmmap_readahead()でまだマッピング
+// されていないページを読み込む. 登録中のアドレス空間は参照を持って
+// おくので、プロセスが先に終了しても解放されない.
+// MADV_WILLNEEDはヒントなので、キューが一杯の場合は登録しない.
+
+#include <common/types.h>
+#include <common/param.h>
+#include <common/riscv.h>
+#include <defs.h>
+#include <printf.h>
+#include <proc.h>
+#include <spinlock.h>
+#include <sleeplock.h>
+
+#define RA_QSIZE    16      // キューの長さ
+
+struct ra_entry {
+    struct mm *mm;          // 参照済み
+    uint64_t start;         // ページ境界
+    uint64_t end;
+};
+
+static struct {
+    struct spinlock lock;
+    struct ra_entry q[RA_QSIZE];
+    int head;               // 次に取り出すエントリ
+    int count;
+} ra;
+
+// mmの[start, end)の先読みを登録する.
+void ra_queue(struct mm *mm, uint64_t start, uint64_t end)
+{
+    struct ra_entry *e;
+    int i;
+
+    acquire(&ra.lock);
+    for (i = 0; i < ra.count; i++) {
+        e = &ra.q[(ra.head + i) % RA_QSIZE];
+        if (e->mm == mm && e->start <= start && end <= e->end) {
+            release(&ra.lock);
+            return;
+        }
+    }
+    if (ra.count == RA_QSIZE) {
+        release(&ra.lock);
+        trace("queue full: 0x%lx-0x%lx", start, end);
+        return;
+    }
+    e = &ra.q[(ra.head + ra.count++) % RA_QSIZE];
+    e->mm = mm;
+    e->start = start;
+    e->end = end;
+    acquire(&mm->lock);
+    mm->ref++;
+    release(&mm->lock);
+    wakeup(&ra);
+    release(&ra.lock);
+}
+
+// 先読みスレッド
+static void ra_thread(void)
+{
+    struct ra_entry e;
+    long ret;
+
+    for (;;) {
+        acquire(&ra.lock);
+        while (ra.count == 0)
+            sleep(&ra, &ra.lock);
+        e = ra.q[ra.head];
+        ra.head = (ra.head + 1) % RA_QSIZE;
+        ra.count--;
+        release(&ra.lock);
+
+        acquiresleep(&e.mm->mmap_lock);
+        if ((ret = mmap_readahead(e.mm, e.start, e.end)) < 0)
+            warn("0x%lx-0x%lx failed: %ld", e.start, e.end, ret);
+        releasesleep(&e.mm->mmap_lock);
+        // 最後の参照であればここでアドレス空間を解放する
+        mm_put(e.mm);
+    }
+}
+
+void ra_init(void)
+{
+    initlock(&ra.lock, "readahead");
+    if (kthread_create("readahead", ra_thread) < 0)
+        panic("ra_init");
+}
@@ -0,0 +1,226 @@
+// 資源の使用量の計上.
+//
+// CPU時間はr_time()の値でスレッドごとに計上する. p->acct_stampは
+// 最後に計上した時刻で、ユーザー空間からトラップした際にそこまでを
+// ユーザー時間、ユーザー空間に戻る際とCPUを明け渡す際にそこまでを
+// システム時間とする. CPUを割り当てられた際にacct_stampを進めるので
+// 待っている間の時間はどちらにも入らない.
+// p->acctは実行中のスレッド自身とCPUを明け渡した後のscheduler()だけが
+// 変更するのでロックしない. 他のスレッドからの読み出しは多少古くてもよい.
+//
+// スレッドが終了するとその使用量をリーダーのdead_acctに加え、
+// 子を回収すると子のスレッドグループとその回収済みの子の使用量を
+// 親のリーダーのchild_acctに加える.
+
+#include <common/types.h>
+#include <common/param.h>
+#include <common/riscv.h>
+#include <common/fs.h>
+#include <spinlock.h>
+#include <proc.h>
+#include <defs.h>
+#include <errno.h>
+#include <printf.h>
+#include <linux/resources.h>
+#include <linux/time.h>
+
+extern struct spinlock wait_lock;
+
+static void acct_add(struct proc_acct *dst, struct proc_acct *src)
+{
+    dst->utime   += src->utime;
+    dst->stime   += src->stime;
+    dst->minflt  += src->minflt;
+    dst->majflt  += src->majflt;
+    dst->inblock += src->inblock;
+    dst->oublock += src->oublock;
+    dst->nvcsw   += src->nvcsw;
+    dst->nivcsw  += src->nivcsw;
+}
+
+// ユーザー空間からトラップした. ここまでをユーザー時間とする
+void acct_utime(struct proc *p)
+{
+    uint64_t now = r_time();
+
+    p->acct.utime += now - p->acct_stamp;
+    p->acct_stamp = now;
+}
+
+// ユーザー空間に戻る、またはCPUを明け渡した. ここまでをシステム時間とする
+void acct_stime(struct proc *p)
+{
+    uint64_t now = r_time();
+
+    p->acct.stime += now - p->acct_stamp;
+    p->acct_stamp = now;
+}
+
+// scheduler()がpにCPUを割り当てる. p->lockを保持して呼び出す
+void acct_switch_in(struct proc *p)
+{
+    p->acct_stamp = r_time();
+}
+
+// scheduler()にpから戻った. p->lockを保持して呼び出す.
+// 眠った場合は自発的、実行可能なままの場合は横取りされたとする
+void acct_switch_out(struct proc *p)
+{
+    acct_stime(p);
+    if (p->state == SLEEPING)
+        p->acct.nvcsw++;
+    else if (p->state == RUNNABLE)
+        p->acct.nivcsw++;
+}
+
+// ページフォルトを処理した. その間にブロックを読んでいればメジャーとする
+void acct_fault(struct proc *p, long inblock)
+{
+    if (p->acct.inblock != inblock)
+        p->acct.majflt++;
+    else
+        p->acct.minflt++;
+}
+
+// ブロックを1つ読み書きした
+void acct_block_io(int write)
+{
+    struct proc *p = myproc();
+
+    if (p == 0)
+        return;
+    if (write)
+        p->acct.oublock += BSIZE / 512;
+    else
+        p->acct.inblock += BSIZE / 512;
+}
+
+// リーダー以外のスレッドpが終了する. wait_lockを保持して呼び出す
+void acct_thread_exit(struct proc *p)
+{
+    acct_stime(p);
+    acct_add(&p->group_leader->dead_acct, &p->acct);
+}
+
+// スレッドグループのリーダーpとその回収済みの子の使用量の合計.
+// pはすべてのスレッドが終了したゾンビであること
+static void acct_group_total(struct proc *p, struct proc_acct *acct)
+{
+    *acct = p->acct;
+    acct_add(acct, &p->dead_acct);
+    acct_add(acct, &p->child_acct);
+}
+
+// リーダーpのスレッドグループの現在の使用量.
+// wait_lockを保持して呼び出す
+static void acct_group_self(struct proc *p, struct proc_acct *acct)
+{
+    struct proc *t;
+
+    *acct = p->acct;
+    acct_add(acct, &p->dead_acct);
+    list_foreach(t, &p->thread_group, thread_group)
+        acct_add(acct, &t->acct);
+}
+
+static void acct_to_rusage(struct proc_acct *acct, struct rusage *ru)
+{
+    memset(ru, 0, sizeof(struct rusage));
+    ru->ru_utime.tv_sec  = acct->utime / (US_INTERVAL * 1000000);
+    ru->ru_utime.tv_usec = (acct->utime / US_INTERVAL) % 1000000;
+    ru->ru_stime.tv_sec  = acct->stime / (US_INTERVAL * 1000000);
+    ru->ru_stime.tv_usec = (acct->stime / US_INTERVAL) % 1000000;
+    ru->ru_minflt  = acct->minflt;
+    ru->ru_majflt  = acct->majflt;
+    ru->ru_inblock = acct->inblock;
+    ru->ru_oublock = acct->oublock;
+    ru->ru_nvcsw   = acct->nvcsw;
+    ru->ru_nivcsw  = acct->nivcsw;
+}
+
+// wait4()がゾンビのリーダーchildを回収する. childの使用量を
+// 親のリーダーparentのchild_acctに加え、ruにchildの使用量を返す.
+// wait_lockを保持して呼び出す
+void acct_reap(struct proc *parent, struct proc *child, struct rusage *ru)
+{
+    struct proc_acct acct;
+
+    acct_group_total(child, &acct);
+    acct_add(&parent->child_acct, &acct);
+    if (ru)
+        acct_to_rusage(&acct, ru);
+}
+
+// 呼び出したスレッド（groupが0）またはそのスレッドグループ（groupが1）の
+// CPU時間をナノ秒で返す（CLOCK_THREAD_CPUTIME_ID, CLOCK_PROCESS_CPUTIME_ID）
+uint64_t cputime_ns(int group)
+{
+    struct proc *p = myproc();
+    struct proc_acct acct;
+
+    acct_stime(p);
+    if (group) {
+        acquire(&wait_lock);
+        acct_group_self(p->group_leader, &acct);
+        release(&wait_lock);
+    } else {
+        acct = p->acct;
+    }
+    return (acct.utime + acct.stime) * 1000 / US_INTERVAL;
+}
+
+// getrusage(2)
+long getrusage(int who, uint64_t addr)
+{
+    struct proc *p = myproc();
+    struct proc_acct acct;
+    struct rusage ru;
+
+    acct_stime(p);
+    switch (who) {
+    case RUSAGE_SELF:
+        acquire(&wait_lock);
+        acct_group_self(p->group_leader, &acct);
+        release(&wait_lock);
+        break;
+    case RUSAGE_CHILDREN:
+        acquire(&wait_lock);
+        acct = p->group_leader->child_acct;
+        release(&wait_lock);
+        break;
+    case RUSAGE_THREAD:
+        acct = p->acct;
+        break;
+    default:
+        return -EINVAL;
+    }
+    acct_to_rusage(&acct, &ru);
+    if (copyout(p->pagetable, addr, (char *)&ru, sizeof(ru)) < 0)
+        return -EFAULT;
+    return 0;
+}
+
+// times(2): 起動からのclock tick数を返す
+long times(uint64_t addr)
+{
+    struct proc *p = myproc();
+    struct proc_acct self, child;
+    struct timespec ts;
+    struct tms tms;
+
+    if (addr) {
+        acct_stime(p);
+        acquire(&wait_lock);
+        acct_group_self(p->group_leader, &self);
+        child = p->group_leader->child_acct;
+        release(&wait_lock);
+        tms.tms_utime  = self.utime / INTERVAL;
+        tms.tms_stime  = self.stime / INTERVAL;
+        tms.tms_cutime = child.utime / INTERVAL;
+        tms.tms_cstime = child.stime / INTERVAL;
+        if (copyout(p->pagetable, addr, (char *)&tms, sizeof(tms)) < 0)
+            return -EFAULT;
+    }
+    clock_gettime(0, CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 100 + ts.tv_nsec / 10000000;
+}
@@ -65,7 +65,6 @@ static inline long sbi_hart_start(uint64_t hartid, uint64_t saddr, uint64_t priv
 
 void sbiinit(void)
 {
-    unsigned long next;
     uint64_t version = sbi_get_spec_version();
     uint64_t major = (version >> SBI_SPEC_VERSION_MAJOR_SHIFT) &
             SBI_SPEC_VERSION_MAJOR_MASK;
@@ -110,14 +109,6 @@ void sbiinit(void)
     if (sbi_probe_extension(SBI_EXT_ID_PMU) > 0)
         printf("SBI PMU extension detected\n");
 
-    /* 割り込みを停止: interrupt-enableビットをクリア */
-    csr_clear(CSR_IE, 1 << 5);
-    /* タイマーのセット: INVERVAL=10ms : 1tick = 1/25MHz = 40 ns */
-    next = csr_read(CSR_TIME) + INTERVAL;
-    sbi_set_timer(next);
-    /* 割り込みを開始; interrupt-enbleビットをセット */
-    csr_set(CSR_IE, 1 << 5);
-
     printf("\n");
 }
 
@@ -126,3 +117,27 @@ void sbi_set_timer(unsigned long stime_value)
     sbi_ecall(SBI_EXT_ID_TIME, SBI_TIME_SET_TIMER, stime_value, 0,
                   0, 0, 0, 0);
 }
+
+/* hart_maskのhartにソフトウェア割り込み（IPI）を送る */
+void sbi_send_ipi(unsigned long hart_mask)
+{
+    sbi_ecall(SBI_EXT_ID_IPI, SBI_IPI_SEND_IPI, hart_mask, 0,
+                  0, 0, 0, 0);
+}
+
+/*
+ * hart_maskのhartで[start, start+size)のTLBエントリをフラッシュさせる.
+ * sizeが-1の場合はすべてのエントリ. 対象のhartが完了するまで戻らない.
+ */
+void sbi_remote_sfence_vma(unsigned long hart_mask, uint64_t start, uint64_t size)
+{
+    sbi_ecall(SBI_EXT_ID_RFNC, SBI_RFNC_REMOTE_SFENCE_VMA, hart_mask, 0,
+                  start, size, 0, 0);
+}
+
+/* sbi_remote_sfence_vma()のasidのエントリだけを対象とする版 */
+void sbi_remote_sfence_vma_asid(unsigned long hart_mask, uint64_t start, uint64_t size, uint64_t asid)
+{
+    sbi_ecall(SBI_EXT_ID_RFNC, SBI_RFNC_REMOTE_SFENCE_VMA_ASID, hart_mask, 0,
+                  start, size, asid, 0);
+}
@@ -0,0 +1,358 @@
+// CPUごとの優先度付き実行キュー.
+//
+// 各CPUのキューは優先度（nice+20. 0が最高、NPRIO-1が最低）ごとの
+// リストとその空きを示すビットマップからなる配列をactiveとexpiredの
+// 2つ持つ. 次に実行するプロセスはactiveのビットマップの最下位ビットの
+// リストの先頭なので、プロセス数によらずO(1)で選べる.
+// タイムスライスを使い切ったプロセスは元の優先度に戻してexpiredに
+// 入れ、activeが空になったら2つを入れ替える.
+// sleepから起きたプロセスは優先度をWAKE_BONUSだけ上げてactiveに入れ、
+// 実行中のプロセスより優先度が高ければそのCPUをプリエンプトさせる.
+// これによりCPUを使い続けるプロセスがいてもシェルなどの対話的な
+// プロセスの応答が1tick以内に収まる.
+//
+// ロックの順序はp->lock -> runqueue.lock. scheduler()はキューから
+// 外したプロセスのp->lockをキューのロックを外してから獲得する.
+
+#include <common/types.h>
+#include <common/param.h>
+#include <common/riscv.h>
+#include <spinlock.h>
+#include <proc.h>
+#include <defs.h>
+#include <errno.h>
+#include <printf.h>
+#include <list.h>
+#include <linux/capability.h>
+#include <linux/resources.h>
+#include <linux/time.h>
+
+#define WAKE_BONUS      5       // 起床したプロセスの優先度を上げる幅
+#define STARVE_TICKS    100     // expiredをこれ以上待たせたらactiveと入れ替える
+
+struct prio_array {
+    uint64_t bitmap;                    // ビットiはqueue[i]が空でない
+    struct list_head queue[NPRIO];
+};
+
+struct runqueue {
+    struct spinlock lock;
+    struct prio_array arrays[2];
+    struct prio_array *active;
+    struct prio_array *expired;
+    int nr;                             // キューにあるプロセス数
+    uint64_t expired_since;             // expiredが空でなくなった時のjiffies
+    int cur_prio;                       // 実行中のプロセスの優先度（idleならNPRIO）
+};
+
+static struct runqueue runqueues[NCPU];
+
+// niceに応じたタイムスライス（tick）: nice -20で10, 0で5, 19で1
+static int nice_slice(int nice)
+{
+    return (19 - nice) / 4 + 1;
+}
+
+void runq_init(void)
+{
+    struct runqueue *rq;
+
+    for (rq = runqueues; rq < &runqueues[NCPU]; rq++) {
+        initlock(&rq->lock, "runq");
+        for (int i = 0; i < 2; i++) {
+            rq->arrays[i].bitmap = 0;
+            for (int j = 0; j < NPRIO; j++)
+                list_init(&rq->arrays[i].queue[j]);
+        }
+        rq->active = &rq->arrays[0];
+        rq->expired = &rq->arrays[1];
+        rq->cur_prio = NPRIO;
+    }
+}
+
+// pのスケジューリング情報を初期化する. allocproc()とclone()から呼び出す.
+void sched_init_proc(struct proc *p, int nice)
+{
+    p->nice = nice;
+    p->prio = nice + 20;
+    p->slice = nice_slice(nice);
+    p->rq_cpu = -1;
+    p->rq_array = NULL;
+    list_init(&p->rq_link);
+}
+
+// rq->lockを保持して呼び出す
+static void rq_enqueue(struct runqueue *rq, struct proc *p, struct prio_array *a)
+{
+    if (a == rq->expired && a->bitmap == 0)
+        rq->expired_since = jiffies;
+    list_push_back(&a->queue[p->prio], &p->rq_link);
+    a->bitmap |= 1UL << p->prio;
+    p->rq_array = a;
+    rq->nr++;
+}
+
+// rq->lockを保持して呼び出す
+static void rq_dequeue(struct runqueue *rq, struct proc *p)
+{
+    struct prio_array *a = p->rq_array;
+
+    list_drop(&p->rq_link);
+    list_init(&p->rq_link);
+    if (list_empty(&a->queue[p->prio]))
+        a->bitmap &= ~(1UL << p->prio);
+    p->rq_array = NULL;
+    p->rq_cpu = -1;
+    rq->nr--;
+}
+
+// cpuに実行中のプロセスを手放させる
+static void resched_cpu(int cpu)
+{
+    if (cpu == cpuid()) {
+        mycpu()->resched = 1;
+    } else {
+        __atomic_store_n(&cpus[cpu].resched, 1, __ATOMIC_SEQ_CST);
+        sbi_send_ipi(1UL << cpu);
+    }
+}
+
+// 起床したプロセスpを入れるキューのCPUを選ぶ. wfiで待っているCPUが
+// あればそれを取り、なければ最後に実行したCPU（キャッシュが温かい）.
+static int select_cpu(struct proc *p)
+{
+    uint64_t online = cpus_online;
+    int id, last = p->last_cpu;
+
+    if (last >= 0 && (online & (1UL << last))
+     && __atomic_exchange_n(&cpus[last].idle, 0, __ATOMIC_SEQ_CST))
+        return last;
+    for (id = 0; id < NCPU; id++) {
+        if ((online & (1UL << id))
+         && __atomic_exchange_n(&cpus[id].idle, 0, __ATOMIC_SEQ_CST))
+            return id;
+    }
+    if (last >= 0 && (online & (1UL << last)))
+        return last;
+    return cpuid();
+}
+
+// 実行可能になったpを実行キューに入れる. p->lockを保持し、
+// p->stateをRUNNABLEにしてから呼び出す.
+// how: 0（新しいプロセス）, RQ_WAKEUP（sleepから起床）, RQ_YIELD（CPUを明け渡した）
+void runq_add(struct proc *p, int how)
+{
+    struct runqueue *rq;
+    struct prio_array *a;
+    int cpu, preempt;
+
+    if (!holding(&p->lock))
+        panic("runq_add: p->lock");
+    // 明け渡したプロセスはこのCPUのキューに戻す
+    cpu = how == RQ_YIELD ? cpuid() : select_cpu(p);
+    rq = &runqueues[cpu];
+
+    acquire(&rq->lock);
+    if (p->slice <= 0) {
+        // タイムスライスを使い切った: 元の優先度でexpiredに入れる
+        p->prio = p->nice + 20;
+        p->slice = nice_slice(p->nice);
+        a = how == RQ_WAKEUP ? rq->active : rq->expired;
+    } else {
+        a = rq->active;
+    }
+    if (how == RQ_WAKEUP)
+        p->prio = p->nice + 20 > WAKE_BONUS ? p->nice + 20 - WAKE_BONUS : 0;
+    rq_enqueue(rq, p, a);
+    p->rq_cpu = cpu;
+    preempt = how != RQ_YIELD && a == rq->active && p->prio < rq->cur_prio;
+    release(&rq->lock);
+
+    if (preempt)
+        resched_cpu(cpu);
+    // tickを止めたり延ばしたりしていれば元に戻させる
+    timer_kick(cpu);
+}
+
+// rqから最も優先度の高いプロセスを外して返す. 空なら0を返す
+static struct proc *rq_take(struct runqueue *rq)
+{
+    struct prio_array *t;
+    struct proc *p;
+    int prio;
+
+    acquire(&rq->lock);
+    if (rq->nr == 0) {
+        release(&rq->lock);
+        return 0;
+    }
+    // activeが空になったか、expiredを長く待たせている場合は入れ替える
+    if (rq->active->bitmap == 0
+     || (rq->expired->bitmap != 0 && jiffies - rq->expired_since >= STARVE_TICKS)) {
+        t = rq->active;
+        rq->active = rq->expired;
+        rq->expired = t;
+        rq->expired_since = jiffies;
+    }
+    prio = __builtin_ctzl(rq->active->bitmap);
+    p = list_entry(list_front(&rq->active->queue[prio]), struct proc, rq_link);
+    rq_dequeue(rq, p);
+    release(&rq->lock);
+    return p;
+}
+
+// scheduler()から呼び出し、このCPUで次に実行するプロセスを返す.
+// 自分のキューが空なら他のCPUのキューから取る. なければ0を返す.
+// 返したプロセスはどのキューにも入っていない.
+struct proc *runq_pick(void)
+{
+    int self = cpuid(), id;
+    struct proc *p;
+
+    p = rq_take(&runqueues[self]);
+    for (id = 0; p == 0 && id < NCPU; id++) {
+        if (id != self && (cpus_online & (1UL << id)))
+            p = rq_take(&runqueues[id]);
+    }
+    runqueues[self].cur_prio = p ? p->prio : NPRIO;
+    return p;
+}
+
+// このCPUのキューに実行可能なプロセスがあるか
+int runq_pending(void)
+{
+    return __atomic_load_n(&runqueues[cpuid()].nr, __ATOMIC_SEQ_CST) != 0;
+}
+
+// タイマー割り込みごとに各CPUで呼び出す. 割り込みは無効.
+// 実行中のプロセスのタイムスライスを減らし、使い切ったら手放させる.
+void sched_tick(void)
+{
+    struct cpu *c = mycpu();
+    struct proc *p = c->proc;
+
+    if (p && --p->slice <= 0)
+        c->resched = 1;
+}
+
+// このCPUで実行中のプロセスがCPUを手放すべきか. フラグはクリアする.
+int sched_need_resched(void)
+{
+    int ret;
+
+    push_off();
+    ret = __atomic_exchange_n(&mycpu()->resched, 0, __ATOMIC_SEQ_CST);
+    pop_off();
+    return ret;
+}
+
+// pのniceを変更する. p->lockを保持して呼び出す.
+// 実行キューにあれば新しい優先度の位置に入れ直す.
+static void set_one_nice(struct proc *p, int nice)
+{
+    struct runqueue *rq;
+    struct prio_array *a;
+    int cpu;
+
+    p->nice = nice;
+    if ((cpu = p->rq_cpu) < 0) {
+        p->prio = nice + 20;
+        return;
+    }
+    rq = &runqueues[cpu];
+    acquire(&rq->lock);
+    if (p->rq_cpu == cpu) {
+        a = p->rq_array;
+        rq_dequeue(rq, p);
+        p->prio = nice + 20;
+        rq_enqueue(rq, p, a);
+        p->rq_cpu = cpu;
+    } else {
+        p->prio = nice + 20;
+    }
+    release(&rq->lock);
+}
+
+// whichとwhoに一致するプロセスか
+static int prio_match(struct proc *p, int which, int who)
+{
+    struct proc *cp = myproc();
+
+    switch (which) {
+    case PRIO_PROCESS:
+        return p->pid == (who ? who : cp->pid);
+    case PRIO_PGRP:
+        return p->pgid == (who ? who : cp->pgid);
+    case PRIO_USER:
+        return p->uid == (who ? who : cp->uid);
+    }
+    return 0;
+}
+
+struct prio_arg {
+    int which, who, nice;
+    struct proc *cp;                // 呼び出したプロセス
+    long ret;
+};
+
+static void setpriority_one(struct proc *p, void *arg)
+{
+    struct prio_arg *pa = arg;
+    struct proc *cp = pa->cp;
+
+    acquire(&p->lock);
+    if (p->state == UNUSED || p->kfunc || !prio_match(p, pa->which, pa->who)) {
+        release(&p->lock);
+        return;
+    }
+    if (p->uid != cp->euid && p->euid != cp->euid && !capable(CAP_SYS_NICE)) {
+        pa->ret = -EPERM;
+    } else if (pa->nice < p->nice && !capable(CAP_SYS_NICE)) {
+        pa->ret = -EACCES;
+    } else {
+        set_one_nice(p, pa->nice);
+        if (pa->ret == -ESRCH)
+            pa->ret = 0;
+    }
+    release(&p->lock);
+}
+
+// setpriority(2): whichとwhoに一致するプロセスのniceをniceにする.
+long setpriority(int which, int who, int nice)
+{
+    struct prio_arg pa = { which, who, nice, myproc(), -ESRCH };
+
+    if (which < PRIO_PROCESS || which > PRIO_USER)
+        return -EINVAL;
+    if (nice < PRIO_MIN)
+        pa.nice = PRIO_MIN;
+    if (nice >= PRIO_MAX)
+        pa.nice = PRIO_MAX - 1;
+
+    foreach_proc(setpriority_one, &pa);
+    return pa.ret;
+}
+
+static void getpriority_one(struct proc *p, void *arg)
+{
+    struct prio_arg *pa = arg;
+
+    acquire(&p->lock);
+    if (p->state != UNUSED && !p->kfunc && prio_match(p, pa->which, pa->who)
+     && 20 - p->nice > pa->ret)
+        pa->ret = 20 - p->nice;
+    release(&p->lock);
+}
+
+// getpriority(2): whichとwhoに一致するプロセスの最も高い優先度を
+// 20-nice（1..40）で返す. 変換はlibcが行う.
+long getpriority(int which, int who)
+{
+    struct prio_arg pa = { which, who, 0, myproc(), -ESRCH };
+
+    if (which < PRIO_PROCESS || which > PRIO_USER)
+        return -EINVAL;
+
+    foreach_proc(getpriority_one, &pa);
+    return pa.ret;
+}
@@ -18,6 +18,7 @@ limitations under the License.
 
 #include <common/types.h>
 #include <defs.h>
+#include <list.h>
 #include <page.h>
 #include <printf.h>
 #include <spinlock.h>
@@ -41,8 +42,27 @@ limitations under the License.
  *  + sizeof(uint64_t) はfreeのSLAB_FREE_END用
  */
 #define SLAB_HEADER_SIZE (sizeof(struct slab_header) + sizeof(uint32_t))
+/**
+ * @ingroup slab
+ * @def SLAB_MAG_SIZE
+ * @brief CPUごとのマガジンに保持するオブジェクトの最大数
+ */
+#define SLAB_MAG_SIZE   16
+/**
+ * @ingroup slab
+ * @def SLAB_MAG_BATCH
+ * @brief マガジンの補充/返却時に一度に移動するオブジェクト数
+ */
+#define SLAB_MAG_BATCH  (SLAB_MAG_SIZE / 2)
+/**
+ * @ingroup slab
+ * @def SLAB_EMPTY_KEEP
+ * @brief キャッシュごとに保持しておく空きスラブの最大数.
+ *        これを超えた空きスラブは直ちにbuddyに返す
+ */
+#define SLAB_EMPTY_KEEP 1
 
-/* slab lock */
+/* slab lock: free_cache_headとslab_cachesを保護する */
 struct spinlock slab_lock;
 
 /**
@@ -52,9 +72,23 @@ struct spinlock slab_lock;
  * @brief スラブヘッダー構造体.
  */
 struct slab_header {
-    struct slab_header *next;   /**< 次のスラブヘッダーへのポインタ */
+    struct list_head list;      /**< full/partial/emptyいずれかのリスト */
     uint32_t *free;             /**< フリーオブジェクト番号リストへのポインタ */
     uint8_t *object;            /**< オブジェクトリストへのポインタ */
+    uint32_t inuse;             /**< 使用中のオブジェクト数 */
+};
+
+/**
+ * @ingroup slab
+ * @struct slab_magazine
+ * @brief CPUごとのオブジェクトマガジン.
+ *        ホットなキャッシュではここから割り当て/ここへ解放することで
+ *        キャッシュロックの取得をSLAB_MAG_BATCH回に1回に減らす
+ */
+struct slab_magazine {
+    uint32_t count;                 /**< 保持しているオブジェクト数 */
+    uint32_t drain;                 /**< 次の操作でスラブに戻す（シュリンカーが設定） */
+    void *objs[SLAB_MAG_SIZE];      /**< オブジェクトスタック */
 };
 
 /**
@@ -65,15 +99,24 @@ struct slab_header {
 struct slab_cache {
     char name[MAX_SLAB_NAME];   /**< キャッシュ名 */
 
-    struct slab_cache *next;    /**< 次のスラブキャッシュへのポインタ */
+    struct slab_cache *next;    /**< 次のスラブキャッシュへのポインタ（free_cache_head用） */
+    struct list_head list;      /**< slab_cachesリスト */
 
     uint32_t slab_size;         /**< スラブのサイズ（page * 2^order） */
     uint32_t object_size;       /**< オブジェクトのサイズ（4バイト切り上げ） */
     uint32_t alignment;          /**< アライメント. 不要な場合は0 */
-
-    struct slab_header *slabs_full;     /**< 全使用済みリスト */
-    struct slab_header *slabs_partial;  /**< 一部使用済みリスト */
+    uint32_t max_objects;       /**< 1スラブのオブジェクト数 */
+    uint32_t nr_empty;          /**< slabs_emptyにあるスラブ数 */
+    bool use_magazine;          /**< CPUごとのマガジンを使用する */
+    bool typesafe;              /**< 空きスラブをbuddyに返さない */
+    void (*ctor)(void *);       /**< 新規スラブのオブジェクトの初期化関数 */
+
+    struct list_head slabs_full;        /**< 全使用済みリスト */
+    struct list_head slabs_partial;     /**< 一部使用済みリスト */
+    struct list_head slabs_empty;       /**< 未使用リスト */
     struct spinlock lock;
+
+    struct slab_magazine mags[NCPU];    /**< CPUごとのマガジン */
 };
 
 /**
@@ -91,6 +134,13 @@ static uint32_t slab_size_limits[PAGE_MAX_DEPTH] = {0};
  */
 struct slab_cache *free_cache_head = NULL;
 
+/**
+ * @ingroup slab
+ * @var slab_caches
+ * @brief 作成済みスラブキャッシュのリスト（シュリンカー用）.
+ */
+static struct list_head slab_caches;
+
 /**
  * @ingroup slab_static
  * @brief 1スラブに格納できる最大オブジェクト数を取得する.
@@ -122,6 +172,7 @@ static struct slab_header *slab_new(const struct slab_cache *cache) {
     /* 1. 新規スラブを割り当て、ヘッダーを0クリアする */
     header = (struct slab_header*)page_address(buddy_alloc(cache->slab_size));
     memset(header, 0, sizeof(struct slab_header));
+    list_init(&header->list);
 
     /* 2. free, objectメンバーのアドレスをセットする */
     header->free = (void *)(header + 1);     /* ヘッダーの直後 */
@@ -139,46 +190,58 @@ static struct slab_header *slab_new(const struct slab_cache *cache) {
     /* 3.1 最後に終了マークをセットする */
     header->free[max_object_num] = SLAB_FREE_END;
     trace("  [%d]: %p = 0x%x", max_object_num, &header->free[max_object_num], header->free[max_object_num]);
+    /* 4. オブジェクトを初期化する */
+    if (cache->ctor) {
+        for (i = 0; i < max_object_num; ++i)
+            cache->ctor(header->object + (cache->object_size * i));
+    }
 
     //debug_bytes("header->free:", (char *)header->free, 64);
 
     return header;
 }
 
+/**
+ * @ingroup slab_static
+ * @brief スラブキャッシュ構造体用のページをfree_cache_headにつなげる.
+ *        slab_lockを保持して呼び出すこと。
+ *
+ * @param cache 0クリアしたページ
+ */
+static void slab_cache_add_page(struct slab_cache *cache) {
+    uint32_t i;
+
+    trace("cache: %p", cache);
+    /* 1. スラブキャッシュ構造体リストとして初期化する（nextフィールドのセット） */
+    for (i = 0; i < (PAGE_SIZE / sizeof(struct slab_cache)) - 1; ++i) {
+        cache[i].next = &cache[i+1];
+        trace("cache[%d]: %p, next: %p", i, &cache[i], cache[i].next);
+    }
+    /* 2. 作成したリストをfree_cache_headにつなげる */
+    cache[i].next = free_cache_head;
+    free_cache_head = cache;
+    trace("free_cache_head: %p", free_cache_head);
+}
+
 /**
  * @ingroup slab_static
  * @brief 新規スラブキャッシュを取得する。
  *      リストfree_cache_headの先頭のスラブキャッシュを切り取って返す。
- *      free_cache_headが空の場合は新規作成してリストに追加し、先頭を返す
+ *      slab_lockを保持し、free_cache_headが空でないことを確認して呼び出すこと。
  *
  * @return 作成されたスラブキャッシュへのポインタ
  */
 static struct slab_cache *slab_cache_new(void) {
-    uint32_t i;
     struct slab_cache *cache;
 
-    /* 1. free_cache_headリストが空の場合は割り当てる */
-    if (!free_cache_head) {
-        /* 1.1 新規リスト用のメモリ（1ページ）を割り当てる */
-        cache = memset(page_address(buddy_alloc(PAGE_SIZE)), 0, PAGE_SIZE);
-        trace("cache: %p", cache);
-        /* 1.2. スラブキャッシュ構造体リストとして初期化する（nextフィールドのセット） */
-        for (i = 0; i < (PAGE_SIZE / sizeof(struct slab_cache)) - 1; ++i) {
-            cache[i].next = &cache[i+1];
-            trace("cache[%d]: %p, next: %p", i, &cache[i], cache[i].next);
-        }
-        /* 1.3 作成したリストをfree_cache_headにつなげる */
-        free_cache_head = cache;
-        trace("free_cache_head: %p", free_cache_head);
-    }
-    /* 2. free_cache_headの先頭のスラブキャッシュ構造体を返す */
+    /* 1. free_cache_headの先頭のスラブキャッシュ構造体を返す */
     cache = free_cache_head;
-    /* 3. free_cache_headを更新する */
+    /* 2. free_cache_headを更新する */
     free_cache_head = cache->next;
-    /* 4. 返すスラブキャッシュをリストから切り離す */
+    /* 3. 返すスラブキャッシュをリストから切り離す */
     cache->next = NULL;
 
-    /* 5. slab_cache lockを初期化する */
+    /* 4. slab_cache lockを初期化する */
     initlock(&cache->lock, "slab_cache");
 
     trace("cache: %p, free_cache_head: %p", cache, free_cache_head);
@@ -227,6 +290,7 @@ void slab_cache_init(void) {
     initlock(&slab_lock, "slab");
 
     free_cache_head = NULL;
+    list_init(&slab_caches);
 }
 
 /**
@@ -251,7 +315,14 @@ struct slab_cache *slab_cache_create(const char *name, uint32_t size, uint32_t a
 
     /* 2. slab lockをacquire */
     acquire(&slab_lock);
-    /* 3. 新規スラブキャッシュを割り当てる */
+    /* 3. 新規スラブキャッシュを割り当てる. 空きがなければページを割り当てて
+     *    補充する. buddy_alloc()はシュリンカーを呼ぶことがあるのでlockを外す */
+    while (!free_cache_head) {
+        release(&slab_lock);
+        cache = memset(page_address(buddy_alloc(PAGE_SIZE)), 0, PAGE_SIZE);
+        acquire(&slab_lock);
+        slab_cache_add_page(cache);
+    }
     cache = slab_cache_new();
     /* 4. slab lock をrelease*/
     release(&slab_lock);
@@ -270,13 +341,76 @@ struct slab_cache *slab_cache_create(const char *name, uint32_t size, uint32_t a
     }
     /* 7. オブジェクトサイズが大きすぎる場合はエラー */
     if (!cache->slab_size) {
+        acquire(&slab_lock);
+        slab_cache_delete(cache);
+        release(&slab_lock);
         return NULL;
     }
+    cache->max_objects = slab_max_object_num(cache);
+    list_init(&cache->slabs_full);
+    list_init(&cache->slabs_partial);
+    list_init(&cache->slabs_empty);
+
+    /* 8. シュリンカーの対象とする */
+    acquire(&slab_lock);
+    list_push_back(&slab_caches, &cache->list);
+    release(&slab_lock);
     trace("created '%s': object: %d, slab: 0x%x, depth: %d, align: %d",
         cache->name, cache->object_size, cache->slab_size, i, cache->alignment);
     return cache;
 }
 
+
+/**
+ * @ingroup slab
+ * @brief スラブキャッシュでCPUごとのマガジンを使用する.
+ *        割り当て/解放が頻繁なキャッシュに対して作成直後に呼び出す
+ *
+ * @param cache スラブキャッシュへのポインタ
+ */
+void slab_cache_set_magazine(struct slab_cache *cache) {
+    acquire(&cache->lock);
+    cache->use_magazine = true;
+    release(&cache->lock);
+}
+
+/**
+ * @ingroup slab
+ * @brief スラブキャッシュのオブジェクトの領域を解放後も同じ型のまま保つ.
+ *        空きスラブをbuddyに返さず、新規スラブのオブジェクトだけを
+ *        ctorで初期化する. 解放したオブジェクトを古いポインタから
+ *        参照しても（ロックの獲得を含めて）壊れないことが必要な
+ *        キャッシュに対して作成直後に呼び出す
+ *
+ * @param cache スラブキャッシュへのポインタ
+ * @param ctor オブジェクトの初期化関数. 不要な場合はNULL
+ */
+void slab_cache_set_typesafe(struct slab_cache *cache, void (*ctor)(void *)) {
+    acquire(&cache->lock);
+    cache->typesafe = true;
+    cache->ctor = ctor;
+    release(&cache->lock);
+}
+
+/**
+ * @ingroup slab_static
+ * @brief リストにつながっているスラブをすべてbuddyに返す.
+ *
+ * @param head スラブリスト
+ * @return 解放したスラブ数
+ */
+static int slab_list_release(struct list_head *head) {
+    struct slab_header *header, *tmp;
+    int n = 0;
+
+    list_foreach_safe(header, tmp, head, list) {
+        list_drop(&header->list);
+        buddy_free(page_find_by_address(header));
+        n++;
+    }
+    return n;
+}
+
 /**
  * @ingroup slab
  * @brief スラブキャッシュを削除する.
@@ -284,97 +418,188 @@ struct slab_cache *slab_cache_create(const char *name, uint32_t size, uint32_t a
  * @param cache 削除するスラブキャッシュへのポインタ
  */
 void slab_cache_destroy(struct slab_cache *cache) {
-    struct slab_header *header, *next_header;
-
-    /* 1. lockをかける */
+    /* 1. シュリンカーの対象から外す */
     acquire(&slab_lock);
+    list_drop(&cache->list);
+    release(&slab_lock);
+
+    /* 2. このキャッシュのすべてのスラブを解放する.
+     *    マガジン内のオブジェクトもスラブと一緒に消える */
+    acquire(&cache->lock);
+    slab_list_release(&cache->slabs_full);
+    slab_list_release(&cache->slabs_partial);
+    slab_list_release(&cache->slabs_empty);
+    release(&cache->lock);
 
-    /* 2. このキャッシュの完全使用済みスラブを解放する */
-    header = cache->slabs_full;
-    while (header) {
-        next_header = header->next;
-        buddy_free(page_find_by_address(header));
-        header = next_header;
-    }
-    /* 2, このキャッシュの一部使用済みスラブを解放する */
-    header = cache->slabs_partial;
-    while (header) {
-        next_header = header->next;
-        buddy_free(page_find_by_address(header));
-        header = next_header;
-    }
     /* 3. スラブキャッシュ構造体を削除する */
+    acquire(&slab_lock);
     slab_cache_delete(cache);
-
-    /* 4. lockを解除 */
     release(&slab_lock);
 }
 
 /**
- * @ingroup slab
- * @brief スラブキャッシュからオブジェクトを割り当てる.
+ * @ingroup slab_static
+ * @brief スラブからオブジェクトを1つ取り出す.
+ *        cache->lockを保持して呼び出すこと。新規スラブの割り当て中は
+ *        lockを一旦解放する。
  *
- * @param cache オブジェクトを割り当てるスラブキャッシュへのポインタ
+ * @param cache スラブキャッシュへのポインタ
  * @return 割り当てられたオブジェクトへのポインタ
  */
-void *slab_cache_alloc(struct slab_cache *cache) {
+static void *slab_object_get(struct slab_cache *cache) {
     struct slab_header *header;
-    uint32_t index = 0, next_index, *free_list = 0;
-
-    /* 1. lockを取得する */
-    acquire(&cache->lock);
+    uint32_t index, next_index, *free_list;
 
-    /* 2. 一部割り当て済みリストから割り当てる */
-    header = cache->slabs_partial;
-    /* 3. 一部割り当て済みリストがない場合は割り当てる */
-    if (!header) {
+    /* 1. 一部割り当て済み、未使用の順にスラブを探す */
+    while (1) {
+        if (!list_empty(&cache->slabs_partial)) {
+            header = list_entry(list_front(&cache->slabs_partial), struct slab_header, list);
+            break;
+        }
+        if (!list_empty(&cache->slabs_empty)) {
+            header = list_entry(list_front(&cache->slabs_empty), struct slab_header, list);
+            list_drop(&header->list);
+            list_push_front(&cache->slabs_partial, &header->list);
+            cache->nr_empty--;
+            break;
+        }
+        /* 2. どちらもない場合は新規スラブを割り当てる.
+         *    buddy_alloc()はシュリンカーを呼ぶことがあるのでlockを外す */
+        release(&cache->lock);
         header = slab_new(cache);
-        cache->slabs_partial = header;
+        acquire(&cache->lock);
+        list_push_front(&cache->slabs_empty, &header->list);
+        cache->nr_empty++;
     }
 
-    /* 4. フリーリストを更新する */
+    /* 3. フリーリストを更新する */
     free_list = (uint32_t *)(header + 1);       /* free_listの先頭アドレス*/
-#if 0
-    if (index < 2)
-        debug_bytes("free_list:", (char *)free_list, 128);
-#endif
     index = (uint32_t)(header->free - free_list); /* 使用するフリーオブジェクトのインデックス */
     next_index = *header->free;                 /* 次のフリーオブジェクトのインデックス */
                                                 /* 初期化時に i+1 が設定されている */
     trace("index: 0x%x, next_index: 0x%x", index, next_index);
     free_list[index] = SLAB_FREE_END;           /* 使用するオブジェクト位置に空き終了マークを付ける */
     header->free = &free_list[next_index];      /* header->freeを更新する */
-    trace("free_list: [%d]: 0x%x, [%d]: 0x%x", index, free_list[index], next_index, free_list[next_index]);
-    trace("header->free: %p = 0x%x", header->free, *header->free);
+    header->inuse++;
 
-    /* 5. header->freeが終了マークを指した場合はslabs_fullにつなげる */
-    if (*header->free == SLAB_FREE_END) {
+    /* 4. 使い切った場合はslabs_fullにつなげる */
+    if (header->inuse == cache->max_objects) {
         trace("header->free is full");
-        /* 4.1 headerをslabs_partialリストから外す */
-        cache->slabs_partial = header->next;
-        /* 4.2 headerをslabs_fullの先頭につなげる */
-        if (cache->slabs_full) {
-            header->next = cache->slabs_full;
+        list_drop(&header->list);
+        list_push_front(&cache->slabs_full, &header->list);
+    }
+
+    return header->object + (cache->object_size * index);
+}
+
+/**
+ * @ingroup slab_static
+ * @brief オブジェクトをスラブに返す.
+ *        cache->lockを保持して呼び出すこと。
+ *
+ * @param cache スラブキャッシュへのポインタ
+ * @param obj 解放するオブジェクト
+ */
+static void slab_object_put(struct slab_cache *cache, void *obj) {
+    uint32_t index, next_index, *free_list;
+    struct page *page = page_find_head(page_find_by_address(obj));
+    struct slab_header *header = (void*)page_address(page);
+
+    /* 1. free_listを求める */
+    free_list = (void *)(header + 1);
+    /* 2. オブジェクトのインデックスを求める */
+    index = ((uint8_t *)obj - header->object) / cache->object_size;
+    /* 3. 次のフリーオブジェクトのインデックスを求める */
+    next_index = (uint32_t)(header->free - free_list);
+    trace("index: 0x%x, next_index: 0x%x", index, next_index);
+    /* 4. 解放するオブジェクトを次のフリーオブジェクトとする */
+    free_list[index] = next_index;
+    header->free = &free_list[index];
+    if (header->inuse == 0)
+        panic("broken slab");
+
+    /* 5. slabs_full -> slabs_partial */
+    if (header->inuse-- == cache->max_objects) {
+        list_drop(&header->list);
+        list_push_front(&cache->slabs_partial, &header->list);
+    }
+    /* 6. 空になったスラブはslabs_emptyに移す. 保持数を超えたらbuddyに返す */
+    if (header->inuse == 0) {
+        list_drop(&header->list);
+        if (cache->nr_empty >= SLAB_EMPTY_KEEP && !cache->typesafe) {
+            buddy_free(page);
         } else {
-            header->next = NULL;
+            list_push_front(&cache->slabs_empty, &header->list);
+            cache->nr_empty++;
         }
-        cache->slabs_full = header;
     }
+}
 
-    /* 6. lockを開放する */
+/**
+ * @ingroup slab_static
+ * @brief シュリンカーに頼まれていればマガジンのオブジェクトをすべてスラブに戻す.
+ *        マガジンは各CPUだけが操作するので、他のCPUのシュリンカーは
+ *        drainを設定し、そのCPUが次にマガジンを使う際にここで戻す。
+ *        割り込みを禁止して呼び出すこと。
+ *
+ * @param cache スラブキャッシュへのポインタ
+ * @param mag このCPUのマガジン
+ */
+static void slab_magazine_drain(struct slab_cache *cache, struct slab_magazine *mag) {
+    if (!__atomic_load_n(&mag->drain, __ATOMIC_ACQUIRE))
+        return;
+    acquire(&cache->lock);
+    while (mag->count > 0)
+        slab_object_put(cache, mag->objs[--mag->count]);
+    __atomic_store_n(&mag->drain, 0, __ATOMIC_RELEASE);
     release(&cache->lock);
+}
 
-    /* 7. 割り当てたオブジェクトを返す */
-    void *addr = header->object + (cache->object_size * index);
-    trace("addr: %p = %p + (0x%x * 0x%x)", addr, header->object, cache->object_size, index);
-#if 0
-    if (index < 2) {
-        debug_bytes("free_list:", (char *)free_list, 128);
+/**
+ * @ingroup slab
+ * @brief スラブキャッシュからオブジェクトを割り当てる.
+ *
+ * @param cache オブジェクトを割り当てるスラブキャッシュへのポインタ
+ * @return 割り当てられたオブジェクトへのポインタ
+ */
+void *slab_cache_alloc(struct slab_cache *cache) {
+    struct slab_magazine *mag;
+    void *obj;
+
+    /* 1. マガジンを使わないキャッシュはスラブから直接割り当てる */
+    if (!cache->use_magazine) {
+        acquire(&cache->lock);
+        obj = slab_object_get(cache);
+        release(&cache->lock);
+        return obj;
+    }
+
+    /* 2. 割り込みを禁止してこのCPUのマガジンを使う */
+    push_off();
+    mag = &cache->mags[cpuid()];
+    slab_magazine_drain(cache, mag);
+    /* 3. マガジンが空の場合はスラブからまとめて補充する.
+     *    slab_object_get()中のbuddy_alloc()がシュリンカーを呼んで
+     *    このマガジンを空にすることがあるので、いったん手元の配列に
+     *    集め、すべて取り終えてからマガジンに入れる */
+    if (mag->count == 0) {
+        void *objs[SLAB_MAG_BATCH];
+        int i;
+
+        acquire(&cache->lock);
+        for (i = 0; i < SLAB_MAG_BATCH; i++)
+            objs[i] = slab_object_get(cache);
+        release(&cache->lock);
+        for (i = 1; i < SLAB_MAG_BATCH; i++)
+            mag->objs[mag->count++] = objs[i];
+        obj = objs[0];
+    } else {
+        obj = mag->objs[--mag->count];
     }
-    printf("\n");
-#endif
-    return addr;
-    //return header->object + (cache->object_size * index);
+    pop_off();
+
+    trace("obj: %p", obj);
+    return obj;
 }
 
 /**
@@ -385,51 +610,69 @@ void *slab_cache_alloc(struct slab_cache *cache) {
  * @param obj 解放するオブジェクト
  */
 void slab_cache_free(struct slab_cache *cache, void *obj) {
-    uint32_t index, next_index, *free_list;
+    struct slab_magazine *mag;
     trace("free obj: %p", obj);
 
-    struct page *page = page_find_head(page_find_by_address(obj));
-    struct slab_header *header = (void*)page_address(page), *h, **hp;
+    /* 1. マガジンを使わないキャッシュはスラブに直接返す */
+    if (!cache->use_magazine) {
+        acquire(&cache->lock);
+        slab_object_put(cache, obj);
+        release(&cache->lock);
+        return;
+    }
 
-    /* 1. lockを取得する */
-    acquire(&cache->lock);
+    /* 2. 割り込みを禁止してこのCPUのマガジンに返す */
+    push_off();
+    mag = &cache->mags[cpuid()];
+    slab_magazine_drain(cache, mag);
+    /* 3. マガジンが満杯の場合は半分をスラブに返す */
+    if (mag->count == SLAB_MAG_SIZE) {
+        acquire(&cache->lock);
+        while (mag->count > SLAB_MAG_SIZE - SLAB_MAG_BATCH)
+            slab_object_put(cache, mag->objs[--mag->count]);
+        release(&cache->lock);
+    }
+    mag->objs[mag->count++] = obj;
+    pop_off();
+}
 
-    /* 2. free_listを求める */
-    free_list = (void *)(header + 1);
-    /* 3. オブジェクトのインデックスを求める */
-    index = ((uint8_t *)obj - header->object) / cache->object_size;
-    /* 4. 次のフリーオブジェクトのインデックスを求める */
-    next_index = (uint32_t)(header->free - free_list);
-    trace("index: 0x%x, next_index: 0x%x", index, next_index);
-    /* 5. 解放するオブジェクトを次のフリーオブジェクトとする */
-    free_list[index] = next_index;
-    header->free = &free_list[index];
-    trace("header->free: %p", header->free);
-    /* 6. 次のオブジェクトが終了マークだった場合は */
-    /*    slabs_fullからslabs_partialに付け替える  */
-    if (free_list[next_index] == SLAB_FREE_END) {
-        trace("next_index is FREE_END");
-        hp = &cache->slabs_full;
-        h = cache->slabs_full;
-        while (h) {
-            if (h == header) {
-                *hp = h->next;
-
-                h->next = cache->slabs_partial;
-                cache->slabs_partial = h;
-                /* lockを開放する */
-                release(&slab_lock);
-                /* 処理終了 */
-                return;
-            }
+/**
+ * @ingroup slab
+ * @brief シュリンカー: 空きスラブをbuddyに返す.
+ *        buddy_alloc()で空きブロックがなくなった際に呼び出される。
+ *        実行中のCPUのマガジンはスラブに戻してから回収する。
+ *        他のCPUのマガジンには戻すように印を付け、そのCPUが次に
+ *        マガジンを使う際に戻させる（空になったスラブはその時にbuddyに返る）。
+ *
+ * @return 解放したスラブ数
+ */
+int slab_cache_reclaim(void) {
+    struct slab_cache *cache;
+    struct slab_magazine *mag;
+    int i, n = 0;
 
-            hp = &h->next;
-            h = h->next;
+    push_off();
+    acquire(&slab_lock);
+    list_foreach(cache, &slab_caches, list) {
+        acquire(&cache->lock);
+        if (cache->use_magazine) {
+            for (i = 0; i < NCPU; i++) {
+                if (i != cpuid())
+                    __atomic_store_n(&cache->mags[i].drain, 1, __ATOMIC_RELEASE);
+            }
+            mag = &cache->mags[cpuid()];
+            while (mag->count > 0)
+                slab_object_put(cache, mag->objs[--mag->count]);
         }
-        /* 何かがおかしいのでpanic */
-        panic("broken slab");
+        if (!cache->typesafe) {
+            n += slab_list_release(&cache->slabs_empty);
+            cache->nr_empty = 0;
+        }
+        release(&cache->lock);
     }
+    release(&slab_lock);
+    pop_off();
 
-    /* 7. lockを開放する */
-    release(&cache->lock);
+    debug("reclaimed %d slabs", n);
+    return n;
 }
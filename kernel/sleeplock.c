@@ -13,6 +13,7 @@ void
 initsleeplock(struct sleeplock *lk, char *name)
 {
     initlock(&lk->lk, "sleep lock");
+    wq_init(&lk->wait, "sleep lock wait");
     lk->name = name;
     lk->locked = 0;
     lk->pid = 0;
@@ -23,7 +24,7 @@ acquiresleep(struct sleeplock *lk)
 {
     acquire(&lk->lk);
     while (lk->locked) {
-        sleep(lk, &lk->lk);
+        wq_sleep_exclusive(&lk->wait, &lk->lk);
     }
     lk->locked = 1;
     lk->pid = myproc()->pid;
@@ -36,7 +37,7 @@ releasesleep(struct sleeplock *lk)
     acquire(&lk->lk);
     lk->locked = 0;
     lk->pid = 0;
-    wakeup(lk);
+    wq_wakeup(&lk->wait);
     release(&lk->lk);
 }
 
@@ -0,0 +1,306 @@
+// 共有オブジェクト（ld-musl等）のページキャッシュ.
+// 動的リンクされたプログラムはexecのたびに同じローダ/ライブラリを
+// mmapするので、ファイルページを一度だけ読み込んでプロセス間で共有する.
+// 読み込み専用のマッピングはキャッシュページをそのまま、書き込み可能な
+// MAP_PRIVATEマッピングはPTE_COWでマッピングし、書き込み時に
+// alloc_cow_page()で複製させる.
+// 各キャッシュページはキャッシュ自身が参照を1つ持ち、マッピングごとに
+// page_refcnt_inc()する.
+// エントリが一杯の場合は最も長く使われていないエントリを追い出す.
+// ファイルが削除されたらエントリを外し、メモリ不足時にはどのプロセスも
+// マッピングしていないキャッシュページを解放する.
+
+#include <common/types.h>
+#include <common/riscv.h>
+#include <common/param.h>
+#include <common/file.h>
+#include <defs.h>
+#include <errno.h>
+#include <printf.h>
+#include <proc.h>
+#include <spinlock.h>
+
+#define SOCACHE_NENT        8
+#define SOCACHE_MAXPAGES    (PGSIZE / sizeof(uint64_t))     // 1エントリ2MBまで
+
+struct socache_entry {
+    struct inode *ip;           // NULLなら空きエントリ
+    uint32_t size;              // キャッシュ作成時のファイルサイズ
+    struct timespec mtime;      // キャッシュ作成時の更新日時
+    uint64_t *pages;            // ファイルページ番号 -> 物理アドレス
+    uint64_t used;              // 最後に使われた時のsocache.clock
+};
+
+static struct {
+    struct spinlock lock;
+    struct socache_entry ent[SOCACHE_NENT];
+    uint64_t clock;             // 登録とマッピングのたびに進める
+} socache;
+
+void socache_init(void)
+{
+    initlock(&socache.lock, "socache");
+}
+
+// キャッシュページをすべて手放す. socache.lockを保持して呼び出すこと.
+// マッピング中のページは各プロセスの参照が残るので解放されない.
+static void socache_drop_pages(struct socache_entry *e)
+{
+    for (int i = 0; i < SOCACHE_MAXPAGES; i++) {
+        if (e->pages[i]) {
+            kfree((void *)e->pages[i]);
+            e->pages[i] = 0;
+        }
+    }
+}
+
+// ipのエントリを返す. ファイルが更新されていたらキャッシュを捨てる.
+// socache.lockを保持して呼び出すこと.
+static struct socache_entry *socache_lookup(struct inode *ip)
+{
+    struct socache_entry *e;
+
+    for (e = socache.ent; e < &socache.ent[SOCACHE_NENT]; e++) {
+        if (e->ip != ip)
+            continue;
+        if (e->size != ip->size || e->mtime.tv_sec != ip->mtime.tv_sec
+         || e->mtime.tv_nsec != ip->mtime.tv_nsec) {
+            debug("inum %d is modified", ip->inum);
+            socache_drop_pages(e);
+            e->size = ip->size;
+            e->mtime = ip->mtime;
+        }
+        e->used = ++socache.clock;
+        return e;
+    }
+    return NULL;
+}
+
+// エントリeを外して、そのinodeを返す. eのページ表は*pagesに返す.
+// socache.lockを保持して呼び出すこと.
+static struct inode *socache_detach(struct socache_entry *e, uint64_t **pages)
+{
+    struct inode *ip = e->ip;
+
+    socache_drop_pages(e);
+    *pages = e->pages;
+    e->ip = NULL;
+    e->pages = NULL;
+    return ip;
+}
+
+// socache_detach()で外したエントリのinodeとページ表を解放する.
+// トランザクションの外で呼び出すこと.
+static void socache_release(struct inode *ip, uint64_t *pages)
+{
+    if (ip == NULL)
+        return;
+    debug("release inum %d", ip->inum);
+    kfree(pages);
+    begin_op();
+    iput(ip);
+    end_op();
+}
+
+// ipをキャッシュ対象に登録する. 空きがない場合は最も長く使われていない
+// エントリを追い出す. トランザクションの外で呼び出すこと.
+void socache_register(struct inode *ip)
+{
+    struct socache_entry *e, *victim = NULL;
+    struct inode *old = NULL;
+    uint64_t *pages, *oldpages = NULL;
+
+    acquire(&socache.lock);
+    for (e = socache.ent; e < &socache.ent[SOCACHE_NENT]; e++) {
+        if (e->ip == ip) {
+            e->used = ++socache.clock;
+            release(&socache.lock);
+            return;
+        }
+    }
+    release(&socache.lock);
+
+    if ((pages = kalloc_zeroed()) == NULL)
+        return;
+
+    acquire(&socache.lock);
+    for (e = socache.ent; e < &socache.ent[SOCACHE_NENT]; e++) {
+        // ロックを外している間に他のプロセスが登録した場合
+        if (e->ip == ip) {
+            release(&socache.lock);
+            kfree(pages);
+            return;
+        }
+        if (victim == NULL || (victim->ip != NULL
+         && (e->ip == NULL || e->used < victim->used)))
+            victim = e;
+    }
+    if (victim->ip != NULL)
+        old = socache_detach(victim, &oldpages);
+    victim->ip = idup(ip);
+    victim->size = ip->size;
+    victim->mtime = ip->mtime;
+    victim->pages = pages;
+    victim->used = ++socache.clock;
+    release(&socache.lock);
+    debug("register inum %d, size 0x%x", ip->inum, ip->size);
+    socache_release(old, oldpages);
+}
+
+// ipが削除された（nlinkが0になった）のでエントリを外す.
+// ipのinodeを解放できるようにキャッシュの参照を手放す.
+// トランザクション内で、ipの参照を持って呼び出すこと.
+void socache_forget(struct inode *ip)
+{
+    struct socache_entry *e;
+    struct inode *old = NULL;
+    uint64_t *pages = NULL;
+
+    acquire(&socache.lock);
+    for (e = socache.ent; e < &socache.ent[SOCACHE_NENT]; e++) {
+        if (e->ip == ip) {
+            old = socache_detach(e, &pages);
+            break;
+        }
+    }
+    release(&socache.lock);
+    if (old == NULL)
+        return;
+    debug("forget inum %d", ip->inum);
+    kfree(pages);
+    // 呼び出し側が参照を持っているので最後の参照にはならない
+    iput(old);
+}
+
+// メモリ不足時にbuddy_alloc()から呼び出される. どのプロセスも
+// マッピングしていないキャッシュページを解放して、そのページ数を返す.
+// エントリは登録したままにする.
+int socache_reclaim(void)
+{
+    struct socache_entry *e;
+    int n = 0;
+
+    acquire(&socache.lock);
+    for (e = socache.ent; e < &socache.ent[SOCACHE_NENT]; e++) {
+        if (e->ip == NULL)
+            continue;
+        for (int i = 0; i < SOCACHE_MAXPAGES; i++) {
+            if (e->pages[i] && page_refcnt_get((void *)e->pages[i]) == 1) {
+                kfree((void *)e->pages[i]);
+                e->pages[i] = 0;
+                n++;
+            }
+        }
+    }
+    release(&socache.lock);
+    if (n > 0)
+        debug("reclaimed %d pages", n);
+    return n;
+}
+
+// ファイルページidxの物理アドレスを参照を1つ増やして返す.
+// キャッシュにない場合は読み込む. 失敗したら0を返す.
+static uint64_t socache_get_page(struct inode *ip, uint64_t idx)
+{
+    struct socache_entry *e;
+    uint64_t pa;
+    uint32_t off = idx * PGSIZE, len;
+    char *mem;
+
+    acquire(&socache.lock);
+    if ((e = socache_lookup(ip)) != NULL && (pa = e->pages[idx]) != 0) {
+        page_refcnt_inc((void *)pa);
+        release(&socache.lock);
+        return pa;
+    }
+    release(&socache.lock);
+
+    // 読み込みはsleepするのでロックを外して行う.
+    // EOFを超える部分はmap_file_pages()と同じくゼロのまま
+    if ((mem = kalloc_zeroed()) == NULL)
+        return 0;
+    ilock(ip);
+    len = ip->size - off > PGSIZE ? PGSIZE : ip->size - off;
+    if (off >= ip->size || readi(ip, 0, (uint64_t)mem, off, len) != len) {
+        iunlock(ip);
+        kfree(mem);
+        return 0;
+    }
+    iunlock(ip);
+
+    acquire(&socache.lock);
+    if ((e = socache_lookup(ip)) == NULL) {
+        // 登録が外された: キャッシュせずに私有ページとして使う
+        release(&socache.lock);
+        return (uint64_t)mem;
+    }
+    if ((pa = e->pages[idx]) != 0) {
+        // 他のプロセスが先に読み込んだ
+        page_refcnt_inc((void *)pa);
+        release(&socache.lock);
+        kfree(mem);
+        return pa;
+    }
+    e->pages[idx] = (uint64_t)mem;
+    page_refcnt_inc(mem);
+    release(&socache.lock);
+    return (uint64_t)mem;
+}
+
+// fのoffsetからlengthをキャッシュページでpagetableのvaにマッピングする.
+// 成功したら0, fがキャッシュ対象でなければ1, エラーの場合は-errnoを返す.
+long socache_map(pagetable_t pagetable, uint64_t va, uint64_t length, uint64_t perm, struct file *f, off_t offset)
+{
+    struct inode *ip = f->ip;
+    uint64_t cur, pa, cperm = perm;
+    long ret;
+    int found;
+
+    if (offset & (PGSIZE - 1))
+        return 1;
+    if ((offset + length + PGSIZE - 1) / PGSIZE > SOCACHE_MAXPAGES)
+        return 1;
+
+    acquire(&socache.lock);
+    found = socache_lookup(ip) != NULL;
+    release(&socache.lock);
+    if (!found)
+        return 1;
+
+    // 書き込み可能な私有マッピング（データ領域）はCOWで共有する
+    if (perm & PTE_W)
+        cperm = (perm & ~PTE_W) | PTE_COW;
+
+    for (cur = 0; cur < length; cur += PGSIZE) {
+        // EOFを超えるページはキャッシュせず、0で埋めた私有ページにする
+        if (offset + cur >= ip->size) {
+            if ((pa = (uint64_t)kalloc_zeroed()) == 0) {
+                ret = -ENOMEM;
+                goto err;
+            }
+            if ((ret = mappages(pagetable, va + cur, PGSIZE, pa, perm)) < 0) {
+                kfree((void *)pa);
+                goto err;
+            }
+            continue;
+        }
+        if ((pa = socache_get_page(ip, (offset + cur) / PGSIZE)) == 0) {
+            ret = -ENOMEM;
+            goto err;
+        }
+        if ((ret = mappages(pagetable, va + cur, PGSIZE, pa, cperm)) < 0) {
+            kfree((void *)pa);
+            goto err;
+        }
+    }
+
+    fence_i();
+    fence_rw();
+
+    return 0;
+
+err:
+    if (cur != 0)
+        uvmunmap(pagetable, va, cur / PGSIZE, 1);
+    return ret;
+}
@@ -57,13 +57,14 @@ start(unsigned long hartid, unsigned long fdt)
     timerinit();
 
     // cpuid()用に各CPUのhartidをそのtpレジスタに保持する。.
-    //int id = r_mhartid();
-    //w_tp(id);
+    int id = r_mhartid();
+    w_tp(id);
 
     // スーパーバイザモードに切り替えて、main()にジャンプする.
     asm volatile("mret");
 #endif
-    //w_tp(hartid);
+    // cpuid()用にこのhartのhartidをtpに保持する.
+    w_tp(hartid);
     main();
 }
 
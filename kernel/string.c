@@ -1,13 +1,39 @@
 #include <common/types.h>
 
+// memset/memcmp/memmove/memcpyは8バイト境界に揃えてからワード単位で
+// 処理する. ページのゼロクリアやコピー、copyin/copyoutの大半はここを通る.
+// ワードループはループ展開しているので、短い端数だけがバイト単位になる.
+
+#define WSIZE       sizeof(uint64_t)
+#define WMASK       (WSIZE - 1)
+#define ALIGNED(p)  (((uint64_t)(p) & WMASK) == 0)
+
 void*
 memset(void *dst, int c, uint32_t n)
 {
-  char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uchar *d = dst;
+  uint64_t *wd, w;
+
+  while(n > 0 && !ALIGNED(d)){
+    *d++ = c;
+    n--;
+  }
+  if(n >= WSIZE){
+    w = (uchar)c;
+    w |= w << 8;
+    w |= w << 16;
+    w |= w << 32;
+    wd = (uint64_t *)d;
+    for(; n >= 8 * WSIZE; n -= 8 * WSIZE, wd += 8){
+      wd[0] = w; wd[1] = w; wd[2] = w; wd[3] = w;
+      wd[4] = w; wd[5] = w; wd[6] = w; wd[7] = w;
+    }
+    for(; n >= WSIZE; n -= WSIZE)
+      *wd++ = w;
+    d = (uchar *)wd;
   }
+  while(n-- > 0)
+    *d++ = c;
   return dst;
 }
 
@@ -18,6 +44,18 @@ memcmp(const void *v1, const void *v2, uint32_t n)
 
   s1 = v1;
   s2 = v2;
+  // 同じ位置関係で揃っていれば一致しているワードを読み飛ばす
+  if(((uint64_t)s1 & WMASK) == ((uint64_t)s2 & WMASK)){
+    while(n > 0 && !ALIGNED(s1)){
+      if(*s1 != *s2)
+        return *s1 - *s2;
+      s1++, s2++, n--;
+    }
+    while(n >= WSIZE && *(const uint64_t *)s1 == *(const uint64_t *)s2){
+      s1 += WSIZE, s2 += WSIZE;
+      n -= WSIZE;
+    }
+  }
   while(n-- > 0){
     if(*s1 != *s2)
       return *s1 - *s2;
@@ -27,34 +65,106 @@ memcmp(const void *v1, const void *v2, uint32_t n)
   return 0;
 }
 
+// 前方コピー. dは8バイト境界にあること. sが境界にない場合は
+// 境界にあるワードを読んでシフトで組み合わせる（リトルエンディアン）.
+// 読み込むのはコピー元のバイトを含むワードだけなので範囲外には触れない.
+static uchar*
+copy_words_fwd(uint64_t *d, const uchar *s, uint32_t nw)
+{
+  const uint64_t *ws;
+  uint64_t lo, hi;
+  uint32_t sh;
+
+  if(ALIGNED(s)){
+    ws = (const uint64_t *)s;
+    for(; nw >= 8; nw -= 8, d += 8, ws += 8){
+      d[0] = ws[0]; d[1] = ws[1]; d[2] = ws[2]; d[3] = ws[3];
+      d[4] = ws[4]; d[5] = ws[5]; d[6] = ws[6]; d[7] = ws[7];
+    }
+    while(nw-- > 0)
+      *d++ = *ws++;
+    return (uchar *)d;
+  }
+
+  sh = ((uint64_t)s & WMASK) * 8;
+  ws = (const uint64_t *)((uint64_t)s & ~WMASK);
+  lo = *ws++;
+  while(nw-- > 0){
+    hi = *ws++;
+    *d++ = (lo >> sh) | (hi << (64 - sh));
+    lo = hi;
+  }
+  return (uchar *)d;
+}
+
+static void
+copy_fwd(uchar *d, const uchar *s, uint32_t n)
+{
+  uint32_t nw;
+
+  if(n >= 2 * WSIZE){
+    while(!ALIGNED(d)){
+      *d++ = *s++;
+      n--;
+    }
+    nw = n / WSIZE;
+    d = copy_words_fwd((uint64_t *)d, s, nw);
+    s += nw * WSIZE;
+    n -= nw * WSIZE;
+  }
+  while(n-- > 0)
+    *d++ = *s++;
+}
+
+// 後方コピー（重なりがありdがsより後ろにある場合）.
+// 位置関係が揃っていればワード単位で、それ以外はバイト単位でコピーする
+static void
+copy_bwd(uchar *d, const uchar *s, uint32_t n)
+{
+  uint64_t *wd;
+  const uint64_t *ws;
+
+  s += n;
+  d += n;
+  if(((uint64_t)s & WMASK) == ((uint64_t)d & WMASK)){
+    while(n > 0 && !ALIGNED(d)){
+      *--d = *--s;
+      n--;
+    }
+    wd = (uint64_t *)d;
+    ws = (const uint64_t *)s;
+    for(; n >= WSIZE; n -= WSIZE)
+      *--wd = *--ws;
+    d = (uchar *)wd;
+    s = (const uchar *)ws;
+  }
+  while(n-- > 0)
+    *--d = *--s;
+}
+
 void*
 memmove(void *dst, const void *src, uint32_t n)
 {
-  const char *s;
-  char *d;
+  const uchar *s = src;
+  uchar *d = dst;
 
-  if(n == 0)
+  if(n == 0 || s == d)
     return dst;
 
-  s = src;
-  d = dst;
-  if(s < d && s + n > d){
-    s += n;
-    d += n;
-    while(n-- > 0)
-      *--d = *--s;
-  } else
-    while(n-- > 0)
-      *d++ = *s++;
+  if(s < d && s + n > d)
+    copy_bwd(d, s, n);
+  else
+    copy_fwd(d, s, n);
 
   return dst;
 }
 
-// memcpy exists to placate GCC.  Use memmove.
+// 領域は重ならないので重なりのチェックをせずに前方コピーする
 void*
 memcpy(void *dst, const void *src, uint32_t n)
 {
-  return memmove(dst, src, n);
+  copy_fwd(dst, src, n);
+  return dst;
 }
 
 int
@@ -18,7 +18,7 @@ static int in_user(uint64_t addr, size_t n)
     struct proc *p = myproc();
 
     // 1. addr + n が code+data 内にある
-    if (addr + n <= p->sz)
+    if (addr + n <= p->mm->sz)
         return 1;
 
     // 2. addr + n が mmap_region内にある
@@ -36,10 +36,10 @@ static int in_user(uint64_t addr, size_t n)
 int fetchaddr(uint64_t addr, uint64_t *ip)
 {
     struct proc *p = myproc();
-    if ((addr >= p->sz || addr + sizeof(uint64_t) > p->sz)          // コード領域外
+    if ((addr >= p->mm->sz || addr + sizeof(uint64_t) > p->mm->sz)          // コード領域外
     && (is_mmap_region(p, (void *)addr, sizeof(uint64_t)) == 0      // mmap領域外
     && (addr < STACKBASE || addr >= STACKTOP))) {                   // スタック領域外
-        debug("addr; 0x%lx, p->sz: 0x%lx", addr, p->sz);
+        debug("addr; 0x%lx, p->mm->sz: 0x%lx", addr, p->mm->sz);
         return -1;
     }
 
@@ -167,6 +167,8 @@ extern long sys_pipe2(void);
 extern long sys_read(void);
 extern long sys_readv(void);
 extern long sys_kill(void);
+extern long sys_tkill(void);
+extern long sys_tgkill(void);
 extern long sys_execve(void);
 extern long sys_fstat(void);
 extern long sys_utimensat(void);
@@ -197,6 +199,8 @@ extern long sys_getdents64(void);
 extern long sys_lseek(void);
 extern long sys_brk(void);
 extern long sys_nanosleep(void);
+extern long sys_getitimer(void);
+extern long sys_setitimer(void);
 extern long sys_uptime(void);
 extern long sys_openat(void);
 extern long sys_ppoll(void);
@@ -216,6 +220,7 @@ extern long sys_munmap(void);
 //extern long sys_mremap(void);
 extern long sys_mprotect(void);
 extern long sys_msync(void);
+extern long sys_madvise(void);
 extern long sys_fadvise64(void);
 extern long sys_rt_sigsuspend(void);
 extern long sys_rt_sigaction(void);
@@ -226,10 +231,15 @@ extern long sys_sysinfo(void);
 extern long sys_set_tid_address(void);
 extern long sys_setpgid(void);
 extern long sys_getpgid(void);
+extern long sys_times(void);
+extern long sys_getrusage(void);
 extern long sys_prlimit64(void);
 extern long sys_renameat2(void);
 extern mode_t sys_umask(void);
 extern long sys_sched_getaffinity(void);
+extern long sys_sched_yield(void);
+extern long sys_setpriority(void);
+extern long sys_getpriority(void);
 extern long sys_faccessat2(void);
 
 long sys_clock_gettime()
@@ -260,24 +270,17 @@ long sys_clock_settime()
 
 
 long sys_futex(void) {
-    uint64_t uaddr, uaddr2;
+    uint64_t uaddr, utime, uaddr2;
     int op, val, val3;
-    struct timespec timeout;
-    static int count = 0;
 
+    // utimeはopによってtimespecのアドレスか整数（val2）
     if (argu64(0, &uaddr) < 0 || argint(1, &op) < 0
-     || argint(2, &val) < 0 || argptr(3, (char *)&timeout, sizeof(struct timespec)) < 0
+     || argint(2, &val) < 0 || argu64(3, &utime) < 0
      || argu64(4, &uaddr2) < 0 || argint(5, &val3) < 0) {
         return -EINVAL;
     }
 
-    if (++count < 5) {
-        trace("uaddr: 0x%lx, op: %d, val: %d, timeout: %p, uaddr2: 0x%lx, val3: %d", uaddr, op, val, &timeout, uaddr2, val3);
-    }
-    if (op & 128)
-        return -ENOSYS;
-    else
-        return 0;
+    return futex(uaddr, op, (uint32_t)val, utime, uaddr2, (uint32_t)val3);
 }
 
 long sys_uname(void) {
@@ -375,15 +378,22 @@ static func syscalls[] = {
     [SYS_set_tid_address] = sys_set_tid_address,    //  96
     [SYS_futex]     = sys_futex,                //  98
     [SYS_nanosleep] = sys_nanosleep,            // 101
+    [SYS_getitimer] = sys_getitimer,            // 102
+    [SYS_setitimer] = sys_setitimer,            // 103
     [SYS_clock_settime] = sys_clock_settime,    // 112
     [SYS_clock_gettime] = sys_clock_gettime,    // 113
     [SYS_sched_getaffinity] = sys_sched_getaffinity, // 123
+    [SYS_sched_yield] = sys_sched_yield,        // 124
     [SYS_kill]      = sys_kill,                 // 129
+    [SYS_tkill]     = sys_tkill,                // 130
+    [SYS_tgkill]    = sys_tgkill,               // 131
     [SYS_rt_sigsuspend] = sys_rt_sigsuspend,    // 133
     [SYS_rt_sigaction] = sys_rt_sigaction,      // 134
     [SYS_rt_sigprocmask] = sys_rt_sigprocmask,  // 135
     [SYS_rt_sigpending] = sys_rt_sigpending,    // 136
     [SYS_rt_sigreturn] = sys_rt_sigreturn,      // 139
+    [SYS_setpriority] = sys_setpriority,        // 140
+    [SYS_getpriority] = sys_getpriority,        // 141
     [SYS_setgid]    = sys_setgid,               // 144
     [SYS_setreuid]  = sys_setreuid,             // 145
     [SYS_setuid]    = sys_setuid,               // 146
@@ -393,9 +403,11 @@ static func syscalls[] = {
     [SYS_getresgid] = sys_getresgid,            // 150
     [SYS_setfsuid]  = sys_setfsuid,             // 151
     [SYS_setfsgid]  = sys_setfsgid,             // 152
+    [SYS_times]     = sys_times,                // 153
     [SYS_setpgid]   = sys_setpgid,              // 154
     [SYS_getpgid]   = sys_getpgid,              // 155
     [SYS_uname]     = sys_uname,                // 160
+    [SYS_getrusage] = sys_getrusage,            // 165
     [SYS_umask]     = (func)sys_umask,          // 166
     [SYS_getpid]    = sys_getpid,               // 172
     [SYS_getppid]   = sys_getppid,              // 173
@@ -416,6 +428,7 @@ static func syscalls[] = {
     [SYS_fadvise64] = sys_fadvise64,            // 223
     [SYS_mprotect]  = sys_mprotect,             // 226
     [SYS_msync]     = sys_msync,                // 227
+    [SYS_madvise]   = sys_madvise,              // 233
     [SYS_wait4]     = sys_wait4,                // 260
     [SYS_prlimit64] = sys_prlimit64,            // 261
     [SYS_renameat2] = sys_renameat2,            // 276
@@ -474,14 +487,17 @@ __attribute__((unused)) static char *syscall_names[] = {
     [SYS_clock_settime] = "sys_clock_settime",    // 112
     [SYS_clock_gettime] = "sys_clock_gettime",    // 113
     [SYS_sched_getaffinity] = "sys_sched_getaffinity", // 123
-    [SYS_sched_yield] = "sys_yield",              // 124
+    [SYS_sched_yield] = "sys_sched_yield",        // 124
     [SYS_kill] = "sys_kill",                      // 129
     [SYS_tkill] = "sys_tkill",                    // 130
+    [SYS_tgkill] = "sys_tgkill",                  // 131
     [SYS_rt_sigsuspend] = "sys_rt_sigsuspend",    // 133
     [SYS_rt_sigaction] = "sys_rt_sigaction",      // 134
     [SYS_rt_sigprocmask] = "sys_rt_sigprocmask",  // 135
     [SYS_rt_sigpending] = "sys_rt_sigpending",    // 136
     [SYS_rt_sigreturn] = "sys_rt_sigreturn",      // 139
+    [SYS_setpriority] = "sys_setpriority",        // 140
+    [SYS_getpriority] = "sys_getpriority",        // 141
     [SYS_setregid] = "sys_setregid",              // 143
     [SYS_setgid] = "sys_setgid",                  // 144
     [SYS_setreuid] = "sys_setreuid",              // 145
@@ -492,11 +508,13 @@ __attribute__((unused)) static char *syscall_names[] = {
     [SYS_getresgid] = "sys_getresgid",            // 150
     [SYS_setfsuid] = "sys_setfsuid",              // 151
     [SYS_setfsgid] = "sys_setfsgid",              // 152
+    [SYS_times] = "sys_times",                    // 153
     [SYS_setpgid] = "sys_setpgid",                // 154
     [SYS_getpgid] = "sys_getpgid",                // 155
     [SYS_getgroups] = "sys_getgroups",            // 158
     [SYS_setgroups] = "sys_setgroups",            // 159
     [SYS_uname] = "sys_uname",                    // 160
+    [SYS_getrusage] = "sys_getrusage",            // 165
     [SYS_umask] = "sys_umask",                    // 166
     [SYS_getpid] = "sys_getpid",                  // 172
     [SYS_getppid] = "sys_getppid",                // 173
@@ -579,11 +597,14 @@ __attribute__((unused)) static int syscall_params[] = {
     [SYS_sched_yield] = 0,                      // 124
     [SYS_kill] = 2,                             // 129
     [SYS_tkill] = 2,                            // 130
+    [SYS_tgkill] = 3,                           // 131
     [SYS_rt_sigsuspend] = 2,                    // 133
     [SYS_rt_sigaction] = 3,                     // 134
     [SYS_rt_sigprocmask] = 4,                   // 135
     [SYS_rt_sigpending] = 2,                    // 136
     [SYS_rt_sigreturn] = 0,                     // 139
+    [SYS_setpriority] = 3,                      // 140
+    [SYS_getpriority] = 2,                      // 141
     [SYS_setregid] = 2,                         // 143
     [SYS_setgid] = 1,                           // 144
     [SYS_setreuid] = 2,                         // 145
@@ -594,11 +615,13 @@ __attribute__((unused)) static int syscall_params[] = {
     [SYS_getresgid] = 3,                        // 150
     [SYS_setfsuid] = 1,                         // 151
     [SYS_setfsgid] = 1,                         // 152
+    [SYS_times] = 1,                            // 153
     [SYS_setpgid] = 2,                          // 154
     [SYS_getpgid] = 1,                          // 155
     [SYS_getgroups] = 2,                        // 158
     [SYS_setgroups] = 2,                        // 159
     [SYS_uname] = 1,                            // 160
+    [SYS_getrusage] = 2,                        // 165
     [SYS_umask] = 1,                            // 166
     [SYS_getpid] = 0,                           // 172
     [SYS_getppid] = 0,                          // 173
@@ -619,7 +642,7 @@ __attribute__((unused)) static int syscall_params[] = {
     [SYS_msync] = 3,                            // 227
     [SYS_madvise] = 3,                          // 233
     [SYS_wait4] = 4,                            // 260
-    [SYS_prlimit64] = 2,                        // 261
+    [SYS_prlimit64] = 4,                        // 261
     [SYS_renameat2] = 5,                        // 276
     [SYS_getrandom] = 3,                        // 278
     [SYS_faccessat2] = 4,                       // 439
@@ -677,6 +700,7 @@ void syscall(void)
         }
 #endif
         ret = syscalls[num]();
+        fdput(p);
 
 #if 0
         if (num != SYS_writev && num != SYS_read) {
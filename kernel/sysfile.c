@@ -30,7 +30,7 @@ static int argfd(int n, int *pfd, struct file **pf)
 
     if (argint(n, &fd) < 0)
         return -1;
-    if (fd < 0 || fd >= NOFILE || (f = myproc()->ofile[fd]) == 0)
+    if ((f = fdget(fd)) == 0)
         return -1;
     if (pfd)
         *pfd = fd;
@@ -42,40 +42,30 @@ static int argfd(int n, int *pfd, struct file **pf)
 // AT_FDCWDをチェックする
 static int check_fdcwd(const char *path, int dirfd)
 {
+   struct file *f;
+
    if (*path != '/' && dirfd != AT_FDCWD) {
-        if (myproc()->ofile[dirfd] == 0)
+        if ((f = fdget(dirfd)) == 0)
             return -EBADF;
-        if (myproc()->ofile[dirfd]->type != T_DIR)
+        if (f->type != T_DIR)
             return -ENOTDIR;
     }
 
     return 0;
 }
 
-// 指定されたファイル用のファイルディスクリプタを割り当てる.
-// 成功時は呼び出し元からファイル参照を引き継ぐ.
-int fdalloc(struct file *f, int from)
-{
-    int fd;
-    struct proc *p = myproc();
-
-    for (fd = from; fd < NOFILE; fd++){
-        if (p->ofile[fd] == 0) {
-            p->ofile[fd] = f;
-            return fd;
-        }
-    }
-    return -EBADF;
-}
-
-
 static long dupfd(int fd, int from)
 {
-    struct file *f = myproc()->ofile[fd];
-    if (!f) return -EBADF;
+    struct file *f;
+    long newfd;
+
+    if ((f = fdget(fd)) == 0)
+        return -EBADF;
 
     filedup(f);
-    return fdalloc(f, from);
+    if ((newfd = fdalloc(f, from, 0)) < 0)
+        fileclose(f);
+    return newfd;
 }
 
 
@@ -93,7 +83,7 @@ long sys_dup(void)
 
     if (argfd(0, 0, &f) < 0)
         return -EINVAL;
-    if ((fd = fdalloc(f, 0)) < 0)
+    if ((fd = fdalloc(f, 0, 0)) < 0)
         return -EBADF;
     filedup(f);
     debug("fd: %d, f.inum: %d, f.type: %d, f.major: %d", fd, f->ip->inum, f->type, f->major);
@@ -103,9 +93,7 @@ long sys_dup(void)
 
 long sys_dup3()
 {
-    struct file *f;
     int fd1, fd2, flags;
-    struct proc *p = myproc();
 
      if (argint(0, &fd1) < 0 || argint(1, &fd2) < 0 || argint(2, &flags) < 0)
         return -EINVAL;
@@ -114,17 +102,8 @@ long sys_dup3()
 
     if (flags & ~O_CLOEXEC) return -EINVAL;
     if (fd1 == fd2) return -EINVAL;
-    if (fd1 < 0 || fd1 >= NOFILE) return -EBADF;
-    if (fd2 < 0 || fd2 >= NOFILE) return -EBADF;
 
-    f = p->ofile[fd1];
-    if (p->ofile[fd2])
-        fileclose(p->ofile[fd2]);
-    filedup(f);
-    if (flags & O_CLOEXEC)
-        bit_add(p->fdflag, fd2);
-    p->ofile[fd2] = f;
-    return fd2;
+    return fddup3(fd1, fd2, flags & O_CLOEXEC);
 }
 
 
@@ -272,13 +251,14 @@ long sys_close(void)
     int fd;
     struct file *f;
 
-    if (argfd(0, &fd, &f) < 0)
+    if (argint(0, &fd) < 0)
         return -EBADF;
 
     trace("pid[%d] fd: %d", myproc()->pid, fd);
 
-    myproc()->ofile[fd] = 0;
-    bit_remove(myproc()->fdflag, fd);
+    // 他のスレッドが先に閉じた場合も0が返る
+    if ((f = fdremove(fd)) == 0)
+        return -EBADF;
     fileclose(f);
     return 0;
 }
@@ -759,7 +739,7 @@ long sys_pipe2(void)
 {
     uint64_t fdarray;       // fd[2]
     struct file *rf, *wf;
-    int fd0, fd1, flags;
+    int fd0, fd1, flags, cloexec;
     struct proc *p = myproc();
 
     if (argint(1, &flags) < 0 || argu64(0, &fdarray) < 0
@@ -771,29 +751,27 @@ long sys_pipe2(void)
         return -EINVAL;
     }
 
-    fd0 = -1;
-    if ((fd0 = fdalloc(rf, 0)) < 0 || (fd1 = fdalloc(wf, 0)) < 0){
-        if (fd0 >= 0)
-            p->ofile[fd0] = 0;
+    cloexec = flags & O_CLOEXEC;
+    if ((fd0 = fdalloc(rf, 0, cloexec)) < 0) {
         fileclose(rf);
         fileclose(wf);
-        return -EMFILE;
+        return fd0;
+    }
+    if ((fd1 = fdalloc(wf, 0, cloexec)) < 0) {
+        fdremove(fd0);
+        fileclose(rf);
+        fileclose(wf);
+        return fd1;
     }
 
     if (copyout(p->pagetable, fdarray, (char*)&fd0, sizeof(fd0)) < 0 ||
         copyout(p->pagetable, fdarray + sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0) {
-        p->ofile[fd0] = 0;
-        p->ofile[fd1] = 0;
-        bit_remove(p->fdflag, fd0);
-        bit_remove(p->fdflag, fd1);
+        fdremove(fd0);
+        fdremove(fd1);
         fileclose(rf);
         fileclose(wf);
         return -EFAULT;
     }
-    if (flags & O_CLOEXEC) {
-        bit_add(p->fdflag, fd0);
-        bit_add(p->fdflag, fd1);
-    }
     return 0;
 }
 
@@ -821,7 +799,6 @@ long sys_ioctl(void)
 long sys_fcntl(void)
 {
     struct file *f;
-    struct proc *p = myproc();
     int fd, cmd, args;
 
     if (argfd(0, &fd, &f) < 0
@@ -835,14 +812,10 @@ long sys_fcntl(void)
             return dupfd(fd, args);
 
         case F_GETFD:
-            return bit_test(p->fdflag, fd) ? FD_CLOEXEC : 0;
+            return fdgetflags(fd);
 
         case F_SETFD:
-            if (args & FD_CLOEXEC)
-                bit_add(p->fdflag, fd);
-            else
-                bit_remove(p->fdflag, fd);
-            return 0;
+            return fdsetflags(fd, args);
 
         case F_GETFL:
             return (f->flags & (FILE_STATUS_FLAGS | O_ACCMODE));
@@ -15,6 +15,7 @@
 #include <linux/stat.h>
 #include <linux/capability.h>
 #include <linux/resources.h>
+#include <linux/sched.h>
 
 long sys_exit(void)
 {
@@ -34,22 +35,24 @@ long sys_exit_group(void)
     if (argint(0, &n) < 0)
         return -EINVAL;
     trace("pid[%d] n: %d", myproc()->pid, n);
-    exit(n);
+    exit_group(n);
 
     // not reached
     return 0;
 }
 
+// スレッドグループIDを返す
 long sys_getpid(void)
 {
-    pid_t pid = myproc()->pid;
+    pid_t pid = myproc()->tgid;
     trace("pid: %d", pid)
     return pid;
 }
 
+// スレッドの親はリーダーの親（reparentで変わる）
 long sys_getppid(void)
 {
-    return myproc()->parent->pid;
+    return myproc()->group_leader->parent->tgid;
 }
 
 long sys_gettid(void)
@@ -64,24 +67,42 @@ long sys_gettid(void)
 long sys_clone(void)
 {
     void *childstk;
-    uint64_t flag, tls;
-    int ptid, ctid;
+    uint64_t flag, tls, ptid, ctid;
 
     if (argu64(0, &flag) < 0 || argu64(1, (uint64_t *) &childstk) < 0
-     || argint(2, &ptid) < 0 || argu64(3, &tls) < 0
-     || argint(4, &ctid) < 0)
+     || argu64(2, &ptid) < 0 || argu64(3, &tls) < 0
+     || argu64(4, &ctid) < 0)
         return -EINVAL;
 
 
-    trace("flag: 0x%lx, cstk: %p, ptid: %d, tls: 0x%lx, ctid: 0x%lx", flag, childstk, ptid, tls, ctid);
-    // FIXME: vforkの実装
-    // flags = 0x4011の例あり(CLONE_VFORK | SIGCHLD)
-    // FIXME: SIGCHLD(=17)のdefine
-    if ((flag & 0xff) != SIGCHLD) {
+    trace("flag: 0x%lx, cstk: %p, ptid: 0x%lx, tls: 0x%lx, ctid: 0x%lx", flag, childstk, ptid, tls, ctid);
+    // vfork: 0x4011 (CLONE_VFORK | SIGCHLD)
+    // posix_spawn: 0x4111 (CLONE_VM | CLONE_VFORK | SIGCHLD)
+    // pthread_create: 0x7d0f00 (CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND
+    //   | CLONE_THREAD | CLONE_SYSVSEM | CLONE_SETTLS | CLONE_PARENT_SETTID
+    //   | CLONE_CHILD_CLEARTID | CLONE_DETACHED)
+    if ((flag & CSIGNAL) != SIGCHLD && (flag & CSIGNAL) != 0) {
         warn("flags other than SIGCHLD are not supported");
-        return -1;
+        return -EINVAL;
+    }
+    if (flag & ~(CSIGNAL | CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND
+               | CLONE_THREAD | CLONE_SYSVSEM | CLONE_SETTLS
+               | CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID
+               | CLONE_CHILD_SETTID | CLONE_DETACHED | CLONE_VFORK)) {
+        warn("unsupported flags: 0x%lx", flag);
+        return -EINVAL;
     }
-    return fork();
+    // スレッドはシグナルハンドラを、シグナルハンドラの共有はアドレス空間の
+    // 共有を必要とする
+    if ((flag & CLONE_THREAD) && !(flag & CLONE_SIGHAND))
+        return -EINVAL;
+    if ((flag & CLONE_SIGHAND) && !(flag & CLONE_VM))
+        return -EINVAL;
+    // 親を止めずにアドレス空間を共有するのはスレッドでしかできない
+    if ((flag & CLONE_VM) && !(flag & (CLONE_VFORK | CLONE_THREAD)))
+        return -EINVAL;
+
+    return clone(flag, (uint64_t)childstk, ptid, tls, ctid);
 }
 
 // pid_t wait4(pid_t wpid, int *status, int options, struct rusage *rusage);
@@ -93,9 +114,6 @@ long sys_wait4(void)
     if (argint(0, &wpid) < 0 || argu64(1, &status) < 0 ||argint(2, &options) < 0 || argu64(3, &ru) < 0)
         return -EINVAL;
 
-    if (ru != 0)
-        return -EINVAL;
-
     trace("wpid: %d, status: 0x%lx, options: 0x%x, ru: 0x%lx", wpid, status, options, ru);
     return wait4(wpid, status, options, ru);
 }
@@ -103,23 +121,19 @@ long sys_wait4(void)
 long sys_brk(void)
 {
     struct proc *p = myproc();
-    long newsz, oldsz = (long)p->sz;
+    long newsz, oldsz, ret;
 
     if (argu64(0, (uint64_t *)&newsz) < 0)
         return -EINVAL;
 
-    if (newsz < 0)
-        return oldsz;
-
+    // 同じアドレス空間の他のスレッドのbrkやページフォルトと直列化する
+    acquiresleep(&p->mm->mmap_lock);
+    ret = oldsz = (long)p->mm->sz;
     trace("name: %s, newsz: 0x%lx, oldsz: 0x%lx", p->name, newsz, oldsz);
-
-    if (newsz == 0)
-        return oldsz;
-
-    if (growproc((newsz - oldsz)) < 0)
-        return oldsz;
-    else
-        return p->sz;
+    if (newsz > 0 && growproc((newsz - oldsz)) == 0)
+        ret = p->mm->sz;
+    releasesleep(&p->mm->mmap_lock);
+    return ret;
 }
 
 size_t sys_mmap(void)
@@ -128,6 +142,7 @@ size_t sys_mmap(void)
     size_t len, off;
     int prot, flags, fd;
     struct file *f;
+    size_t ret;
 
     if (argu64(0, (uint64_t *) &addr) < 0 || argu64(1, &len) < 0
      || argint(2, &prot) < 0 || argint(3, &flags) < 0
@@ -140,8 +155,7 @@ size_t sys_mmap(void)
         if (fd != -1) return -EINVAL;
         f = NULL;
     } else {
-        if (fd < 0 || fd >= NOFILE) return -EBADF;
-        if ((f = myproc()->ofile[fd]) == 0) return -EBADF;
+        if ((f = fdget(fd)) == 0) return -EBADF;
     }
 
     if ((flags & (MAP_PRIVATE | MAP_SHARED)) == 0) {
@@ -172,21 +186,33 @@ size_t sys_mmap(void)
         error("file is not writable");
         return -EACCES;
     }
-
-    return mmap(addr, len, prot, flags, f, off);
+    // 書き戻しで実行中のプログラムを書き換えさせない
+    if (!(flags & MAP_ANONYMOUS) && (flags & MAP_SHARED)
+     && (prot & PROT_WRITE) && f->ip->nexec > 0)
+        return -ETXTBSY;
+
+    // 他のスレッドのページフォルトが領域リストを参照しないようにする
+    acquiresleep(&myproc()->mm->mmap_lock);
+    ret = mmap(addr, len, prot, flags, f, off);
+    releasesleep(&myproc()->mm->mmap_lock);
+    return ret;
 }
 
 long sys_munmap(void)
 {
     void *addr;
     size_t len;
+    long ret;
 
     if (argu64(0, (uint64_t *)&addr) < 0 || argu64(1, &len) < 0)
          return -EINVAL;
 
     trace("addr: 0x%llx, len: 0x%llx", addr, len);
 
-    return munmap(addr, len);
+    acquiresleep(&myproc()->mm->mmap_lock);
+    ret = munmap(addr, len);
+    releasesleep(&myproc()->mm->mmap_lock);
+    return ret;
 }
 
 // int mprotect(void *addr, size_t len, int prot);
@@ -195,6 +221,7 @@ long sys_mprotect(void)
     void *addr;
     size_t len;
     int prot;
+    long ret;
 
     if (argu64(0, (uint64_t *)&addr) < 0 || argu64(1, &len) < 0
      || argint(2, &prot) < 0)
@@ -208,7 +235,10 @@ long sys_mprotect(void)
 
     trace("addr: %p, len: 0x%lx, prot: 0x%x", addr, len, prot);
 
-    return mprotect(addr, len, prot);
+    acquiresleep(&myproc()->mm->mmap_lock);
+    ret = mprotect(addr, len, prot);
+    releasesleep(&myproc()->mm->mmap_lock);
+    return ret;
 }
 
 long sys_msync(void)
@@ -216,21 +246,41 @@ long sys_msync(void)
     void *addr;
     size_t length;
     int flags;
+    long ret;
 
     if (argu64(0, (uint64_t *)&addr) < 0 || argu64(1, &length) < 0
      || argint(2, &flags) < 0)
         return -EINVAL;
 
-    return msync(addr, length, flags);
+    acquiresleep(&myproc()->mm->mmap_lock);
+    ret = msync(addr, length, flags);
+    releasesleep(&myproc()->mm->mmap_lock);
+    return ret;
+}
+
+long sys_madvise(void)
+{
+    void *addr;
+    size_t length;
+    int advice;
+    long ret;
+
+    if (argu64(0, (uint64_t *)&addr) < 0 || argu64(1, &length) < 0
+     || argint(2, &advice) < 0)
+        return -EINVAL;
 
+    acquiresleep(&myproc()->mm->mmap_lock);
+    ret = madvise(addr, length, advice);
+    releasesleep(&myproc()->mm->mmap_lock);
+    return ret;
 }
 
 long sys_nanosleep(void)
 {
     struct timespec req;
     uint64_t rem;
-    uint64_t expire;
     struct timespec t = { 0, 0 };
+    long ret;
 
     if (argu64(1, &rem) < 0)
         return -EINVAL;
@@ -242,15 +292,50 @@ long sys_nanosleep(void)
     if (req.tv_nsec >= 1000000000L || req.tv_nsec < 0 || req.tv_sec < 0)
         return -EINVAL;
 
-    expire = req.tv_sec * 1000000 + (req.tv_nsec + 999) / 1000;
-    trace("sec: %d, nsec: %d, expire: %d", req.tv_sec, req.tv_nsec, expire);
-    delayus(expire);
+    trace("sec: %d, nsec: %d", req.tv_sec, req.tv_nsec);
+    ret = nanosleep(&req, &t);
 
-    if (rem) {
+    if (ret == -EINTR && rem) {
         if (copyout(myproc()->pagetable, rem, (char *)&t, sizeof(struct timespec)) < 0)
             return -EFAULT;
     }
 
+    return ret;
+}
+
+long sys_getitimer(void)
+{
+    int which;
+    uint64_t addr;
+    struct itimerval value;
+    long ret;
+
+    if (argint(0, &which) < 0 || argu64(1, &addr) < 0)
+        return -EINVAL;
+
+    if ((ret = getitimer(which, &value)) < 0)
+        return ret;
+    if (copyout(myproc()->pagetable, addr, (char *)&value, sizeof(value)) < 0)
+        return -EFAULT;
+    return 0;
+}
+
+long sys_setitimer(void)
+{
+    int which;
+    uint64_t vaddr, oaddr;
+    struct itimerval value, ovalue;
+    long ret;
+
+    if (argint(0, &which) < 0 || argu64(1, &vaddr) < 0 || argu64(2, &oaddr) < 0)
+        return -EINVAL;
+
+    if (copyin(myproc()->pagetable, (char *)&value, vaddr, sizeof(value)) < 0)
+        return -EFAULT;
+    if ((ret = setitimer(which, &value, oaddr ? &ovalue : NULL)) < 0)
+        return ret;
+    if (oaddr && copyout(myproc()->pagetable, oaddr, (char *)&ovalue, sizeof(ovalue)) < 0)
+        return -EFAULT;
     return 0;
 }
 
@@ -270,6 +355,36 @@ long sys_kill(void)
     return kill(pid, sig);
 }
 
+// int tkill(pid_t tid, int sig);
+long sys_tkill(void)
+{
+    pid_t tid;
+    int sig;
+
+    if (argint(0, &tid) < 0 || argint(1, &sig) < 0)
+        return -EINVAL;
+
+    if (tid <= 0 || sig < 0 || sig >= NSIG)
+        return -EINVAL;
+
+    return tkill(0, tid, sig);
+}
+
+// int tgkill(pid_t tgid, pid_t tid, int sig);
+long sys_tgkill(void)
+{
+    pid_t tgid, tid;
+    int sig;
+
+    if (argint(0, &tgid) < 0 || argint(1, &tid) < 0 || argint(2, &sig) < 0)
+        return -EINVAL;
+
+    if (tgid <= 0 || tid <= 0 || sig < 0 || sig >= NSIG)
+        return -EINVAL;
+
+    return tkill(tgid, tid, sig);
+}
+
 // return how many clock tick interrupts have occurred
 // since start.
 long sys_sysinfo(void)
@@ -278,8 +393,14 @@ long sys_sysinfo(void)
 }
 
 // pid_t set_tid_address(int *tidptr);
+// スレッド終了時に*tidptrに0を書いてfutexで起こす
 long sys_set_tid_address(void)
 {
+    uint64_t tidptr;
+
+    if (argu64(0, &tidptr) < 0)
+        return -EINVAL;
+    myproc()->clear_child_tid = tidptr;
     return myproc()->pid;
 }
 
@@ -378,16 +499,22 @@ long sys_ppoll(void) {
     nfds_t nfds;
     struct timespec timeout_ts;
     sigset_t sigmask;
+    uint64_t taddr, maddr;
 
-    //struct proc *p = myproc();
+    struct proc *p = myproc();
     trace("[0]: fds: 0x%lx, nfds: 0x%lx, timeout: 0x%lx, sigmask: 0x%lx", p->trapframe->a0, p->trapframe->a1, p->trapframe->a2, p->trapframe->a3);
 
-    if (argu64(1, &nfds) < 0
-     || argptr(2, (char *)&timeout_ts, sizeof(struct timespec)) < 0
-     || argptr(3, (char *)&sigmask, sizeof(sigset_t)) < 0) {
+    if (argu64(1, &nfds) < 0 || argu64(2, &taddr) < 0 || argu64(3, &maddr) < 0) {
         trace("invald either of nfds, timeout, sigmask");
         return -EINVAL;
-     }
+    }
+    // timeoutとsigmaskはNULLでもよい
+    if (taddr && copyin(p->pagetable, (char *)&timeout_ts, taddr, sizeof(struct timespec)) < 0)
+        return -EFAULT;
+    if (taddr && (timeout_ts.tv_sec < 0 || timeout_ts.tv_nsec < 0 || timeout_ts.tv_nsec >= 1000000000L))
+        return -EINVAL;
+    if (maddr && copyin(p->pagetable, (char *)&sigmask, maddr, sizeof(sigset_t)) < 0)
+        return -EFAULT;
 
 
     if (nfds > 0) {
@@ -408,7 +535,7 @@ long sys_ppoll(void) {
     }
 
     trace("fds: %p, nfds: %ld, timeout: 0x%lx, sigmask: 0x%lx", fds, nfds, &timeout_ts, sigmask);
-    return ppoll(fds, nfds, &timeout_ts, &sigmask);
+    return ppoll(fds, nfds, taddr ? &timeout_ts : NULL, maddr ? &sigmask : NULL);
 }
 
 static inline void
@@ -438,6 +565,29 @@ long sys_getpgid(void) {
     return getpgid(pid);
 }
 
+// clock_t times(struct tms *buf);
+long sys_times(void)
+{
+    uint64_t buf;
+
+    if (argu64(0, &buf) < 0)
+        return -EINVAL;
+
+    return times(buf);
+}
+
+// int getrusage(int who, struct rusage *usage);
+long sys_getrusage(void)
+{
+    int who;
+    uint64_t usage;
+
+    if (argint(0, &who) < 0 || argu64(1, &usage) < 0)
+        return -EINVAL;
+
+    return getrusage(who, usage);
+}
+
 long sys_setpgid(void)
 {
     pid_t pid, pgid;
@@ -809,7 +959,8 @@ long sys_sched_getaffinity(void) {
 
     trace("pid: %d, size: 0x%lx, maskp: 0x%lx", pid, cpusetsize, maskp);
 
-    mask.__bits[0] = 1UL;
+    memset(&mask, 0, sizeof(mask));
+    mask.__bits[0] = cpus_online;
     if (copyout(myproc()->pagetable, maskp, (char *)&mask, sizeof(cpu_set_t)) < 0)
             return -EINVAL;
 
@@ -817,12 +968,41 @@ long sys_sched_getaffinity(void) {
 }
 
 
+long sys_sched_yield(void)
+{
+    yield();
+    return 0;
+}
+
+long sys_setpriority(void)
+{
+    int which, who, nice;
+
+    if (argint(0, &which) < 0 || argint(1, &who) < 0 || argint(2, &nice) < 0)
+        return -EINVAL;
+
+    return setpriority(which, who, nice);
+}
+
+long sys_getpriority(void)
+{
+    int which, who;
+
+    if (argint(0, &which) < 0 || argint(1, &who) < 0)
+        return -EINVAL;
+
+    return getpriority(which, who);
+}
+
+// prlimit64(2): 資源の制限はスレッドグループで共有するのでリーダーに置く.
+// RLIMIT_NOFILE以外は値を保持するだけで制限はしない.
 long sys_prlimit64(void)
 {
     pid_t pid;
     int resource;
     uint64_t new_limit_p, old_limit_p;
-    struct rlimit old_limit;
+    struct rlimit old_limit, new_limit;
+    struct proc *p, *cp = myproc();
 
     if (argint(0, &pid) < 0 || argint(1, &resource) < 0
      || argu64(2, &new_limit_p) < 0
@@ -832,13 +1012,44 @@ long sys_prlimit64(void)
     trace("pid=%d, resource=%d, new_limit=0x%llx, old_limit=0x%llx",
         pid, resource, new_limit_p, old_limit_p);
 
-    if (old_limit_p != 0) {
-        old_limit.rlim_cur = RLIM_SAVED_CUR;
-        old_limit.rlim_max = RLIM_SAVED_MAX;
-        if (copyout(myproc()->pagetable, old_limit_p, (char *)&old_limit, sizeof(struct rlimit)) < 0)
+    if (resource < 0 || resource >= RLIM_NLIMITS)
+        return -EINVAL;
+    if (new_limit_p != 0) {
+        if (copyin(cp->pagetable, (char *)&new_limit, new_limit_p, sizeof(struct rlimit)) < 0)
+            return -EFAULT;
+        if (new_limit.rlim_cur > new_limit.rlim_max)
             return -EINVAL;
+        if (resource == RLIMIT_NOFILE && new_limit.rlim_max > NR_OPEN)
+            return -EPERM;
     }
 
-    return 0;
+    if (pid == 0) {
+        p = cp->group_leader;
+    } else {
+        if ((p = find_proc(pid)) == 0)
+            return -ESRCH;
+        p = p->group_leader;
+        if (p->tgid != cp->tgid
+         && (cp->uid != p->uid || cp->uid != p->euid || cp->uid != p->suid)
+         && !capable(CAP_SYS_RESOURCE))
+            return -EPERM;
+    }
 
+    acquire(&p->lock);
+    old_limit = p->rlim[resource];
+    if (new_limit_p != 0) {
+        if (new_limit.rlim_max > old_limit.rlim_max && !capable(CAP_SYS_RESOURCE)) {
+            release(&p->lock);
+            return -EPERM;
+        }
+        p->rlim[resource] = new_limit;
+    }
+    release(&p->lock);
+
+    if (old_limit_p != 0) {
+        if (copyout(cp->pagetable, old_limit_p, (char *)&old_limit, sizeof(struct rlimit)) < 0)
+            return -EFAULT;
+    }
+
+    return 0;
 }
@@ -0,0 +1,462 @@
+// カーネルタイマー.
+//
+// 各hartは期限順に並べたタイマーのリスト（timer_base）を持ち、SBIの
+// タイマーを次のtickと先頭のタイマーの期限の早い方に設定する.
+// タイマーはtickを待たずに期限（r_time()の単位）で時間切れになるので、
+// nanosleep等の精度は10msのtickより細かくなる.
+// タイマーは登録したhartのリストに入り、そのhartのタイマー割り込みで
+// コールバックが呼び出される. 1つのタイマーを登録・削除するのは
+// 所有者だけ（とコールバック自身）とする. スレッドグループで共有する
+// ITIMER_REALのタイマーはitimer_lockで直列化する.
+//
+// tickは必要な時だけ動かす. idleのhartはtickを止めて次のタイマーの期限
+// まで眠り（hart 0はNOHZ_IDLE_MAXごとに起きてclockintr()を呼ぶ）、
+// 他に実行可能なプロセスがないhartはtickの間隔をNOHZ_STRETCH倍に延ばす.
+// 実行キューにプロセスが入るとrunq_add()がtimer_kick()で元に戻す.
+// jiffiesとxtimeはtime CSRから求めるのでtickを飛ばしても狂わない.
+//
+// timer_base.lockを保持して他のロックは獲得しない.
+
+#include <common/types.h>
+#include <common/param.h>
+#include <common/riscv.h>
+#include <config.h>
+#include <spinlock.h>
+#include <proc.h>
+#include <defs.h>
+#include <errno.h>
+#include <printf.h>
+#include <list.h>
+#include <timer.h>
+#include <linux/signal.h>
+
+#define MAX_SLEEP_SEC   1000000000L     // これより長い時間は切り詰める（約31年）
+#define NOHZ_IDLE_MAX   100             // idleのhart 0のtick間隔（tick, 1秒）
+#define NOHZ_STRETCH    10              // 1つのプロセスだけが動いているhartのtick間隔（tick）
+
+// timer_base.mode
+#define TICK_PERIODIC   0               // INTERVALごと
+#define TICK_STRETCHED  1               // NOHZ_STRETCHごと
+#define TICK_STOPPED    2               // idle
+
+struct timer_base {
+    struct spinlock lock;
+    struct list_head head;              // 期限順
+    struct timer_list *running;         // コールバックを実行中のタイマー
+    uint64_t next_tick;                 // 次にtick処理をするr_time()
+    int mode;                           // TICK_*
+};
+
+static struct timer_base bases[NCPU];
+
+// timer_sleep_until()の時間切れを待つ
+static struct spinlock tsleep_lock;
+
+// ITIMER_REALはスレッドグループで1つなので、複数のスレッドからの
+// setitimerを直列化する
+static struct spinlock itimer_lock;
+
+void timerinit(void)
+{
+    for (int i = 0; i < NCPU; i++) {
+        initlock(&bases[i].lock, "timer");
+        list_init(&bases[i].head);
+    }
+    initlock(&tsleep_lock, "tsleep");
+    initlock(&itimer_lock, "itimer");
+}
+
+// このhartのタイマーを次のtickと先頭のタイマーの期限の早い方に設定する.
+// base->lockを保持し、割り込みは無効で呼び出す.
+static void timer_program(struct timer_base *base)
+{
+#ifndef CONFIG_RISCV_M_MODE
+    struct timer_list *t;
+    uint64_t next = base->next_tick;
+
+    if (!list_empty(&base->head)) {
+        t = list_entry(list_front(&base->head), struct timer_list, list);
+        if (t->expires < next)
+            next = t->expires;
+    }
+    sbi_set_timer(next);
+#endif
+}
+
+// このhartのタイマー割り込みを開始する.
+// 各hartは自分のタイマーでスケジューラを動かす.
+void timerinithart(void)
+{
+#ifndef CONFIG_RISCV_M_MODE
+    struct timer_base *base = &bases[cpuid()];
+
+    /* 割り込みを停止: interrupt-enableビットをクリア */
+    csr_clear(CSR_IE, 1 << 5);
+    /* タイマーのセット: INVERVAL=10ms : 1tick = 1/25MHz = 40 ns */
+    acquire(&base->lock);
+    base->next_tick = csr_read(CSR_TIME) + INTERVAL;
+    timer_program(base);
+    release(&base->lock);
+    /* 割り込みを開始; interrupt-enbleビットをセット */
+    csr_set(CSR_IE, 1 << 5);
+#endif
+}
+
+// timerをこのhartに登録する. timerは登録されていてはならない.
+void add_timer(struct timer_list *timer)
+{
+    struct timer_base *base;
+    struct list_head *pos;
+    struct timer_list *t;
+
+    push_off();
+    base = &bases[cpuid()];
+    acquire(&base->lock);
+    if (timer_pending(timer))
+        panic("add_timer");
+    // 同じ期限のタイマーは登録順
+    for (pos = base->head.next; pos != &base->head; pos = pos->next) {
+        t = list_entry(pos, struct timer_list, list);
+        if (timer->expires < t->expires)
+            break;
+    }
+    list_insert(&timer->list, pos->prev, pos);
+    timer->cpu = cpuid();
+    // 先頭になったら割り込みの時刻を早める
+    if (base->head.next == &timer->list)
+        timer_program(base);
+    release(&base->lock);
+    pop_off();
+}
+
+// timerを登録から外す. 外したら1、登録されていなければ0、
+// コールバックを実行中なら-1を返す.
+static int try_to_del_timer(struct timer_list *timer)
+{
+    struct timer_base *base;
+    int cpu = __atomic_load_n(&timer->cpu, __ATOMIC_ACQUIRE);
+    int ret = 0;
+
+    if (cpu < 0)
+        return 0;
+    base = &bases[cpu];
+    acquire(&base->lock);
+    if (base->running == timer) {
+        ret = -1;
+    } else if (timer_pending(timer)) {
+        list_drop(&timer->list);
+        list_init(&timer->list);
+        ret = 1;
+    }
+    release(&base->lock);
+    return ret;
+}
+
+// timerを登録から外す. 外したら1、登録されていなければ0を返す.
+// コールバックを実行中でも待たない.
+int del_timer(struct timer_list *timer)
+{
+    return try_to_del_timer(timer) > 0;
+}
+
+// timerを登録から外し、コールバックを実行中なら終了を待つ.
+// 戻った後はコールバックがtimerを参照しない.
+int del_timer_sync(struct timer_list *timer)
+{
+    int ret;
+
+    while ((ret = try_to_del_timer(timer)) < 0)
+        ;
+    return ret;
+}
+
+// timerの期限をexpiresに変えて登録し直す. 登録されていたら1を返す.
+int mod_timer(struct timer_list *timer, uint64_t expires)
+{
+    int ret = del_timer(timer);
+
+    timer->expires = expires;
+    add_timer(timer);
+    return ret;
+}
+
+// 期限が来たタイマーのコールバックを呼び出す. 割り込みは無効.
+static void run_timers(struct timer_base *base, uint64_t now)
+{
+    struct timer_list *t;
+
+    acquire(&base->lock);
+    while (!list_empty(&base->head)) {
+        t = list_entry(list_front(&base->head), struct timer_list, list);
+        if (t->expires > now)
+            break;
+        list_drop(&t->list);
+        list_init(&t->list);
+        base->running = t;
+        // コールバックはadd_timer()等を呼べるようにロックを外して呼ぶ
+        release(&base->lock);
+        t->function(t->data);
+        acquire(&base->lock);
+        base->running = NULL;
+    }
+    release(&base->lock);
+}
+
+// タイマー割り込み. devintr()から割り込み無効で呼び出す.
+// tickの時刻であればclockintr()とsched_tick()を呼び出し、
+// 期限が来たタイマーを処理してから次の割り込みを設定する.
+void timer_interrupt(void)
+{
+    struct timer_base *base = &bases[cpuid()];
+    uint64_t now = r_time();
+    int tick;
+
+#ifdef CONFIG_RISCV_M_MODE
+    // M-modeではtickごとに転送されるソフトウェア割り込みで呼び出される
+    tick = 1;
+#else
+    tick = now >= base->next_tick;
+    if (tick) {
+        acquire(&base->lock);
+        // 先にmodeを変えてからキューを見る. runq_add()はキューに入れてから
+        // modeを見るので、どちらかが必ず相手に気づく
+        __atomic_store_n(&base->mode, TICK_STRETCHED, __ATOMIC_SEQ_CST);
+        if (mycpu()->proc && !runq_pending()) {
+            base->next_tick = now + NOHZ_STRETCH * INTERVAL;
+        } else {
+            base->mode = TICK_PERIODIC;
+            base->next_tick = now + INTERVAL;
+        }
+        release(&base->lock);
+    }
+#endif
+    if (tick) {
+        clockintr();
+        sched_tick();
+    }
+    run_timers(base, now);
+#ifndef CONFIG_RISCV_M_MODE
+    acquire(&base->lock);
+    timer_program(base);
+    release(&base->lock);
+#endif
+}
+
+// このhartのtickをINTERVALごとに戻す. 割り込みは無効で呼び出す.
+static void tick_restart(struct timer_base *base)
+{
+#ifndef CONFIG_RISCV_M_MODE
+    acquire(&base->lock);
+    if (base->mode != TICK_PERIODIC) {
+        base->mode = TICK_PERIODIC;
+        base->next_tick = r_time() + INTERVAL;
+        timer_program(base);
+    }
+    release(&base->lock);
+#endif
+}
+
+// cpuの実行キューにプロセスを入れたrunq_add()から呼び出す.
+// cpuのtickが止まっているか延びていれば元に戻させる.
+void timer_kick(int cpu)
+{
+#ifndef CONFIG_RISCV_M_MODE
+    if (__atomic_load_n(&bases[cpu].mode, __ATOMIC_SEQ_CST) == TICK_PERIODIC)
+        return;
+    push_off();
+    if (cpu == cpuid())
+        tick_restart(&bases[cpu]);
+    else
+        sbi_send_ipi(1UL << cpu);   // IPIを受けたhartがtimer_kick()を呼ぶ
+    pop_off();
+#endif
+}
+
+// scheduler()がwfiで待つ前に割り込み無効で呼び出す. tickを止めて
+// 次のタイマーの期限まで割り込まないようにする.
+void timer_idle_enter(void)
+{
+#ifndef CONFIG_RISCV_M_MODE
+    struct timer_base *base = &bases[cpuid()];
+
+    acquire(&base->lock);
+    __atomic_store_n(&base->mode, TICK_STOPPED, __ATOMIC_SEQ_CST);
+    // hart 0はwb_tick()等のために時々起きる
+    base->next_tick = cpuid() == 0 ? r_time() + NOHZ_IDLE_MAX * INTERVAL : ~0UL;
+    timer_program(base);
+    release(&base->lock);
+#endif
+}
+
+// wfiから復帰したscheduler()が割り込み無効で呼び出す.
+// tickを再開し、止まっていた間のjiffiesを進める.
+void timer_idle_exit(void)
+{
+    tick_restart(&bases[cpuid()]);
+    clockintr();
+}
+
+// timespecをr_time()の単位に変換する
+uint64_t timespec_to_cycles(const struct timespec *ts)
+{
+    time_t sec = ts->tv_sec < MAX_SLEEP_SEC ? ts->tv_sec : MAX_SLEEP_SEC;
+
+    return sec * 1000000UL * US_INTERVAL + (ts->tv_nsec * US_INTERVAL + 999) / 1000;
+}
+
+static void cycles_to_timespec(uint64_t cycles, struct timespec *ts)
+{
+    uint64_t us = cycles / US_INTERVAL;
+
+    ts->tv_sec = us / 1000000;
+    ts->tv_nsec = (us % 1000000) * 1000 + (cycles % US_INTERVAL) * 1000 / US_INTERVAL;
+}
+
+static uint64_t timeval_to_cycles(const struct timeval *tv)
+{
+    time_t sec = tv->tv_sec < MAX_SLEEP_SEC ? tv->tv_sec : MAX_SLEEP_SEC;
+
+    return (sec * 1000000UL + tv->tv_usec) * US_INTERVAL;
+}
+
+static void cycles_to_timeval(uint64_t cycles, struct timeval *tv)
+{
+    uint64_t us = (cycles + US_INTERVAL - 1) / US_INTERVAL;
+
+    tv->tv_sec = us / 1000000;
+    tv->tv_usec = us % 1000000;
+}
+
+// timer_sleep_until()のタイマーのコールバック. dataは待ちのチャネル
+static void process_timeout(uint64_t data)
+{
+    acquire(&tsleep_lock);
+    wakeup((void *)data);
+    release(&tsleep_lock);
+}
+
+// r_time()がexpiresになるまで眠る. シグナルで起こされたら-EINTR、
+// 時間切れなら0を返す.
+long timer_sleep_until(uint64_t expires)
+{
+    struct timer_list t;
+    long ret = 0;
+
+    init_timer(&t);
+    t.expires = expires;
+    t.function = process_timeout;
+    t.data = (uint64_t)&t;
+    add_timer(&t);
+
+    acquire(&tsleep_lock);
+    while (r_time() < expires) {
+        if ((ret = sleep_intr(&t, &tsleep_lock)) < 0)
+            break;
+    }
+    release(&tsleep_lock);
+
+    del_timer_sync(&t);
+    return ret;
+}
+
+// sys_nanosleepの実装. シグナルで中断したらremに残り時間を入れる.
+long nanosleep(struct timespec *req, struct timespec *rem)
+{
+    uint64_t expires = r_time() + timespec_to_cycles(req);
+    uint64_t now;
+    long ret;
+
+    ret = timer_sleep_until(expires);
+    if (ret == -EINTR && rem) {
+        now = r_time();
+        cycles_to_timespec(expires > now ? expires - now : 0, rem);
+    }
+    return ret;
+}
+
+// ppoll(2)のタイムアウト. timeoutだけ眠る.
+long timer_sleep(struct timespec *timeout)
+{
+    return timer_sleep_until(r_time() + timespec_to_cycles(timeout));
+}
+
+// ITIMER_REALのタイマーのコールバック. dataはスレッドグループのリーダー.
+// SIGALRMをプロセスに送り、周期タイマーであれば次の期限で登録し直す.
+void it_real_fn(uint64_t data)
+{
+    struct proc *leader = (struct proc *)data;
+
+    send_signal(signal_target(leader), SIGALRM);
+    if (leader->it_real_incr) {
+        leader->it_real.expires += leader->it_real_incr;
+        add_timer(&leader->it_real);
+    }
+}
+
+// leaderのITIMER_REALの残り時間と周期をvalueに入れる.
+static void it_real_get(struct proc *leader, struct itimerval *value)
+{
+    uint64_t expires, now = r_time();
+
+    expires = leader->it_real.expires;
+    if (timer_pending(&leader->it_real) && expires > now)
+        cycles_to_timeval(expires - now, &value->it_value);
+    else
+        value->it_value.tv_sec = value->it_value.tv_usec = 0;
+    cycles_to_timeval(leader->it_real_incr, &value->it_interval);
+}
+
+// sys_getitimerの実装. ITIMER_REALのみ.
+// タイマーはプロセス（スレッドグループ）単位なのでリーダーのものを使う.
+long getitimer(int which, struct itimerval *value)
+{
+    if (which != ITIMER_REAL)
+        return -EINVAL;
+
+    acquire(&itimer_lock);
+    it_real_get(myproc()->group_leader, value);
+    release(&itimer_lock);
+    return 0;
+}
+
+// sys_setitimerの実装. ITIMER_REALのみ（ITIMER_VIRTUAL, ITIMER_PROFは
+// プロセスのCPU時間を計っていないので未対応）.
+// タイマーはプロセス（スレッドグループ）単位なのでリーダーのものを使う.
+long setitimer(int which, struct itimerval *value, struct itimerval *ovalue)
+{
+    struct proc *p = myproc()->group_leader;
+    uint64_t incr;
+
+    if (which != ITIMER_REAL)
+        return -EINVAL;
+    if (value->it_value.tv_usec < 0 || value->it_value.tv_usec >= 1000000
+     || value->it_interval.tv_usec < 0 || value->it_interval.tv_usec >= 1000000
+     || value->it_value.tv_sec < 0 || value->it_interval.tv_sec < 0)
+        return -EINVAL;
+
+    acquire(&itimer_lock);
+    if (ovalue)
+        it_real_get(p, ovalue);
+
+    del_timer_sync(&p->it_real);
+    incr = timeval_to_cycles(&value->it_interval);
+    p->it_real_incr = incr;
+    if (value->it_value.tv_sec || value->it_value.tv_usec) {
+        p->it_real.expires = r_time() + timeval_to_cycles(&value->it_value);
+        p->it_real.function = it_real_fn;
+        p->it_real.data = (uint64_t)p;
+        add_timer(&p->it_real);
+    }
+    release(&itimer_lock);
+    return 0;
+}
+
+// スレッドグループの最後のスレッドのexit()から呼び出す.
+// leaderが持つプロセスのタイマーを止める.
+void exit_itimers(struct proc *leader)
+{
+    acquire(&itimer_lock);
+    leader->it_real_incr = 0;
+    del_timer_sync(&leader->it_real);
+    release(&itimer_lock);
+}
@@ -40,6 +40,7 @@ usertrap(void)
 {
     int which_dev = 0;
     int ret = 0;
+    long inblock;
 
     if ((r_sstatus() & SSTATUS_SPP) != 0)
         panic("usertrap: not from user mode");
@@ -50,6 +51,9 @@ usertrap(void)
 
     struct proc *p = myproc();
 
+    // ここまでをユーザー時間とする
+    acct_utime(p);
+
     // sepcとstvalを保存
     uint64_t sepc = r_sepc();
     uint64_t stval = r_stval();
@@ -79,21 +83,34 @@ usertrap(void)
         intr_on();
         syscall();
         trace("epc: 0x%lx, sp: 0x%lx, tp: 0x%lx, a0: 0x%lx", p->trapframe->epc, p->trapframe->sp, p->trapframe->tp, p->trapframe->a0);
-    // 13: ページアクセス例外 (load)
-    } else if (scause == SCAUSE_PAGE_LOAD) {
-        if (alloc_mmap_page(p, stval, scause) < 0) {
+    // 12: ページアクセス例外 (fetch), 13: ページアクセス例外 (load)
+    // 同じアドレス空間の他のスレッドと同時にページを割り当てないようにする
+    } else if (scause == SCAUSE_PAGE_FETCH || scause == SCAUSE_PAGE_LOAD) {
+        inblock = p->acct.inblock;
+        acquiresleep(&p->mm->mmap_lock);
+        if ((ret = exec_fault(p, stval)) < 0
+         || (ret == 1 && alloc_mmap_page(p, stval, scause) < 0)) {
             error("pid[%d] LOAD failed: addr=0x%lx on 0x%lx", p->pid, stval, sepc);
             setkilled(p);
         }
+        releasesleep(&p->mm->mmap_lock);
+        acct_fault(p, inblock);
     // 15: ページアクセス例外 (store)
     } else if (scause == SCAUSE_PAGE_STORE) {
+        inblock = p->acct.inblock;
+        acquiresleep(&p->mm->mmap_lock);
         if ((ret = alloc_cow_page(p->pagetable, stval)) < 0) {
             error("pid[%d] STORE COW failed: addr=0x%lx on 0x%lx", p->pid, stval, sepc);
             setkilled(p);
+        } else if (ret == 1 && (ret = exec_fault(p, stval)) < 0) {
+            error("pid[%d] STORE failed: addr=0x%lx on 0x%lx", p->pid, stval, sepc);
+            setkilled(p);
         } else if (ret == 1 && alloc_mmap_page(p, stval, scause) < 0) {
             error("pid[%d] STORE failed: addr=0x%lx on 0x%lx", p->pid, stval, sepc);
             setkilled(p);
         }
+        releasesleep(&p->mm->mmap_lock);
+        acct_fault(p, inblock);
     } else if ((which_dev = devintr()) != 0) {
         // ok
     } else {
@@ -107,8 +124,9 @@ usertrap(void)
         exit(xstate);
     }
 
-    // タイマー割り込みの場合はCPUを明け渡す.
-    if (which_dev == 2) {
+    // タイムスライスを使い切ったか、より優先度の高いプロセスが
+    // 起床した場合はCPUを明け渡す.
+    if (sched_need_resched()) {
         yield();
     }
 
@@ -130,6 +148,9 @@ usertrapret(void)
     // usertrap()が正しいユーザ空間に戻るまで割り込みを無効にする。
     intr_off();
 
+    // ここまでをシステム時間とする
+    acct_stime(p);
+
     // システムコール、割り込み、例外の送り先をtrampoline.Sのuservecにする
     uint64_t trampoline_uservec = TRAMPOLINE + (uservec - trampoline);
     w_stvec(trampoline_uservec);
@@ -139,9 +160,7 @@ usertrapret(void)
     p->trapframe->kernel_satp = r_satp();         // カーネルページテーブル
     p->trapframe->kernel_sp = p->kstack + PGSIZE; // プロセスのカーネルスタック
     p->trapframe->kernel_trap = (uint64_t)usertrap;
-    // FIXME: cpuは１つしか使わない。tpを別の目的で使用する
-    //p->trapframe->kernel_hartid = r_tp();         // hartid for cpuid()
-    p->trapframe->kernel_hartid = 0UL;
+    p->trapframe->kernel_hartid = r_tp();         // hartid for cpuid()
 
     // trampoline.Sのsretがユーザ空間に移動できるように
     // レジスタを設定する
@@ -156,13 +175,15 @@ usertrapret(void)
     w_sepc(p->trapframe->epc);
 
     // trampoline.Sに切り替えるユーザページテーブルを伝える
-    uint64_t satp = MAKE_SATP(p->pagetable);
+    // ASIDを付けるのでtrampoline.SではTLBをフラッシュしない
+    uint64_t satp = MAKE_SATP_ASID(p->pagetable, proc_asid(p));
 
     // メモリの先頭にあるtrampoline.S内のuserret()を呼び出す。
     // この関数はユーザページテーブルに切り替え、ユーザレジスタを
-    // 復元し、sretでユーザモードに切り替える
+    // 復元し、sretでユーザモードに切り替える.
+    // trapframeはスレッドごとのスロットにマッピングされている
     uint64_t trampoline_userret = TRAMPOLINE + (userret - trampoline);
-    ((void (*)(uint64_t))trampoline_userret)(satp);
+    ((void (*)(uint64_t, uint64_t))trampoline_userret)(satp, TRAPFRAME_SLOT(p->tf_slot));
 }
 
 // カーネルコードからの割り込みと例外は現在のカーネル
@@ -186,8 +207,9 @@ kerneltrap()
         panic("kerneltrap");
     }
 
-    // タイマー割り込みの場合はCPUを明け渡す.
-    if (which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING) {
+    // タイムスライスを使い切ったか、より優先度の高いプロセスが
+    // 起床した場合はCPUを明け渡す.
+    if (myproc() != 0 && myproc()->state == RUNNING && sched_need_resched()) {
         trace("yield");
         yield();
     }
@@ -237,25 +259,24 @@ static int devintr()
     } else if (scause == 0x8000000000000001L) {
         // OpenSBIまたはkernelvec.Sのtimervecから転送された
         // マシンモードタイマー割り込みからのソフトウェア割り込み,
-
-        if (cpuid() == 0){
-            clockintr();
-        }
+        timer_interrupt();
 
         // sipのSSIPビットをクリアすることによりソフトウェア
         // 割り込みにacknowledgeする
         w_sip(r_sip() & ~2);
         return 2;
 #else
+    } else if (scause == 0x8000000000000001L) {
+        // 他のhartからSBI経由で送られたIPI（ソフトウェア割り込み）.
+        // runq_add()がこのhartのresched（またはidleのwfiからの復帰）や
+        // tickの再開を求めている
+        w_sip(r_sip() & ~2);
+        timer_kick(cpuid());
+        return 2;
     } else if ((scause & 0x8000000000000000L) && (scause & 0xff) == 5) {
-        // S-modeのタイマー割り込み,
-        unsigned long next;
-
-        csr_clear(CSR_IE, 1 << 5);
-        clockintr();
-        next = csr_read(CSR_TIME) + INTERVAL;
-        sbi_set_timer(next);
-        csr_set(CSR_IE, 1 << 5);
+        // S-modeのタイマー割り込み. tickとカーネルタイマーの期限の
+        // 早い方で割り込むので、timer_interrupt()がどちらかを判断する
+        timer_interrupt();
         //debug("timer");
 
         return 2;
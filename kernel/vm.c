@@ -9,6 +9,8 @@
 #include <linux/mman.h>
 #include <config.h>
 #include <printf.h>
+#include <spinlock.h>
+#include <page.h>
 #ifdef DUO256
 #include <cv181x_reg.h>
 #else
@@ -25,11 +27,36 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+// TLBのASID（アドレス空間識別子）. カーネルページテーブルは0を、
+// プロセスは1..maxを使い、ユーザ空間に戻る際にsatpに設定する.
+// ASIDを使い切ったら世代を進め、古い世代のASIDを持つプロセスには
+// 次にユーザ空間に戻る際に割り当て直す. 各hartは新しい世代のASIDを
+// 最初に使う前に自分のTLB全体をフラッシュする.
+static struct {
+    struct spinlock lock;
+    uint64_t max;           // 0ならASIDは実装されていない
+    uint64_t next;          // 次に割り当てるASID
+    uint64_t gen;           // 現在の世代
+} asids;
+
+// COWページのコピーを直列化する. アドレス空間を共有するスレッドが
+// 同じページに同時に書き込んでも一度だけコピーする.
+static struct spinlock cow_lock;
+
+// ユーザPTEの変更の世代. uvmflush()/uvmflush_page()で進め、
+// copyin/copyoutがキャッシュしている変換を無効にする.
+static uint64_t uvm_gen = 1;
+
+// これより多くのページのPTEを変更した場合はページごとではなく
+// ASID全体をフラッシュする
+#define FLUSH_ALL_PAGES     32
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
 {
     pagetable_t kpgtbl;
+    uint64_t mstart, mend;
 
     kpgtbl = (pagetable_t) kalloc();
     memset(kpgtbl, 0, PGSIZE);
@@ -49,15 +76,24 @@ kvmmake(void)
     kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64_t)etext-KERNBASE, PTE_EXEC);
 
     // カーネルのデータセクションから最大物理RAMまでマップする.
-    kvmmap(kpgtbl, (uint64_t)etext, (uint64_t)etext, PHYSTOP-(uint64_t)etext, PTE_NORMAL);
+    // 2MB境界に挟まれた部分は2MBページでマップしてTLBの到達範囲を広げる.
+    // textは書き込み禁止のまま4KBページでマップする.
+    mstart = MEGAPGROUNDUP((uint64_t)etext);
+    mend = MEGAPGROUNDDOWN(PHYSTOP);
+    if (mstart < mend) {
+        if (mstart > (uint64_t)etext)
+            kvmmap(kpgtbl, (uint64_t)etext, (uint64_t)etext, mstart-(uint64_t)etext, PTE_NORMAL);
+        if (mapmegapages(kpgtbl, mstart, mend-mstart, mstart, PTE_NORMAL) != 0)
+            panic("kvmmake: megapage");
+        if (PHYSTOP > mend)
+            kvmmap(kpgtbl, mend, mend, PHYSTOP-mend, PTE_NORMAL);
+    } else {
+        kvmmap(kpgtbl, (uint64_t)etext, (uint64_t)etext, PHYSTOP-(uint64_t)etext, PTE_NORMAL);
+    }
 
     // トラップ処理への入出力ようにトランポリンをカーネルの最大仮想アドレスにマップする
     kvmmap(kpgtbl, TRAMPOLINE, (uint64_t)trampoline, PGSIZE, PTE_EXEC);
 
-    // 各プロセス用のカーネルスタックを割り当ててマップする.
-    // プロすす数の上限は決まっており、すべて割り当てる。
-    proc_mapstacks(kpgtbl);
-
     return kpgtbl;
 }
 
@@ -66,6 +102,10 @@ void
 kvminit(void)
 {
     kernel_pagetable = kvmmake();
+    initlock(&asids.lock, "asid");
+    initlock(&cow_lock, "cow");
+    asids.next = 1;
+    asids.gen = 1;
 }
 
 // Switch h/w page table register to the kernel's page table,
@@ -77,12 +117,192 @@ kvminithart(void)
     asm volatile("fence rw, rw");
     sfence_vma();
 
+    // ASIDフィールドのすべてのビットに1を書いて実装されているビットを調べる
+    w_satp(MAKE_SATP(kernel_pagetable) | SATP_ASID_MASK);
+    asids.max = (r_satp() & SATP_ASID_MASK) >> SATP_ASID_SHIFT;
     w_satp(MAKE_SATP(kernel_pagetable));
 
     // flush stale entries from the TLB.
     sfence_vma();
 }
 
+// pのアドレス空間のASIDを返す. 現在の世代のASIDを持っていなければ割り当てる.
+// スレッドはアドレス空間ごとに同じASIDを使う.
+// usertrapret()がsatpを作る際に呼び出す.
+// 割り込みを無効にして呼び出すこと.
+uint64_t
+proc_asid(struct proc *p)
+{
+    struct cpu *c = mycpu();
+    struct mm *mm = p->mm;
+    struct page *root = page_find_by_address(mm->pagetable);
+
+    // このページテーブルの変換がTLBに入りうることを記録する
+    if (!(root->flags & PF_PGTBL_LOADED))
+        __atomic_fetch_or(&root->flags, PF_PGTBL_LOADED, __ATOMIC_SEQ_CST);
+    acquire(&asids.lock);
+    if (asids.max == 0) {
+        release(&asids.lock);
+        return 0;
+    }
+    if (mm->asid_gen != asids.gen) {
+        if (asids.next > asids.max) {
+            // 使い切った: 古い世代のエントリは各hartが破棄する
+            asids.gen++;
+            asids.next = 1;
+            trace("asid generation %ld", asids.gen);
+        }
+        // asid_hartsはそのまま残す. 他のhartで実行中のスレッドは
+        // ユーザ空間に戻るまで古いASIDを使い続ける
+        mm->asid = asids.next++;
+        mm->asid_gen = asids.gen;
+    }
+    if (c->asid_gen != asids.gen) {
+        // このhartには前の世代で同じASIDを使ったエントリが残っている
+        sfence_vma();
+        c->asid_gen = asids.gen;
+    }
+    __atomic_fetch_or(&mm->asid_harts, 1UL << cpuid(), __ATOMIC_SEQ_CST);
+    release(&asids.lock);
+    return mm->asid;
+}
+
+// pagetableのTLBエントリを持ちうるASIDをasidに、そのエントリを
+// 持ちうる他のhartのマスクをhartsに返す.
+// 現在のプロセスのページテーブルでそのASIDが現世代のものなら1を返す.
+// ASIDが古い世代のもの、またはアドレス空間を実行したhartのいずれかが
+// まだ前の世代のASIDを使っている可能性がある場合は、ASIDでは
+// フラッシュできないのでアドレス空間を実行したhartをhartsに入れて-1を返す.
+// 一度もsatpに設定していないページテーブル（forkの子やexecで作成中の
+// もの）はTLBにエントリがないので0を、それ以外（ASID非対応、他の
+// プロセスのページテーブル）は他のすべてのhartをhartsに入れて-1を返す.
+// 割り込みを無効にして呼び出すこと.
+static int
+pagetable_asid(pagetable_t pagetable, uint64_t *asid, uint64_t *harts)
+{
+    struct proc *p = mycpu()->proc;
+    uint64_t others = cpus_online & ~(1UL << cpuid());
+    uint64_t mask;
+    int ret = 1;
+
+    *harts = others;
+    if (p == 0 || p->pagetable != pagetable) {
+        struct page *root = page_find_by_address(pagetable);
+        if (root && !(__atomic_load_n(&root->flags, __ATOMIC_SEQ_CST) & PF_PGTBL_LOADED))
+            return 0;
+        return -1;
+    }
+    if (asids.max == 0)
+        return -1;
+    acquire(&asids.lock);
+    mask = p->mm->asid_harts & others;
+    if (p->mm->asid_gen != asids.gen)
+        ret = -1;
+    for (int i = 0; ret > 0 && i < NCPU; i++) {
+        if ((mask & (1UL << i)) && cpus[i].asid_gen != asids.gen)
+            ret = -1;
+    }
+    *asid = p->mm->asid;
+    *harts = mask;
+    release(&asids.lock);
+    return ret;
+}
+
+// pagetableのvaからsizeバイトのPTEを変更した後にそのTLBエントリを
+// フラッシュする. sizeが-1ならすべてのエントリをフラッシュする.
+// このhartではFLUSH_ALL_PAGES以下ならページごとに、それより多ければ
+// まとめてフラッシュし、他のhartにエントリが残っていればSBIのRFENCEを
+// 1回だけ呼び出してフラッシュさせる.
+void
+uvmflush_range(pagetable_t pagetable, uint64_t va, uint64_t size)
+{
+    uint64_t asid, harts, a;
+    int ret, all = size > FLUSH_ALL_PAGES * PGSIZE;
+
+    push_off();
+    ret = pagetable_asid(pagetable, &asid, &harts);
+    __atomic_fetch_add(&uvm_gen, 1, __ATOMIC_RELAXED);
+    if (all) {
+        va = 0;
+        size = -1UL;
+    }
+    if (ret > 0) {
+        if (all)
+            sfence_vma_asid(asid);
+        for (a = va; !all && a < va + size; a += PGSIZE)
+            sfence_vma_addr_asid(a, asid);
+        if (harts)
+            sbi_remote_sfence_vma_asid(harts, va, size, asid);
+    } else if (ret < 0) {
+        if (all)
+            sfence_vma();
+        for (a = va; !all && a < va + size; a += PGSIZE)
+            sfence_vma_addr(a);
+        if (harts)
+            sbi_remote_sfence_vma(harts, va, size);
+    }
+    pop_off();
+}
+
+// pagetableのvaのPTEを変更した後にそのTLBエントリをフラッシュする.
+void
+uvmflush_page(pagetable_t pagetable, uint64_t va)
+{
+    uvmflush_range(pagetable, va, PGSIZE);
+}
+
+// pagetableのTLBエントリをすべてフラッシュする.
+void
+uvmflush(pagetable_t pagetable)
+{
+    uvmflush_range(pagetable, 0, -1UL);
+}
+
+// vaを含む2MBページのレベル1のリーフPTEを返す.
+// 2MBページでマップされていない場合は0を返す.
+pte_t *
+walkmega(pagetable_t pagetable, uint64_t va)
+{
+    pte_t *pte;
+
+    if (va >= MAXVA)
+        return 0;
+
+    pte = &pagetable[PX(2, va)];
+    if ((*pte & PTE_V) == 0)
+        return 0;
+    pte = &((pagetable_t)PTE2PA(*pte))[PX(1, va)];
+    if ((*pte & PTE_V) == 0 || PTE_TABLE(*pte))
+        return 0;
+    return pte;
+}
+
+// ユーザの2MBページのリーフPTE *pteを4KBページ512個のレベル0の
+// ページテーブルに置き換える. 物理ページも独立した512ページに分割して、
+// 以降は4KBページとしてCOW、解放できるようにする.
+// 成功したら0, ページテーブルを割り当てられなかったら-1を返す.
+static int
+split_megapage(pte_t *pte)
+{
+    pagetable_t pt0;
+    uint64_t pa = PTE2PA(*pte);
+    uint64_t flags = PTE_FLAGS(*pte);
+
+    // カーネルの直接マップは分割しない
+    if ((flags & PTE_U) == 0)
+        panic("split_megapage: kernel");
+
+    if ((pt0 = (pagetable_t)kalloc_zeroed()) == 0)
+        return -1;
+    for (int i = 0; i < 512; i++)
+        pt0[i] = PA2PTE(pa + i * PGSIZE) | flags;
+    buddy_split(page_find_by_address((void *)pa));
+    *pte = PA2PTE(pt0) | PTE_V;
+    sfence_vma();
+    trace("split pa: 0x%lx", pa);
+    return 0;
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
@@ -104,11 +324,13 @@ walk(pagetable_t pagetable, uint64_t va, int alloc)
     for (int level = 2; level > 0; level--) {
         pte_t *pte = &pagetable[PX(level, va)];
         if(*pte & PTE_V) {
+            // 2MBページは4KBページに分割してから辿る
+            if (!PTE_TABLE(*pte) && (level != 1 || split_megapage(pte) < 0))
+                return 0;
             pagetable = (pagetable_t)PTE2PA(*pte);
         } else {
-            if (!alloc || (pagetable = (pagetable_t)kalloc()) == 0)
+            if (!alloc || (pagetable = (pagetable_t)kalloc_zeroed()) == 0)
                 return 0;
-            memset(pagetable, 0, PGSIZE);
             *pte = PA2PTE(pagetable) | PTE_V;
         }
     }
@@ -127,6 +349,13 @@ walkaddr(pagetable_t pagetable, uint64_t va)
     if (va >= MAXVA)
         return 0;
 
+    // 2MBページは分割せずにページ内の位置を加える
+    if ((pte = walkmega(pagetable, va)) != 0) {
+        if ((*pte & PTE_U) == 0)
+            return 0;
+        return PTE2PA(*pte) + (va & (MEGAPGSIZE - 1) & ~(PGSIZE - 1));
+    }
+
     pte = walk(pagetable, va, 0);
     if (pte == 0)
         return 0;
@@ -155,7 +384,7 @@ kvmmap(pagetable_t kpgtbl, uint64_t va, uint64_t pa, uint64_t sz, uint64_t perm)
 int
 mappages(pagetable_t pagetable, uint64_t va, uint64_t size, uint64_t pa, uint64_t perm)
 {
-    uint64_t a, last;
+    uint64_t a, last, npages;
     pte_t *pte;
 
     if (size == 0)
@@ -163,9 +392,13 @@ mappages(pagetable_t pagetable, uint64_t va, uint64_t size, uint64_t pa, uint64_
 
     a = PGROUNDDOWN(va);
     last = PGROUNDDOWN(va + size - 1);
+    npages = (last - a) / PGSIZE + 1;
     for(;;) {
-        if((pte = walk(pagetable, a, 1)) == 0)
+        if((pte = walk(pagetable, a, 1)) == 0) {
+            if (a > PGROUNDDOWN(va))
+                uvmflush_range(pagetable, PGROUNDDOWN(va), a - PGROUNDDOWN(va));
             return -1;
+        }
         if (*pte & PTE_V) {
             debug("va: 0x%lx, pte: 0x%lx, *pte=0x%lx", a, pte, *pte);
             panic("mappages: remap");
@@ -177,17 +410,90 @@ mappages(pagetable_t pagetable, uint64_t va, uint64_t size, uint64_t pa, uint64_
         a += PGSIZE;
         pa += PGSIZE;
     }
-    sfence_vma();
+    uvmflush_range(pagetable, PGROUNDDOWN(va), npages * PGSIZE);
+    return 0;
+}
+
+// paから始まる物理アドレスを参照するvaから始まる仮想アドレスを
+// 2MBページ（レベル1のリーフPTE）でマップする. va, pa, sizeは
+// 2MB境界になければならない. 成功したら0, ページテーブルページを
+// 割り当てられなかった場合、または既にマップされている（レベル0の
+// ページテーブルがある）場合は -1 を返す.
+int
+mapmegapages(pagetable_t pagetable, uint64_t va, uint64_t size, uint64_t pa, uint64_t perm)
+{
+    pagetable_t pt1;
+    pte_t *pte;
+    uint64_t a;
+
+    if ((va | size | pa) & (MEGAPGSIZE - 1))
+        panic("mapmegapages: not aligned");
+
+    for (a = va; a < va + size; a += MEGAPGSIZE, pa += MEGAPGSIZE) {
+        pte = &pagetable[PX(2, a)];
+        if (*pte & PTE_V) {
+            pt1 = (pagetable_t)PTE2PA(*pte);
+        } else {
+            if ((pt1 = (pagetable_t)kalloc_zeroed()) == 0)
+                return -1;
+            *pte = PA2PTE(pt1) | PTE_V;
+        }
+        pte = &pt1[PX(1, a)];
+        if (*pte & PTE_V)
+            return -1;
+        *pte = PA2PTE(pa) | perm | PTE_V | PTE_A | PTE_D;
+    }
+    uvmflush_range(pagetable, va, size);
     return 0;
 }
 
+// ユーザのvaに0で埋めた2MBページを割り当ててマップする.
+// vaは2MB境界になければならない. 2MBの空きブロックがない場合や
+// マップできない場合は -1 を返すので、呼び出し側は4KBページで代替する.
+int
+uvmalloc_megapage(pagetable_t pagetable, uint64_t va, uint64_t perm)
+{
+    struct page *page;
+    void *mem;
+
+    if ((page = buddy_try_alloc(MEGAPGSIZE)) == NULL)
+        return -1;
+    mem = page_address(page);
+    memset(mem, 0, MEGAPGSIZE);
+    if (mapmegapages(pagetable, va, MEGAPGSIZE, (uint64_t)mem, perm) != 0) {
+        buddy_free(page);
+        return -1;
+    }
+    return 0;
+}
+
+// uvmunmap()で解放するページ. TLBをフラッシュするまで解放を遅らせる
+struct unmap_batch {
+    int n;
+    uint64_t pa[FLUSH_ALL_PAGES];
+};
+
+// batchのページのTLBエントリはフラッシュ済みなので解放する
+static void
+unmap_batch_free(struct unmap_batch *batch)
+{
+    for (int i = 0; i < batch->n; i++) {
+        trace("pa: 0x%lx, refcnt: %d", batch->pa[i], page_refcnt_get((char *)batch->pa[i]));
+        kfree((void *)batch->pa[i]);
+    }
+    batch->n = 0;
+}
+
 // vaから始まるマッピングをnpagesページ削除する。vaはページアライン
 // されていなければならない。マッピングは存在しなければならない。
 // オプションで物理メモリを解放する。
+// 他のhartが古い変換で解放したページにアクセスしないように、物理メモリは
+// TLBをフラッシュしてから解放する.
 void
 uvmunmap(pagetable_t pagetable, uint64_t va, uint64_t npages, int do_free)
 {
-    uint64_t a;
+    struct unmap_batch batch;
+    uint64_t a, start, end = va + npages*PGSIZE;
     pte_t *pte;
 
     trace("papetable: 0x%lx, va: 0x%lx, np: %ld, free: %d", pagetable, va, npages, do_free);
@@ -195,27 +501,43 @@ uvmunmap(pagetable_t pagetable, uint64_t va, uint64_t npages, int do_free)
     if ((va % PGSIZE) != 0)
         panic("uvmunmap: not aligned");
 
-    for (a = va; a < va + npages*PGSIZE; a += PGSIZE) {
-        if ((pte = walk(pagetable, a, 0)) == 0) {
-            trace("no pte for va: 0x%lx", a);
-            continue;
-        }
+    batch.n = 0;
+    for (a = start = va; a < end; a += PGSIZE) {
+        // 2MBページは全体を削除する場合はそのまま解放し、
+        // 一部だけの場合はwalk()で4KBページに分割してから削除する
+        if ((pte = walkmega(pagetable, a)) != 0 && (a & (MEGAPGSIZE - 1)) == 0
+         && a + MEGAPGSIZE <= end) {
+            if (do_free)
+                batch.pa[batch.n++] = PTE2PA(*pte);
+            *pte = 0;
+            a += MEGAPGSIZE - PGSIZE;
+        } else {
+            if ((pte = walk(pagetable, a, 0)) == 0) {
+                trace("no pte for va: 0x%lx", a);
+                continue;
+            }
 
-        // uvmcopyと同じ理由
-        if ((*pte & PTE_V) == 0) {
-            trace("[%d] pte: %p, *pte: 0x%lx", a, pte, *pte);
-            continue;
+            // uvmcopyと同じ理由
+            if ((*pte & PTE_V) == 0) {
+                trace("[%d] pte: %p, *pte: 0x%lx", a, pte, *pte);
+                continue;
+            }
+            if ((PTE_FLAGS(*pte) & 0x3ff) == PTE_V)
+                panic("uvmunmap: not a leaf");
+            if (do_free)
+                batch.pa[batch.n++] = PTE2PA(*pte);
+            *pte = 0;
         }
-        if ((PTE_FLAGS(*pte) & 0x3ff) == PTE_V)
-            panic("uvmunmap: not a leaf");
-        if (do_free) {
-            uint64_t pa = PTE2PA(*pte);
-            trace("pa: 0x%lx, refcnt: %d", pa, page_refcnt_get((char *)pa));
-            kfree((void*)pa);
+        // 削除した範囲をまとめてフラッシュしてから解放する
+        if (batch.n == FLUSH_ALL_PAGES) {
+            uvmflush_range(pagetable, start, a + PGSIZE - start);
+            unmap_batch_free(&batch);
+            start = a + PGSIZE;
         }
-        *pte = 0;
     }
-    sfence_vma();
+    if (start < end)
+        uvmflush_range(pagetable, start, end - start);
+    unmap_batch_free(&batch);
     fence_i();
 }
 
@@ -229,6 +551,8 @@ uvmcreate(void)
     if (pagetable == 0)
         return 0;
     memset(pagetable, 0, PGSIZE);
+    // まだsatpに設定していないので変更してもTLBのフラッシュは不要
+    __atomic_fetch_and(&page_find_by_address(pagetable)->flags, ~PF_PGTBL_LOADED, __ATOMIC_SEQ_CST);
     return pagetable;
 }
 
@@ -262,12 +586,11 @@ uvmalloc(pagetable_t pagetable, uint64_t oldsz, uint64_t newsz, int xperm)
 
     oldsz = PGROUNDUP(oldsz);
     for (a = oldsz; a < newsz; a += PGSIZE){
-        mem = kalloc();
+        mem = kalloc_zeroed();
         if (mem == 0) {
             uvmdealloc(pagetable, a, oldsz);
             return 0;
         }
-        memset(mem, 0, PGSIZE);
         if (mappages(pagetable, a, PGSIZE, (uint64_t)mem, PTE_RO|PTE_U|xperm) != 0) {
             kfree(mem);
             uvmdealloc(pagetable, a, oldsz);
@@ -314,7 +637,7 @@ freewalk(pagetable_t pagetable)
             panic("Invalid leaf PTE");
         }
     }
-    kfree((void*)pagetable);
+    kfree_cold((void*)pagetable);
 }
 
 // ユーザメモリページを解放し、
@@ -324,13 +647,16 @@ uvmfree(pagetable_t pagetable, uint64_t sz)
 {
     if (sz > 0)
         uvmunmap(pagetable, 0, PGROUNDUP(sz)/PGSIZE, 1);
+    __atomic_fetch_and(&page_find_by_address(pagetable)->flags, ~PF_PGTBL_LOADED, __ATOMIC_SEQ_CST);
     freewalk(pagetable);
 }
 
 // 親プロセスのページテーブルを子のページテーブルにコピーする。
-// 物理メモリもコピーする.
+// 物理メモリはコピーせず、親子で共有する（COW）.
+// 書き込み可能なプライベートページは親子とも書き込み不可+PTE_COWとし、
+// 書き込み時にalloc_cow_page()でコピーする.
 // 成功したら 0, 失敗したら -1 を返す.
-// 失敗した場合は割り当てたページをすべて開放する.
+// 失敗した場合はマッピングしたページをすべて開放する.
 int
 uvmcopy(struct proc *old, struct proc *new)
 {
@@ -338,8 +664,7 @@ uvmcopy(struct proc *old, struct proc *new)
     pagetable_t pg1, pg0;
     uint64_t pa, va;
     uint64_t flags;
-    char *mem;
-    struct mmap_region *region;
+    struct mmap_region *region = old->mm->regions;
 
     for (int i = 0; i < 256; i++) {
         pte_2 = &old->pagetable[i];
@@ -348,29 +673,39 @@ uvmcopy(struct proc *old, struct proc *new)
             for (int j = 0; j < 512; j++) {
                 pte_1 = &pg1[j];
                 if (*pte_1 & PTE_V) {
+                    // 2MBページは子とCOWで共有するために4KBページに分割する
+                    if (!PTE_TABLE(*pte_1) && split_megapage(pte_1) < 0) {
+                        va = (uint64_t)i << 30 | (uint64_t)j << 21;
+                        goto err;
+                    }
                     pg0 = (pagetable_t)PTE2PA(*pte_1);
                     for (int k = 0; k < 512; k++) {
-                        // MAXVA - USERTOP : trampoline, trapframce, guardpageはmapping済み
-                        if (i == 255 && j == 511 && k >= 509)
+                        va = (uint64_t)i << 30 | (uint64_t)j << 21 | (uint64_t)k << 12;
+                        // USERTOP - MAXVA : trampolineと子のtrapframeはmapping済み.
+                        // 親のスレッドのtrapframeはコピーしない
+                        if (va >= USERTOP)
                             continue;
                         pte_0 = &pg0[k];
                         if (*pte_0 & PTE_V) {
-                            va = (uint64_t)i << 30 | (uint64_t)j << 21 | (uint64_t)k << 12;
                             pa = PTE2PA(*pte_0);
                             flags = PTE_FLAGS(*pte_0);
-                            region = find_mmap_region(old, (void *)va);
+                            // vaは昇順に走査するのでregionリストも並行して進める
+                            while (region && (uint64_t)region->addr + region->length <= va)
+                                region = region->next;
                             // mmapされたアドレスでMAP_SHAREDの場合は親のpaをそのまま使用
-                            // それ以外は新規paに親のpaをコピーして使用
-                            if (region && region->flags & MAP_SHARED) {
-                                mem = (char *)pa;
-                                page_refcnt_inc((void *)pa);
-                                trace("use parent's pa: 0x%lx, refcnt: %d", pa, page_refcnt_get((void *)pa));
-                            } else {
-                                if ((mem = kalloc()) == 0)
-                                    goto err;
-                                memmove(mem, (char*)pa, PGSIZE);
+                            // それ以外の書き込み可能ページは親子ともCOWにする
+                            if ((flags & PTE_W) && !(region && (uint64_t)region->addr <= va
+                             && region->flags & MAP_SHARED)) {
+                                flags = (flags & ~PTE_W) | PTE_COW;
+                                *pte_0 = PA2PTE(pa) | flags;
                             }
-                            if (mappages(new->pagetable, va, PGSIZE, (uint64_t)mem, flags) != 0) {
+                            // 共有書き込みマッピングの書き込み済みページは子では
+                            // 書き込み禁止にして、子の書き込みも検出できるようにする
+                            if (flags & PTE_WP)
+                                flags &= ~PTE_W;
+                            page_refcnt_inc((void *)pa);
+                            if (mappages(new->pagetable, va, PGSIZE, pa, flags) != 0) {
+                                page_refcnt_dec((void *)pa);
                                 goto err;
                             }
                         }
@@ -380,12 +715,15 @@ uvmcopy(struct proc *old, struct proc *new)
         }
     }
 
+    // 親のTLBに残っている書き込み可能なエントリを破棄する
+    uvmflush(old->pagetable);
     fence_i();
     fence_rw();
 
     return 0;
 
 err:
+    uvmflush(old->pagetable);
     if (va < MMAPBASE)
         uvmunmap(new->pagetable, 0, va / PGSIZE, 1);
     else
@@ -405,6 +743,85 @@ uvmclear(pagetable_t pagetable, uint64_t va)
     if (pte == 0)
         panic("uvmclear");
     *pte &= ~PTE_U;
+    uvmflush_page(pagetable, PGROUNDDOWN(va));
+}
+
+// 現在のプロセスがcopyin/copyoutで最後に変換したページva0の物理アドレスを
+// 返す. writeが0でなければcopyoutで書き込めることを確認した変換だけを使う.
+// キャッシュにない、またはその後にユーザPTEが変更されていたら0を返す.
+static inline uint64_t
+uva_lookup(struct proc *p, pagetable_t pagetable, uint64_t va0, int write)
+{
+    if (p == 0 || p->pagetable != pagetable || p->uva_va != va0
+     || p->uva_gen != __atomic_load_n(&uvm_gen, __ATOMIC_RELAXED)
+     || (write && !p->uva_write))
+        return 0;
+    return p->uva_pa;
+}
+
+// va0の変換をキャッシュする. genは変換を始める前のuvm_gen.
+static inline void
+uva_fill(struct proc *p, pagetable_t pagetable, uint64_t va0, uint64_t pa0, int write, uint64_t gen)
+{
+    if (p == 0 || p->pagetable != pagetable)
+        return;
+    p->uva_va = va0;
+    p->uva_pa = pa0;
+    p->uva_write = write;
+    p->uva_gen = gen;
+}
+
+// p[0..n)で最初の'\0'の位置を返す. なければnを返す.
+// pは物理ページ内のアドレスで、ワード単位で読んでもページを越えない.
+static uint64_t
+strnlen_page(const char *p, uint64_t n)
+{
+    const uint64_t ones = 0x0101010101010101UL, highs = 0x8080808080808080UL;
+    const char *s = p;
+    uint64_t w;
+
+    while (n > 0 && ((uint64_t)s & 7)) {
+        if (*s == '\0')
+            return s - p;
+        s++, n--;
+    }
+    // ワード内に0のバイトがあるかを一度に調べる
+    for (; n >= 8; s += 8, n -= 8) {
+        w = *(const uint64_t *)s;
+        if ((w - ones) & ~w & highs)
+            break;
+    }
+    while (n > 0 && *s != '\0')
+        s++, n--;
+    return s - p;
+}
+
+// walkaddr()と同じだが、実行ファイルやmmapされたファイルのまだ
+// 読み込まれていないページの場合は読み込んでから物理アドレスを返す.
+// scauseはalloc_mmap_page()に渡す例外の種類.
+static uint64_t
+walkaddr_fault(pagetable_t pagetable, uint64_t va, uint64_t scause)
+{
+    struct proc *p = myproc();
+    uint64_t pa = walkaddr(pagetable, va);
+    int ret, locked;
+
+    if (pa != 0 || p == 0 || p->pagetable != pagetable)
+        return pa;
+    // スピンロック保持中はexec_fault()が読み込みを断るのでmmap_lockは取らない.
+    // mmap/munmap/brk等のシステムコール中（sysproc.cでmmap_lockを取得済み）の
+    // copyin/copyoutではすでに保持している
+    locked = mycpu()->noff > 0 || holdingsleep(&p->mm->mmap_lock);
+    if (!locked)
+        acquiresleep(&p->mm->mmap_lock);
+    if ((ret = exec_fault(p, va)) == 1 && mycpu()->noff == 0
+     && find_mmap_region(p, (void *)va) != NULL)
+        ret = alloc_mmap_page(p, va, scause) < 0 ? -1 : 0;
+    if (!locked)
+        releasesleep(&p->mm->mmap_lock);
+    if (ret == 0)
+        pa = walkaddr(pagetable, va);
+    return pa;
 }
 
 // カーネル空間からユーザ空間にコピーする.
@@ -413,21 +830,32 @@ uvmclear(pagetable_t pagetable, uint64_t va)
 int
 copyout(pagetable_t pagetable, uint64_t dstva, char *src, uint64_t len)
 {
-    uint64_t n, va0, pa0;
+    struct proc *p = myproc();
+    uint64_t n, va0, pa0, gen;
 
     while (len > 0) {
         va0 = PGROUNDDOWN(dstva);
-        int ret = alloc_cow_page(pagetable, va0);
-        if (ret < 0) {
-            return -1;
-        } else if (ret == 1) {
-            trace("not cow");
-        }
+        // 同じページへの連続した書き込みはキャッシュした変換を使う
+        if ((pa0 = uva_lookup(p, pagetable, va0, 1)) == 0) {
+            // 未読み込みのページは先に読み込む
+            if (walkaddr_fault(pagetable, va0, SCAUSE_PAGE_STORE) == 0) {
+                trace("pa0 = 0: dstva: 0x%lx (va0: 0x%lx)", dstva, va0);
+                return -1;
+            }
+            int ret = alloc_cow_page(pagetable, va0);
+            if (ret < 0) {
+                return -1;
+            } else if (ret == 1) {
+                trace("not cow");
+            }
 
-        pa0 = walkaddr(pagetable, va0);
-        if (pa0 == 0) {
-            trace("pa0 = 0: dstva: 0x%lx (va0: 0x%lx)", dstva, va0);
-            return -1;
+            gen = __atomic_load_n(&uvm_gen, __ATOMIC_RELAXED);
+            pa0 = walkaddr(pagetable, va0);
+            if (pa0 == 0) {
+                trace("pa0 = 0: dstva: 0x%lx (va0: 0x%lx)", dstva, va0);
+                return -1;
+            }
+            uva_fill(p, pagetable, va0, pa0, 1, gen);
         }
 
         n = PGSIZE - (dstva - va0);
@@ -453,14 +881,19 @@ copyout(pagetable_t pagetable, uint64_t dstva, char *src, uint64_t len)
 int copyin(pagetable_t pagetable, char *dst, uint64_t srcva, uint64_t len)
 {
     trace("dst: %p, srcva: 0x%lx, len: %ld", dst, srcva, len);
-    uint64_t n, va0, pa0;
+    struct proc *p = myproc();
+    uint64_t n, va0, pa0, gen;
 
     while (len > 0) {
         va0 = PGROUNDDOWN(srcva);
-        pa0 = walkaddr(pagetable, va0);
-        if (pa0 == 0) {
-            trace("pa0 = 0: srcva: 0x%lx (va0: 0x%lx)", srcva, va0);
-            return -1;
+        if ((pa0 = uva_lookup(p, pagetable, va0, 0)) == 0) {
+            gen = __atomic_load_n(&uvm_gen, __ATOMIC_RELAXED);
+            pa0 = walkaddr_fault(pagetable, va0, SCAUSE_PAGE_LOAD);
+            if (pa0 == 0) {
+                trace("pa0 = 0: srcva: 0x%lx (va0: 0x%lx)", srcva, va0);
+                return -1;
+            }
+            uva_fill(p, pagetable, va0, pa0, 0, gen);
         }
         n = PGSIZE - (srcva - va0);
         if (n > len)
@@ -483,9 +916,9 @@ int copyin(pagetable_t pagetable, char *dst, uint64_t srcva, uint64_t len)
 int
 copyinstr(pagetable_t pagetable, char *dst, uint64_t srcva, uint64_t max)
 {
-    uint64_t n = 0, va0, pa0;
-    int got_null = 0;
-    trace("pid[%d] dst=%p, srcva=0x%lx, max=%ld", myproc()->pid, dst, srcva, max);
+    struct proc *p = myproc();
+    uint64_t n, len, va0, pa0, gen;
+    trace("pid[%d] dst=%p, srcva=0x%lx, max=%ld", p->pid, dst, srcva, max);
 
     if (srcva == 0UL) {
         // 空送信
@@ -493,40 +926,34 @@ copyinstr(pagetable_t pagetable, char *dst, uint64_t srcva, uint64_t max)
         return 0;
     }
 
-    while (got_null == 0 && max > 0) {
+    while (max > 0) {
         va0 = PGROUNDDOWN(srcva);
-        pa0 = walkaddr(pagetable, va0);
-        if (pa0 == 0) {
-            trace("va0: 0x%lx, pa0=0", va0);
-            return -1;
+        if ((pa0 = uva_lookup(p, pagetable, va0, 0)) == 0) {
+            gen = __atomic_load_n(&uvm_gen, __ATOMIC_RELAXED);
+            pa0 = walkaddr_fault(pagetable, va0, SCAUSE_PAGE_LOAD);
+            if (pa0 == 0) {
+                trace("va0: 0x%lx, pa0=0", va0);
+                return -1;
+            }
+            uva_fill(p, pagetable, va0, pa0, 0, gen);
         }
 
         n = PGSIZE - (srcva - va0);
         if (n > max)
             n = max;
 
-        char *p = (char *) (pa0 + (srcva - va0));
-        while (n > 0) {
-            if (*p == '\0') {
-                *dst = '\0';
-                got_null = 1;
-                break;
-            } else {
-                *dst = *p;
-            }
-            --n;
-            --max;
-            p++;
-            dst++;
+        // このページ内の文字列の長さを調べてまとめてコピーする
+        len = strnlen_page((char *)(pa0 + (srcva - va0)), n);
+        memmove(dst, (char *)(pa0 + (srcva - va0)), len);
+        if (len < n) {
+            dst[len] = '\0';
+            return 0;
         }
-
+        dst += n;
+        max -= n;
         srcva = va0 + PGSIZE;
     }
-    if (got_null) {
-        return 0;
-    } else {
-        return -1;
-    }
+    return -1;
 }
 
 int alloc_cow_page(pagetable_t pagetable, uint64_t va)
@@ -536,20 +963,46 @@ int alloc_cow_page(pagetable_t pagetable, uint64_t va)
         return -1;
     }
 
+    // 2MBページは書き込み可能な無名ページにしか使わず、COWにもしない
+    if (walkmega(pagetable, va) != 0)
+        return 1;
+
     pte_t *pte = walk(pagetable, va, 0);
     // COW領域でない
     if (pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0) {
         return 1;
     }
 
+    // 共有書き込みファイルマッピングの最初の書き込み: 書き込みを許可して
+    // 書き戻しキューに登録する
+    if (*pte & PTE_WP) {
+        if (!(*pte & PTE_W)) {
+            *pte |= PTE_W | PTE_D;
+            uvmflush_page(pagetable, PGROUNDDOWN(va));
+            if (myproc() && myproc()->pagetable == pagetable)
+                mmap_dirty(myproc(), PGROUNDDOWN(va), PTE2PA(*pte));
+        }
+        return 0;
+    }
+
+    // 同じアドレス空間の他のスレッドが同じページを同時にコピーしないようにする.
+    // 先にコピーされていた場合は書き込み可能になっている
+    acquire(&cow_lock);
+    if ((*pte & PTE_W) && (*pte & PTE_D) && !(*pte & PTE_COW)) {
+        release(&cow_lock);
+        return 0;
+    }
+
     // COW領域ではない書き込み不可アドレスの書き込み例外: プロセスをkill
     if (!(*pte & PTE_COW) && !(*pte & PTE_W)) {
+        release(&cow_lock);
         debug("RO addr: 0x%lx, *pte DAGU_XWRV = %08b", va, *pte & 0xff);
         return -1;
     }
 
     // COW領域ではない書き込み可アドレスの書き込み例外: ここでは何もしない
     if ((*pte & PTE_W) || !(*pte & PTE_COW)) {
+        release(&cow_lock);
         trace("pid[%d] va: 0x%lx not COW", myproc()->pid)
         return 1;
     }
@@ -558,35 +1011,38 @@ int alloc_cow_page(pagetable_t pagetable, uint64_t va)
     uint64_t pa = PTE2PA(*pte);
     uint64_t va0 = PGROUNDDOWN(va);
     char *mem;
+    int ret = 0;
 
     // 複数のプロセスがこのページを参照しているのでコピーが必要
     if (page_refcnt_get((void *) pa) > 1) {
         if ((mem = kalloc()) == 0) {
             error("no memory");
-            return -1;
-        }
-        memmove(mem, (char*)pa, PGSIZE);
-        uvmunmap(pagetable, va0, 1, 1);
-        flags &= ~PTE_COW;
-        flags |= PTE_W;
-        if (mappages(pagetable, va0, PGSIZE, (uint64_t)mem, flags) != 0) {
-            kfree(mem);
-            error("mappages error: va=0x%lx", va);
-            return -1;
+            ret = -1;
+        } else {
+            memmove(mem, (char*)pa, PGSIZE);
+            flags &= ~PTE_COW;
+            flags |= PTE_W | PTE_D;
+            *pte = PA2PTE(mem) | flags;
+            uvmflush_page(pagetable, va0);
+            // 元のページの参照を1つ減らす（最後の参照ならここで解放される）.
+            // 他のhartのTLBから古い変換を消してから行う
+            kfree((void *)pa);
+            trace("alloc ok: va=0x%lx, pa: %p", va, mem);
+            fence_i();
         }
-        trace("alloc ok: va=0x%lx, pa: %p", va, mem);
-        fence_i();
-        return 0;
+    // 他の参照はすでになくなっているのでそのまま書き込み可能にする
     } else if (page_refcnt_get((void *) pa) == 1){
-        *pte |= PTE_W;
-        *pte &= ~PTE_C;
+        *pte |= PTE_W | PTE_D;
+        *pte &= ~PTE_COW;
+        uvmflush_page(pagetable, va0);
         trace("flag updated: pa: 0x%lx", pa);
         fence_i();
-        return 0;
     } else {
         error("unknown error: va=0x%lx", va);
-        return -1;
+        ret = -1;
     }
+    release(&cow_lock);
+    return ret;
 }
 
 void uvmdump(pagetable_t pagetable, pid_t pid, char *name)
@@ -607,6 +1063,8 @@ void uvmdump(pagetable_t pagetable, pid_t pid, char *name)
                     uint64_t pa1 = PTE2PA(*pte_1);
                     uint64_t va1 = (uint64_t)i << 30 | (uint64_t)j << 21;
                     printf("  [% 3d][% 3d]   va: 0x%010lx, pa: 0x%010lx, pte: 0x%lx\n", i, j, va1, pa1, *pte_1);
+                    if (!PTE_TABLE(*pte_1))
+                        continue;
                     for (int k = 0; k < 512; k++) {
                         pte_t *pte_0 = &pg0[k];
                         if (*pte_0 & PTE_V) {
@@ -0,0 +1,207 @@
+// 待ち行列とsleep()/wakeup().
+//
+// 待ち行列（struct wait_queue）には待っているプロセスだけがつながるので、
+// 起床はproc[]全体ではなく待っている数に比例する時間で済む.
+// 排他的な待ち（wq_sleep_exclusive）はwq_wakeup()で1つだけ起こすので、
+// パイプやバッファを待つプロセスが一斉に起きて奪い合うことがない.
+//
+// 従来のsleep(chan)/wakeup(chan)はchanのハッシュで選んだ待ち行列を使う.
+// 同じバケットには他のchanの待ちもつながるのでchanが一致するものだけ起こす.
+//
+// ロックの順序は（呼び出し側の）lk -> wait_queue.lock -> p->lock.
+
+#include <common/types.h>
+#include <common/param.h>
+#include <common/riscv.h>
+#include <spinlock.h>
+#include <proc.h>
+#include <defs.h>
+#include <printf.h>
+#include <waitqueue.h>
+#include <errno.h>
+
+#define NWAITHASH   64      // 2のべき乗
+
+static struct wait_queue waithash[NWAITHASH];
+
+void waitinit(void)
+{
+    for (int i = 0; i < NWAITHASH; i++)
+        wq_init(&waithash[i], "waithash");
+}
+
+void wq_init(struct wait_queue *wq, char *name)
+{
+    initlock(&wq->lock, name);
+    list_init(&wq->head);
+}
+
+static struct wait_queue *chan_queue(void *chan)
+{
+    return &waithash[((uint64_t)chan * 0x9e3779b97f4a7c15UL) >> 58];
+}
+
+// lkを保持して呼び出す. lkを外してwqで眠り、起床したらlkを再獲得する.
+// intrであればシグナルでも起床し、眠る前にシグナルがあれば眠らずに
+// -EINTRを返す.
+static int wait_on(struct wait_queue *wq, void *chan, int exclusive, int intr, struct spinlock *lk)
+{
+    struct proc *p = myproc();
+    struct wait_entry e;
+
+    e.p = p;
+    e.chan = chan;
+    e.exclusive = exclusive;
+
+    acquire(&wq->lock);
+    if (exclusive)
+        list_push_back(&wq->head, &e.link);
+    else
+        list_push_front(&wq->head, &e.link);
+
+    // p->lockを保持している間はwake_up()がpを起こせないので、
+    // wq->lockとlkを外してからsched()するまでの起床を取りこぼさない
+    acquire(&p->lock);  //DOC: sleeplock1
+    // send_signal()はシグナルを保留してからp->lockを獲得してwakeup_intr()
+    // するので、ここで見えなければ眠った後に起こされる
+    if (intr && signal_pending(p)) {
+        list_drop(&e.link);
+        release(&p->lock);
+        release(&wq->lock);
+        return -EINTR;
+    }
+    release(&wq->lock);
+    release(lk);
+
+    // Go to sleep.
+    p->chan = chan ? chan : wq;
+    p->sleep_intr = intr;
+    p->state = SLEEPING;
+
+    sched();
+
+    // Tidy up.
+    p->chan = 0;
+    p->sleep_intr = 0;
+    release(&p->lock);
+
+    // kill等、wake_up()以外で起床した場合はまだつながっている
+    acquire(&wq->lock);
+    if (!list_empty(&e.link))
+        list_drop(&e.link);
+    release(&wq->lock);
+
+    // Reacquire original lock.
+    acquire(lk);
+    return 0;
+}
+
+// wqで待っているプロセスを起こす. chanがNULLでなければchanで待っている
+// ものだけ. 排他的な待ちをnr_exclusive個起こしたら止める（0なら全部）.
+// 起こしたプロセスの数を返す.
+static int wake_up(struct wait_queue *wq, void *chan, int nr_exclusive)
+{
+    struct wait_entry *e, *t;
+    struct proc *p;
+    int exclusive, woken = 0;
+
+    // 待っているプロセスはwake_up()を呼ぶ側と同じlkを保持してつながるので
+    // ロックなしで空を確認してよい（clockintr()等の毎回の呼び出しを軽くする）
+    if (list_empty(&wq->head))
+        return 0;
+
+    acquire(&wq->lock);
+    list_foreach_safe(e, t, &wq->head, link) {
+        if (chan && e->chan != chan)
+            continue;
+        // eは待っているプロセスのスタックにあるが、wq->lockを外すまでは
+        // wait_on()から戻らないので参照してよい
+        p = e->p;
+        exclusive = e->exclusive;
+        list_drop(&e->link);
+        list_init(&e->link);
+
+        acquire(&p->lock);
+        if (p->state == SLEEPING) {
+            p->state = RUNNABLE;
+            runq_add(p, RQ_WAKEUP);
+            release(&p->lock);
+            woken++;
+            if (exclusive && nr_exclusive > 0 && --nr_exclusive == 0)
+                break;
+        } else {
+            // killで既に起床している
+            release(&p->lock);
+        }
+    }
+    release(&wq->lock);
+    return woken;
+}
+
+// lkを保持して呼び出す. wqで眠る.
+void wq_sleep(struct wait_queue *wq, struct spinlock *lk)
+{
+    wait_on(wq, NULL, 0, 0, lk);
+}
+
+// lkを保持して呼び出す. wqで排他的に眠る.
+void wq_sleep_exclusive(struct wait_queue *wq, struct spinlock *lk)
+{
+    wait_on(wq, NULL, 1, 0, lk);
+}
+
+// 非排他的な待ちをすべてと、排他的な待ちを1つ起こす.
+int wq_wakeup(struct wait_queue *wq)
+{
+    return wake_up(wq, NULL, 1);
+}
+
+// すべての待ちを起こす.
+int wq_wakeup_all(struct wait_queue *wq)
+{
+    return wake_up(wq, NULL, 0);
+}
+
+// Atomically release lock and sleep on chan.
+// Reacquires lock when awakened.
+void
+sleep(void *chan, struct spinlock *lk)
+{
+    wait_on(chan_queue(chan), chan, 0, 0, lk);
+}
+
+// sleep()と同じだがシグナルでも起床する. シグナルで起こされたか、
+// 眠る前にシグナルがあれば-EINTRを返す. lkは再獲得している.
+int
+sleep_intr(void *chan, struct spinlock *lk)
+{
+    struct proc *p = myproc();
+
+    wait_on(chan_queue(chan), chan, 0, 1, lk);
+    return signal_pending(p) ? -EINTR : 0;
+}
+
+// send_signal()から呼び出す. pがsleep_intr()で眠っていれば起こして
+// 1を返す. シグナルはユーザモードに戻る際に処理される.
+int
+wakeup_intr(struct proc *p)
+{
+    int ret = 0;
+
+    acquire(&p->lock);
+    if (p->state == SLEEPING && p->sleep_intr) {
+        p->state = RUNNABLE;
+        runq_add(p, RQ_WAKEUP);
+        ret = 1;
+    }
+    release(&p->lock);
+    return ret;
+}
+
+// Wake up all processes sleeping on chan.
+// Must be called without any p->lock.
+void
+wakeup(void *chan)
+{
+    wake_up(chan_queue(chan), chan, 0);
+}
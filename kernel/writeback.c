@@ -0,0 +1,236 @@
+// 共有ファイルマッピング（MAP_SHARED|PROT_WRITE）のdirtyページの書き戻し.
+//
+// これらのページはPTE_WPを付けて書き込み禁止でマッピングしておき、
+// 最初の書き込みでalloc_cow_page()からmmap_dirty()経由でwb_dirty()を
+// 呼んでキューに登録する. msync/munmapは書き込まれたページを再び
+// 書き込み禁止に戻してキューに登録する.
+// 書き戻しスレッドはキューをまとめて取り出し、(inode, offset)順に
+// ソートして、連続するページを1つのトランザクションで書き込む.
+
+#include <common/types.h>
+#include <common/param.h>
+#include <common/riscv.h>
+#include <common/file.h>
+#include <defs.h>
+#include <errno.h>
+#include <printf.h>
+#include <proc.h>
+#include <spinlock.h>
+#include <sleeplock.h>
+#include <linux/time.h>
+
+#define WB_QSIZE    128     // キューの長さ
+#define WB_BATCH    32      // これだけ溜まったらスレッドを起こす
+#define WB_DELAY    500     // 最初の登録からこのjiffies（5秒）経ったら書き戻す
+// 1トランザクションで書けるページ数（filewrite()と同じ計算）
+#define WB_RUN      (((MAXOPBLOCKS-1-1-2) / 2) * BSIZE / PGSIZE)
+
+struct wb_entry {
+    struct inode *ip;       // idup()済み
+    uint32_t off;           // ページ境界のファイルオフセット
+    uint64_t pa;            // page_refcnt_inc()済み
+    uint64_t seq;
+};
+
+static struct {
+    struct spinlock lock;
+    struct wb_entry q[WB_QSIZE];
+    int count;
+    int kick;               // 溜まっていなくても書き戻す
+    uint64_t since;         // キューが空でなくなった時のjiffies
+    uint64_t seq;           // 最後に登録したエントリの番号
+    uint64_t done;          // 書き戻しが完了したエントリの番号
+    uint64_t error;         // 書き戻しに失敗したバッチの最後の番号
+} wb;
+
+// スレッドだけが使う
+static struct wb_entry batch[WB_QSIZE];
+
+// ipのoffのページpaを書き戻しキューに登録して、エントリの番号を返す.
+// 同じページが既に登録済みならその番号を返す. 別々にマッピングした
+// プロセスが同じoffの異なるページを登録した場合はどちらも書き戻す.
+// キューが一杯の場合、waitが0でなければ
+// 空くまで待ち、0なら登録せずに0を返す.
+uint64_t wb_dirty(struct inode *ip, uint32_t off, uint64_t pa, int wait)
+{
+    struct wb_entry *e;
+    uint64_t seq;
+
+    acquire(&wb.lock);
+    for (e = wb.q; e < &wb.q[wb.count]; e++) {
+        if (e->ip == ip && e->off == off && e->pa == pa) {
+            seq = e->seq;
+            release(&wb.lock);
+            return seq;
+        }
+    }
+    while (wb.count == WB_QSIZE) {
+        if (!wait) {
+            release(&wb.lock);
+            return 0;
+        }
+        wb.kick = 1;
+        wakeup(&wb);
+        sleep(&wb.count, &wb.lock);
+    }
+    e = &wb.q[wb.count++];
+    e->ip = idup(ip);
+    e->off = off;
+    e->pa = pa;
+    page_refcnt_inc((void *)pa);
+    e->seq = seq = ++wb.seq;
+    if (wb.count == 1)
+        wb.since = jiffies;
+    if (wb.count >= WB_BATCH)
+        wakeup(&wb);
+    release(&wb.lock);
+    return seq;
+}
+
+// 現在の最後のエントリ番号
+uint64_t wb_seq(void)
+{
+    uint64_t seq;
+
+    acquire(&wb.lock);
+    seq = wb.seq;
+    release(&wb.lock);
+    return seq;
+}
+
+// キューにあるページをすぐに書き戻させる
+void wb_kick(void)
+{
+    acquire(&wb.lock);
+    if (wb.count > 0) {
+        wb.kick = 1;
+        wakeup(&wb);
+    }
+    release(&wb.lock);
+}
+
+// エントリtoまでの書き戻しを待つ. fromより後のエントリの書き戻しに
+// 失敗していたら-EIOを返す.
+long wb_wait(uint64_t from, uint64_t to)
+{
+    long ret = 0;
+
+    acquire(&wb.lock);
+    if (wb.count > 0) {
+        wb.kick = 1;
+        wakeup(&wb);
+    }
+    while (wb.done < to)
+        sleep(&wb.done, &wb.lock);
+    if (wb.error > from)
+        ret = -EIO;
+    release(&wb.lock);
+    return ret;
+}
+
+// clockintr()から呼び出す. 古いエントリがあればスレッドを起こす
+void wb_tick(void)
+{
+    acquire(&wb.lock);
+    if (wb.count > 0 && !wb.kick && jiffies - wb.since >= WB_DELAY) {
+        wb.kick = 1;
+        wakeup(&wb);
+    }
+    release(&wb.lock);
+}
+
+// (ip, off)順の挿入ソート. nはWB_QSIZE以下.
+// 安定なので同じ(ip, off)のエントリは登録順に書き込まれる
+static void wb_sort(struct wb_entry *b, int n)
+{
+    struct wb_entry t;
+    int i, j;
+
+    for (i = 1; i < n; i++) {
+        t = b[i];
+        for (j = i; j > 0 && (b[j-1].ip > t.ip || (b[j-1].ip == t.ip && b[j-1].off > t.off)); j--)
+            b[j] = b[j-1];
+        b[j] = t;
+    }
+}
+
+// b[0..n)は同じinodeの連続したページ. 1トランザクションで書き込む
+static int wb_write_run(struct wb_entry *b, int n)
+{
+    struct inode *ip = b[0].ip;
+    struct timespec ts;
+    uint32_t len;
+    int i, ret = 0;
+
+    begin_op();
+    ilock(ip);
+    for (i = 0; i < n; i++) {
+        // ファイルを切り詰めた後のページは書かない（ファイルを伸ばさない）
+        if (b[i].off >= ip->size)
+            break;
+        len = ip->size - b[i].off > PGSIZE ? PGSIZE : ip->size - b[i].off;
+        if (writei(ip, 0, b[i].pa, b[i].off, len) != len) {
+            error("inum %d off 0x%x failed", ip->inum, b[i].off);
+            ret = -1;
+            break;
+        }
+    }
+    clock_gettime(0, CLOCK_REALTIME, &ts);
+    ip->mtime = ip->atime = ts;
+    iupdate(ip);
+    iunlock(ip);
+    end_op();
+    return ret;
+}
+
+// 書き戻しスレッド
+static void wb_thread(void)
+{
+    uint64_t last;
+    int n, i, j, failed;
+
+    for (;;) {
+        acquire(&wb.lock);
+        while (wb.count == 0 || (wb.count < WB_BATCH && !wb.kick))
+            sleep(&wb, &wb.lock);
+        n = wb.count;
+        memmove(batch, wb.q, n * sizeof(struct wb_entry));
+        last = wb.seq;
+        wb.count = 0;
+        wb.kick = 0;
+        wakeup(&wb.count);
+        release(&wb.lock);
+
+        wb_sort(batch, n);
+        failed = 0;
+        for (i = 0; i < n; i = j) {
+            for (j = i + 1; j < n && j - i < WB_RUN && batch[j].ip == batch[i].ip
+                 && batch[j].off == batch[j-1].off + PGSIZE; j++)
+                ;
+            if (wb_write_run(&batch[i], j - i) < 0)
+                failed = 1;
+        }
+        trace("wrote %d pages", n);
+
+        for (i = 0; i < n; i++) {
+            kfree((void *)batch[i].pa);
+            begin_op();
+            iput(batch[i].ip);
+            end_op();
+        }
+
+        acquire(&wb.lock);
+        wb.done = last;
+        if (failed)
+            wb.error = last;
+        wakeup(&wb.done);
+        release(&wb.lock);
+    }
+}
+
+void wb_init(void)
+{
+    initlock(&wb.lock, "writeback");
+    if (kthread_create("writeback", wb_thread) < 0)
+        panic("wb_init");
+}
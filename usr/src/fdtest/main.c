@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// ファイルディスクリプタの表を確認する.
+// 埋め込みの64個を超えてfdを割り当てられること、最小の空いているfdが
+// 返ること、forkで大きな表が複製されること、RLIMIT_NOFILEの取得と
+// 設定、上限でEMFILE/EINVAL/EBADFが返ることを確かめる.
+
+#define NFD     200
+
+static int ok = 0, ng = 0;
+
+static void
+check(int cond, char *what)
+{
+  if (cond) {
+    ok++;
+  } else {
+    printf("  %s: failed\n", what);
+    ng++;
+  }
+}
+
+static void
+close_from(int from, int to)
+{
+  for (int fd = from; fd < to; fd++)
+    close(fd);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct rlimit rl, old;
+  int fd, last = -1, pid, status, n;
+
+  printf("fdtest: getrlimit\n");
+  check(getrlimit(RLIMIT_NOFILE, &old) == 0, "getrlimit");
+  check(old.rlim_cur >= NFD && old.rlim_cur <= old.rlim_max, "default limit");
+
+  printf("fdtest: expand\n");
+  for (int i = 0; i < NFD; i++) {
+    if ((fd = dup(0)) < 0)
+      break;
+    if (last >= 0 && fd != last + 1)
+      break;
+    last = fd;
+  }
+  check(last >= NFD, "dup beyond 64");
+  close(70);
+  check(dup(0) == 70, "lowest free fd");
+  check(fcntl(0, F_DUPFD, 500) == 500, "F_DUPFD 500");
+  check(fcntl(80, F_SETFD, FD_CLOEXEC) == 0, "F_SETFD");
+
+  // 子には大きな表が複製される
+  if ((pid = fork()) == 0) {
+    if (fcntl(500, F_GETFD) != 0 || fcntl(80, F_GETFD) != FD_CLOEXEC)
+      exit(1);
+    exit(0);
+  }
+  check(waitpid(pid, &status, 0) == pid && WIFEXITED(status)
+        && WEXITSTATUS(status) == 0, "fork copies table");
+  close_from(3, last + 1);
+  close(500);
+
+  printf("fdtest: setrlimit\n");
+  rl.rlim_cur = 100;
+  rl.rlim_max = old.rlim_max;
+  check(setrlimit(RLIMIT_NOFILE, &rl) == 0, "setrlimit");
+  check(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur == 100, "limit set");
+  for (n = 0; dup(0) >= 0; n++)
+    ;
+  check(errno == EMFILE, "EMFILE");
+  check(n == 100 - 3, "fds up to limit");
+  check(fcntl(0, F_DUPFD, 100) < 0 && errno == EINVAL, "F_DUPFD over limit");
+  check(dup2(0, 100) < 0 && errno == EBADF, "dup2 over limit");
+  close_from(3, 100);
+  rl.rlim_cur = rl.rlim_max + 1;
+  check(setrlimit(RLIMIT_NOFILE, &rl) < 0 && errno == EINVAL, "cur > max");
+  check(setrlimit(RLIMIT_NOFILE, &old) == 0, "restore");
+
+  printf("fdtest: ok: %d, ng: %d\n", ok, ng);
+  exit(ng == 0 ? 0 : 1);
+}
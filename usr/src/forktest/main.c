@@ -6,6 +6,10 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
+#include <spawn.h>
+
+extern char **environ;
 
 int ok = 0, ng = 0;
 
@@ -99,11 +103,151 @@ static void fork_test3(void) {
     ok++;
 }
 
+static void fork_test4(void) {
+    printf("[04] cow\n");
+
+    int *p1 = mmap((void *)0, 4096 * 4, PROT_READ | PROT_WRITE,
+                           MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (p1 == MAP_FAILED) {
+        printf("mmap failed\n");
+        ng++;
+        return;
+    }
+    p1[0] = 23;
+    p1[1024] = 45;
+
+    int pid = fork();
+    if (pid < 0) {
+        printf("fork failed\n");
+        ng++;
+        return;
+    }
+    if (pid == 0) {
+        // 子の書き込みは親に見えず、親の書き込みは子に見えない
+        sleep(1);
+        if (p1[0] != 23 || p1[1024] != 45)
+            exit(1);
+        p1[0] = 100;
+        exit(p1[0] == 100 ? 0 : 2);
+    }
+    p1[1024] = 46;
+    int status;
+    wait(&status);
+    if (WEXITSTATUS(status) != 0 || p1[0] != 23 || p1[1024] != 46) {
+        printf("04: ng, status=%d, p1[0]=%d, p1[1024]=%d\n", WEXITSTATUS(status), p1[0], p1[1024]);
+        ng++;
+    } else {
+        printf("04: ok\n");
+        ok++;
+    }
+    munmap(p1, 4096 * 4);
+}
+
+static long elapsed_us(struct timespec *s, struct timespec *e) {
+    return (e->tv_sec - s->tv_sec) * 1000000L + (e->tv_nsec - s->tv_nsec) / 1000;
+}
+
+// fork+exit+waitの平均時間を常駐メモリ量を変えて計測する.
+// COWが効いていれば常駐メモリ量にほとんど比例しない
+static void fork_test5(void) {
+    static const size_t sizes[] = { 0, 1 << 20, 4 << 20 };
+    struct timespec start, end;
+    int i, n, loops = 20;
+
+    printf("[05] fork latency\n");
+
+    for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+        char *buf = NULL;
+        if (sizes[i]) {
+            buf = mmap((void *)0, sizes[i], PROT_READ | PROT_WRITE,
+                            MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+            if (buf == MAP_FAILED) {
+                printf("mmap failed\n");
+                ng++;
+                return;
+            }
+            memset(buf, 1, sizes[i]);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (n = 0; n < loops; n++) {
+            int pid = fork();
+            if (pid < 0) {
+                printf("fork failed\n");
+                ng++;
+                return;
+            }
+            if (pid == 0)
+                _exit(0);
+            wait(NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("  resident %4ld KB: %ld us/fork\n", (long)(sizes[i] >> 10),
+            elapsed_us(&start, &end) / loops);
+
+        if (buf)
+            munmap(buf, sizes[i]);
+    }
+    printf("05: ok\n");
+    ok++;
+}
+
+// fork+execveとposix_spawn（CLONE_VM|CLONE_VFORK）の比較
+static void fork_test6(void) {
+    char *argv[] = { "echo", "-n", "", NULL };
+    struct timespec start, end;
+    int n, pid, status, loops = 10;
+    long t_fork, t_spawn;
+
+    printf("[06] posix_spawn\n");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (n = 0; n < loops; n++) {
+        pid = fork();
+        if (pid < 0) {
+            printf("fork failed\n");
+            ng++;
+            return;
+        }
+        if (pid == 0) {
+            execve("/bin/echo", argv, environ);
+            _exit(127);
+        }
+        waitpid(pid, &status, 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    t_fork = elapsed_us(&start, &end) / loops;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (n = 0; n < loops; n++) {
+        if (posix_spawn(&pid, "/bin/echo", NULL, NULL, argv, environ) != 0) {
+            printf("posix_spawn failed\n");
+            ng++;
+            return;
+        }
+        waitpid(pid, &status, 0);
+        if (WEXITSTATUS(status) != 0) {
+            printf("06: ng, status=%d\n", WEXITSTATUS(status));
+            ng++;
+            return;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    t_spawn = elapsed_us(&start, &end) / loops;
+
+    printf("  fork+exec: %ld us, posix_spawn: %ld us\n", t_fork, t_spawn);
+    printf("06: ok\n");
+    ok++;
+}
+
 int main(void) {
     fork_test0();
     fork_test1();
     fork_test2();
     fork_test3();
+    fork_test4();
+    fork_test5();
+    fork_test6();
     printf("fork test:  ok: %d, ng: %d\n", ok, ng);
     return 0;
 }
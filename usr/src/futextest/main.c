@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+// futexを確認する.
+// スレッドがないのでMAP_SHAREDの無名ページを共有した子プロセスを待たせ、
+// FUTEX_WAIT/WAKE/CMP_REQUEUE/WAIT_BITSETとタイムアウトを確かめる.
+
+#define FUTEX_WAIT          0
+#define FUTEX_WAKE          1
+#define FUTEX_CMP_REQUEUE   4
+#define FUTEX_WAIT_BITSET   9
+#define FUTEX_WAKE_BITSET   10
+#define FUTEX_PRIVATE_FLAG  128
+
+#define NCHILD  3
+
+static int ok = 0, ng = 0;
+
+static long
+futex(int *uaddr, int op, int val, void *timeout, int *uaddr2, int val3)
+{
+  return syscall(SYS_futex, uaddr, op, val, timeout, uaddr2, val3);
+}
+
+static long
+now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+check(int cond, char *what)
+{
+  if (cond) {
+    ok++;
+  } else {
+    printf("  %s: failed\n", what);
+    ng++;
+  }
+}
+
+// *wordが0の間FUTEX_WAITで待つ子をn個作る
+static void
+spawn_waiters(int *word, int n, int op, int bitset)
+{
+  for (int i = 0; i < n; i++) {
+    if (fork() == 0) {
+      while (__atomic_load_n(word, __ATOMIC_SEQ_CST) == 0) {
+        if (futex(word, op, 0, 0, 0, bitset) < 0 && errno != EAGAIN && errno != EINTR)
+          exit(1);
+      }
+      exit(0);
+    }
+  }
+}
+
+// 子がn個起きるまでuaddrをwakeする. 起こした数を返す
+static int
+wake_all(int *word, int n, int op, int bitset)
+{
+  struct timespec ts = { 0, 10000000 };
+  int woken = 0;
+  long r;
+
+  for (int i = 0; i < 200 && woken < n; i++) {
+    if ((r = futex(word, op, n - woken, 0, 0, bitset)) > 0)
+      woken += r;
+    else
+      nanosleep(&ts, 0);
+  }
+  return woken;
+}
+
+static int
+reap(int n)
+{
+  int status, bad = 0;
+
+  for (int i = 0; i < n; i++) {
+    if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      bad++;
+  }
+  return bad;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int *w = mmap(0, 4096, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+  struct timespec ts = { 0, 50000000 };
+  int priv = 0;
+  long start, t;
+
+  if (w == MAP_FAILED) {
+    printf("futextest: mmap failed\n");
+    exit(1);
+  }
+
+  printf("futextest: wait\n");
+  w[0] = 1;
+  check(futex(&priv, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, 1, 0, 0, 0) < 0 && errno == EAGAIN, "EAGAIN");
+  check(futex(&w[0], FUTEX_WAKE, 1, 0, 0, 0) == 0, "wake nobody");
+  start = now_ms();
+  check(futex(&priv, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, 0, &ts, 0, 0) < 0 && errno == ETIMEDOUT, "ETIMEDOUT");
+  t = now_ms() - start;
+  check(t >= 40 && t < 500, "timeout 50ms");
+  check(futex((int *)((char *)w + 1), FUTEX_WAIT, 0, 0, 0, 0) < 0 && errno == EINVAL, "unaligned");
+
+  printf("futextest: wake\n");
+  w[0] = 0;
+  spawn_waiters(&w[0], NCHILD, FUTEX_WAIT, 0);
+  check(wake_all(&w[0], 1, FUTEX_WAKE, 0) == 1, "wake one");
+  w[0] = 1;
+  check(wake_all(&w[0], NCHILD - 1, FUTEX_WAKE, 0) == NCHILD - 1, "wake rest");
+  check(reap(NCHILD) == 0, "waiters exit");
+
+  printf("futextest: cmp_requeue\n");
+  w[0] = 0;
+  w[1] = 0;
+  spawn_waiters(&w[0], 2, FUTEX_WAIT, 0);
+  {
+    struct timespec wait = { 0, 10000000 };
+    long r = 0;
+    // 2つとも待つまで移し続ける
+    for (int i = 0; i < 200 && r < 2; i++) {
+      long n = futex(&w[0], FUTEX_CMP_REQUEUE, 0, (void *)(2L - r), &w[1], 0);
+      if (n > 0)
+        r += n;
+      else
+        nanosleep(&wait, 0);
+    }
+    check(r == 2, "requeued");
+    check(futex(&w[0], FUTEX_CMP_REQUEUE, 0, (void *)1L, &w[1], 5) < 0 && errno == EAGAIN, "cmp mismatch");
+  }
+  check(futex(&w[0], FUTEX_WAKE, 2, 0, 0, 0) == 0, "none left on first");
+  w[0] = 1;
+  check(wake_all(&w[1], 2, FUTEX_WAKE, 0) == 2, "wake requeued");
+  check(reap(2) == 0, "requeued exit");
+
+  printf("futextest: bitset\n");
+  w[2] = 0;
+  spawn_waiters(&w[2], 1, FUTEX_WAIT_BITSET, 0x1);
+  nanosleep(&ts, 0);
+  check(futex(&w[2], FUTEX_WAKE_BITSET, 1, 0, 0, 0x2) == 0, "bitset mismatch");
+  w[2] = 1;
+  check(wake_all(&w[2], 1, FUTEX_WAKE_BITSET, 0x3) == 1, "bitset match");
+  check(reap(1) == 0, "bitset exit");
+
+  printf("futextest: ok: %d, ng: %d\n", ok, ng);
+  exit(ng == 0 ? 0 : 1);
+}
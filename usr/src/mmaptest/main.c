@@ -10,7 +10,7 @@
 #include <signal.h>
 
 #define MMAPBASE    0x2000000000UL
-#define MMAPTOP     0x3FFFFFD000UL
+#define MMAPTOP     0x3FFFFBE000UL
 
 char *filename = "mmaptest.txt";
 
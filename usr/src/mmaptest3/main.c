@@ -6,12 +6,17 @@
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <errno.h>
 
 #define BSIZE        512
 #define PGSIZE      4096
 
 void mmap_test();
 void fork_test();
+void fault_around_test();
+void madvise_test();
+void msync_test();
+void hugepage_test();
 void more_test();
 char buf[PGSIZE];
 
@@ -20,6 +25,10 @@ main(int argc, char *argv[])
 {
   mmap_test();
   fork_test();
+  fault_around_test();
+  madvise_test();
+  msync_test();
+  hugepage_test();
   // more_testはladyアクセスを前提としているのでテストは行わない
   //more_test();
   printf("mmaptest: all tests succeeded\n");
@@ -355,6 +364,248 @@ fork_test(void)
   printf("test fork: OK\n");
 }
 
+//
+// 多ページのファイルをmmapして、順方向と逆方向に読み込む.
+// 各ページはフォルト時にまとめて読み込まれるが、内容は変わらないこと、
+// mmapしてもfdのファイルオフセットは変わらないことをチェックする.
+//
+#define FA_NPAGES   64
+
+static void
+_v2(char *p, int i)
+{
+  if (p[i * PGSIZE] != 'a' + i % 26 || p[i * PGSIZE + PGSIZE - 1] != 'a' + i % 26) {
+    printf("mismatch at page %d, got 0x%x\n", i, p[i * PGSIZE]);
+    err("fault around mismatch");
+  }
+}
+
+void
+fault_around_test(void)
+{
+  int fd, i, pid;
+  char *p;
+  const char * const f = "mmap.fa";
+
+  printf("test fault around\n");
+
+  unlink(f);
+  if ((fd = open(f, O_WRONLY | O_CREAT)) == -1)
+    err("open (fa1)");
+  for (i = 0; i < FA_NPAGES; i++) {
+    memset(buf, 'a' + i % 26, PGSIZE);
+    if (write(fd, buf, PGSIZE) != PGSIZE)
+      err("write (fa)");
+  }
+  close(fd);
+
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open (fa2)");
+
+  // 順方向
+  p = mmap(0, PGSIZE*FA_NPAGES, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (fa1)");
+  if (lseek(fd, 0, SEEK_CUR) != 0)
+    err("mmap moved file offset");
+  for (i = 0; i < FA_NPAGES; i++)
+    _v2(p, i);
+  if (munmap(p, PGSIZE*FA_NPAGES) == -1)
+    err("munmap (fa1)");
+
+  // 逆方向（後続ページが既にマッピング済みの場合）
+  p = mmap(0, PGSIZE*FA_NPAGES, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (fa2)");
+  for (i = FA_NPAGES - 1; i >= 0; i -= 3)
+    _v2(p, i);
+  p[0] = 'Z';
+
+  // 子は親がまだ触れていないページもファイルの内容で読めること
+  if ((pid = fork()) < 0)
+    err("fork (fa)");
+  if (pid == 0) {
+    if (p[0] != 'Z')
+      err("fault around child (1)");
+    for (i = 1; i < FA_NPAGES; i++)
+      _v2(p, i);
+    exit(0);
+  }
+  int status = -1;
+  wait(&status);
+  if (status != 0)
+    err("fault around child (2)");
+
+  if (munmap(p, PGSIZE*FA_NPAGES) == -1)
+    err("munmap (fa2)");
+  close(fd);
+  unlink(f);
+
+  printf("test fault around: OK\n");
+}
+
+//
+// madvise: DONTNEEDした私有マッピングは無名なら0に、ファイルなら
+// ファイルの内容に戻ること、WILLNEEDとヒントはエラーにならないこと
+//
+void
+madvise_test(void)
+{
+  int fd, i;
+  char *p;
+  const char * const f = "mmap.dur";
+
+  printf("test madvise\n");
+
+  p = mmap(0, PGSIZE*4, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap (ma1)");
+  memset(p, 'x', PGSIZE*4);
+  if (madvise(p + PGSIZE, PGSIZE*2, MADV_DONTNEED) == -1)
+    err("madvise dontneed (1)");
+  for (i = 0; i < PGSIZE*4; i++) {
+    char want = (i < PGSIZE || i >= PGSIZE*3) ? 'x' : 0;
+    if (p[i] != want) {
+      printf("mismatch at %d, wanted 0x%x, got 0x%x\n", i, want, p[i]);
+      err("madvise dontneed anon");
+    }
+  }
+  if (madvise(p, PGSIZE*4, MADV_FREE) == -1)
+    err("madvise free");
+  p[0] = 'y';
+  if (p[0] != 'y')
+    err("write after madvise free");
+  if (madvise(p, PGSIZE, 12345) != -1 || errno != EINVAL)
+    err("madvise invalid advice");
+  if (munmap(p, PGSIZE*4) == -1)
+    err("munmap (ma1)");
+
+  makefile(f);
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open (ma)");
+  p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (ma2)");
+  if (madvise(p, PGSIZE*2, MADV_SEQUENTIAL) == -1 || madvise(p, PGSIZE*2, MADV_WILLNEED) == -1)
+    err("madvise hint");
+  memset(p, 'Z', PGSIZE*2);
+  if (madvise(p, PGSIZE*2, MADV_DONTNEED) == -1)
+    err("madvise dontneed (2)");
+  _v1(p);
+  if (madvise(p, PGSIZE*2, MADV_FREE) != -1 || errno != EINVAL)
+    err("madvise free on file mapping");
+  if (munmap(p, PGSIZE*2) == -1)
+    err("munmap (ma2)");
+  close(fd);
+
+  printf("test madvise: OK\n");
+}
+
+//
+// 共有書き込みマッピング: MS_ASYNC/MS_SYNCの後にread()で内容が見えること、
+// 書き戻し後の再度の書き込みも書き戻されることをチェックする
+//
+void
+msync_test(void)
+{
+  int fd;
+  char *p;
+  const char * const f = "mmap.dur";
+
+  printf("test msync\n");
+
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open (ms)");
+  p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (ms)");
+
+  p[0] = 'B';
+  p[PGSIZE] = 'C';
+  if (msync(p, PGSIZE*2, MS_ASYNC) == -1)
+    err("msync async");
+  if (msync(p, PGSIZE*2, MS_SYNC) == -1)
+    err("msync sync (1)");
+  if (lseek(fd, 0, SEEK_SET) != 0 || read(fd, buf, 1) != 1 || buf[0] != 'B')
+    err("msync: first page not written");
+  if (lseek(fd, PGSIZE, SEEK_SET) != PGSIZE || read(fd, buf, 1) != 1 || buf[0] != 'C')
+    err("msync: second page not written");
+
+  // 書き戻した後の書き込み
+  p[0] = 'D';
+  if (msync(p, PGSIZE, MS_SYNC) == -1)
+    err("msync sync (2)");
+  if (lseek(fd, 0, SEEK_SET) != 0 || read(fd, buf, 1) != 1 || buf[0] != 'D')
+    err("msync: rewrite not written");
+
+  if (munmap(p, PGSIZE*2) == -1)
+    err("munmap (ms)");
+  close(fd);
+  unlink(f);
+
+  printf("test msync: OK\n");
+}
+
+//
+// 2MBページ: 2MB以上の無名マッピングは2MB境界に置かれること、
+// fork後の親子の書き込み、一部のmunmap/DONTNEEDで分割されても
+// 残りの内容が変わらないことをチェックする
+//
+#define HUGE_SIZE   (2*1024*1024)
+
+void
+hugepage_test(void)
+{
+  char *p;
+  int i, pid, status;
+
+  printf("test huge page\n");
+
+  p = mmap(0, HUGE_SIZE*2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap (hp)");
+  if ((unsigned long)p & (HUGE_SIZE - 1))
+    err("huge mapping is not 2MB aligned");
+  for (i = 0; i < HUGE_SIZE*2; i += PGSIZE)
+    if (p[i] != 0)
+      err("huge page not zeroed");
+  for (i = 0; i < HUGE_SIZE*2; i += PGSIZE)
+    p[i] = (char)(i / PGSIZE);
+
+  pid = fork();
+  if (pid < 0)
+    err("fork (hp)");
+  if (pid == 0) {
+    for (i = 0; i < HUGE_SIZE*2; i += PGSIZE) {
+      if (p[i] != (char)(i / PGSIZE))
+        err("huge page content in child");
+      p[i] = 'c';
+    }
+    exit(0);
+  }
+  wait(&status);
+  if (status != 0)
+    err("huge page child failed");
+  for (i = 0; i < HUGE_SIZE*2; i += PGSIZE)
+    if (p[i] != (char)(i / PGSIZE))
+      err("huge page modified by child");
+
+  if (munmap(p, PGSIZE) == -1)
+    err("munmap (hp1)");
+  if (madvise(p + HUGE_SIZE, PGSIZE, MADV_DONTNEED) == -1)
+    err("madvise (hp)");
+  if (p[HUGE_SIZE] != 0)
+    err("huge page dontneed");
+  for (i = PGSIZE; i < HUGE_SIZE*2; i += PGSIZE)
+    if (i != HUGE_SIZE && p[i] != (char)(i / PGSIZE))
+      err("huge page content after split");
+  if (munmap(p + PGSIZE, HUGE_SIZE*2 - PGSIZE) == -1)
+    err("munmap (hp2)");
+
+  printf("test huge page: OK\n");
+}
+
 void
 more_test()
 {
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// パイプのピンポンでコンテキストスイッチの遅延を計る.
+// 親子が2本のパイプで1バイトを往復させる. 1往復で2回の起床と
+// コンテキストスイッチが起きる.
+// CPUを使い続けるプロセス（hog）を動かした状態でも計り、起床した
+// プロセスがすぐにスケジュールされる（遅延がtick単位にならない）ことを
+// 確認する. あわせてsetpriority/getpriority/sched_yieldを確認する.
+
+#define ROUNDS  5000
+#define NHOG    5
+
+static int ok = 0, ng = 0;
+
+static long
+now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// ROUNDS往復にかかった時間（ms）を返す. 失敗したら-1
+static long
+pingpong(void)
+{
+  int p1[2], p2[2], pid, status;
+  char c = 0;
+  long start, t;
+
+  if (pipe(p1) < 0 || pipe(p2) < 0)
+    return -1;
+  if ((pid = fork()) < 0)
+    return -1;
+  if (pid == 0) {
+    close(p1[1]);
+    close(p2[0]);
+    for (int i = 0; i < ROUNDS; i++) {
+      if (read(p1[0], &c, 1) != 1 || write(p2[1], &c, 1) != 1)
+        exit(1);
+    }
+    exit(0);
+  }
+  close(p1[0]);
+  close(p2[1]);
+  start = now_ms();
+  for (int i = 0; i < ROUNDS; i++) {
+    if (write(p1[1], &c, 1) != 1 || read(p2[0], &c, 1) != 1) {
+      t = -1;
+      goto out;
+    }
+  }
+  t = now_ms() - start;
+out:
+  close(p1[1]);
+  close(p2[0]);
+  wait(&status);
+  if (status != 0)
+    return -1;
+  return t;
+}
+
+static void
+report(char *what, long t)
+{
+  if (t < 0) {
+    printf("  %s: failed\n", what);
+    ng++;
+    return;
+  }
+  // 1往復で2回切り替わる
+  printf("  %s: %d round trips in %ld ms, %ld us/switch\n",
+         what, ROUNDS, t, t * 1000 / (ROUNDS * 2));
+  ok++;
+}
+
+static void
+hog(void)
+{
+  volatile unsigned long x = 0;
+
+  for (;;)
+    x++;
+}
+
+static void
+check(int cond, char *what)
+{
+  if (cond) {
+    ok++;
+  } else {
+    printf("  %s: failed\n", what);
+    ng++;
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int hogs[NHOG], pid, status;
+  long base, loaded;
+
+  printf("pingpong: idle system\n");
+  base = pingpong();
+  report("no load", base);
+
+  printf("pingpong: with %d cpu hogs\n", NHOG);
+  for (int i = 0; i < NHOG; i++) {
+    if ((hogs[i] = fork()) == 0)
+      hog();
+  }
+  loaded = pingpong();
+  report("loaded", loaded);
+  // hogがいても起床したプロセスはtickを待たずに動く
+  check(loaded >= 0 && loaded * 1000 / (ROUNDS * 2) < 10000, "bounded wakeup latency");
+
+  printf("pingpong: priority\n");
+  // hogのniceを上げてもhogは動き続ける（飢餓にならない）
+  check(setpriority(PRIO_PROCESS, hogs[0], 10) == 0, "setpriority");
+  check(getpriority(PRIO_PROCESS, hogs[0]) == 10, "getpriority");
+  check(setpriority(PRIO_PROCESS, 0, 5) == 0 && getpriority(PRIO_PROCESS, 0) == 5, "nice self");
+  check(setpriority(3, 0, 0) < 0, "invalid which");
+  check(sched_yield() == 0, "sched_yield");
+  for (int i = 0; i < NHOG; i++) {
+    kill(hogs[i], SIGKILL);
+    waitpid(hogs[i], &status, 0);
+  }
+
+  // niceは子に引き継がれる
+  if ((pid = fork()) == 0)
+    exit(getpriority(PRIO_PROCESS, 0) == 5 ? 0 : 1);
+  waitpid(pid, &status, 0);
+  check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "inherit nice");
+
+  printf("pingpong: ok: %d, ng: %d\n", ok, ng);
+  exit(ng == 0 ? 0 : 1);
+}
@@ -0,0 +1,106 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/times.h>
+#include <sys/wait.h>
+
+// 資源の使用量を確認する.
+// CPUを使うとCLOCK_PROCESS_CPUTIME_ID/CLOCK_THREAD_CPUTIME_IDと
+// getrusageのユーザー時間が増えること、眠ると自発的なコンテキスト
+// スイッチが、ページに触るとページフォルトが数えられること、
+// wait4のrusageとtimesで回収した子の使用量が得られることを確かめる.
+
+static int ok = 0, ng = 0;
+
+static void
+check(int cond, char *what)
+{
+  if (cond) {
+    ok++;
+  } else {
+    printf("  %s: failed\n", what);
+    ng++;
+  }
+}
+
+static long
+ts_ns(struct timespec *ts)
+{
+  return ts->tv_sec * 1000000000L + ts->tv_nsec;
+}
+
+static long
+tv_us(struct timeval *tv)
+{
+  return tv->tv_sec * 1000000L + tv->tv_usec;
+}
+
+// 約msミリ秒CPUを使う
+static void
+spin(long ms)
+{
+  struct timespec start, now;
+  volatile long x = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do {
+    for (int i = 0; i < 10000; i++)
+      x++;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  } while (ts_ns(&now) - ts_ns(&start) < ms * 1000000L);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct timespec t0, t1, th, ts = { 0, 10000000 };
+  struct rusage ru0, ru1;
+  struct tms tms;
+  char *mem;
+  int pid, status;
+
+  printf("rusagetest: cputime\n");
+  check(clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t0) == 0, "process clock");
+  getrusage(RUSAGE_SELF, &ru0);
+  spin(100);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t1);
+  check(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &th) == 0, "thread clock");
+  check(getrusage(RUSAGE_SELF, &ru1) == 0, "getrusage");
+  check(ts_ns(&t1) - ts_ns(&t0) >= 80000000L, "process cputime advances");
+  check(ts_ns(&th) >= ts_ns(&t1) - ts_ns(&t0), "thread cputime");
+  check(tv_us(&ru1.ru_utime) - tv_us(&ru0.ru_utime) >= 50000, "utime advances");
+
+  printf("rusagetest: counters\n");
+  getrusage(RUSAGE_SELF, &ru0);
+  for (int i = 0; i < 3; i++)
+    nanosleep(&ts, 0);
+  mem = mmap(0, 16 * 4096, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  for (int i = 0; i < 16; i++)
+    mem[i * 4096] = 1;
+  getrusage(RUSAGE_SELF, &ru1);
+  check(ru1.ru_nvcsw - ru0.ru_nvcsw >= 3, "voluntary switches");
+  check(ru1.ru_minflt - ru0.ru_minflt >= 16, "minor faults");
+  check(getrusage(RUSAGE_THREAD, &ru1) == 0, "RUSAGE_THREAD");
+
+  printf("rusagetest: children\n");
+  getrusage(RUSAGE_CHILDREN, &ru0);
+  check(tv_us(&ru0.ru_utime) == 0, "no children yet");
+  if ((pid = fork()) == 0) {
+    spin(100);
+    exit(0);
+  }
+  check(wait4(pid, &status, 0, &ru1) == pid, "wait4");
+  check(tv_us(&ru1.ru_utime) + tv_us(&ru1.ru_stime) >= 80000, "wait4 rusage");
+  getrusage(RUSAGE_CHILDREN, &ru0);
+  check(tv_us(&ru0.ru_utime) == tv_us(&ru1.ru_utime), "RUSAGE_CHILDREN");
+  check(times(&tms) > 0, "times");
+  check(tms.tms_cutime + tms.tms_cstime >= 8, "tms_cutime");
+  check(tms.tms_utime >= 10, "tms_utime");
+
+  printf("rusagetest: ok: %d, ng: %d\n", ok, ng);
+  exit(ng == 0 ? 0 : 1);
+}
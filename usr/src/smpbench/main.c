@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+// SMPのスケーリングを確認する.
+// 同じ量の仕事をするワーカーを1, 2, ... NWORKER個forkして、全員が
+// 終わるまでの時間を計る. hartが増えれば同じ時間で処理できる量が増える.
+// 各ワーカーは計算に加えてmmap/書き込み/munmapを繰り返すので、hart間を
+// 移動したプロセスのTLBエントリのフラッシュ（RFENCE）も確認できる.
+
+#define NWORKER     4
+#define SPIN        2000000
+#define ROUNDS      64
+#define MAPPAGES    8
+#define PAGE        4096
+
+static void
+fail(char *why)
+{
+  printf("smpbench failure: %s, pid=%d\n", why, getpid());
+  exit(1);
+}
+
+static long
+now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// 1ワーカー分の仕事. 0なら成功
+static int
+work(int id)
+{
+  volatile unsigned long x = id;
+  char *p;
+
+  for (int r = 0; r < ROUNDS; r++) {
+    for (long i = 0; i < SPIN / ROUNDS; i++)
+      x = x * 6364136223846793005UL + 1442695040888963407UL;
+    p = mmap(0, MAPPAGES * PAGE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (p == MAP_FAILED)
+      return 1;
+    for (int i = 0; i < MAPPAGES; i++)
+      p[i * PAGE] = (char)(id + r + i);
+    for (int i = 0; i < MAPPAGES; i++) {
+      if (p[i * PAGE] != (char)(id + r + i))
+        return 2;
+    }
+    if (munmap(p, MAPPAGES * PAGE) < 0)
+      return 3;
+  }
+  return 0;
+}
+
+// n個のワーカーを並行に動かしてかかった時間（ms）を返す
+static long
+run(int n)
+{
+  int pid, status;
+  long start = now_ms();
+
+  for (int i = 0; i < n; i++) {
+    if ((pid = fork()) < 0)
+      fail("fork");
+    if (pid == 0)
+      exit(work(i));
+  }
+  for (int i = 0; i < n; i++) {
+    if (wait(&status) < 0)
+      fail("wait");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      fail("worker");
+  }
+  return now_ms() - start;
+}
+
+int
+main(int argc, char *argv[])
+{
+  long t, base = 0;
+  int max = NWORKER;
+
+  if (argc > 1 && (max = atoi(argv[1])) <= 0)
+    max = NWORKER;
+
+  printf("smpbench: %d workers max\n", max);
+  for (int n = 1; n <= max; n++) {
+    t = run(n);
+    if (t == 0)
+      t = 1;
+    if (n == 1)
+      base = t;
+    // n個分の仕事をbaseの時間でできていればn倍
+    printf("  %d workers: %ld ms, throughput x%ld.%02ld\n",
+           n, t, n * base / t, (n * base * 100 / t) % 100);
+  }
+  printf("smpbench: all tests succeeded\n");
+  exit(0);
+}
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+// スレッドを確認する.
+// pthread_createで作ったスレッドがアドレス空間とファイルを共有し、
+// 同じpid（tgid）と異なるtidを持つこと、mutexで保護したカウンタが
+// 正しく数えられること、pthread_joinで戻り値を受け取れることを確かめる.
+
+#define NTHREAD 4
+#define COUNT   10000
+
+static int ok = 0, ng = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static long counter = 0;
+static int pids[NTHREAD], tids[NTHREAD];
+static int pfd[2];
+
+static void
+check(int cond, char *what)
+{
+  if (cond) {
+    ok++;
+  } else {
+    printf("  %s: failed\n", what);
+    ng++;
+  }
+}
+
+static void *
+worker(void *arg)
+{
+  long id = (long)arg;
+
+  pids[id] = getpid();
+  tids[id] = syscall(SYS_gettid);
+  for (int i = 0; i < COUNT; i++) {
+    pthread_mutex_lock(&lock);
+    counter++;
+    pthread_mutex_unlock(&lock);
+  }
+  // メインスレッドが作ったパイプに書ける
+  if (write(pfd[1], "x", 1) != 1)
+    return (void *)-1L;
+  return (void *)(id + 100);
+}
+
+int
+main(int argc, char *argv[])
+{
+  pthread_t th[NTHREAD];
+  void *ret;
+  char buf[NTHREAD];
+  int pid, status;
+
+  if (pipe(pfd) < 0) {
+    printf("threadtest: pipe failed\n");
+    exit(1);
+  }
+
+  printf("threadtest: create/join\n");
+  for (long i = 0; i < NTHREAD; i++)
+    check(pthread_create(&th[i], 0, worker, (void *)i) == 0, "pthread_create");
+  for (int i = 0; i < NTHREAD; i++) {
+    check(pthread_join(th[i], &ret) == 0, "pthread_join");
+    check((long)ret == i + 100, "return value");
+  }
+  check(counter == (long)NTHREAD * COUNT, "counter");
+  check(read(pfd[0], buf, NTHREAD) == NTHREAD, "shared files");
+
+  printf("threadtest: pid/tid\n");
+  for (int i = 0; i < NTHREAD; i++) {
+    check(pids[i] == getpid(), "same pid");
+    check(tids[i] != getpid(), "own tid");
+    for (int j = 0; j < i; j++)
+      check(tids[i] != tids[j], "distinct tid");
+  }
+
+  // スレッドが残っていてもexitでプロセス全体が終了する
+  printf("threadtest: exit with threads\n");
+  if ((pid = fork()) == 0) {
+    for (long i = 0; i < NTHREAD; i++)
+      pthread_create(&th[i], 0, (void *(*)(void *))pause, 0);
+    exit(7);
+  }
+  check(waitpid(pid, &status, 0) == pid && WIFEXITED(status)
+        && WEXITSTATUS(status) == 7, "exit_group");
+
+  printf("threadtest: ok: %d, ng: %d\n", ok, ng);
+  exit(ng == 0 ? 0 : 1);
+}
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+// カーネルタイマーを確認する.
+// nanosleep/poll（ppoll）のタイムアウト/alarm/setitimerが期待した時間で
+// 終わること、nanosleepがSIGALRMで中断されることを確かめる.
+// 眠っている間CPUを使わないことはsmpbench等と並行に動かして確認する.
+
+#define NSLEEP  50
+
+static int ok = 0, ng = 0;
+
+static long
+now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+check(int cond, char *what)
+{
+  if (cond) {
+    ok++;
+  } else {
+    printf("  %s: failed\n", what);
+    ng++;
+  }
+}
+
+static void
+on_alarm(int sig)
+{
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct timespec req = { 0, 2000000 };
+  struct itimerval it, old;
+  struct sigaction act = { 0 };
+  long start, t;
+  int pid, status;
+
+  // 2msを繰り返す. tick（10ms）単位に丸められない
+  printf("timertest: nanosleep\n");
+  start = now_ms();
+  for (int i = 0; i < NSLEEP; i++)
+    nanosleep(&req, 0);
+  t = now_ms() - start;
+  printf("  %d x 2ms: %ld ms\n", NSLEEP, t);
+  check(t >= NSLEEP * 2 - 10 && t < NSLEEP * 2 * 3, "nanosleep 2ms");
+
+  printf("timertest: poll timeout\n");
+  start = now_ms();
+  check(poll(0, 0, 100) == 0, "poll returns 0");
+  t = now_ms() - start;
+  check(t >= 90 && t < 300, "poll 100ms");
+
+  printf("timertest: setitimer/getitimer\n");
+  it.it_value.tv_sec = 10;
+  it.it_value.tv_usec = 0;
+  it.it_interval.tv_sec = 0;
+  it.it_interval.tv_usec = 500000;
+  check(setitimer(ITIMER_REAL, &it, 0) == 0, "setitimer");
+  check(getitimer(ITIMER_REAL, &old) == 0 && old.it_value.tv_sec <= 10
+        && old.it_value.tv_sec >= 9 && old.it_interval.tv_usec == 500000, "getitimer");
+  it.it_value.tv_sec = 0;
+  check(setitimer(ITIMER_REAL, &it, &old) == 0 && old.it_value.tv_sec >= 9, "disarm");
+  check(getitimer(ITIMER_REAL, &old) == 0 && old.it_value.tv_sec == 0
+        && old.it_value.tv_usec == 0, "disarmed");
+  check(setitimer(ITIMER_VIRTUAL, &it, 0) < 0 && errno == EINVAL, "ITIMER_VIRTUAL");
+
+  // alarmの既定の動作でプロセスが終了する
+  printf("timertest: alarm\n");
+  start = now_ms();
+  if ((pid = fork()) == 0) {
+    alarm(1);
+    pause();
+    exit(1);
+  }
+  waitpid(pid, &status, 0);
+  t = now_ms() - start;
+  check(!(WIFEXITED(status) && WEXITSTATUS(status) == 1), "alarm terminates");
+  check(t >= 900 && t < 2000, "alarm 1s");
+
+  // SIGALRMで長いnanosleepが中断される
+  printf("timertest: interrupted nanosleep\n");
+  start = now_ms();
+  if ((pid = fork()) == 0) {
+    struct timespec longreq = { 10, 0 };
+    act.sa_handler = on_alarm;
+    sigaction(SIGALRM, &act, 0);
+    it.it_value.tv_sec = 0;
+    it.it_value.tv_usec = 200000;
+    it.it_interval.tv_sec = it.it_interval.tv_usec = 0;
+    setitimer(ITIMER_REAL, &it, 0);
+    nanosleep(&longreq, 0);
+    exit(1);
+  }
+  waitpid(pid, &status, 0);
+  t = now_ms() - start;
+  check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "SIGALRM handler");
+  check(t >= 150 && t < 2000, "nanosleep interrupted");
+
+  printf("timertest: ok: %d, ng: %d\n", ok, ng);
+  exit(ng == 0 ? 0 : 1);
+}
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/wait.h>
+
+// 待ち行列の排他的な起床を確認する.
+// 1本のパイプに複数の書き手と読み手をつなぎ、書いたバイト数と
+// 読んだバイト数が一致すること、誰も眠ったまま取り残されない
+// （全員が終了する）ことを確かめる. あわせて時間を計る.
+
+#define NWRITER 4
+#define NREADER 4
+#define COUNT   20000
+
+static long
+now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fds[2], res[2], pid, status, ng = 0;
+  long start, total = 0, n;
+  char buf[64];
+
+  if (pipe(fds) < 0 || pipe(res) < 0) {
+    printf("waittest: pipe failed\n");
+    exit(1);
+  }
+
+  start = now_ms();
+  for (int i = 0; i < NWRITER; i++) {
+    if ((pid = fork()) < 0) {
+      printf("waittest: fork failed\n");
+      exit(1);
+    }
+    if (pid == 0) {
+      close(fds[0]);
+      close(res[0]);
+      close(res[1]);
+      for (int j = 0; j < COUNT; j++) {
+        if (write(fds[1], "x", 1) != 1)
+          exit(1);
+      }
+      exit(0);
+    }
+  }
+  for (int i = 0; i < NREADER; i++) {
+    if ((pid = fork()) < 0) {
+      printf("waittest: fork failed\n");
+      exit(1);
+    }
+    if (pid == 0) {
+      close(fds[1]);
+      close(res[0]);
+      n = 0;
+      while ((status = read(fds[0], buf, 1 + i * 16)) > 0)
+        n += status;
+      write(res[1], &n, sizeof(n));
+      exit(0);
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+  close(res[1]);
+
+  for (int i = 0; i < NWRITER + NREADER; i++) {
+    if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      ng++;
+  }
+  while (read(res[0], &n, sizeof(n)) == sizeof(n))
+    total += n;
+  close(res[0]);
+
+  printf("waittest: %d writers, %d readers, %ld bytes in %ld ms\n",
+         NWRITER, NREADER, total, now_ms() - start);
+  if (total != (long)NWRITER * COUNT) {
+    printf("waittest: expected %ld bytes\n", (long)NWRITER * COUNT);
+    ng++;
+  }
+  printf("waittest: %s\n", ng == 0 ? "ok" : "failed");
+  exit(ng == 0 ? 0 : 1);
+}